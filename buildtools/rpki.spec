@@ -80,6 +80,7 @@ exit 0
 %{_bindir}/rcynic
 %{_bindir}/rcynic-cron
 %{_bindir}/rcynic-html
+%{_bindir}/rcynic-summary-xml
 %{_bindir}/rcynic-svn
 %{_bindir}/rcynic-text
 %{_bindir}/rpki-rtr
@@ -0,0 +1,529 @@
+/* $Id$ */
+
+/**
+ * @file bench-validation-status.c
+ *
+ * Microbenchmark for rcynic's validation status index.  Reads URIs,
+ * one per line, on standard input, then times inserting all of them
+ * and looking all of them up, once in the AVL tree plus output stack
+ * log_validation_status() used to use and once in the arena-backed
+ * hash index it uses now, and reports how much memory each one took.
+ *
+ * Both structures are restated here, stripped of everything but the
+ * index itself, so that this builds without OpenSSL.  The entries
+ * carry the same fixed fields as rcynic's, sized for about as many
+ * status codes as rcynic has.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define	URI_MAX		(sizeof("rsync://") - 1 + 256 + 1 + FILENAME_MAX)
+#define	EVENT_BYTES	((160 + 7) / 8)
+
+typedef struct { char s[URI_MAX]; } uri_t;
+
+/*
+ * The old way: one malloc()ed entry per URI, each with a whole uri_t,
+ * in an AVL tree, plus a pointer on a stack for output.
+ */
+
+typedef struct avl_node {
+  uri_t uri;
+  int generation;
+  time_t timestamp;
+  unsigned char events[EVENT_BYTES];
+  short balance;
+  struct avl_node *left_child;
+  struct avl_node *right_child;
+} avl_node_t;
+
+typedef struct {
+  avl_node_t *root, *in_waiting;
+  avl_node_t **stack;
+  size_t count, alloc;
+  size_t bytes;
+} avl_index_t;
+
+static int avl_cmp(const avl_node_t *node, const uri_t *uri, const int generation)
+{
+  int cmp = node->generation - generation;
+  return cmp ? cmp : strcmp(uri->s, node->uri.s);
+}
+
+/**
+ * validation_status_sprout() as it was, less the debugging messages.
+ */
+static avl_node_t *avl_sprout(avl_node_t **node, int *needs_balancing, avl_node_t *new_node)
+{
+  avl_node_t *p1, *p2, *result;
+  int cmp;
+
+  if (*node == NULL) {
+    new_node->left_child = NULL;
+    new_node->right_child = NULL;
+    new_node->balance = 0;
+    *node = new_node;
+    *needs_balancing = 1;
+    return *node;
+  }
+
+  cmp = avl_cmp(*node, &new_node->uri, new_node->generation);
+
+  if (cmp < 0) {
+    result = avl_sprout(&(*node)->left_child, needs_balancing, new_node);
+    if (*needs_balancing) {
+      switch ((*node)->balance) {
+      case 1:
+	(*node)->balance = 0;
+	*needs_balancing = 0;
+	break;
+      case 0:
+	(*node)->balance = -1;
+	break;
+      case -1:
+	p1 = (*node)->left_child;
+	if (p1->balance == -1) {
+	  (*node)->left_child = p1->right_child;
+	  p1->right_child = *node;
+	  (*node)->balance = 0;
+	  *node = p1;
+	} else {
+	  p2 = p1->right_child;
+	  p1->right_child = p2->left_child;
+	  p2->left_child = p1;
+	  (*node)->left_child = p2->right_child;
+	  p2->right_child = *node;
+	  (*node)->balance = p2->balance == -1 ? 1 : 0;
+	  p1->balance = p2->balance == 1 ? -1 : 0;
+	  *node = p2;
+	}
+	(*node)->balance = 0;
+	*needs_balancing = 0;
+      }
+    }
+    return result;
+  }
+
+  if (cmp > 0) {
+    result = avl_sprout(&(*node)->right_child, needs_balancing, new_node);
+    if (*needs_balancing) {
+      switch ((*node)->balance) {
+      case -1:
+	(*node)->balance = 0;
+	*needs_balancing = 0;
+	break;
+      case 0:
+	(*node)->balance = 1;
+	break;
+      case 1:
+	p1 = (*node)->right_child;
+	if (p1->balance == 1) {
+	  (*node)->right_child = p1->left_child;
+	  p1->left_child = *node;
+	  (*node)->balance = 0;
+	  *node = p1;
+	} else {
+	  p2 = p1->left_child;
+	  p1->left_child = p2->right_child;
+	  p2->right_child = p1;
+	  (*node)->right_child = p2->left_child;
+	  p2->left_child = *node;
+	  (*node)->balance = p2->balance == 1 ? -1 : 0;
+	  p1->balance = p2->balance == -1 ? 1 : 0;
+	  *node = p2;
+	}
+	(*node)->balance = 0;
+	*needs_balancing = 0;
+      }
+    }
+    return result;
+  }
+
+  *needs_balancing = 0;
+  return *node;
+}
+
+/**
+ * What log_validation_status() did with a new URI.
+ */
+static int avl_add(avl_index_t *idx, const uri_t *uri, const int generation)
+{
+  int needs_balancing = 0;
+  avl_node_t *v;
+
+  if (idx->in_waiting == NULL) {
+    if ((idx->in_waiting = malloc(sizeof(*idx->in_waiting))) == NULL)
+      return 0;
+    idx->bytes += sizeof(*idx->in_waiting);
+  }
+
+  v = idx->in_waiting;
+  memset(v, 0, sizeof(*v));
+  v->uri = *uri;
+  v->generation = generation;
+
+  if ((v = avl_sprout(&idx->root, &needs_balancing, v)) != idx->in_waiting)
+    return 1;
+  idx->in_waiting = NULL;
+
+  if (idx->count == idx->alloc) {
+    size_t alloc = idx->alloc ? idx->alloc * 2 : 4;
+    avl_node_t **stack = realloc(idx->stack, alloc * sizeof(*stack));
+    if (stack == NULL)
+      return 0;
+    idx->bytes += (alloc - idx->alloc) * sizeof(*stack);
+    idx->stack = stack;
+    idx->alloc = alloc;
+  }
+
+  idx->stack[idx->count++] = v;
+  return 1;
+}
+
+static avl_node_t *avl_find(const avl_index_t *idx, const uri_t *uri, const int generation)
+{
+  avl_node_t *node = idx->root;
+  int cmp;
+
+  while (node != NULL && (cmp = avl_cmp(node, uri, generation)) != 0)
+    node = cmp < 0 ? node->left_child : node->right_child;
+
+  return node;
+}
+
+static void avl_free(avl_index_t *idx)
+{
+  size_t i;
+
+  for (i = 0; i < idx->count; i++)
+    free(idx->stack[i]);
+  free(idx->stack);
+  free(idx->in_waiting);
+  memset(idx, 0, sizeof(*idx));
+}
+
+/*
+ * The new way: entries carved out of an arena with the URI inline,
+ * found through an open-addressed hash table, linked in insertion
+ * order for output.
+ */
+
+#define	ARENA_BLOCK_SIZE	(1 << 20)
+#define	ARENA_ALIGN		16
+#define	MIN_SLOTS		1024
+
+typedef struct hash_node {
+  struct hash_node *next;
+  time_t timestamp;
+  unsigned hash;
+  int generation;
+  unsigned char events[EVENT_BYTES];
+  char uri[];
+} hash_node_t;
+
+typedef struct arena_block {
+  struct arena_block *next;
+  unsigned char *base;
+  size_t used, size;
+} arena_block_t;
+
+typedef struct {
+  hash_node_t **slots;
+  size_t nslots, count;
+  hash_node_t *head, *tail;
+  arena_block_t *arena;
+  size_t bytes;
+} hash_index_t;
+
+static void *arena_alloc(hash_index_t *idx, size_t n)
+{
+  arena_block_t *a = idx->arena;
+  void *result;
+
+  n = (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+  if (a == NULL || a->size - a->used < n) {
+    size_t size = n > ARENA_BLOCK_SIZE ? n : ARENA_BLOCK_SIZE;
+    if ((a = malloc(sizeof(*a))) == NULL)
+      return NULL;
+    if ((a->base = malloc(size)) == NULL) {
+      free(a);
+      return NULL;
+    }
+    idx->bytes += sizeof(*a) + size;
+    a->size = size;
+    a->used = 0;
+    a->next = idx->arena;
+    idx->arena = a;
+  }
+
+  result = a->base + a->used;
+  a->used += n;
+  return result;
+}
+
+static unsigned hash_uri(const char *uri, const int generation)
+{
+  unsigned h = 2166136261U ^ (unsigned) generation;
+
+  while (*uri) {
+    h ^= (unsigned char) *uri++;
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+static hash_node_t **hash_slot(const hash_index_t *idx, const char *uri,
+			       const int generation, const unsigned hash)
+{
+  size_t mask = idx->nslots - 1, i;
+  hash_node_t *v;
+
+  for (i = hash & mask; (v = idx->slots[i]) != NULL; i = (i + 1) & mask)
+    if (v->hash == hash && v->generation == generation && !strcmp(v->uri, uri))
+      break;
+
+  return &idx->slots[i];
+}
+
+static int hash_grow(hash_index_t *idx)
+{
+  size_t nslots = idx->nslots ? idx->nslots * 2 : MIN_SLOTS;
+  hash_node_t **slots, *v;
+
+  if ((slots = calloc(nslots, sizeof(*slots))) == NULL)
+    return 0;
+
+  idx->bytes += (nslots - idx->nslots) * sizeof(*slots);
+  free(idx->slots);
+  idx->slots = slots;
+  idx->nslots = nslots;
+
+  for (v = idx->head; v != NULL; v = v->next)
+    *hash_slot(idx, v->uri, v->generation, v->hash) = v;
+
+  return 1;
+}
+
+/**
+ * What validation_status_add() does now.
+ */
+static int hash_add(hash_index_t *idx, const uri_t *uri, const int generation)
+{
+  unsigned hash = hash_uri(uri->s, generation);
+  hash_node_t *v;
+  size_t len;
+
+  if (idx->nslots > 0 && *hash_slot(idx, uri->s, generation, hash) != NULL)
+    return 1;
+
+  if ((idx->count + 1) * 4 > idx->nslots * 3 && !hash_grow(idx))
+    return 0;
+
+  len = strlen(uri->s);
+
+  if ((v = arena_alloc(idx, sizeof(*v) + len + 1)) == NULL)
+    return 0;
+
+  memset(v, 0, sizeof(*v));
+  memcpy(v->uri, uri->s, len + 1);
+  v->generation = generation;
+  v->hash = hash;
+
+  *hash_slot(idx, v->uri, generation, hash) = v;
+  idx->count++;
+
+  if (idx->tail)
+    idx->tail->next = v;
+  else
+    idx->head = v;
+  idx->tail = v;
+
+  return 1;
+}
+
+static hash_node_t *hash_find(const hash_index_t *idx, const uri_t *uri, const int generation)
+{
+  if (idx->nslots == 0)
+    return NULL;
+  return *hash_slot(idx, uri->s, generation, hash_uri(uri->s, generation));
+}
+
+static void hash_free(hash_index_t *idx)
+{
+  arena_block_t *a;
+
+  while ((a = idx->arena) != NULL) {
+    idx->arena = a->next;
+    free(a->base);
+    free(a);
+  }
+  free(idx->slots);
+  memset(idx, 0, sizeof(*idx));
+}
+
+static double now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ * Times for one structure: CPU microseconds per insert, per lookup
+ * that hits, and per lookup that misses, plus bytes of memory.
+ */
+typedef struct {
+  double insert, hit, miss;
+  size_t bytes;
+} result_t;
+
+/*
+ * Both runs insert every URI for the current generation and look each
+ * one up once as current (a hit) and once as backup (a miss), which
+ * is roughly what a run with no backup objects does.  rcynic's callers
+ * hand us a uri_t, so we copy each URI into one first; that costs
+ * both structures the same.
+ */
+
+static int run_avl(char **uris, const size_t n, const int rounds, result_t *r, long *sink)
+{
+  static uri_t u;
+  avl_index_t idx;
+  double t0, t1, t2, t3;
+  size_t i;
+  int k;
+
+  memset(r, 0, sizeof(*r));
+  memset(&idx, 0, sizeof(idx));
+
+  for (k = 0; k < rounds; k++) {
+    t0 = now_us();
+    for (i = 0; i < n; i++)
+      if (!avl_add(&idx, (strcpy(u.s, uris[i]), &u), 0))
+	return 0;
+    t1 = now_us();
+    for (i = 0; i < n; i++)
+      *sink += avl_find(&idx, (strcpy(u.s, uris[i]), &u), 0) != NULL;
+    t2 = now_us();
+    for (i = 0; i < n; i++)
+      *sink += avl_find(&idx, (strcpy(u.s, uris[i]), &u), 1) != NULL;
+    t3 = now_us();
+    r->insert += t1 - t0;
+    r->hit    += t2 - t1;
+    r->miss   += t3 - t2;
+    r->bytes   = idx.bytes;
+    avl_free(&idx);
+  }
+
+  return 1;
+}
+
+static int run_hash(char **uris, const size_t n, const int rounds, result_t *r, long *sink)
+{
+  static uri_t u;
+  hash_index_t idx;
+  double t0, t1, t2, t3;
+  size_t i;
+  int k;
+
+  memset(r, 0, sizeof(*r));
+  memset(&idx, 0, sizeof(idx));
+
+  for (k = 0; k < rounds; k++) {
+    t0 = now_us();
+    for (i = 0; i < n; i++)
+      if (!hash_add(&idx, (strcpy(u.s, uris[i]), &u), 0))
+	return 0;
+    t1 = now_us();
+    for (i = 0; i < n; i++)
+      *sink += hash_find(&idx, (strcpy(u.s, uris[i]), &u), 0) != NULL;
+    t2 = now_us();
+    for (i = 0; i < n; i++)
+      *sink += hash_find(&idx, (strcpy(u.s, uris[i]), &u), 1) != NULL;
+    t3 = now_us();
+    r->insert += t1 - t0;
+    r->hit    += t2 - t1;
+    r->miss   += t3 - t2;
+    r->bytes   = idx.bytes;
+    hash_free(&idx);
+  }
+
+  return 1;
+}
+
+static void report(const char *label, const result_t *r, const size_t n, const int rounds)
+{
+  double ops = (double) n * rounds;
+
+  printf("%-10s insert %8.3f us  hit %8.3f us  miss %8.3f us  memory %10.1f MB (%.0f bytes/URI)\n",
+	 label, r->insert / ops, r->hit / ops, r->miss / ops,
+	 r->bytes / 1048576.0, (double) r->bytes / n);
+}
+
+int main(int argc, char *argv[])
+{
+  char line[URI_MAX + 2];
+  char **uris = NULL, **u;
+  size_t n = 0, alloc = 0, len;
+  result_t avl, hash;
+  int rounds = 10;
+  long sink = 0;
+
+  if (argc > 2 && !strcmp(argv[1], "-r")) {
+    rounds = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+
+  if (argc != 1 || rounds < 1) {
+    fprintf(stderr, "usage: %s [-r rounds] < uri-list\n", argv[0]);
+    return 1;
+  }
+
+  while (fgets(line, sizeof(line), stdin) != NULL) {
+    if ((len = strcspn(line, "\r\n")) == 0 || len >= URI_MAX)
+      continue;
+    line[len] = '\0';
+    if (n == alloc) {
+      alloc = alloc ? alloc * 2 : 1024;
+      if ((u = realloc(uris, alloc * sizeof(*uris))) == NULL) {
+	fprintf(stderr, "Out of memory\n");
+	return 1;
+      }
+      uris = u;
+    }
+    if ((uris[n++] = strdup(line)) == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+  }
+
+  if (n == 0) {
+    fprintf(stderr, "No URIs\n");
+    return 1;
+  }
+
+  /*
+   * Warm up once each, then time them alternately so drift hits both.
+   */
+
+  if (!run_avl(uris, n, 1, &avl, &sink) || !run_hash(uris, n, 1, &hash, &sink) ||
+      !run_avl(uris, n, rounds, &avl, &sink) || !run_hash(uris, n, rounds, &hash, &sink)) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  printf("%lu URIs, %d rounds, CPU time per operation\n", (unsigned long) n, rounds);
+  report("AVL tree:", &avl, n, rounds);
+  report("hash:", &hash, n, rounds);
+
+  while (n > 0)
+    free(uris[--n]);
+  free(uris);
+  return sink < 0;
+}
@@ -7,29 +7,79 @@
 #define __RCYNIC_C__DEFSTACK_H__
 
 /*
- * Safestack macros for validation_status_t.
+ * Safestack macros for ta_stats_t.
  */
-#define sk_validation_status_t_new(st)                     SKM_sk_new(validation_status_t, (st))
-#define sk_validation_status_t_new_null()                  SKM_sk_new_null(validation_status_t)
-#define sk_validation_status_t_free(st)                    SKM_sk_free(validation_status_t, (st))
-#define sk_validation_status_t_num(st)                     SKM_sk_num(validation_status_t, (st))
-#define sk_validation_status_t_value(st, i)                SKM_sk_value(validation_status_t, (st), (i))
-#define sk_validation_status_t_set(st, i, val)             SKM_sk_set(validation_status_t, (st), (i), (val))
-#define sk_validation_status_t_zero(st)                    SKM_sk_zero(validation_status_t, (st))
-#define sk_validation_status_t_push(st, val)               SKM_sk_push(validation_status_t, (st), (val))
-#define sk_validation_status_t_unshift(st, val)            SKM_sk_unshift(validation_status_t, (st), (val))
-#define sk_validation_status_t_find(st, val)               SKM_sk_find(validation_status_t, (st), (val))
-#define sk_validation_status_t_find_ex(st, val)            SKM_sk_find_ex(validation_status_t, (st), (val))
-#define sk_validation_status_t_delete(st, i)               SKM_sk_delete(validation_status_t, (st), (i))
-#define sk_validation_status_t_delete_ptr(st, ptr)         SKM_sk_delete_ptr(validation_status_t, (st), (ptr))
-#define sk_validation_status_t_insert(st, val, i)          SKM_sk_insert(validation_status_t, (st), (val), (i))
-#define sk_validation_status_t_set_cmp_func(st, cmp)       SKM_sk_set_cmp_func(validation_status_t, (st), (cmp))
-#define sk_validation_status_t_dup(st)                     SKM_sk_dup(validation_status_t, st)
-#define sk_validation_status_t_pop_free(st, free_func)     SKM_sk_pop_free(validation_status_t, (st), (free_func))
-#define sk_validation_status_t_shift(st)                   SKM_sk_shift(validation_status_t, (st))
-#define sk_validation_status_t_pop(st)                     SKM_sk_pop(validation_status_t, (st))
-#define sk_validation_status_t_sort(st)                    SKM_sk_sort(validation_status_t, (st))
-#define sk_validation_status_t_is_sorted(st)               SKM_sk_is_sorted(validation_status_t, (st))
+#define sk_ta_stats_t_new(st)                     SKM_sk_new(ta_stats_t, (st))
+#define sk_ta_stats_t_new_null()                  SKM_sk_new_null(ta_stats_t)
+#define sk_ta_stats_t_free(st)                    SKM_sk_free(ta_stats_t, (st))
+#define sk_ta_stats_t_num(st)                     SKM_sk_num(ta_stats_t, (st))
+#define sk_ta_stats_t_value(st, i)                SKM_sk_value(ta_stats_t, (st), (i))
+#define sk_ta_stats_t_set(st, i, val)             SKM_sk_set(ta_stats_t, (st), (i), (val))
+#define sk_ta_stats_t_zero(st)                    SKM_sk_zero(ta_stats_t, (st))
+#define sk_ta_stats_t_push(st, val)               SKM_sk_push(ta_stats_t, (st), (val))
+#define sk_ta_stats_t_unshift(st, val)            SKM_sk_unshift(ta_stats_t, (st), (val))
+#define sk_ta_stats_t_find(st, val)               SKM_sk_find(ta_stats_t, (st), (val))
+#define sk_ta_stats_t_find_ex(st, val)            SKM_sk_find_ex(ta_stats_t, (st), (val))
+#define sk_ta_stats_t_delete(st, i)               SKM_sk_delete(ta_stats_t, (st), (i))
+#define sk_ta_stats_t_delete_ptr(st, ptr)         SKM_sk_delete_ptr(ta_stats_t, (st), (ptr))
+#define sk_ta_stats_t_insert(st, val, i)          SKM_sk_insert(ta_stats_t, (st), (val), (i))
+#define sk_ta_stats_t_set_cmp_func(st, cmp)       SKM_sk_set_cmp_func(ta_stats_t, (st), (cmp))
+#define sk_ta_stats_t_dup(st)                     SKM_sk_dup(ta_stats_t, st)
+#define sk_ta_stats_t_pop_free(st, free_func)     SKM_sk_pop_free(ta_stats_t, (st), (free_func))
+#define sk_ta_stats_t_shift(st)                   SKM_sk_shift(ta_stats_t, (st))
+#define sk_ta_stats_t_pop(st)                     SKM_sk_pop(ta_stats_t, (st))
+#define sk_ta_stats_t_sort(st)                    SKM_sk_sort(ta_stats_t, (st))
+#define sk_ta_stats_t_is_sorted(st)               SKM_sk_is_sorted(ta_stats_t, (st))
+
+/*
+ * Safestack macros for pp_stats_t.
+ */
+#define sk_pp_stats_t_new(st)                     SKM_sk_new(pp_stats_t, (st))
+#define sk_pp_stats_t_new_null()                  SKM_sk_new_null(pp_stats_t)
+#define sk_pp_stats_t_free(st)                    SKM_sk_free(pp_stats_t, (st))
+#define sk_pp_stats_t_num(st)                     SKM_sk_num(pp_stats_t, (st))
+#define sk_pp_stats_t_value(st, i)                SKM_sk_value(pp_stats_t, (st), (i))
+#define sk_pp_stats_t_set(st, i, val)             SKM_sk_set(pp_stats_t, (st), (i), (val))
+#define sk_pp_stats_t_zero(st)                    SKM_sk_zero(pp_stats_t, (st))
+#define sk_pp_stats_t_push(st, val)               SKM_sk_push(pp_stats_t, (st), (val))
+#define sk_pp_stats_t_unshift(st, val)            SKM_sk_unshift(pp_stats_t, (st), (val))
+#define sk_pp_stats_t_find(st, val)               SKM_sk_find(pp_stats_t, (st), (val))
+#define sk_pp_stats_t_find_ex(st, val)            SKM_sk_find_ex(pp_stats_t, (st), (val))
+#define sk_pp_stats_t_delete(st, i)               SKM_sk_delete(pp_stats_t, (st), (i))
+#define sk_pp_stats_t_delete_ptr(st, ptr)         SKM_sk_delete_ptr(pp_stats_t, (st), (ptr))
+#define sk_pp_stats_t_insert(st, val, i)          SKM_sk_insert(pp_stats_t, (st), (val), (i))
+#define sk_pp_stats_t_set_cmp_func(st, cmp)       SKM_sk_set_cmp_func(pp_stats_t, (st), (cmp))
+#define sk_pp_stats_t_dup(st)                     SKM_sk_dup(pp_stats_t, st)
+#define sk_pp_stats_t_pop_free(st, free_func)     SKM_sk_pop_free(pp_stats_t, (st), (free_func))
+#define sk_pp_stats_t_shift(st)                   SKM_sk_shift(pp_stats_t, (st))
+#define sk_pp_stats_t_pop(st)                     SKM_sk_pop(pp_stats_t, (st))
+#define sk_pp_stats_t_sort(st)                    SKM_sk_sort(pp_stats_t, (st))
+#define sk_pp_stats_t_is_sorted(st)               SKM_sk_is_sorted(pp_stats_t, (st))
+
+/*
+ * Safestack macros for trace_walk_t.
+ */
+#define sk_trace_walk_t_new(st)                     SKM_sk_new(trace_walk_t, (st))
+#define sk_trace_walk_t_new_null()                  SKM_sk_new_null(trace_walk_t)
+#define sk_trace_walk_t_free(st)                    SKM_sk_free(trace_walk_t, (st))
+#define sk_trace_walk_t_num(st)                     SKM_sk_num(trace_walk_t, (st))
+#define sk_trace_walk_t_value(st, i)                SKM_sk_value(trace_walk_t, (st), (i))
+#define sk_trace_walk_t_set(st, i, val)             SKM_sk_set(trace_walk_t, (st), (i), (val))
+#define sk_trace_walk_t_zero(st)                    SKM_sk_zero(trace_walk_t, (st))
+#define sk_trace_walk_t_push(st, val)               SKM_sk_push(trace_walk_t, (st), (val))
+#define sk_trace_walk_t_unshift(st, val)            SKM_sk_unshift(trace_walk_t, (st), (val))
+#define sk_trace_walk_t_find(st, val)               SKM_sk_find(trace_walk_t, (st), (val))
+#define sk_trace_walk_t_find_ex(st, val)            SKM_sk_find_ex(trace_walk_t, (st), (val))
+#define sk_trace_walk_t_delete(st, i)               SKM_sk_delete(trace_walk_t, (st), (i))
+#define sk_trace_walk_t_delete_ptr(st, ptr)         SKM_sk_delete_ptr(trace_walk_t, (st), (ptr))
+#define sk_trace_walk_t_insert(st, val, i)          SKM_sk_insert(trace_walk_t, (st), (val), (i))
+#define sk_trace_walk_t_set_cmp_func(st, cmp)       SKM_sk_set_cmp_func(trace_walk_t, (st), (cmp))
+#define sk_trace_walk_t_dup(st)                     SKM_sk_dup(trace_walk_t, st)
+#define sk_trace_walk_t_pop_free(st, free_func)     SKM_sk_pop_free(trace_walk_t, (st), (free_func))
+#define sk_trace_walk_t_shift(st)                   SKM_sk_shift(trace_walk_t, (st))
+#define sk_trace_walk_t_pop(st)                     SKM_sk_pop(trace_walk_t, (st))
+#define sk_trace_walk_t_sort(st)                    SKM_sk_sort(trace_walk_t, (st))
+#define sk_trace_walk_t_is_sorted(st)               SKM_sk_is_sorted(trace_walk_t, (st))
 
 /*
  * Safestack macros for walk_ctx_t.
@@ -81,6 +131,31 @@
 #define sk_rsync_ctx_t_sort(st)                    SKM_sk_sort(rsync_ctx_t, (st))
 #define sk_rsync_ctx_t_is_sorted(st)               SKM_sk_is_sorted(rsync_ctx_t, (st))
 
+/*
+ * Safestack macros for rsync_host_t.
+ */
+#define sk_rsync_host_t_new(st)                     SKM_sk_new(rsync_host_t, (st))
+#define sk_rsync_host_t_new_null()                  SKM_sk_new_null(rsync_host_t)
+#define sk_rsync_host_t_free(st)                    SKM_sk_free(rsync_host_t, (st))
+#define sk_rsync_host_t_num(st)                     SKM_sk_num(rsync_host_t, (st))
+#define sk_rsync_host_t_value(st, i)                SKM_sk_value(rsync_host_t, (st), (i))
+#define sk_rsync_host_t_set(st, i, val)             SKM_sk_set(rsync_host_t, (st), (i), (val))
+#define sk_rsync_host_t_zero(st)                    SKM_sk_zero(rsync_host_t, (st))
+#define sk_rsync_host_t_push(st, val)               SKM_sk_push(rsync_host_t, (st), (val))
+#define sk_rsync_host_t_unshift(st, val)            SKM_sk_unshift(rsync_host_t, (st), (val))
+#define sk_rsync_host_t_find(st, val)               SKM_sk_find(rsync_host_t, (st), (val))
+#define sk_rsync_host_t_find_ex(st, val)            SKM_sk_find_ex(rsync_host_t, (st), (val))
+#define sk_rsync_host_t_delete(st, i)               SKM_sk_delete(rsync_host_t, (st), (i))
+#define sk_rsync_host_t_delete_ptr(st, ptr)         SKM_sk_delete_ptr(rsync_host_t, (st), (ptr))
+#define sk_rsync_host_t_insert(st, val, i)          SKM_sk_insert(rsync_host_t, (st), (val), (i))
+#define sk_rsync_host_t_set_cmp_func(st, cmp)       SKM_sk_set_cmp_func(rsync_host_t, (st), (cmp))
+#define sk_rsync_host_t_dup(st)                     SKM_sk_dup(rsync_host_t, st)
+#define sk_rsync_host_t_pop_free(st, free_func)     SKM_sk_pop_free(rsync_host_t, (st), (free_func))
+#define sk_rsync_host_t_shift(st)                   SKM_sk_shift(rsync_host_t, (st))
+#define sk_rsync_host_t_pop(st)                     SKM_sk_pop(rsync_host_t, (st))
+#define sk_rsync_host_t_sort(st)                    SKM_sk_sort(rsync_host_t, (st))
+#define sk_rsync_host_t_is_sorted(st)               SKM_sk_is_sorted(rsync_host_t, (st))
+
 /*
  * Safestack macros for rsync_history_t.
  */
@@ -106,6 +181,131 @@
 #define sk_rsync_history_t_sort(st)                    SKM_sk_sort(rsync_history_t, (st))
 #define sk_rsync_history_t_is_sorted(st)               SKM_sk_is_sorted(rsync_history_t, (st))
 
+/*
+ * Safestack macros for rrdp_delta_t.
+ */
+#define sk_rrdp_delta_t_new(st)                     SKM_sk_new(rrdp_delta_t, (st))
+#define sk_rrdp_delta_t_new_null()                  SKM_sk_new_null(rrdp_delta_t)
+#define sk_rrdp_delta_t_free(st)                    SKM_sk_free(rrdp_delta_t, (st))
+#define sk_rrdp_delta_t_num(st)                     SKM_sk_num(rrdp_delta_t, (st))
+#define sk_rrdp_delta_t_value(st, i)                SKM_sk_value(rrdp_delta_t, (st), (i))
+#define sk_rrdp_delta_t_set(st, i, val)             SKM_sk_set(rrdp_delta_t, (st), (i), (val))
+#define sk_rrdp_delta_t_zero(st)                    SKM_sk_zero(rrdp_delta_t, (st))
+#define sk_rrdp_delta_t_push(st, val)               SKM_sk_push(rrdp_delta_t, (st), (val))
+#define sk_rrdp_delta_t_unshift(st, val)            SKM_sk_unshift(rrdp_delta_t, (st), (val))
+#define sk_rrdp_delta_t_find(st, val)               SKM_sk_find(rrdp_delta_t, (st), (val))
+#define sk_rrdp_delta_t_find_ex(st, val)            SKM_sk_find_ex(rrdp_delta_t, (st), (val))
+#define sk_rrdp_delta_t_delete(st, i)               SKM_sk_delete(rrdp_delta_t, (st), (i))
+#define sk_rrdp_delta_t_delete_ptr(st, ptr)         SKM_sk_delete_ptr(rrdp_delta_t, (st), (ptr))
+#define sk_rrdp_delta_t_insert(st, val, i)          SKM_sk_insert(rrdp_delta_t, (st), (val), (i))
+#define sk_rrdp_delta_t_set_cmp_func(st, cmp)       SKM_sk_set_cmp_func(rrdp_delta_t, (st), (cmp))
+#define sk_rrdp_delta_t_dup(st)                     SKM_sk_dup(rrdp_delta_t, st)
+#define sk_rrdp_delta_t_pop_free(st, free_func)     SKM_sk_pop_free(rrdp_delta_t, (st), (free_func))
+#define sk_rrdp_delta_t_shift(st)                   SKM_sk_shift(rrdp_delta_t, (st))
+#define sk_rrdp_delta_t_pop(st)                     SKM_sk_pop(rrdp_delta_t, (st))
+#define sk_rrdp_delta_t_sort(st)                    SKM_sk_sort(rrdp_delta_t, (st))
+#define sk_rrdp_delta_t_is_sorted(st)               SKM_sk_is_sorted(rrdp_delta_t, (st))
+
+/*
+ * Safestack macros for rrdp_change_t.
+ */
+#define sk_rrdp_change_t_new(st)                     SKM_sk_new(rrdp_change_t, (st))
+#define sk_rrdp_change_t_new_null()                  SKM_sk_new_null(rrdp_change_t)
+#define sk_rrdp_change_t_free(st)                    SKM_sk_free(rrdp_change_t, (st))
+#define sk_rrdp_change_t_num(st)                     SKM_sk_num(rrdp_change_t, (st))
+#define sk_rrdp_change_t_value(st, i)                SKM_sk_value(rrdp_change_t, (st), (i))
+#define sk_rrdp_change_t_set(st, i, val)             SKM_sk_set(rrdp_change_t, (st), (i), (val))
+#define sk_rrdp_change_t_zero(st)                    SKM_sk_zero(rrdp_change_t, (st))
+#define sk_rrdp_change_t_push(st, val)               SKM_sk_push(rrdp_change_t, (st), (val))
+#define sk_rrdp_change_t_unshift(st, val)            SKM_sk_unshift(rrdp_change_t, (st), (val))
+#define sk_rrdp_change_t_find(st, val)               SKM_sk_find(rrdp_change_t, (st), (val))
+#define sk_rrdp_change_t_find_ex(st, val)            SKM_sk_find_ex(rrdp_change_t, (st), (val))
+#define sk_rrdp_change_t_delete(st, i)               SKM_sk_delete(rrdp_change_t, (st), (i))
+#define sk_rrdp_change_t_delete_ptr(st, ptr)         SKM_sk_delete_ptr(rrdp_change_t, (st), (ptr))
+#define sk_rrdp_change_t_insert(st, val, i)          SKM_sk_insert(rrdp_change_t, (st), (val), (i))
+#define sk_rrdp_change_t_set_cmp_func(st, cmp)       SKM_sk_set_cmp_func(rrdp_change_t, (st), (cmp))
+#define sk_rrdp_change_t_dup(st)                     SKM_sk_dup(rrdp_change_t, st)
+#define sk_rrdp_change_t_pop_free(st, free_func)     SKM_sk_pop_free(rrdp_change_t, (st), (free_func))
+#define sk_rrdp_change_t_shift(st)                   SKM_sk_shift(rrdp_change_t, (st))
+#define sk_rrdp_change_t_pop(st)                     SKM_sk_pop(rrdp_change_t, (st))
+#define sk_rrdp_change_t_sort(st)                    SKM_sk_sort(rrdp_change_t, (st))
+#define sk_rrdp_change_t_is_sorted(st)               SKM_sk_is_sorted(rrdp_change_t, (st))
+
+/*
+ * Safestack macros for validation_cache_t.
+ */
+#define sk_validation_cache_t_new(st)                     SKM_sk_new(validation_cache_t, (st))
+#define sk_validation_cache_t_new_null()                  SKM_sk_new_null(validation_cache_t)
+#define sk_validation_cache_t_free(st)                    SKM_sk_free(validation_cache_t, (st))
+#define sk_validation_cache_t_num(st)                     SKM_sk_num(validation_cache_t, (st))
+#define sk_validation_cache_t_value(st, i)                SKM_sk_value(validation_cache_t, (st), (i))
+#define sk_validation_cache_t_set(st, i, val)             SKM_sk_set(validation_cache_t, (st), (i), (val))
+#define sk_validation_cache_t_zero(st)                    SKM_sk_zero(validation_cache_t, (st))
+#define sk_validation_cache_t_push(st, val)               SKM_sk_push(validation_cache_t, (st), (val))
+#define sk_validation_cache_t_unshift(st, val)            SKM_sk_unshift(validation_cache_t, (st), (val))
+#define sk_validation_cache_t_find(st, val)               SKM_sk_find(validation_cache_t, (st), (val))
+#define sk_validation_cache_t_find_ex(st, val)            SKM_sk_find_ex(validation_cache_t, (st), (val))
+#define sk_validation_cache_t_delete(st, i)               SKM_sk_delete(validation_cache_t, (st), (i))
+#define sk_validation_cache_t_delete_ptr(st, ptr)         SKM_sk_delete_ptr(validation_cache_t, (st), (ptr))
+#define sk_validation_cache_t_insert(st, val, i)          SKM_sk_insert(validation_cache_t, (st), (val), (i))
+#define sk_validation_cache_t_set_cmp_func(st, cmp)       SKM_sk_set_cmp_func(validation_cache_t, (st), (cmp))
+#define sk_validation_cache_t_dup(st)                     SKM_sk_dup(validation_cache_t, st)
+#define sk_validation_cache_t_pop_free(st, free_func)     SKM_sk_pop_free(validation_cache_t, (st), (free_func))
+#define sk_validation_cache_t_shift(st)                   SKM_sk_shift(validation_cache_t, (st))
+#define sk_validation_cache_t_pop(st)                     SKM_sk_pop(validation_cache_t, (st))
+#define sk_validation_cache_t_sort(st)                    SKM_sk_sort(validation_cache_t, (st))
+#define sk_validation_cache_t_is_sorted(st)               SKM_sk_is_sorted(validation_cache_t, (st))
+
+/*
+ * Safestack macros for vrp_t.
+ */
+#define sk_vrp_t_new(st)                     SKM_sk_new(vrp_t, (st))
+#define sk_vrp_t_new_null()                  SKM_sk_new_null(vrp_t)
+#define sk_vrp_t_free(st)                    SKM_sk_free(vrp_t, (st))
+#define sk_vrp_t_num(st)                     SKM_sk_num(vrp_t, (st))
+#define sk_vrp_t_value(st, i)                SKM_sk_value(vrp_t, (st), (i))
+#define sk_vrp_t_set(st, i, val)             SKM_sk_set(vrp_t, (st), (i), (val))
+#define sk_vrp_t_zero(st)                    SKM_sk_zero(vrp_t, (st))
+#define sk_vrp_t_push(st, val)               SKM_sk_push(vrp_t, (st), (val))
+#define sk_vrp_t_unshift(st, val)            SKM_sk_unshift(vrp_t, (st), (val))
+#define sk_vrp_t_find(st, val)               SKM_sk_find(vrp_t, (st), (val))
+#define sk_vrp_t_find_ex(st, val)            SKM_sk_find_ex(vrp_t, (st), (val))
+#define sk_vrp_t_delete(st, i)               SKM_sk_delete(vrp_t, (st), (i))
+#define sk_vrp_t_delete_ptr(st, ptr)         SKM_sk_delete_ptr(vrp_t, (st), (ptr))
+#define sk_vrp_t_insert(st, val, i)          SKM_sk_insert(vrp_t, (st), (val), (i))
+#define sk_vrp_t_set_cmp_func(st, cmp)       SKM_sk_set_cmp_func(vrp_t, (st), (cmp))
+#define sk_vrp_t_dup(st)                     SKM_sk_dup(vrp_t, st)
+#define sk_vrp_t_pop_free(st, free_func)     SKM_sk_pop_free(vrp_t, (st), (free_func))
+#define sk_vrp_t_shift(st)                   SKM_sk_shift(vrp_t, (st))
+#define sk_vrp_t_pop(st)                     SKM_sk_pop(vrp_t, (st))
+#define sk_vrp_t_sort(st)                    SKM_sk_sort(vrp_t, (st))
+#define sk_vrp_t_is_sorted(st)               SKM_sk_is_sorted(vrp_t, (st))
+
+/*
+ * Safestack macros for router_key_t.
+ */
+#define sk_router_key_t_new(st)                     SKM_sk_new(router_key_t, (st))
+#define sk_router_key_t_new_null()                  SKM_sk_new_null(router_key_t)
+#define sk_router_key_t_free(st)                    SKM_sk_free(router_key_t, (st))
+#define sk_router_key_t_num(st)                     SKM_sk_num(router_key_t, (st))
+#define sk_router_key_t_value(st, i)                SKM_sk_value(router_key_t, (st), (i))
+#define sk_router_key_t_set(st, i, val)             SKM_sk_set(router_key_t, (st), (i), (val))
+#define sk_router_key_t_zero(st)                    SKM_sk_zero(router_key_t, (st))
+#define sk_router_key_t_push(st, val)               SKM_sk_push(router_key_t, (st), (val))
+#define sk_router_key_t_unshift(st, val)            SKM_sk_unshift(router_key_t, (st), (val))
+#define sk_router_key_t_find(st, val)               SKM_sk_find(router_key_t, (st), (val))
+#define sk_router_key_t_find_ex(st, val)            SKM_sk_find_ex(router_key_t, (st), (val))
+#define sk_router_key_t_delete(st, i)               SKM_sk_delete(router_key_t, (st), (i))
+#define sk_router_key_t_delete_ptr(st, ptr)         SKM_sk_delete_ptr(router_key_t, (st), (ptr))
+#define sk_router_key_t_insert(st, val, i)          SKM_sk_insert(router_key_t, (st), (val), (i))
+#define sk_router_key_t_set_cmp_func(st, cmp)       SKM_sk_set_cmp_func(router_key_t, (st), (cmp))
+#define sk_router_key_t_dup(st)                     SKM_sk_dup(router_key_t, st)
+#define sk_router_key_t_pop_free(st, free_func)     SKM_sk_pop_free(router_key_t, (st), (free_func))
+#define sk_router_key_t_shift(st)                   SKM_sk_shift(router_key_t, (st))
+#define sk_router_key_t_pop(st)                     SKM_sk_pop(router_key_t, (st))
+#define sk_router_key_t_sort(st)                    SKM_sk_sort(router_key_t, (st))
+#define sk_router_key_t_is_sorted(st)               SKM_sk_is_sorted(router_key_t, (st))
+
 /*
  * Safestack macros for task_t.
  */
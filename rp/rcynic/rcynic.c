@@ -34,24 +34,40 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/file.h>
 #include <errno.h>
 #include <sys/signal.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <limits.h>
 #include <fcntl.h>
 #include <signal.h>
-#include <utime.h>
 #include <glob.h>
 #include <sys/param.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(EPOLL_CLOEXEC) && defined(SYS_pidfd_open)
+#define	USE_EPOLL		/* epoll() and pidfds for rsync_mgr() */
+#endif
 
 #define SYSLOG_NAMES		/* defines CODE prioritynames[], facilitynames[] */
 #include <syslog.h>
@@ -66,6 +82,8 @@
 #include <openssl/rand.h>
 #include <openssl/asn1t.h>
 #include <openssl/cms.h>
+#include <openssl/sha.h>
+#include <openssl/ssl.h>
 
 #include <rpki/roa.h>
 #include <rpki/manifest.h>
@@ -86,6 +104,9 @@
 #define SCHEME_HTTP	("http://")
 #define	SIZEOF_HTTP	(sizeof(SCHEME_HTTP) - 1)
 
+#define SCHEME_HTTPS	("https://")
+#define	SIZEOF_HTTPS	(sizeof(SCHEME_HTTPS) - 1)
+
 /**
  * Maximum length of a hostname.
  */
@@ -104,11 +125,110 @@
  */
 #define	KILL_MAX	10
 
+/**
+ * Size of the rsync timer wheel, in one-second slots.  Must be a
+ * power of two.  Deadlines further out than this just go around the
+ * wheel more than once.
+ */
+#define	RSYNC_TIMER_SLOTS	256
+
+/**
+ * Maximum number of events we take from epoll_wait() at once.
+ */
+#define	RSYNC_MAX_EVENTS	64
+
+/**
+ * Longest a repository host's backoff can grow, as a multiple of
+ * retry_wait_min.
+ */
+#define	RSYNC_HOST_BACKOFF_MAX	16
+
+/**
+ * Most AS numbers we'll expand a single router certificate into, one
+ * router key each.  Real router certificates name one AS, or a few;
+ * this just keeps a certificate covering a huge AS range from eating
+ * all our memory.
+ */
+#define	ROUTER_CERT_ASNS_MAX	1024
+
+/**
+ * Upper limits on the size of objects we're willing to read.  These
+ * are far larger than anything we expect to see, they're just here to
+ * keep a broken or hostile repository from making us swallow an
+ * arbitrarily large file.
+ */
+#define	MAX_CERT_SIZE	(1 << 20)
+#define	MAX_CRL_SIZE	(1 << 26)
+#define	MAX_CMS_SIZE	(1 << 24)
+
+/**
+ * Objects larger than this are mapped rather than read into memory.
+ */
+#define	MMAP_THRESHOLD	(1 << 16)
+
+/**
+ * Arena parameters for validation status entries.
+ */
+#define	ARENA_BLOCK_SIZE	(1 << 20)
+#define	ARENA_ALIGN		16
+
+/**
+ * Initial size of the validation status hash table.  Must be a power
+ * of two.
+ */
+#define	VALIDATION_STATUS_MIN_SLOTS	1024
+
+/**
+ * Initial size of the rsync URI trie's hash table.  Must be a power
+ * of two.
+ */
+#define	RSYNC_TRIE_MIN_SLOTS	1024
+
+/**
+ * Initial size of the URI interning table.  Must be a power of two.
+ */
+#define	URI_TABLE_MIN_SLOTS	4096
+
+/**
+ * Initial size of the CRL cache's hash table.  Must be a power of
+ * two.
+ */
+#define	CRL_CACHE_MIN_SLOTS	256
+
+/**
+ * Initial state of the FNV-1a hash used for interned URIs.
+ */
+#define	URI_HASH_INIT		2166136261U
+
 /**
  * Version number of XML summary output.
  */
 #define	XML_SUMMARY_VERSION	1
 
+/**
+ * Version number and magic string of binary summary output, and how
+ * much to buffer when writing it.
+ */
+#define	BINARY_SUMMARY_VERSION	1
+#define	BINARY_SUMMARY_MAGIC	"RCYNSUM"
+#define	BINARY_SUMMARY_BUFSIZE	(1024 * 1024)
+
+/**
+ * Version number of validation cache file format.
+ */
+#define	VALIDATION_CACHE_VERSION	2
+
+/**
+ * Version number, magic strings, and record sizes of VRP output file
+ * format.
+ */
+#define	VRP_OUTPUT_VERSION	1
+#define	VRP_OUTPUT_MAGIC	"RCYNVRP"
+#define	VRP_DELTA_MAGIC		"RCYNVRD"
+#define	VRP_OUTPUT_HEADER_LEN	32
+#define	VRP_OUTPUT_VRP_LEN	24
+#define	VRP_OUTPUT_KEY_LEN	28
+
 /**
  * How much buffer space do we need for a raw address?
  */
@@ -262,6 +382,9 @@ static const struct {
   QB(roa_max_prefixlen_too_short,	"ROA maxPrefixlen too short")	    \
   QB(roa_resource_not_in_ee,		"ROA resource not in EE")	    \
   QB(roa_resources_malformed,		"ROA resources malformed")	    \
+  QB(rrdp_transfer_failed,		"RRDP transfer failed")		    \
+  QB(rrdp_transfer_timed_out,		"RRDP transfer timed out")	    \
+  QB(rrdp_uri_outside_repository,	"RRDP URI outside repository")	    \
   QB(rsync_transfer_failed,		"rsync transfer failed")	    \
   QB(rsync_transfer_timed_out,		"rsync transfer timed out")	    \
   QB(safi_not_allowed,			"SAFI not allowed")		    \
@@ -308,6 +431,7 @@ static const struct {
   QG(non_rsync_uri_in_extension,	"Non-rsync URI in extension")	    \
   QG(object_accepted,			"Object accepted")		    \
   QG(rechecking_object,			"Rechecking object")		    \
+  QG(rrdp_transfer_succeeded,		"RRDP transfer succeeded")	    \
   QG(rsync_transfer_succeeded,		"rsync transfer succeeded")	    \
   QG(validation_ok,			"OK")
 
@@ -372,9 +496,118 @@ static const char * const object_generation_label[] = { OBJECT_GENERATIONS NULL
 #undef	QQ
 
 /**
- * Type-safe string wrapper for URIs.
+ * Ways in which we can install an object into the new authenticated
+ * tree, in the order in which we try them, so that the XML summary
+ * can report what installation cost us.
+ */
+
+#define COPY_METHODS \
+  QQ(link)		\
+  QQ(reflink)		\
+  QQ(copy_file_range)	\
+  QQ(sendfile)		\
+  QQ(read_write)
+
+#define	QQ(x)	copy_method_##x ,
+typedef enum copy_method { COPY_METHODS COPY_METHOD_T_MAX } copy_method_t;
+#undef	QQ
+
+#define	QQ(x)	#x ,
+static const char * const copy_method_label[] = { COPY_METHODS NULL };
+#undef	QQ
+
+/**
+ * Phases of a run, in order, for timing reports.
+ */
+
+#define RUN_PHASES \
+  QQ(startup)		\
+  QQ(trust_anchors)	\
+  QQ(validation)	\
+  QQ(finalize)		\
+  QQ(output)
+
+#define	QQ(x)	run_phase_##x ,
+typedef enum run_phase { RUN_PHASES RUN_PHASE_T_MAX } run_phase_t;
+#undef	QQ
+
+#define	QQ(x)	#x ,
+static const char * const run_phase_label[] = { RUN_PHASES NULL };
+#undef	QQ
+
+/**
+ * Types of object we count per trust anchor.
+ */
+
+#define OBJECT_TYPES \
+  QQ(cer)		\
+  QQ(crl)		\
+  QQ(mft)		\
+  QQ(roa)		\
+  QQ(gbr)
+
+#define	QQ(x)	object_type_##x ,
+typedef enum object_type { OBJECT_TYPES OBJECT_TYPE_T_MAX } object_type_t;
+#undef	QQ
+
+#define	QQ(x)	#x ,
+static const char * const object_type_label[] = { OBJECT_TYPES NULL };
+#undef	QQ
+
+/**
+ * Operations whose cost we track, per run, per trust anchor, and per
+ * publication point.
+ */
+
+#define OPERATIONS \
+  QQ(fetch)		\
+  QQ(decode)		\
+  QQ(extensions)	\
+  QQ(verify)		\
+  QQ(resources)		\
+  QQ(install)		\
+  QQ(finalize)		\
+  QQ(prune)
+
+#define	QQ(x)	operation_##x ,
+typedef enum operation { OPERATIONS OPERATION_T_MAX } operation_t;
+#undef	QQ
+
+#define	QQ(x)	#x ,
+static const char * const operation_label[] = { OPERATIONS NULL };
+#undef	QQ
+
+/**
+ * What a set of operation timings covers.
+ */
+
+#define TIMING_SCOPES \
+  QQ(run)		\
+  QQ(trust_anchor)	\
+  QQ(publication_point)
+
+#define	QQ(x)	timing_scope_##x ,
+typedef enum timing_scope { TIMING_SCOPES TIMING_SCOPE_T_MAX } timing_scope_t;
+#undef	QQ
+
+#define	QQ(x)	#x ,
+static const char * const timing_scope_label[] = { TIMING_SCOPES NULL };
+#undef	QQ
+
+/**
+ * Handle for an interned URI.  s points to a string owned by the URI
+ * interning table (or to a constant empty string), so handles are
+ * cheap to copy and never need to be freed.  Code which only needs a
+ * URI for the duration of a lookup may point s at a local buffer, but
+ * such a handle must never be stored anywhere.
+ */
+typedef struct { const char *s; } uri_t;
+
+/**
+ * The empty URI.  Anything that holds a uri_t must be initialized
+ * to this rather than to all zeros.
  */
-typedef struct { char s[URI_MAX]; } uri_t;
+static const uri_t uri_empty = { "" };
 
 /**
  * Type-safe string wrapper for filename paths.
@@ -392,20 +625,88 @@ typedef struct { unsigned char h[EVP_MAX_MD_SIZE]; } hashbuf_t;
 typedef struct { char s[sizeof("2001-01-01T00:00:00Z") + 1]; } timestamp_t;
 
 /**
- * Per-URI validation status object.
- * uri must be first element.
+ * Per-URI validation status object.  These live in the validation
+ * status index's arena, with the URI stored inline after the fixed
+ * part, so each entry takes only as much memory as its URI needs.
  */
 typedef struct validation_status {
-  uri_t uri;
-  object_generation_t generation;
+  struct validation_status *next;	/* Next entry in insertion order */
   time_t timestamp;
+  unsigned hash;
+  object_generation_t generation;
   unsigned char events[(MIB_COUNTER_T_MAX + 7) / 8];
-  short balance;
-  struct validation_status *left_child;
-  struct validation_status *right_child;
+  char uri[];
 } validation_status_t;
 
-DECLARE_STACK_OF(validation_status_t)
+/**
+ * Block of memory from which we carve validation_status_t and
+ * uri_entry_t objects.
+ */
+typedef struct arena_block {
+  struct arena_block *next;
+  unsigned char *base;
+  size_t used, size;
+} arena_block_t;
+
+/**
+ * Interned URI.  The string is stored inline.  hash is the FNV-1a
+ * state after the last character, which is also the state from which
+ * to continue when hashing a longer URI that has this one as prefix.
+ */
+typedef struct uri_entry {
+  unsigned hash;
+  size_t len;
+  char s[];
+} uri_entry_t;
+
+/**
+ * URI interning table: an open-addressed hash table (linear probing,
+ * power-of-two size) of uri_entry_t objects carved from an arena.
+ */
+typedef struct uri_table {
+  uri_entry_t **slots;
+  size_t nslots, count;
+  arena_block_t *arena;
+} uri_table_t;
+
+/**
+ * Index of validation_status_t objects: an open-addressed hash table
+ * (linear probing, power-of-two size) for lookup, plus a list in
+ * insertion order for output.
+ */
+typedef struct validation_status_index {
+  validation_status_t **slots;
+  size_t nslots, count;
+  validation_status_t *head, *tail;
+  arena_block_t *arena;
+} validation_status_index_t;
+
+/**
+ * Record types in the binary summary.
+ */
+typedef enum {
+  binary_summary_header_record			= 'H',
+  binary_summary_label_record			= 'L',
+  binary_summary_generation_record		= 'G',
+  binary_summary_string_record			= 'S',
+  binary_summary_validation_status_record	= 'V',
+  binary_summary_rsync_history_record		= 'R',
+  binary_summary_object_install_record		= 'I',
+  binary_summary_operation_record		= 'O',
+  binary_summary_timing_record			= 'T',
+  binary_summary_end_record			= 'E'
+} binary_summary_record_t;
+
+/**
+ * String table for the binary summary: an open-addressed hash table
+ * mapping each URI we've written to its index, so that a URI which
+ * appears more than once only costs its full length once.
+ */
+typedef struct binary_summary_strtab {
+  const char **strings;
+  unsigned long *index;
+  size_t nslots, count;
+} binary_summary_strtab_t;
 
 /**
  * Structure to hold data parsed out of a certificate.
@@ -416,6 +717,118 @@ typedef struct certinfo {
   uri_t uri, sia, aia, crldp, manifest, signedobject, rrdpnotify;
 } certinfo_t;
 
+/**
+ * X.509v3 extensions allowed by the RPKI certificate profile.
+ */
+
+#define CERT_EXTENSIONS \
+  QQ(basic_constraints)		\
+  QQ(key_usage)			\
+  QQ(ext_key_usage)		\
+  QQ(subject_key_identifier)	\
+  QQ(authority_key_identifier)	\
+  QQ(crl_distribution_points)	\
+  QQ(info_access)		\
+  QQ(sinfo_access)		\
+  QQ(certificate_policies)	\
+  QQ(sbgp_ipAddrBlock)		\
+  QQ(sbgp_autonomousSysNum)
+
+#define	QQ(x)	cert_extension_##x ,
+typedef enum cert_extension { CERT_EXTENSIONS CERT_EXTENSION_T_MAX } cert_extension_t;
+#undef	QQ
+
+#define	CERT_EXTENSION(x)	(1U << cert_extension_##x)
+
+/**
+ * What one pass over a certificate's extensions found: bitmaps of
+ * which allowed extensions are present and which are marked
+ * critical, a count of extensions that shouldn't be there at all
+ * (unknown, duplicated, or undecodable), and decoded forms of the
+ * extensions OpenSSL doesn't already keep decoded in the X509.
+ */
+typedef struct cert_extensions {
+  unsigned present, critical;
+  int unexpected;
+  AUTHORITY_INFO_ACCESS *aia, *sia;
+  EXTENDED_KEY_USAGE *eku;
+  STACK_OF(POLICYINFO) *policies;
+} cert_extensions_t;
+
+/**
+ * Accumulated cost of some operation: how many times we did it, and
+ * the wall clock and CPU time it took, in microseconds.
+ */
+typedef struct timing {
+  unsigned long count;
+  unsigned long long wall, cpu;
+} timing_t;
+
+/**
+ * Stopwatch for timing one operation.  Between stopwatch_start() and
+ * stopwatch_stop() this holds the starting times; afterwards, the
+ * elapsed times.  cpu_clock is the per-thread or per-process CPU
+ * clock, depending on what we're timing.
+ */
+typedef struct stopwatch {
+  clockid_t cpu_clock;
+  struct timespec wall, cpu;
+} stopwatch_t;
+
+/**
+ * Per-trust-anchor object counts and operation costs.  The walk
+ * context at the bottom of each walk context stack points at the
+ * entry for the trust anchor from which that walk started.
+ */
+typedef struct ta_stats {
+  uri_t uri;
+  unsigned long accepted[OBJECT_TYPE_T_MAX], rejected[OBJECT_TYPE_T_MAX];
+  timing_t timing[OPERATION_T_MAX];
+} ta_stats_t;
+
+DECLARE_STACK_OF(ta_stats_t)
+
+/**
+ * Per-publication-point operation costs.  Each walk context points at
+ * the entry for its certificate's SIA, created the first time we
+ * charge anything to it.  A publication point can end up with more
+ * than one entry (eg, during a key rollover), so these are coalesced
+ * by pp_stats_coalesce() before we write them out.
+ */
+typedef struct pp_stats {
+  uri_t uri;
+  timing_t timing[OPERATION_T_MAX];
+} pp_stats_t;
+
+DECLARE_STACK_OF(pp_stats_t)
+
+/**
+ * Trace record for one walk_cert() publication point, from when we
+ * start fetching it until its walk context is freed, which happens
+ * only after everything underneath it is done too.  Times are
+ * microseconds on the monotonic clock; 0 means "hasn't happened".
+ */
+typedef struct trace_walk {
+  uri_t uri;
+  struct trace_walk *parent;
+  unsigned long long start, fetched, end;
+} trace_walk_t;
+
+DECLARE_STACK_OF(trace_walk_t)
+
+/**
+ * State for the trace-output option.  Events are streamed to the
+ * temporary file as they happen; walk records are kept until the end
+ * of the run, when we write them out and work out the critical path.
+ */
+typedef struct trace {
+  FILE *f;
+  path_t temp;
+  unsigned long long epoch, threshold;
+  unsigned long nevents;
+  STACK_OF(trace_walk_t) *walks;
+} trace_t;
+
 typedef struct rcynic_ctx rcynic_ctx_t;
 
 /**
@@ -439,14 +852,22 @@ typedef struct walk_ctx {
   unsigned refcount;
   certinfo_t certinfo;
   X509 *cert;
+  EVP_PKEY *pkey;
+  IPAddrBlocks *addr;
+  ASIdentifierChoice *asnum;
   Manifest *manifest;
   object_generation_t manifest_generation;
   STACK_OF(OPENSSL_STRING) *filenames;
   int manifest_iteration, filename_iteration, stale_manifest;
+  int busy, have_chain_hash, have_resources, unchanged;
+  hashbuf_t chain_hash;
   walk_state_t state;
   uri_t crldp;
   STACK_OF(X509) *certs;
   STACK_OF(X509_CRL) *crls;
+  ta_stats_t *ta_stats;
+  pp_stats_t *pp_stats;
+  trace_walk_t *trace;
 } walk_ctx_t;
 
 DECLARE_STACK_OF(walk_ctx_t)
@@ -480,10 +901,12 @@ typedef enum { RSYNC_STATES RSYNC_STATE_T_MAX } rsync_state_t;
 #undef	QQ
 
 /**
- * Context for asyncronous rsync.
+ * Context for asyncronous rsync.  RRDP fetches use the same context:
+ * uri is still the rsync URI of what we're fetching, and notify is the
+ * RRDP notification URI we're fetching it from.
  */
 typedef struct rsync_ctx {
-  uri_t uri;
+  uri_t uri, notify;
   void (*handler)(rcynic_ctx_t *, const struct rsync_ctx *, const rsync_status_t, const uri_t *, void *);
   void *cookie;
   rsync_state_t state;
@@ -494,14 +917,42 @@ typedef struct rsync_ctx {
   } problem;
   unsigned tries;
   pid_t pid;
-  int fd;
-  time_t started, deadline;
+  int fd, pidfd;
+  time_t started, launched, deadline;
+  unsigned long long launched_usec;
+  struct rsync_ctx *timer_next, **timer_prev;
+  struct rsync_ctx *host_next, **host_prev;
+  struct rsync_trie_node *node;
+  struct rsync_host *host;
   char buffer[URI_MAX * 4];
   size_t buflen;
 } rsync_ctx_t;
 
 DECLARE_STACK_OF(rsync_ctx_t)
 
+/**
+ * Per-host fetch scheduling state.  Hosts are keyed by scheme and
+ * hostname, so rsync and RRDP service on the same machine are tracked
+ * separately.  The limit on parallel fetches starts at
+ * max-fetches-per-host and adapts: it shrinks when the host refuses
+ * us or times out, and creeps back up as fetches succeed.  busy is
+ * the total time we've spent fetching from this host this run, which
+ * is what we use to share fetch slots fairly between hosts.  waiting
+ * is this host's queue of contexts that don't have a subprocess yet,
+ * oldest first, so picking the next fetch doesn't mean looking at
+ * every context we have.
+ */
+typedef struct rsync_host {
+  int running, limit;
+  unsigned failures;
+  unsigned long fetches;
+  time_t busy, backoff_until;
+  struct rsync_ctx *waiting, **waiting_tail;
+  char name[SIZEOF_RSYNC + HOSTNAME_MAX];
+} rsync_host_t;
+
+DECLARE_STACK_OF(rsync_host_t)
+
 /**
  * Record of rsync attempts.
  */
@@ -514,6 +965,197 @@ typedef struct rsync_history {
 
 DECLARE_STACK_OF(rsync_history_t)
 
+/**
+ * Bits in rsync_trie_node_t.changed.
+ */
+#define	RSYNC_CHANGED_DIR	1 /* Something in this directory changed */
+#define	RSYNC_CHANGED_TREE	2 /* Anything at or under here may have changed */
+
+/**
+ * Node in the trie of rsync URIs, one per path component.  A node
+ * records the rsync_history_t for a fetch of exactly its URI, if
+ * there was one, and how many active rsync contexts are at its URI
+ * and at or anywhere under it.  That's enough to answer "have we
+ * already fetched something covering this?" and "does this overlap
+ * something we're fetching?" by walking one path.  changed records
+ * what rsync's --itemize-changes output told us about this directory.
+ */
+typedef struct rsync_trie_node {
+  struct rsync_trie_node *parent;
+  rsync_history_t *history;
+  int active, active_below, changed;
+  unsigned hash;
+  size_t len;
+  char name[];
+} rsync_trie_node_t;
+
+/**
+ * Trie of rsync URIs.  Children are found through a single hash table
+ * keyed on parent node and component name (open addressing, linear
+ * probing, power-of-two size), so a step down costs the same
+ * regardless of fanout.  Nodes live in an arena and are never freed
+ * individually.
+ */
+typedef struct rsync_trie {
+  rsync_trie_node_t *root;
+  rsync_trie_node_t **slots;
+  size_t nslots, count;
+  arena_block_t *arena;
+} rsync_trie_t;
+
+/**
+ * RRDP (RFC 8182) protocol details and parser limits.
+ */
+#define	RRDP_XMLNS		"http://www.ripe.net/rpki/rrdp"
+#define	RRDP_MAX_REDIRECTS	5
+#define	RRDP_MAX_ATTRS		8
+#define	RRDP_SESSION_MAX	64
+#define	RRDP_HASH_HEX_LEN	(HASH_SHA256_LEN * 2)
+#define	RRDP_WHITESPACE		" \t\r\n"
+
+/**
+ * Prefix on the line an RRDP subprocess writes to its output pipe for
+ * each object URI it refused because it's outside the repository it
+ * was fetching, so that the parent can count it.
+ */
+#define	RRDP_OUTSIDE_TAG	"RRDP outside repository: "
+
+/**
+ * A delta listed in an RRDP notification file.
+ */
+typedef struct rrdp_delta {
+  unsigned long serial;
+  char uri[URI_MAX];
+  char hash[RRDP_HASH_HEX_LEN + 1];
+} rrdp_delta_t;
+
+DECLARE_STACK_OF(rrdp_delta_t)
+
+/**
+ * A change to the unauthenticated tree that an RRDP snapshot or delta
+ * asks for, held back until we've seen the whole document and checked
+ * its hash.  A published object is already sitting in a temporary
+ * file next to path.
+ */
+typedef struct rrdp_change {
+  int withdraw;
+  char path[];
+} rrdp_change_t;
+
+DECLARE_STACK_OF(rrdp_change_t)
+
+/**
+ * Kinds of RRDP document.
+ */
+typedef enum {
+  rrdp_doc_notification,
+  rrdp_doc_snapshot,
+  rrdp_doc_delta
+} rrdp_doc_t;
+
+/**
+ * Attributes of an XML element, pointing into the parser's tag buffer.
+ */
+typedef struct rrdp_attrs {
+  const char *name[RRDP_MAX_ATTRS], *value[RRDP_MAX_ATTRS];
+  int n;
+} rrdp_attrs_t;
+
+/**
+ * State for parsing one RRDP document.  We parse as the bytes arrive
+ * off the network, so this holds the XML tokenizer's state, what the
+ * document has told us so far, and the object we're in the middle of
+ * decoding, if any.  For snapshots and deltas, session_id and serial
+ * are set up beforehand from the notification file and checked
+ * against the document, and base is the rsync URI every object has to
+ * be under.
+ */
+typedef struct rrdp_parser {
+  const rcynic_ctx_t *rc;
+  rrdp_doc_t doc;
+  const char *source, *base;
+  enum { rrdp_lex_text, rrdp_lex_tag, rrdp_lex_comment } lex;
+  char tag[URI_MAX * 2 + 256], quote;
+  size_t taglen;
+  int depth, failed, done, skip;
+  char session_id[RRDP_SESSION_MAX];
+  unsigned long serial, objects, outside;
+  char snapshot_uri[URI_MAX], snapshot_hash[RRDP_HASH_HEX_LEN + 1];
+  STACK_OF(rrdp_delta_t) *deltas;
+  STACK_OF(rrdp_change_t) *changes;
+  path_t path, temp;
+  int fd, b64_count, b64_pad;
+  unsigned long b64_bits;
+  unsigned char out[4096];
+  size_t outlen;
+} rrdp_parser_t;
+
+/**
+ * CRL we've already accepted, kept in memory so that we don't have to
+ * read it back from disk every time we need it.
+ */
+typedef struct crl_cache {
+  uri_t uri;
+  object_generation_t generation;
+  hashbuf_t hash;
+  X509_CRL *crl;
+} crl_cache_t;
+
+/**
+ * CRL cache: an open-addressed hash table (linear probing,
+ * power-of-two size) of crl_cache_t objects, keyed by interned URI.
+ */
+typedef struct crl_cache_index {
+  crl_cache_t **slots;
+  size_t nslots, count;
+} crl_cache_index_t;
+
+/**
+ * Entry in the persistent validation cache.  key identifies an
+ * object together with everything its validity depends on, the rest
+ * is what we need to reproduce the result of the full check without
+ * doing it again.  size, mtime and ino identify the file we last
+ * hashed, so that we can tell whether it's still the same one.
+ */
+typedef struct validation_cache {
+  unsigned char key[SHA256_DIGEST_LENGTH];
+  char expires[sizeof("20010101000000Z")];
+  unsigned char events[(MIB_COUNTER_T_MAX + 7) / 8];
+  certinfo_t certinfo;
+  off_t size;
+  time_t mtime;
+  ino_t ino;
+  int usable;
+} validation_cache_t;
+
+DECLARE_STACK_OF(validation_cache_t)
+
+/**
+ * One validated ROA payload (prefix, maximum length, and origin AS)
+ * collected for the VRP output file.  addr is in network byte order,
+ * zero-filled past the end of an IPv4 address.
+ */
+typedef struct vrp {
+  unsigned long asn;
+  unsigned char afi, prefixlen, max_prefixlen;
+  unsigned char addr[ADDR_RAW_BUF_LEN];
+} vrp_t;
+
+DECLARE_STACK_OF(vrp_t)
+
+/**
+ * One BGPsec router key collected for the VRP output file.  key is
+ * the DER-encoded SubjectPublicKeyInfo, stored inline.
+ */
+typedef struct router_key {
+  unsigned long asn;
+  unsigned char ski[SHA_DIGEST_LENGTH];
+  size_t keylen;
+  unsigned char key[];
+} router_key_t;
+
+DECLARE_STACK_OF(router_key_t)
+
 /**
  * Deferred task.
  */
@@ -547,29 +1189,72 @@ typedef struct rcynic_x509_store_ctx {
   const certinfo_t *subject;
 } rcynic_x509_store_ctx_t;
 
+/**
+ * Worker pool for multi-threaded validation.  There's one big lock,
+ * held by whichever thread is running rcynic code; it's only released
+ * while waiting for work or while doing expensive crypto or DER
+ * decoding on objects that no other thread can see.  While paused is
+ * set, workers finish what they're doing but don't take new tasks.
+ */
+typedef struct worker_pool {
+  pthread_mutex_t lock;		/* The big lock */
+  pthread_cond_t work;		/* Tasks have been queued */
+  pthread_cond_t idle;		/* Task queue drained and nobody busy */
+  pthread_cond_t frame;		/* Some walk_ctx_t is no longer busy */
+  pthread_t *threads;
+  int nthreads, busy, shutdown, numbered, paused;
+} worker_pool_t;
+
+/**
+ * Small number identifying the current thread in the trace output:
+ * zero for the main thread, one and up for worker threads in the
+ * order they started.  Portable, unlike kernel thread IDs.
+ */
+static __thread unsigned thread_number;
+
 /**
  * Program context that would otherwise be a mess of global variables.
  */
 struct rcynic_ctx {
   path_t authenticated, old_authenticated, new_authenticated, unauthenticated;
+  path_t rrdp_directory;
   char *jane, *rsync_program;
-  STACK_OF(validation_status_t) *validation_status;
-  STACK_OF(rsync_history_t) *rsync_history;
+  validation_status_index_t *validation_status;
+  uri_table_t *uri_table;
+  STACK_OF(rsync_history_t) *rsync_history, *rrdp_failures;
+  rsync_trie_t *rsync_trie;
+  crl_cache_index_t *crl_cache;
+  STACK_OF(validation_cache_t) *validation_cache, *validation_cache_used;
+  STACK_OF(ta_stats_t) *ta_stats;
+  STACK_OF(pp_stats_t) *pp_stats;
+  trace_t *trace;
+  STACK_OF(vrp_t) *vrps;
+  STACK_OF(router_key_t) *router_keys;
+  arena_block_t *vrp_arena;
   STACK_OF(rsync_ctx_t) *rsync_queue;
+  STACK_OF(rsync_host_t) *rsync_hosts;
+  rsync_ctx_t *rsync_timers[RSYNC_TIMER_SLOTS];
+  time_t rsync_timer_clock;
+  int rsync_timer_count, rsync_running, rsync_epoll;
   STACK_OF(task_t) *task_queue;
   int use_syslog, allow_stale_crl, allow_stale_manifest, use_links;
   int require_crl_in_manifest, rsync_timeout, priority[LOG_LEVEL_T_MAX];
   int allow_non_self_signed_trust_anchor, allow_object_not_in_manifest;
-  int max_parallel_fetches, max_retries, retry_wait_min, run_rsync;
+  int max_parallel_fetches, worker_threads, max_retries, retry_wait_min, run_rsync;
+  int max_fetches_per_host, max_vrp_deltas;
   int allow_digest_mismatch, allow_crl_digest_mismatch;
   int allow_nonconformant_name, allow_ee_without_signedObject;
   int allow_1024_bit_ee_key, allow_wrong_cms_si_attributes;
-  int rsync_early;
+  int rsync_early, old_authenticated_fixed, incremental_validation;
   unsigned max_select_time;
-  validation_status_t *validation_status_in_waiting;
-  validation_status_t *validation_status_root;
+  time_t validation_time;
   log_level_t log_level;
   X509_STORE *x509_store;
+  worker_pool_t *pool;
+  unsigned long copy_method_count[COPY_METHOD_T_MAX], unchanged_pps;
+  run_phase_t phase;
+  stopwatch_t phase_stopwatch;
+  timing_t phase_timing[RUN_PHASE_T_MAX], operation_timing[OPERATION_T_MAX];
 };
 
 
@@ -735,26 +1420,6 @@ static void sk_OPENSSL_STRING_remove(STACK_OF(OPENSSL_STRING) *sk, const char *s
   OPENSSL_STRING_free((void *) sk_OPENSSL_STRING_delete(sk, sk_OPENSSL_STRING_find(sk, str)));
 }
 
-/**
- * Allocate a new validation_status_t object.
- */
-static validation_status_t *validation_status_t_new(void)
-{
-  validation_status_t *v = malloc(sizeof(*v));
-  if (v)
-    memset(v, 0, sizeof(*v));
-  return v;
-}
-
-/**
- * Type-safe wrapper around free() to keep safestack macros happy.
- */
-static void validation_status_t_free(validation_status_t *v)
-{
-  if (v)
-    free(v);
-}
-
 
 
 /**
@@ -785,43 +1450,224 @@ static int rsync_history_cmp(const rsync_history_t * const *a, const rsync_histo
   return strcmp((*a)->uri.s, (*b)->uri.s);
 }
 
-
-
 /**
- * Convert a time_t to a printable string in UTC format.
+ * Type-safe wrapper around free() to keep safestack macros happy.
  */
-static const char *time_to_string(timestamp_t *ts, const time_t *t)
+static void ta_stats_t_free(ta_stats_t *t)
 {
-  time_t now;
-  size_t n;
-
-  assert(ts != NULL);
-
-  if (t == NULL) {
-    now = time(0);
-    t = &now;
-  }
-
-  n = strftime(ts->s, sizeof(ts->s), "%Y-%m-%dT%H:%M:%SZ", gmtime(t));
-  assert(n > 0);
-
-  return ts->s;
+  if (t)
+    free(t);
 }
 
-/*
- * GCC attributes to help catch format string errors.
+/**
+ * Compare two ta_stats_t objects.
  */
-
-#ifdef __GNUC__
-
-static void logmsg(const rcynic_ctx_t *rc,
-		   const log_level_t level,
-		   const char *fmt, ...)
-     __attribute__ ((format (printf, 3, 4)));
-#endif
+static int ta_stats_cmp(const ta_stats_t * const *a, const ta_stats_t * const *b)
+{
+  return strcmp((*a)->uri.s, (*b)->uri.s);
+}
 
 /**
- * Logging.
+ * Type-safe wrapper around free() to keep safestack macros happy.
+ */
+static void pp_stats_t_free(pp_stats_t *p)
+{
+  if (p)
+    free(p);
+}
+
+/**
+ * Compare two pp_stats_t objects.
+ */
+static int pp_stats_cmp(const pp_stats_t * const *a, const pp_stats_t * const *b)
+{
+  return strcmp((*a)->uri.s, (*b)->uri.s);
+}
+
+/**
+ * Start a stopwatch.
+ */
+static void stopwatch_start(stopwatch_t *sw, const clockid_t cpu_clock)
+{
+  sw->cpu_clock = cpu_clock;
+  (void) clock_gettime(CLOCK_MONOTONIC, &sw->wall);
+  (void) clock_gettime(cpu_clock, &sw->cpu);
+}
+
+/**
+ * Microseconds from one timespec to another.
+ */
+static unsigned long long timespec_diff(const struct timespec *start,
+					const struct timespec *finish)
+{
+  long long usec = ((long long) (finish->tv_sec - start->tv_sec) * 1000000 +
+		    (finish->tv_nsec - start->tv_nsec) / 1000);
+  return usec > 0 ? usec : 0;
+}
+
+/**
+ * Stop a stopwatch, leaving the elapsed times in it.
+ */
+static void stopwatch_stop(stopwatch_t *sw)
+{
+  struct timespec wall, cpu;
+  unsigned long long usec;
+
+  (void) clock_gettime(sw->cpu_clock, &cpu);
+  (void) clock_gettime(CLOCK_MONOTONIC, &wall);
+
+  usec = timespec_diff(&sw->wall, &wall);
+  sw->wall.tv_sec  = usec / 1000000;
+  sw->wall.tv_nsec = usec % 1000000 * 1000;
+
+  usec = timespec_diff(&sw->cpu, &cpu);
+  sw->cpu.tv_sec  = usec / 1000000;
+  sw->cpu.tv_nsec = usec % 1000000 * 1000;
+}
+
+/**
+ * Current time on the monotonic clock, in microseconds.
+ */
+static unsigned long long monotonic_usec(void)
+{
+  struct timespec now;
+  (void) clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Add a stopped stopwatch's elapsed times to a timing_t.
+ */
+static void timing_add(timing_t *t, const stopwatch_t *sw)
+{
+  t->count++;
+  t->wall += (unsigned long long) sw->wall.tv_sec * 1000000 + sw->wall.tv_nsec / 1000;
+  t->cpu  += (unsigned long long) sw->cpu.tv_sec  * 1000000 + sw->cpu.tv_nsec  / 1000;
+}
+
+/**
+ * Free a crl_cache_t object.
+ */
+static void crl_cache_t_free(crl_cache_t *c)
+{
+  if (c) {
+    X509_CRL_free(c->crl);
+    free(c);
+  }
+}
+
+/**
+ * Type-safe wrapper around free() to keep safestack macros happy.
+ */
+static void validation_cache_t_free(validation_cache_t *vc)
+{
+  if (vc)
+    free(vc);
+}
+
+/**
+ * Compare two validation_cache_t objects.
+ */
+static int validation_cache_cmp(const validation_cache_t * const *a, const validation_cache_t * const *b)
+{
+  return memcmp((*a)->key, (*b)->key, sizeof((*a)->key));
+}
+
+/**
+ * Compare two vrp_t objects.  Sorts by address family, then prefix,
+ * then origin AS, which is what an RTR server wants for lookups.
+ */
+static int vrp_cmp(const vrp_t * const *a, const vrp_t * const *b)
+{
+  int cmp;
+
+  if ((*a)->afi != (*b)->afi)
+    return (*a)->afi < (*b)->afi ? -1 : 1;
+  if ((cmp = memcmp((*a)->addr, (*b)->addr, sizeof((*a)->addr))) != 0)
+    return cmp;
+  if ((*a)->prefixlen != (*b)->prefixlen)
+    return (*a)->prefixlen < (*b)->prefixlen ? -1 : 1;
+  if ((*a)->max_prefixlen != (*b)->max_prefixlen)
+    return (*a)->max_prefixlen < (*b)->max_prefixlen ? -1 : 1;
+  if ((*a)->asn != (*b)->asn)
+    return (*a)->asn < (*b)->asn ? -1 : 1;
+  return 0;
+}
+
+/**
+ * Compare two router_key_t objects.
+ */
+static int router_key_cmp(const router_key_t * const *a, const router_key_t * const *b)
+{
+  int cmp;
+
+  if ((*a)->asn != (*b)->asn)
+    return (*a)->asn < (*b)->asn ? -1 : 1;
+  if ((cmp = memcmp((*a)->ski, (*b)->ski, sizeof((*a)->ski))) != 0)
+    return cmp;
+  if ((*a)->keylen != (*b)->keylen)
+    return (*a)->keylen < (*b)->keylen ? -1 : 1;
+  return memcmp((*a)->key, (*b)->key, (*a)->keylen);
+}
+
+
+
+/**
+ * Convert a time_t to a printable string in UTC format.
+ */
+static const char *time_to_string(timestamp_t *ts, const time_t *t)
+{
+  time_t now;
+  size_t n;
+
+  assert(ts != NULL);
+
+  if (t == NULL) {
+    now = time(0);
+    t = &now;
+  }
+
+  n = strftime(ts->s, sizeof(ts->s), "%Y-%m-%dT%H:%M:%SZ", gmtime(t));
+  assert(n > 0);
+
+  return ts->s;
+}
+
+/**
+ * Current time as far as validation is concerned.  This is the real
+ * clock unless the validation-time option has frozen it, in which
+ * case every check in the run sees the same time and results are
+ * reproducible.
+ */
+static time_t validation_now(const rcynic_ctx_t *rc)
+{
+  return rc->validation_time ? rc->validation_time : time(0);
+}
+
+/**
+ * X509_cmp_current_time(), but against validation_now().
+ */
+static int validation_cmp_time(const rcynic_ctx_t *rc, const ASN1_TIME *t)
+{
+  time_t now = rc->validation_time;
+
+  return now ? X509_cmp_time(t, &now) : X509_cmp_current_time(t);
+}
+
+/*
+ * GCC attributes to help catch format string errors.
+ */
+
+#ifdef __GNUC__
+
+static void logmsg(const rcynic_ctx_t *rc,
+		   const log_level_t level,
+		   const char *fmt, ...)
+     __attribute__ ((format (printf, 3, 4)));
+#endif
+
+/**
+ * Logging.
  */
 static void vlogmsg(const rcynic_ctx_t *rc,
 		    const log_level_t level,
@@ -992,6 +1838,40 @@ static int configure_unsigned_integer(const rcynic_ctx_t *rc,
   }
 }
 
+/**
+ * Configure time variable, in the same YYYY-MM-DDTHH:MM:SSZ format
+ * we use in the XML summary.  We do the calendar arithmetic
+ * ourselves (days-from-civil) rather than relying on timegm(), which
+ * isn't portable.
+ */
+static int configure_time(const rcynic_ctx_t *rc,
+			  time_t *result,
+			  const char *val)
+{
+  unsigned year, month, day, hour, minute, second, era, yoe, doy;
+  char z, junk;
+
+  assert(rc && result && val);
+
+  if (sscanf(val, "%4u-%2u-%2uT%2u:%2u:%2u%c%c",
+	     &year, &month, &day, &hour, &minute, &second, &z, &junk) != 7 ||
+      z != 'Z' || year < 1970 || month < 1 || month > 12 || day < 1 || day > 31 ||
+      hour > 23 || minute > 59 || second > 60) {
+    logmsg(rc, log_usage_err, "Bad time value %s, expected YYYY-MM-DDTHH:MM:SSZ", val);
+    return 0;
+  }
+
+  if (month <= 2)
+    year--;
+  era = year / 400;
+  yoe = year - era * 400;
+  doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+
+  *result = ((((time_t) era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468) * 24 +
+	      hour) * 60 + minute) * 60 + second;
+  return 1;
+}
+
 
 
 /**
@@ -1054,11 +1934,12 @@ static int is_rsync(const char *uri)
 }
 
 /**
- * Is string an http URI?
+ * Is string an http or https URI?
  */
 static int is_http(const char *uri)
 {
-  return uri && !strncmp(uri, SCHEME_HTTP, SIZEOF_HTTP);
+  return uri && (!strncmp(uri, SCHEME_HTTP,  SIZEOF_HTTP) ||
+		 !strncmp(uri, SCHEME_HTTPS, SIZEOF_HTTPS));
 }
 
 /**
@@ -1142,247 +2023,478 @@ static void validation_status_set_code(validation_status_t *v,
 }
 
 /**
- * validation_status object comparison, for AVL tree rather than
- * OpenSSL stacks.
+ * Allocate memory from an arena.  Arena memory is never freed
+ * individually, only all at once by arena_free().
  */
-static int
-validation_status_cmp(const validation_status_t *node,
-		      const uri_t *uri,
-		      const object_generation_t generation)
+static void *arena_alloc(arena_block_t **arena, size_t n)
 {
-  int cmp = ((int) node->generation) - ((int) generation);
-  if (cmp)
-    return cmp;
-  else
-    return strcmp(uri->s, node->uri.s);
+  arena_block_t *a = *arena;
+  void *result;
+
+  n = (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+  if (a == NULL || a->size - a->used < n) {
+    size_t size = n > ARENA_BLOCK_SIZE ? n : ARENA_BLOCK_SIZE;
+    if ((a = malloc(sizeof(*a))) == NULL)
+      return NULL;
+    if ((a->base = malloc(size)) == NULL) {
+      free(a);
+      return NULL;
+    }
+    a->size = size;
+    a->used = 0;
+    a->next = *arena;
+    *arena = a;
+  }
+
+  result = a->base + a->used;
+  a->used += n;
+  return result;
 }
 
 /**
- * validation_status AVL tree insertion.  Adapted from code written by
- * Paul Vixie and explictly placed in the public domain using examples
- * from the book: "Algorithms & Data Structures," Niklaus Wirth,
- * Prentice-Hall, 1986, ISBN 0-13-022005-1.  Thanks, Paul!
+ * Free an arena and everything allocated from it.
  */
-static validation_status_t *
-validation_status_sprout(validation_status_t **node,
-			 int *needs_balancing,
-			 validation_status_t *new_node)
+static void arena_free(arena_block_t *arena)
 {
-#ifdef AVL_DEBUG
-#define AVL_MSG(msg) sprintf(stderr, "AVL_DEBUG: '%s'\n", msg)
-#else
-#define AVL_MSG(msg)
-#endif
-
-  validation_status_t *p1, *p2, *result;
-  int cmp;
+  arena_block_t *a;
 
-  /*
-   * Are we grounded?  If so, add the node "here" and set the
-   * rebalance flag, then exit.
-   */
-  if (*node == NULL) {
-    AVL_MSG("Grounded, adding new node");
-    new_node->left_child = NULL;
-    new_node->right_child = NULL;
-    new_node->balance = 0;
-    *node = new_node;
-    *needs_balancing = 1;
-    return *node;
+  while ((a = arena) != NULL) {
+    arena = a->next;
+    free(a->base);
+    free(a);
   }
+}
 
-  /*
-   * Compare the data.
-   */
-  cmp = validation_status_cmp(*node, &new_node->uri, new_node->generation);
+/**
+ * Allocate a new URI interning table.
+ */
+static uri_table_t *uri_table_new(void)
+{
+  uri_table_t *t = malloc(sizeof(*t));
+  if (t)
+    memset(t, 0, sizeof(*t));
+  return t;
+}
 
-  /*
-   * If LESS, prepare to move to the left.
-   */
-  if (cmp < 0) {
+/**
+ * Free a URI interning table.  Any handles still pointing into it
+ * are dead after this.
+ */
+static void uri_table_free(uri_table_t *t)
+{
+  if (t) {
+    arena_free(t->arena);
+    free(t->slots);
+    free(t);
+  }
+}
+
+/**
+ * Continue an FNV-1a hash over n bytes of a URI.
+ */
+static unsigned uri_hash(unsigned h, const char *s, size_t n)
+{
+  while (n-- > 0) {
+    h ^= (unsigned char) *s++;
+    h *= 16777619U;
+  }
+  return h;
+}
 
-    AVL_MSG("LESS. sprouting left.");
-    result = validation_status_sprout(&(*node)->left_child, needs_balancing, new_node);
+/**
+ * Get at the table entry behind a non-empty interned URI handle.
+ */
+static const uri_entry_t *uri_entry(const uri_t *uri)
+{
+  assert(uri && uri->s && uri->s[0]);
+  return (const uri_entry_t *) (uri->s - offsetof(uri_entry_t, s));
+}
 
-    if (*needs_balancing) {
-      AVL_MSG("LESS: left branch has grown longer");
+/**
+ * Length of an interned URI, without rescanning it.
+ */
+static size_t uri_length(const uri_t *uri)
+{
+  return uri->s[0] ? uri_entry(uri)->len : 0;
+}
 
-      switch ((*node)->balance) {
+/**
+ * Find the slot in a URI interning table where the concatenation of
+ * prefix and suffix lives or would live.
+ */
+static uri_entry_t **uri_table_slot(const uri_table_t *t,
+				    const char *prefix, const size_t prefix_len,
+				    const char *suffix, const size_t suffix_len,
+				    const unsigned hash)
+{
+  size_t mask = t->nslots - 1, i;
+  uri_entry_t *e;
 
-      case 1:
-	/*
-	 * Right branch WAS longer; balance is ok now.
-	 */
-	AVL_MSG("LESS: case 1.. balance restored implicitly");
-	(*node)->balance = 0;
-	*needs_balancing = 0;
-	break;
+  for (i = hash & mask; (e = t->slots[i]) != NULL; i = (i + 1) & mask)
+    if (e->hash == hash && e->len == prefix_len + suffix_len &&
+	!memcmp(e->s, prefix, prefix_len) &&
+	!memcmp(e->s + prefix_len, suffix, suffix_len))
+      break;
 
-      case 0:
-	/*
-	 * Balance WAS okay; now left branch longer.
-	 */
-	AVL_MSG("LESS: case 0.. balnce bad but still ok");
-	(*node)->balance = -1;
-	break;
+  return &t->slots[i];
+}
 
-      case -1:
-	/*
-	 * Left branch was already too long.  Rebalance.
-	 */
-	AVL_MSG("LESS: case -1: rebalancing");
-	p1 = (*node)->left_child;
-
-	if (p1->balance == -1) {
-	  AVL_MSG("LESS: single LL");
-	  (*node)->left_child = p1->right_child;
-	  p1->right_child = *node;
-	  (*node)->balance = 0;
-	  *node = p1;
-	}
+/**
+ * Double the size of a URI interning table's hash table.
+ */
+static int uri_table_grow(uri_table_t *t)
+{
+  size_t nslots = t->nslots ? t->nslots * 2 : URI_TABLE_MIN_SLOTS;
+  uri_entry_t **slots, *e;
+  size_t i, j;
 
-	else {
-	  AVL_MSG("LESS: double LR");
+  if ((slots = calloc(nslots, sizeof(*slots))) == NULL)
+    return 0;
 
-	  p2 = p1->right_child;
-	  p1->right_child = p2->left_child;
-	  p2->left_child = p1;
+  for (i = 0; i < t->nslots; i++) {
+    if ((e = t->slots[i]) == NULL)
+      continue;
+    for (j = e->hash & (nslots - 1); slots[j] != NULL; j = (j + 1) & (nslots - 1))
+      ;
+    slots[j] = e;
+  }
 
-	  (*node)->left_child = p2->right_child;
-	  p2->right_child = *node;
+  free(t->slots);
+  t->slots = slots;
+  t->nslots = nslots;
+  return 1;
+}
 
-	  if (p2->balance == -1)
-	    (*node)->balance = 1;
-	  else
-	    (*node)->balance = 0;
+/**
+ * Intern the concatenation of prefix and suffix, starting the hash
+ * from prefix_hash, which must be the hash state after prefix.
+ */
+static int uri_table_intern(const rcynic_ctx_t *rc,
+			    uri_t *uri,
+			    const char *prefix, const size_t prefix_len,
+			    const unsigned prefix_hash,
+			    const char *suffix)
+{
+  uri_table_t *t = rc->uri_table;
+  size_t suffix_len = strlen(suffix);
+  unsigned hash = uri_hash(prefix_hash, suffix, suffix_len);
+  uri_entry_t **slot, *e;
 
-	  if (p2->balance == 1)
-	    p1->balance = -1;
-	  else
-	    p1->balance = 0;
-	  *node = p2;
-	}
+  assert(t && uri);
 
-	(*node)->balance = 0;
-	*needs_balancing = 0;
-      }
-    }
-    return result;
+  if (prefix_len + suffix_len == 0) {
+    *uri = uri_empty;
+    return 1;
   }
 
-  /*
-   * If MORE, prepare to move to the right.
-   */
-  if (cmp > 0) {
-
-    AVL_MSG("MORE: sprouting to the right");
-    result = validation_status_sprout(&(*node)->right_child, needs_balancing, new_node);
+  if (prefix_len + suffix_len >= URI_MAX)
+    return 0;
 
-    if (*needs_balancing) {
-      AVL_MSG("MORE: right branch has grown longer");
+  if (t->nslots > 0 &&
+      (e = *uri_table_slot(t, prefix, prefix_len, suffix, suffix_len, hash)) != NULL) {
+    uri->s = e->s;
+    return 1;
+  }
 
-      switch ((*node)->balance) {
+  if (((t->count + 1) * 4 > t->nslots * 3 && !uri_table_grow(t)) ||
+      (e = arena_alloc(&t->arena, sizeof(*e) + prefix_len + suffix_len + 1)) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't intern URI %s%s", prefix, suffix);
+    return 0;
+  }
 
-      case -1:AVL_MSG("MORE: balance was off, fixed implicitly");
-	(*node)->balance = 0;
-	*needs_balancing = 0;
-	break;
+  e->hash = hash;
+  e->len = prefix_len + suffix_len;
+  memcpy(e->s, prefix, prefix_len);
+  memcpy(e->s + prefix_len, suffix, suffix_len + 1);
 
-      case 0:	AVL_MSG("MORE: balance was okay, now off but ok");
-	(*node)->balance = 1;
-	break;
+  slot = uri_table_slot(t, prefix, prefix_len, suffix, suffix_len, hash);
+  *slot = e;
+  t->count++;
 
-      case 1:	AVL_MSG("MORE: balance was off, need to rebalance");
-	p1 = (*node)->right_child;
+  uri->s = e->s;
+  return 1;
+}
 
-	if (p1->balance == 1) {
-	  AVL_MSG("MORE: single RR");
-	  (*node)->right_child = p1->left_child;
-	  p1->left_child = *node;
-	  (*node)->balance = 0;
-	  *node = p1;
-	}
+/**
+ * Intern a URI.  Fails if the URI is too long or if we run out of
+ * memory.
+ */
+static int uri_intern(const rcynic_ctx_t *rc,
+		      uri_t *uri,
+		      const char *s)
+{
+  return uri_table_intern(rc, uri, "", 0, URI_HASH_INIT, s);
+}
 
-	else {
-	  AVL_MSG("MORE: double RL");
+/**
+ * Intern the URI of an object in a publication point.  The parent's
+ * length and hash state are already in the table, so we only have
+ * to look at the name, and we never build the full URI on the stack.
+ */
+static int uri_intern_child(const rcynic_ctx_t *rc,
+			    uri_t *uri,
+			    const uri_t *parent,
+			    const char *name)
+{
+  const uri_entry_t *p;
 
-	  p2 = p1->left_child;
-	  p1->left_child = p2->right_child;
-	  p2->right_child = p1;
+  if (!parent->s[0])
+    return uri_intern(rc, uri, name);
 
-	  (*node)->right_child = p2->left_child;
-	  p2->left_child = *node;
+  p = uri_entry(parent);
+  return uri_table_intern(rc, uri, p->s, p->len, p->hash, name);
+}
 
-	  if (p2->balance == 1)
-	    (*node)->balance = -1;
-	  else
-	    (*node)->balance = 0;
+/**
+ * Reset a certinfo_t, leaving all of its URIs empty.
+ */
+static void certinfo_clear(certinfo_t *certinfo)
+{
+  memset(certinfo, 0, sizeof(*certinfo));
+  certinfo->uri = certinfo->sia = certinfo->aia = certinfo->crldp = uri_empty;
+  certinfo->manifest = certinfo->signedobject = certinfo->rrdpnotify = uri_empty;
+}
 
-	  if (p2->balance == -1)
-	    p1->balance = 1;
-	  else
-	    p1->balance = 0;
+/**
+ * Allocate a new validation status index.
+ */
+static validation_status_index_t *validation_status_index_new(void)
+{
+  validation_status_index_t *idx = malloc(sizeof(*idx));
+  if (idx)
+    memset(idx, 0, sizeof(*idx));
+  return idx;
+}
 
-	  *node = p2;
-	} /*else*/
-	(*node)->balance = 0;
-	*needs_balancing = 0;
-      }
-    }
-    return result;
+/**
+ * Free a validation status index and all the entries in it.
+ */
+static void validation_status_index_free(validation_status_index_t *idx)
+{
+  if (idx) {
+    arena_free(idx->arena);
+    free(idx->slots);
+    free(idx);
   }
-
-  /*
-   * Neither more nor less, found existing node matching key, return it.
-   */
-  AVL_MSG("I found it!");
-  *needs_balancing = 0;
-  return *node;
-
-#undef AVL_MSG
 }
 
 /**
- * Add a validation status entry to internal log.
+ * Hash function for validation status index (32-bit FNV-1a over the
+ * URI, seeded with the generation).
  */
-static void log_validation_status(rcynic_ctx_t *rc,
-				  const uri_t *uri,
-				  const mib_counter_t code,
-				  const object_generation_t generation)
+static unsigned validation_status_hash(const char *uri,
+				       const object_generation_t generation)
 {
-  validation_status_t *v = NULL;
-  int needs_balancing = 0;
+  unsigned h = 2166136261U ^ (unsigned) generation;
 
-  assert(rc && uri && code < MIB_COUNTER_T_MAX && generation < OBJECT_GENERATION_MAX);
+  while (*uri) {
+    h ^= (unsigned char) *uri++;
+    h *= 16777619U;
+  }
 
-  if (!rc->validation_status)
-    return;
+  return h;
+}
 
-  if (code == rsync_transfer_skipped && !rc->run_rsync)
-    return;
+/**
+ * Find the slot in a validation status index where an entry lives or
+ * would live.
+ */
+static validation_status_t **
+validation_status_slot(const validation_status_index_t *idx,
+		       const char *uri,
+		       const object_generation_t generation,
+		       const unsigned hash)
+{
+  size_t mask = idx->nslots - 1, i;
+  validation_status_t *v;
 
-  if (rc->validation_status_in_waiting == NULL &&
-      (rc->validation_status_in_waiting = validation_status_t_new()) == NULL) {
-    logmsg(rc, log_sys_err, "Couldn't allocate validation status entry for %s", uri->s);
-    return;
-  }
+  for (i = hash & mask; (v = idx->slots[i]) != NULL; i = (i + 1) & mask)
+    if (v->hash == hash && v->generation == generation && !strcmp(v->uri, uri))
+      break;
+
+  return &idx->slots[i];
+}
+
+/**
+ * Double the size of a validation status index's hash table.
+ */
+static int validation_status_index_grow(validation_status_index_t *idx)
+{
+  size_t nslots = idx->nslots ? idx->nslots * 2 : VALIDATION_STATUS_MIN_SLOTS;
+  validation_status_t **slots, *v;
+
+  if ((slots = calloc(nslots, sizeof(*slots))) == NULL)
+    return 0;
+
+  free(idx->slots);
+  idx->slots = slots;
+  idx->nslots = nslots;
+
+  for (v = idx->head; v != NULL; v = v->next)
+    *validation_status_slot(idx, v->uri, v->generation, v->hash) = v;
+
+  return 1;
+}
+
+/**
+ * Hash lookup for validation status objects.
+ */
+static validation_status_t *
+validation_status_find(const validation_status_index_t *idx,
+		       const uri_t *uri,
+		       const object_generation_t generation)
+{
+  if (idx == NULL || idx->nslots == 0)
+    return NULL;
+
+  return *validation_status_slot(idx, uri->s, generation,
+				 validation_status_hash(uri->s, generation));
+}
+
+/**
+ * Find a validation status object, creating it if it doesn't exist
+ * yet.  New entries are appended to the insertion-order list;
+ * validation_status_index_sort() puts it in output order later.
+ */
+static validation_status_t *
+validation_status_add(validation_status_index_t *idx,
+		      const uri_t *uri,
+		      const object_generation_t generation)
+{
+  unsigned hash = validation_status_hash(uri->s, generation);
+  validation_status_t *v;
+  size_t len;
+
+  assert(idx && uri);
+
+  if (idx->nslots > 0 &&
+      (v = *validation_status_slot(idx, uri->s, generation, hash)) != NULL)
+    return v;
+
+  if ((idx->count + 1) * 4 > idx->nslots * 3 &&
+      !validation_status_index_grow(idx))
+    return NULL;
+
+  len = strlen(uri->s);
+
+  if ((v = arena_alloc(&idx->arena, sizeof(*v) + len + 1)) == NULL)
+    return NULL;
 
-  v = rc->validation_status_in_waiting;
   memset(v, 0, sizeof(*v));
-  v->uri = *uri;
+  memcpy(v->uri, uri->s, len + 1);
   v->generation = generation;
+  v->hash = hash;
+
+  *validation_status_slot(idx, v->uri, generation, hash) = v;
+  idx->count++;
+
+  if (idx->tail)
+    idx->tail->next = v;
+  else
+    idx->head = v;
+  idx->tail = v;
+
+  return v;
+}
+
+/**
+ * Order two validation status entries by URI, then by generation.
+ */
+static int validation_status_cmp(const validation_status_t *a,
+				 const validation_status_t *b)
+{
+  int cmp = strcmp(a->uri, b->uri);
+
+  if (cmp)
+    return cmp;
+  else
+    return (int) a->generation - (int) b->generation;
+}
+
+/**
+ * Sort a validation status index's list by URI and generation, so
+ * that the summaries come out the same however many worker threads
+ * we used.  Insertion order depends on which thread got to which
+ * publication point first.  This is a bottom-up merge sort of the
+ * list in place, so it can't fail for want of memory; the hash table
+ * points at the entries themselves, so it doesn't care.
+ */
+static void validation_status_index_sort(validation_status_index_t *idx)
+{
+  validation_status_t *p, *q, *e, *head, *tail;
+  size_t k, merges, psize, qsize;
+
+  assert(idx);
+
+  if ((head = idx->head) == NULL)
+    return;
+
+  for (k = 1;; k *= 2) {
+    p = head;
+    head = tail = NULL;
+    merges = 0;
+
+    while (p != NULL) {
+      merges++;
+      for (q = p, psize = 0; q != NULL && psize < k; psize++)
+	q = q->next;
+      qsize = k;
+
+      while (psize > 0 || (qsize > 0 && q != NULL)) {
+	if (psize == 0 || (qsize > 0 && q != NULL && validation_status_cmp(q, p) < 0)) {
+	  e = q;
+	  q = q->next;
+	  qsize--;
+	} else {
+	  e = p;
+	  p = p->next;
+	  psize--;
+	}
+	if (tail != NULL)
+	  tail->next = e;
+	else
+	  head = e;
+	tail = e;
+      }
+
+      p = q;
+    }
+
+    tail->next = NULL;
+
+    if (merges <= 1)
+      break;
+  }
+
+  idx->head = head;
+  idx->tail = tail;
+}
+
+/**
+ * Add a validation status entry to internal log.
+ */
+static void log_validation_status(rcynic_ctx_t *rc,
+				  const uri_t *uri,
+				  const mib_counter_t code,
+				  const object_generation_t generation)
+{
+  validation_status_t *v = NULL;
+
+  assert(rc && uri && code < MIB_COUNTER_T_MAX && generation < OBJECT_GENERATION_MAX);
+
+  if (!rc->validation_status)
+    return;
 
-  v = validation_status_sprout(&rc->validation_status_root, &needs_balancing, v);
-  if (v == rc->validation_status_in_waiting)
-    rc->validation_status_in_waiting = NULL;
+  if (code == rsync_transfer_skipped && !rc->run_rsync)
+    return;
 
-  if (rc->validation_status_in_waiting == NULL &&
-      !sk_validation_status_t_push(rc->validation_status, v)) {
+  if ((v = validation_status_add(rc->validation_status, uri, generation)) == NULL) {
     logmsg(rc, log_sys_err, "Couldn't store validation status entry for %s", uri->s);
     return;
   }
 
-  v->timestamp = time(0);
+  v->timestamp = validation_now(rc);
 
   if (validation_status_get_code(v, code))
     return;
@@ -1398,15 +2510,66 @@ static void log_validation_status(rcynic_ctx_t *rc,
 	 uri->s);
 }
 
+/**
+ * Copy the contents of one open file to another, using the cheapest
+ * mechanism the kernel offers: a reflink if the filesystem can share
+ * blocks, otherwise an in-kernel copy, otherwise read() and write().
+ * Each mechanism picks up at the current file offsets, so if one
+ * gives up partway through the next one just carries on.
+ */
+static int copy_fd(const int in,
+		   const int out,
+		   off_t remaining,
+		   copy_method_t *method)
+{
+  char buffer[BUFSIZ];
+  ssize_t n, m;
+  char *b;
+
+#ifdef FICLONE
+  *method = copy_method_reflink;
+  if (ioctl(out, FICLONE, in) == 0)
+    return 1;
+#endif
+
+#ifdef SYS_copy_file_range
+  *method = copy_method_copy_file_range;
+  while (remaining > 0 &&
+	 (n = syscall(SYS_copy_file_range, in, NULL, out, NULL, (size_t) remaining, 0)) > 0)
+    remaining -= n;
+  if (remaining == 0)
+    return 1;
+#endif
+
+#ifdef __linux__
+  *method = copy_method_sendfile;
+  while (remaining > 0 && (n = sendfile(out, in, NULL, (size_t) remaining)) > 0)
+    remaining -= n;
+  if (remaining == 0)
+    return 1;
+#endif
+
+  *method = copy_method_read_write;
+  while ((n = read(in, buffer, sizeof(buffer))) != 0) {
+    if (n < 0)
+      return 0;
+    for (b = buffer; n > 0; b += m, n -= m)
+      if ((m = write(out, b, n)) < 0)
+	return 0;
+  }
+
+  return 1;
+}
+
 /**
  * Copy or link a file, as the case may be.
  */
-static int cp_ln(const rcynic_ctx_t *rc, const path_t *source, const path_t *target)
+static int cp_ln(rcynic_ctx_t *rc, const path_t *source, const path_t *target)
 {
   struct stat statbuf;
-  struct utimbuf utimebuf;
-  FILE *in = NULL, *out = NULL;
-  int c, ok = 0;
+  struct timespec times[2];
+  copy_method_t method;
+  int in = -1, out = -1, ok = 0;
 
   if (rc->use_links) {
     (void) unlink(target->s);
@@ -1414,28 +2577,20 @@ static int cp_ln(const rcynic_ctx_t *rc, const path_t *source, const path_t *tar
     if (!ok)
       logmsg(rc, log_sys_err, "Couldn't link %s to %s: %s",
 	     source->s, target->s, strerror(errno));
+    else
+      rc->copy_method_count[copy_method_link]++;
     return ok;
   }
 
-  if ((in = fopen(source->s, "rb")) == NULL ||
-      (out = fopen(target->s, "wb")) == NULL)
+  if ((in = open(source->s, O_RDONLY)) < 0 ||
+      fstat(in, &statbuf) < 0 ||
+      (out = open(target->s, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
     goto done;
 
-  while ((c = getc(in)) != EOF)
-    if (putc(c, out) == EOF)
-      goto done;
-
-  ok = 1;
-
- done:
-  ok &= !(in  != NULL && fclose(in)  == EOF);
-  ok &= !(out != NULL && fclose(out) == EOF);
+  if (!copy_fd(in, out, statbuf.st_size, &method))
+    goto done;
 
-  if (!ok) {
-    logmsg(rc, log_sys_err, "Couldn't copy %s to %s: %s",
-	   source->s, target->s, strerror(errno));
-    return ok;
-  }
+  rc->copy_method_count[method]++;
 
   /*
    * Perserve the file modification time to allow for detection of
@@ -1443,25 +2598,45 @@ static int cp_ln(const rcynic_ctx_t *rc, const path_t *source, const path_t *tar
    * the times is not optimal, but is also not critical, thus no
    * failure return.
    */
-  if (stat(source->s, &statbuf) < 0 ||
-      (utimebuf.actime = statbuf.st_atime,
-       utimebuf.modtime = statbuf.st_mtime,
-       utime(target->s, &utimebuf) < 0))
+  times[0].tv_sec  = statbuf.st_atime;
+  times[0].tv_nsec = 0;
+  times[1].tv_sec  = statbuf.st_mtime;
+  times[1].tv_nsec = 0;
+  if (futimens(out, times) < 0)
     logmsg(rc, log_sys_err, "Couldn't copy inode timestamp from %s to %s: %s",
 	   source->s, target->s, strerror(errno));
 
+  ok = 1;
+
+ done:
+  if (!ok)
+    logmsg(rc, log_sys_err, "Couldn't copy %s to %s: %s",
+	   source->s, target->s, strerror(errno));
+  if (in >= 0)
+    (void) close(in);
+  if (out >= 0 && close(out) < 0 && ok) {
+    logmsg(rc, log_sys_err, "Couldn't copy %s to %s: %s",
+	   source->s, target->s, strerror(errno));
+    ok = 0;
+  }
   return ok;
 }
 
+static void operation_charge(rcynic_ctx_t *, STACK_OF(walk_ctx_t) *,
+			     const operation_t, const stopwatch_t *);
+
 /**
  * Install an object.
  */
 static int install_object(rcynic_ctx_t *rc,
+			  STACK_OF(walk_ctx_t) *wsk,
 			  const uri_t *uri,
 			  const path_t *source,
 			  const object_generation_t generation)
 {
+  stopwatch_t sw;
   path_t target;
+  int ok;
 
   if (!uri_to_filename(rc, uri, &target, &rc->new_authenticated)) {
     logmsg(rc, log_data_err, "Couldn't generate installation name for %s", uri->s);
@@ -1473,28 +2648,17 @@ static int install_object(rcynic_ctx_t *rc,
     return 0;
   }
 
-  if (!cp_ln(rc, source, &target))
+  stopwatch_start(&sw, CLOCK_THREAD_CPUTIME_ID);
+  ok = cp_ln(rc, source, &target);
+  stopwatch_stop(&sw);
+  operation_charge(rc, wsk, operation_install, &sw);
+
+  if (!ok)
     return 0;
   log_validation_status(rc, uri, object_accepted, generation);
   return 1;
 }
 
-/**
- * AVL tree lookup for validation status objects.
- */
-static validation_status_t *
-validation_status_find(validation_status_t *node,
-		       const uri_t *uri,
-		       const object_generation_t generation)
-{
-  int cmp;
-
-  while (node != NULL && (cmp = validation_status_cmp(node, uri, generation)) != 0)
-    node = cmp < 0 ? node->left_child : node->right_child;
-
-  return node;
-}
-
 /**
  * Check whether we have a validation status entry corresponding to a
  * given filename.  This is intended for use during pruning the
@@ -1504,15 +2668,17 @@ static int
 validation_status_find_filename(const rcynic_ctx_t *rc,
 				const char *filename)
 {
+  char buf[URI_MAX];
   uri_t uri;
 
-  if (strlen(filename) + SIZEOF_RSYNC >= sizeof(uri.s))
+  if (strlen(filename) + SIZEOF_RSYNC >= sizeof(buf))
     return 0;
 
-  strcpy(uri.s, SCHEME_RSYNC);
-  strcat(uri.s, filename);
+  strcpy(buf, SCHEME_RSYNC);
+  strcat(buf, filename);
+  uri.s = buf;
 
-  return validation_status_find(rc->validation_status_root, &uri, object_generation_current) != NULL;
+  return validation_status_find(rc->validation_status, &uri, object_generation_current) != NULL;
 }
 
 /**
@@ -1547,7 +2713,7 @@ static int skip_checking_this_object(rcynic_ctx_t *rc,
   if (generation != object_generation_current)
     return 1;
 
-  v = validation_status_find(rc->validation_status_root, uri, generation);
+  v = validation_status_find(rc->validation_status, uri, generation);
 
   if (v != NULL && validation_status_get_code(v, object_accepted))
     return 1;
@@ -1586,22 +2752,27 @@ static int startswith(const char *str, const char *prefix)
 /**
  * Convert a filename to a file:// URI, for logging.
  */
-static void filename_to_uri(uri_t *uri,
+static void filename_to_uri(const rcynic_ctx_t *rc,
+			    uri_t *uri,
 			    const char *fn)
 {
-  assert(sizeof("file://") < sizeof(uri->s));
-  strcpy(uri->s, "file://");
+  char buf[URI_MAX];
+
+  assert(sizeof("file://") < sizeof(buf));
+  strcpy(buf, "file://");
   if (*fn != '/') {
-    if (getcwd(uri->s + strlen(uri->s), sizeof(uri->s) - strlen(uri->s)) == NULL ||
-	(!endswith(uri->s, "/") && strlen(uri->s) >= sizeof(uri->s) - 1))
-      uri->s[0] = '\0';
+    if (getcwd(buf + strlen(buf), sizeof(buf) - strlen(buf)) == NULL ||
+	(!endswith(buf, "/") && strlen(buf) >= sizeof(buf) - 1))
+      buf[0] = '\0';
     else
-      strcat(uri->s, "/");
+      strcat(buf, "/");
   }
-  if (uri->s[0] != '\0' && strlen(uri->s) + strlen(fn) < sizeof(uri->s))
-    strcat(uri->s, fn);
+  if (buf[0] != '\0' && strlen(buf) + strlen(fn) < sizeof(buf))
+    strcat(buf, fn);
   else
-    uri->s[0] = '\0';
+    buf[0] = '\0';
+  if (!uri_intern(rc, uri, buf))
+    *uri = uri_empty;
 }
 
 /**
@@ -1783,7 +2954,8 @@ static int finalize_directories(const rcynic_ctx_t *rc)
     return 0;
   }
 
-  if (real_old.s[0] && strlen(rc->authenticated.s) + sizeof(".old") < sizeof(path.s)) {
+  if (real_old.s[0] && !rc->old_authenticated_fixed &&
+      strlen(rc->authenticated.s) + sizeof(".old") < sizeof(path.s)) {
     assert(real_old.s[strlen(real_old.s) - 1] != '/');
 
     path = rc->authenticated;
@@ -1819,29 +2991,6 @@ static int finalize_directories(const rcynic_ctx_t *rc)
 
 
 
-/**
- * Test whether a pair of URIs "conflict", that is, whether attempting
- * to rsync both of them at the same time in parallel might cause
- * unpredictable behavior.  Might need a better name for this test.
- *
- * Returns non-zero iff the two URIs "conflict".
- */
-static int conflicting_uris(const uri_t *a, const uri_t *b)
-{
-  size_t len_a, len_b;
-
-  assert(a && is_rsync(a->s) && b && is_rsync(b->s));
-
-  len_a = strlen(a->s);
-  len_b = strlen(b->s);
-
-  assert(len_a < sizeof(a->s) && len_b < sizeof(b->s));
-
-  return !strncmp(a->s, b->s, len_a < len_b ? len_a : len_b);
-}
-
-
-
 /**
  * Read non-directory filenames from a directory, so we can check to
  * see what's missing from a manifest.
@@ -1919,7 +3068,11 @@ static void walk_ctx_detach(walk_ctx_t *w)
 {
   if (w != NULL && --(w->refcount) == 0) {
     assert(w->refcount == 0);
+    if (w->trace != NULL)
+      w->trace->end = monotonic_usec();
     X509_free(w->cert);
+    EVP_PKEY_free(w->pkey);
+    sk_IPAddressFamily_free(w->addr);
     Manifest_free(w->manifest);
     sk_X509_free(w->certs);
     sk_X509_CRL_pop_free(w->crls, X509_CRL_free);
@@ -1928,6 +3081,119 @@ static void walk_ctx_detach(walk_ctx_t *w)
   }
 }
 
+/**
+ * Public key of a walk context's certificate, for checking signatures
+ * on its products.  We decode it the first time we need it and keep
+ * it for the life of the frame, since a CA with thousands of products
+ * would otherwise be asking for the same key thousands of times.
+ * Caller must not free the result.
+ */
+static EVP_PKEY *walk_ctx_pkey(walk_ctx_t *w)
+{
+  assert(w && w->cert);
+
+  if (w->pkey == NULL)
+    w->pkey = X509_get_pubkey(w->cert);
+
+  return w->pkey;
+}
+
+/**
+ * Work out the RFC 3779 resources a certificate really holds, given
+ * the resources its issuer really holds: same as what the certificate
+ * says, except that "inherit" is replaced by the issuer's resources
+ * for that address family or for AS numbers.  Results point into the
+ * certificate and the issuer's results, nothing is copied, so the
+ * address stack must be freed with sk_IPAddressFamily_free().
+ *
+ * Returns X509_V_OK or the error X509_verify_cert() would report.
+ */
+static int resolve_resources(X509 *x,
+			     IPAddrBlocks *parent_addr,
+			     ASIdentifierChoice *parent_asnum,
+			     IPAddrBlocks **addr,
+			     ASIdentifierChoice **asnum)
+{
+  IPAddressFamily *f, *p = NULL;
+  int i, j, error = X509_V_ERR_UNNESTED_RESOURCE;
+
+  assert(x && addr && asnum);
+
+  *addr = NULL;
+  *asnum = NULL;
+
+  if (x->rfc3779_asid && x->rfc3779_asid->asnum) {
+    if (x->rfc3779_asid->asnum->type != ASIdentifierChoice_inherit)
+      *asnum = x->rfc3779_asid->asnum;
+    else if ((*asnum = parent_asnum) == NULL)
+      goto lose;
+  }
+
+  if (x->rfc3779_addr == NULL)
+    return X509_V_OK;
+
+  if ((*addr = sk_IPAddressFamily_new_null()) == NULL)
+    goto oom;
+
+  for (i = 0; i < sk_IPAddressFamily_num(x->rfc3779_addr); i++) {
+    f = sk_IPAddressFamily_value(x->rfc3779_addr, i);
+    if (f->ipAddressChoice->type == IPAddressChoice_inherit) {
+      for (j = 0; j < sk_IPAddressFamily_num(parent_addr); j++) {
+	p = sk_IPAddressFamily_value(parent_addr, j);
+	if (!ASN1_OCTET_STRING_cmp(p->addressFamily, f->addressFamily))
+	  break;
+      }
+      if (j >= sk_IPAddressFamily_num(parent_addr))
+	goto lose;
+      f = p;
+    }
+    if (!sk_IPAddressFamily_push(*addr, f))
+      goto oom;
+  }
+
+  return X509_V_OK;
+
+ oom:
+  error = X509_V_ERR_OUT_OF_MEM;
+ lose:
+  sk_IPAddressFamily_free(*addr);
+  *addr = NULL;
+  *asnum = NULL;
+  return error;
+}
+
+/**
+ * Resolved RFC 3779 resources of the certificate in frame i of a walk
+ * context stack, see resolve_resources().  Works down from the trust
+ * anchor the first time it's called for a frame, after which the
+ * answer is just sitting there.  Call with the big lock held: parent
+ * frames are shared between walk context stacks.
+ */
+static int walk_ctx_resources(STACK_OF(walk_ctx_t) *wsk, const int i)
+{
+  walk_ctx_t *w = sk_walk_ctx_t_value(wsk, i), *parent = NULL;
+  int error;
+
+  assert(w && w->cert);
+
+  if (w->have_resources)
+    return X509_V_OK;
+
+  if (i > 0) {
+    parent = sk_walk_ctx_t_value(wsk, i - 1);
+    if ((error = walk_ctx_resources(wsk, i - 1)) != X509_V_OK)
+      return error;
+  }
+
+  error = resolve_resources(w->cert,
+			    parent ? parent->addr  : NULL,
+			    parent ? parent->asnum : NULL,
+			    &w->addr, &w->asnum);
+
+  w->have_resources = error == X509_V_OK;
+  return error;
+}
+
 /**
  * Return top context of a walk context stack.
  */
@@ -1998,6 +3264,7 @@ static void walk_ctx_loop_next(const rcynic_ctx_t *rc, STACK_OF(walk_ctx_t) *wsk
 }
 
 static int check_manifest(rcynic_ctx_t *rc, STACK_OF(walk_ctx_t) *wsk);
+static int rsync_unchanged(const rcynic_ctx_t *rc, const uri_t *uri);
 
 /**
  * Loop initializer for walk context.  Think of this as the thing you
@@ -2022,6 +3289,13 @@ static void walk_ctx_loop_init(rcynic_ctx_t *rc, STACK_OF(walk_ctx_t) *wsk)
   if (!w->manifest)
     logmsg(rc, log_telemetry, "Couldn't get manifest %s, blundering onward", w->certinfo.manifest.s);
 
+  if (rc->validation_cache != NULL && w->manifest != NULL &&
+      rsync_unchanged(rc, &w->certinfo.sia)) {
+    logmsg(rc, log_verbose, "No changes fetched for %s", w->certinfo.sia.s);
+    w->unchanged = 1;
+    rc->unchanged_pps++;
+  }
+
   w->manifest_iteration = 0;
   w->filename_iteration = 0;
   w->state++;
@@ -2030,7 +3304,7 @@ static void walk_ctx_loop_init(rcynic_ctx_t *rc, STACK_OF(walk_ctx_t) *wsk)
   assert(w->filenames == NULL);
   w->filenames = directory_filenames(rc, w->state, &w->certinfo.sia);
 
-  w->stale_manifest = w->manifest != NULL && X509_cmp_current_time(w->manifest->nextUpdate) < 0;
+  w->stale_manifest = w->manifest != NULL && validation_cmp_time(rc, w->manifest->nextUpdate) < 0;
 
   while (!walk_ctx_loop_done(wsk) &&
 	 (w->manifest == NULL  || w->manifest_iteration >= sk_FileAndHash_num(w->manifest->fileList)) &&
@@ -2068,13 +3342,13 @@ static int walk_ctx_loop_this(const rcynic_ctx_t *rc,
     return 0;
   }
 
-  if (strlen(w->certinfo.sia.s) + strlen(name) >= sizeof(uri->s)) {
-    logmsg(rc, log_data_err, "URI %s%s too long, skipping", w->certinfo.sia.s, uri->s);
+  if (uri_length(&w->certinfo.sia) + strlen(name) >= URI_MAX) {
+    logmsg(rc, log_data_err, "URI %s%s too long, skipping", w->certinfo.sia.s, name);
     return 0;
   }
 
-  strcpy(uri->s, w->certinfo.sia.s);
-  strcat(uri->s, name);
+  if (!uri_intern_child(rc, uri, &w->certinfo.sia, name))
+    return 0;
 
   if (fah != NULL) {
     sk_OPENSSL_STRING_remove(w->filenames, name);
@@ -2112,10 +3386,11 @@ static walk_ctx_t *walk_ctx_stack_push(STACK_OF(walk_ctx_t) *wsk,
 
   memset(w, 0, sizeof(*w));
   w->cert = x;
+  w->crldp = uri_empty;
   if (certinfo != NULL)
     w->certinfo = *certinfo;
   else
-    memset(&w->certinfo, 0, sizeof(w->certinfo));
+    certinfo_clear(&w->certinfo);
 
   if (!sk_walk_ctx_t_push(wsk, w)) {
     free(w);
@@ -2186,3267 +3461,8730 @@ static void walk_ctx_stack_free(STACK_OF(walk_ctx_t) *wsk)
   sk_walk_ctx_t_pop_free(wsk, walk_ctx_detach);
 }
 
-
-
-static int rsync_count_running(const rcynic_ctx_t *);
-
 /**
- * Add a task to the task queue.
+ * Find or create the ta_stats_t for a trust anchor.  Returns NULL
+ * only on allocation failure, which just means we don't count this
+ * trust anchor's objects.
  */
-static int task_add(const rcynic_ctx_t *rc,
-		    void (*handler)(rcynic_ctx_t *, void *),
-		    void *cookie)
+static ta_stats_t *ta_stats_find(const rcynic_ctx_t *rc, const uri_t *uri)
 {
-  task_t *t = malloc(sizeof(*t));
-
-  assert(rc && rc->task_queue && handler);
+  ta_stats_t *t, key;
+  int i;
 
-  assert(rsync_count_running(rc) <= rc->max_parallel_fetches);
+  assert(rc && uri && rc->ta_stats);
 
-  if (!t)
-    return 0;
+  key.uri = *uri;
+  if ((i = sk_ta_stats_t_find(rc->ta_stats, &key)) >= 0)
+    return sk_ta_stats_t_value(rc->ta_stats, i);
 
-  t->handler = handler;
-  t->cookie = cookie;
+  if ((t = malloc(sizeof(*t))) == NULL)
+    return NULL;
+  memset(t, 0, sizeof(*t));
+  t->uri = *uri;
 
-  if (sk_task_t_push(rc->task_queue, t))
-    return 1;
+  if (!sk_ta_stats_t_push(rc->ta_stats, t)) {
+    free(t);
+    return NULL;
+  }
 
-  free(t);
-  return 0;
+  return t;
 }
 
 /**
- * Run tasks until queue is empty.
+ * Count an accepted or rejected object against the trust anchor from
+ * which this walk started.
  */
-static void task_run_q(rcynic_ctx_t *rc)
+static void ta_stats_count(STACK_OF(walk_ctx_t) *wsk,
+			   const object_type_t type,
+			   const int accepted)
 {
-  task_t *t;
-  assert(rc && rc->task_queue);
-  while ((t = sk_task_t_shift(rc->task_queue)) != NULL) {
-    t->handler(rc, t->cookie);
-    free(t);
-  }
-}
+  walk_ctx_t *w = sk_walk_ctx_t_value(wsk, 0);
 
-
+  if (w == NULL || w->ta_stats == NULL)
+    return;
+
+  if (accepted)
+    w->ta_stats->accepted[type]++;
+  else
+    w->ta_stats->rejected[type]++;
+}
 
 /**
- * Check cache of whether we've already fetched a particular URI.
+ * Charge the time on a stopped stopwatch to an operation: for the run
+ * as a whole, and, if we have a walk context stack, for the trust
+ * anchor from which the walk started and for the publication point
+ * of the certificate we're working on.  Call with the big lock held.
  */
-static rsync_history_t *rsync_history_uri(const rcynic_ctx_t *rc,
-					  const uri_t *uri)
+static void operation_charge(rcynic_ctx_t *rc,
+			     STACK_OF(walk_ctx_t) *wsk,
+			     const operation_t op,
+			     const stopwatch_t *sw)
 {
-  rsync_history_t h;
-  char *s;
-  int i;
+  walk_ctx_t *w;
 
-  assert(rc && uri && rc->rsync_history);
+  assert(rc && sw && op < OPERATION_T_MAX);
 
-  if (!is_rsync(uri->s))
-    return NULL;
+  timing_add(&rc->operation_timing[op], sw);
 
-  h.uri = *uri;
+  if (wsk == NULL)
+    return;
 
-  while ((s = strrchr(h.uri.s, '/')) != NULL && s[1] == '\0')
-    *s = '\0';
+  if ((w = sk_walk_ctx_t_value(wsk, 0)) != NULL && w->ta_stats != NULL)
+    timing_add(&w->ta_stats->timing[op], sw);
 
-  while ((i = sk_rsync_history_t_find(rc->rsync_history, &h)) < 0) {
-    if ((s = strrchr(h.uri.s, '/')) == NULL ||
-	(s - h.uri.s) < SIZEOF_RSYNC)
-      return NULL;
-    *s = '\0';
+  if ((w = walk_ctx_stack_head(wsk)) == NULL || w->certinfo.sia.s[0] == '\0')
+    return;
+
+  if (w->pp_stats == NULL && (w->pp_stats = malloc(sizeof(*w->pp_stats))) != NULL) {
+    memset(w->pp_stats, 0, sizeof(*w->pp_stats));
+    w->pp_stats->uri = w->certinfo.sia;
+    if (!sk_pp_stats_t_push(rc->pp_stats, w->pp_stats)) {
+      free(w->pp_stats);
+      w->pp_stats = NULL;
+    }
   }
 
-  return sk_rsync_history_t_value(rc->rsync_history, i);
+  if (w->pp_stats != NULL)
+    timing_add(&w->pp_stats->timing[op], sw);
 }
 
 /**
- * Record that we've already attempted to synchronize a particular
- * rsync URI.
+ * Sort the publication point statistics and merge entries for the
+ * same publication point.  Only safe once all walks are finished,
+ * since walk contexts point into this stack.
  */
-static void rsync_history_add(const rcynic_ctx_t *rc,
-			      const rsync_ctx_t *ctx,
-			      const rsync_status_t status)
+static void pp_stats_coalesce(rcynic_ctx_t *rc)
 {
-  int final_slash = 0;
-  rsync_history_t *h;
-  uri_t uri;
-  size_t n;
-  char *s;
+  pp_stats_t *p, *q = NULL;
+  int i, j, op;
 
-  assert(rc && ctx && rc->rsync_history && is_rsync(ctx->uri.s));
+  sk_pp_stats_t_sort(rc->pp_stats);
 
-  uri = ctx->uri;
-
-  while ((s = strrchr(uri.s, '/')) != NULL && s[1] == '\0') {
-    final_slash = 1;
-    *s = '\0';
+  for (i = j = 0; (p = sk_pp_stats_t_value(rc->pp_stats, i)) != NULL; i++) {
+    if (q != NULL && !strcmp(p->uri.s, q->uri.s)) {
+      for (op = 0; op < OPERATION_T_MAX; op++) {
+	q->timing[op].count += p->timing[op].count;
+	q->timing[op].wall  += p->timing[op].wall;
+	q->timing[op].cpu   += p->timing[op].cpu;
+      }
+      pp_stats_t_free(p);
+    } else {
+      (void) sk_pp_stats_t_set(rc->pp_stats, j++, p);
+      q = p;
+    }
   }
 
-  if (status != rsync_status_done) {
+  while (sk_pp_stats_t_num(rc->pp_stats) > j)
+    (void) sk_pp_stats_t_pop(rc->pp_stats);
+}
 
-    n = SIZEOF_RSYNC + strcspn(uri.s + SIZEOF_RSYNC, "/");
-    assert(n < sizeof(uri.s));
-    uri.s[n] = '\0';
-    final_slash = 1;
 
-    if ((h = rsync_history_uri(rc, &uri)) != NULL) {
-      assert(h->status != rsync_status_done);
-      return;
-    }
+
+/**
+ * Type-safe wrapper around free() to keep safestack macros happy.
+ */
+static void trace_walk_t_free(trace_walk_t *t)
+{
+  if (t)
+    free(t);
+}
+
+/**
+ * Free trace state, discarding the output file if we never finished
+ * it.
+ */
+static void trace_free(trace_t *t)
+{
+  if (t == NULL)
+    return;
+  if (t->f != NULL) {
+    (void) fclose(t->f);
+    (void) unlink(t->temp.s);
   }
+  sk_trace_walk_t_pop_free(t->walks, trace_walk_t_free);
+  free(t);
+}
 
-  if ((h = rsync_history_t_new()) != NULL) {
-    h->uri = uri;
-    h->status = status;
-    h->started = ctx->started;
-    h->finished = time(0);
-    h->final_slash = final_slash;
+/**
+ * Start the trace output file.  threshold is in milliseconds.
+ */
+static int trace_open(rcynic_ctx_t *rc,
+		      const char *filename,
+		      const unsigned threshold)
+{
+  trace_t *t = NULL;
+
+  if (filename == NULL)
+    return 1;
+
+  if ((t = malloc(sizeof(*t))) == NULL)
+    goto lose;
+  memset(t, 0, sizeof(*t));
+
+  if (snprintf(t->temp.s, sizeof(t->temp.s), "%s.%u.tmp", filename, (unsigned) getpid()) >= sizeof(t->temp.s)) {
+    logmsg(rc, log_usage_err, "Filename \"%s\" is too long, not writing trace", filename);
+    goto lose;
   }
 
-  if (h == NULL || !sk_rsync_history_t_push(rc->rsync_history, h)) {
-    rsync_history_t_free(h);
-    logmsg(rc, log_sys_err,
-	   "Couldn't add %s to rsync_history, blundering onwards", uri.s);
+  if ((t->walks = sk_trace_walk_t_new_null()) == NULL ||
+      (t->f = fopen(t->temp.s, "w")) == NULL ||
+      fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", t->f) == EOF)
+    goto lose;
+
+  t->epoch = monotonic_usec();
+  t->threshold = (unsigned long long) threshold * 1000;
+  rc->trace = t;
+  return 1;
+
+ lose:
+  logmsg(rc, log_sys_err, "Couldn't start trace output %s: %s", filename, strerror(errno));
+  trace_free(t);
+  return 0;
+}
+
+/**
+ * Write a JSON string.
+ */
+static void trace_put_string(FILE *f, const char *s)
+{
+  (void) putc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      (void) fprintf(f, "\\%c", *s);
+    else if ((unsigned char) *s < 0x20)
+      (void) fprintf(f, "\\u%04x", (unsigned char) *s);
+    else
+      (void) putc(*s, f);
   }
+  (void) putc('"', f);
 }
 
-
+/**
+ * Start a trace event: separator, name, category, phase, timestamp.
+ * Caller supplies the rest and the closing brace.
+ */
+static void trace_event(trace_t *t,
+			const char *name,
+			const char *cat,
+			const char ph,
+			const unsigned long long when)
+{
+  (void) fputs(t->nevents++ ? ",\n" : "\n", t->f);
+  (void) fputs("{\"name\":", t->f);
+  trace_put_string(t->f, name);
+  (void) fprintf(t->f, ",\"cat\":\"%s\",\"ph\":\"%c\",\"pid\":%u,\"ts\":%llu",
+		 cat, ph, (unsigned) getpid(),
+		 when > t->epoch ? when - t->epoch : 0);
+}
 
 /**
- * Return count of how many rsync contexts are in running.
+ * Start tracing the walk of the publication point at the top of a
+ * walk context stack.  Its parent is whatever publication point the
+ * frame below it belongs to.
  */
-static int rsync_count_running(const rcynic_ctx_t *rc)
+static void trace_walk_start(rcynic_ctx_t *rc, STACK_OF(walk_ctx_t) *wsk)
 {
-  const rsync_ctx_t *ctx;
-  int i, n = 0;
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  walk_ctx_t *parent = sk_walk_ctx_t_value(wsk, sk_walk_ctx_t_num(wsk) - 2);
+  trace_walk_t *t;
 
-  assert(rc && rc->rsync_queue);
+  if (rc->trace == NULL || w == NULL || w->trace != NULL)
+    return;
 
-  for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i) {
-    switch (ctx->state) {
-    case rsync_state_running:
-    case rsync_state_closed:
-    case rsync_state_terminating:
-      n++;
-    default:
-      continue;
-    }
+  if ((t = malloc(sizeof(*t))) == NULL)
+    return;
+  memset(t, 0, sizeof(*t));
+  t->uri = w->certinfo.sia;
+  t->parent = parent ? parent->trace : NULL;
+  t->start = monotonic_usec();
+
+  if (!sk_trace_walk_t_push(rc->trace->walks, t)) {
+    free(t);
+    return;
   }
 
-  return n;
+  w->trace = t;
 }
 
 /**
- * Test whether an rsync context conflicts with anything that's
- * currently runable.
+ * Note that the publication point at the top of a walk context stack
+ * has finished fetching (or didn't need fetching).
  */
-static int rsync_conflicts(const rcynic_ctx_t *rc,
-			   const rsync_ctx_t *ctx)
+static void trace_walk_fetched(rcynic_ctx_t *rc, STACK_OF(walk_ctx_t) *wsk)
 {
-  const rsync_ctx_t *c;
-  int i;
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
 
-  assert(rc && ctx && rc->rsync_queue);
+  if (rc->trace != NULL && w != NULL && w->trace != NULL && !w->trace->fetched)
+    w->trace->fetched = monotonic_usec();
+}
 
-  for (i = 0; (c = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i)
-    if (c != ctx &&
-	(c->state == rsync_state_initial ||
-	 c->state == rsync_state_running) &&
-	conflicting_uris(&c->uri, &ctx->uri))
-      return 1;
+/**
+ * Trace a fetch subprocess, when it exits.  Each subprocess gets its
+ * own track, named by its process ID.
+ */
+static void trace_fetch(rcynic_ctx_t *rc,
+			const rsync_ctx_t *ctx,
+			const int exit_status)
+{
+  const unsigned long long now = monotonic_usec();
 
-  return 0;
+  if (rc->trace == NULL || !ctx->launched_usec)
+    return;
+
+  trace_event(rc->trace, ctx->uri.s, "fetch", 'X', ctx->launched_usec);
+  (void) fprintf(rc->trace->f, ",\"dur\":%llu,\"tid\":%u,\"args\":{\"exit\":%d,\"tries\":%u}}",
+		 now - ctx->launched_usec, (unsigned) ctx->pid, exit_status, ctx->tries);
 }
 
 /**
- * Test whether a rsync context is runable at this time.
+ * Start timing a check_* call for the trace.  Returns 0 if we're not
+ * tracing.
  */
-static int rsync_runable(const rcynic_ctx_t *rc,
-			 const rsync_ctx_t *ctx)
+static unsigned long long trace_check_start(const rcynic_ctx_t *rc)
 {
-  assert(rc && ctx);
-
-  switch (ctx->state) {
+  return rc->trace ? monotonic_usec() : 0;
+}
 
-  case rsync_state_initial:
-  case rsync_state_running:
-    return 1;
+/**
+ * Finish timing a check_* call, and trace it if it took longer than
+ * the threshold.  Call with the big lock held.
+ */
+static void trace_check_end(rcynic_ctx_t *rc,
+			    const char *name,
+			    const uri_t *uri,
+			    const unsigned long long start)
+{
+  unsigned long long now;
 
-  case rsync_state_retry_wait:
-    return ctx->deadline <= time(0);
+  if (rc->trace == NULL || start == 0 ||
+      (now = monotonic_usec()) - start < rc->trace->threshold)
+    return;
 
-  case rsync_state_closed:
-  case rsync_state_terminating:
-    return 0;
+  trace_event(rc->trace, name, "check", 'X', start);
+  (void) fprintf(rc->trace->f, ",\"dur\":%llu,\"tid\":%u,\"args\":{\"uri\":",
+		 now - start, thread_number);
+  trace_put_string(rc->trace->f, uri->s);
+  (void) fputs("}}", rc->trace->f);
+}
 
-  case rsync_state_conflict_wait:
-    return !rsync_conflicts(rc, ctx);
+/**
+ * Find the child of a walk record which finished last, that is, the
+ * one which held up its parent's completion.  Pass NULL to find the
+ * last trust anchor to finish.
+ */
+static const trace_walk_t *trace_walk_last_child(const trace_t *t,
+						 const trace_walk_t *parent)
+{
+  const trace_walk_t *last = NULL, *w;
+  int i;
 
-  default:
-    break;
-  }
+  for (i = 0; (w = sk_trace_walk_t_value(t->walks, i)) != NULL; i++)
+    if (w->parent == parent && (last == NULL || w->end > last->end))
+      last = w;
 
-  return 0;
+  return last;
 }
 
 /**
- * Return count of runable rsync contexts.
+ * Finish the trace: write out the walk records, work out the critical
+ * path, log it, and add it to the trace on a track of its own, then
+ * rename the file into place.
+ *
+ * The critical path starts from the trust anchor whose walk finished
+ * last and follows, at each level, the child publication point which
+ * finished last, since that's the one its parent was waiting for.
+ * For each publication point along the way we report how long it
+ * spent waiting for its fetch, which is usually the interesting part.
  */
-static int rsync_count_runable(const rcynic_ctx_t *rc)
+static int trace_close(rcynic_ctx_t *rc, const char *filename)
 {
-  const rsync_ctx_t *ctx;
-  int i, n = 0;
+  trace_t *t = rc->trace;
+  const unsigned long long now = monotonic_usec();
+  const trace_walk_t *w;
+  int i, ok;
 
-  assert(rc && rc->rsync_queue);
+  if (t == NULL)
+    return 1;
 
-  for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i)
-    if (rsync_runable(rc, ctx))
-      n++;
+  for (i = 0; i < sk_trace_walk_t_num(t->walks); i++) {
+    trace_walk_t *tw = sk_trace_walk_t_value(t->walks, i);
+    if (!tw->end)
+      tw->end = now;
+    if (!tw->fetched || tw->fetched > tw->end)
+      tw->fetched = tw->end;
+    trace_event(t, tw->uri.s, "walk", 'b', tw->start);
+    (void) fprintf(t->f, ",\"id\":%d}", i);
+    trace_event(t, "fetch", "walk", 'b', tw->start);
+    (void) fprintf(t->f, ",\"id\":%d}", i);
+    trace_event(t, "fetch", "walk", 'e', tw->fetched);
+    (void) fprintf(t->f, ",\"id\":%d}", i);
+    trace_event(t, tw->uri.s, "walk", 'e', tw->end);
+    (void) fprintf(t->f, ",\"id\":%d}", i);
+  }
+
+  trace_event(t, "thread_name", "__metadata", 'M', t->epoch);
+  (void) fputs(",\"tid\":0,\"args\":{\"name\":\"critical path\"}}", t->f);
+
+  for (w = trace_walk_last_child(t, NULL); w != NULL; w = trace_walk_last_child(t, w)) {
+    logmsg(rc, log_telemetry,
+	   "Critical path: %s, fetch %llu.%03llus, finished at +%llu.%03llus",
+	   w->uri.s,
+	   (w->fetched - w->start) / 1000000, (w->fetched - w->start) / 1000 % 1000,
+	   (w->end - t->epoch) / 1000000, (w->end - t->epoch) / 1000 % 1000);
+    trace_event(t, w->uri.s, "critical_path", 'X', w->start);
+    (void) fprintf(t->f, ",\"dur\":%llu,\"tid\":0,\"args\":{\"fetch_us\":%llu}}",
+		   w->end - w->start, w->fetched - w->start);
+  }
+
+  ok = fputs("\n]}\n", t->f) != EOF;
+  ok &= fclose(t->f) != EOF;
+  t->f = NULL;
 
-  return n;
+  if (ok)
+    ok &= rename(t->temp.s, filename) == 0;
+
+  if (!ok) {
+    logmsg(rc, log_sys_err, "Couldn't write trace to %s: %s", filename, strerror(errno));
+    (void) unlink(t->temp.s);
+  }
+
+  return ok;
 }
 
+
+
+static int rsync_count_running(const rcynic_ctx_t *);
+
 /**
- * Call rsync context handler, if one is set.
+ * Add a task to the task queue.
  */
-static void rsync_call_handler(rcynic_ctx_t *rc,
-			       rsync_ctx_t *ctx,
-			       const rsync_status_t status)
+static int task_add(const rcynic_ctx_t *rc,
+		    void (*handler)(rcynic_ctx_t *, void *),
+		    void *cookie)
 {
-  if (!ctx)
-    return;
+  task_t *t = malloc(sizeof(*t));
 
-  switch (status) {
+  assert(rc && rc->task_queue && handler);
 
-  case rsync_status_pending:
-  case rsync_status_done:
-    break;
+  assert(rsync_count_running(rc) <= rc->max_parallel_fetches);
 
-  case rsync_status_failed:
-    log_validation_status(rc, &ctx->uri, rsync_transfer_failed, object_generation_null);
-    break;
+  if (!t)
+    return 0;
 
-  case rsync_status_timed_out:
-    log_validation_status(rc, &ctx->uri, rsync_transfer_timed_out, object_generation_null);
-    break;
+  t->handler = handler;
+  t->cookie = cookie;
 
-  case rsync_status_skipped:
-    log_validation_status(rc, &ctx->uri, rsync_transfer_skipped, object_generation_null);
-    break;
+  if (sk_task_t_push(rc->task_queue, t)) {
+    if (rc->pool)
+      pthread_cond_signal(&rc->pool->work);
+    return 1;
   }
 
-  if (ctx->handler)
-    ctx->handler(rc, ctx, status, &ctx->uri, ctx->cookie);
+  free(t);
+  return 0;
 }
 
 /**
- * Run an rsync process.
+ * Run one task from the queue.  Caller must hold the big lock if
+ * we're running with a worker pool.
  */
-static void rsync_run(rcynic_ctx_t *rc,
-		      rsync_ctx_t *ctx)
+static void task_run_one(rcynic_ctx_t *rc)
 {
-  static const char * const rsync_cmd[] = {
-    "rsync", "--update", "--times", "--copy-links", "--itemize-changes"
-  };
-  static const char * const rsync_tree_args[] = {
-    "--recursive", "--delete"
-  };
+  task_t *t;
 
-  const char *argv[10];
-  path_t path;
-  int i, argc = 0, flags, pipe_fds[2];
+  assert(rc && rc->task_queue);
 
-  pipe_fds[0] = pipe_fds[1] = -1;
+  if ((t = sk_task_t_shift(rc->task_queue)) == NULL)
+    return;
 
-  assert(rc && ctx && ctx->pid == 0 && ctx->state != rsync_state_running && rsync_runable(rc, ctx));
+  if (rc->pool)
+    rc->pool->busy++;
 
-  if (rsync_history_uri(rc, &ctx->uri)) {
-    logmsg(rc, log_verbose, "Late rsync cache hit for %s", ctx->uri.s);
-    rsync_call_handler(rc, ctx, rsync_status_done);
-    (void) sk_rsync_ctx_t_delete_ptr(rc->rsync_queue, ctx);
-    free(ctx);
-    return;
-  }
+  t->handler(rc, t->cookie);
+  free(t);
 
-  assert(rsync_count_running(rc) < rc->max_parallel_fetches);
+  if (rc->pool && --rc->pool->busy == 0 &&
+      (rc->pool->paused || sk_task_t_num(rc->task_queue) == 0))
+    pthread_cond_broadcast(&rc->pool->idle);
+}
 
-  logmsg(rc, log_telemetry, "Fetching %s", ctx->uri.s);
+/**
+ * Run tasks until queue is empty.  With a worker pool, the main
+ * thread works the queue along with the workers, then waits until
+ * everybody is idle, so that the caller sees the same quiescent state
+ * it would have seen in the single-threaded case.
+ */
+static void task_run_q(rcynic_ctx_t *rc)
+{
+  assert(rc && rc->task_queue);
 
-  memset(argv, 0, sizeof(argv));
+  while (sk_task_t_num(rc->task_queue) > 0)
+    task_run_one(rc);
 
-  for (i = 0; i < sizeof(rsync_cmd)/sizeof(*rsync_cmd); i++) {
-    assert(argc < sizeof(argv)/sizeof(*argv));
-    argv[argc++] = rsync_cmd[i];
-  }
-  if (endswith(ctx->uri.s, "/")) {
-    for (i = 0; i < sizeof(rsync_tree_args)/sizeof(*rsync_tree_args); i++) {
-      assert(argc < sizeof(argv)/sizeof(*argv));
-      argv[argc++] = rsync_tree_args[i];
-    }
+  while (rc->pool && (rc->pool->busy > 0 || sk_task_t_num(rc->task_queue) > 0)) {
+    if (sk_task_t_num(rc->task_queue) > 0)
+      task_run_one(rc);
+    else
+      pthread_cond_wait(&rc->pool->idle, &rc->pool->lock);
   }
+}
 
-  if (rc->rsync_program)
-    argv[0] = rc->rsync_program;
 
-  if (!uri_to_filename(rc, &ctx->uri, &path, &rc->unauthenticated)) {
-    logmsg(rc, log_data_err, "Couldn't extract filename from URI: %s", ctx->uri.s);
-    goto lose;
-  }
 
-  assert(argc < sizeof(argv)/sizeof(*argv));
-  argv[argc++] = ctx->uri.s;
+/**
+ * Release the big lock around work which doesn't touch any shared
+ * state, typically signature checks and DER decoding of objects
+ * which only the calling thread can see.  No-op if we're not running
+ * with a worker pool.
+ */
+static void rcynic_unlock(const rcynic_ctx_t *rc)
+{
+  if (rc->pool)
+    pthread_mutex_unlock(&rc->pool->lock);
+}
 
-  assert(argc < sizeof(argv)/sizeof(*argv));
-  argv[argc++] = path.s;
+/**
+ * Reacquire the big lock after rcynic_unlock().
+ */
+static void rcynic_lock(const rcynic_ctx_t *rc)
+{
+  if (rc->pool)
+    pthread_mutex_lock(&rc->pool->lock);
+}
 
-  if (!mkdir_maybe(rc, &path)) {
-    logmsg(rc, log_sys_err, "Couldn't make target directory: %s", path.s);
-    goto lose;
-  }
+/**
+ * Park the worker pool so that the main thread can fork().  The child
+ * of a threaded process gets only the thread that called fork(), so
+ * any lock another thread held at the time, be it ours, OpenSSL's, or
+ * malloc()'s, stays locked in the child forever.  Once nobody is busy,
+ * every worker is waiting for work with the big lock released, and
+ * none of them can be holding anything else.  Tasks queued meanwhile
+ * wait until worker_pool_resume().  Caller holds the big lock and
+ * must not be running a task itself, which is true of rsync_mgr().
+ */
+static void worker_pool_pause(rcynic_ctx_t *rc)
+{
+  worker_pool_t *pool = rc->pool;
 
-  for (i = 0; i < argc; i++)
-    logmsg(rc, log_debug, "rsync argv[%d]: %s", i, argv[i]);
+  if (pool == NULL)
+    return;
 
-  if (pipe(pipe_fds) < 0) {
-    logmsg(rc, log_sys_err, "pipe() failed: %s", strerror(errno));
-    goto lose;
-  }
+  pool->paused = 1;
 
-  switch ((ctx->pid = vfork())) {
+  while (pool->busy > 0)
+    pthread_cond_wait(&pool->idle, &pool->lock);
+}
 
-  case -1:
-     logmsg(rc, log_sys_err, "vfork() failed: %s", strerror(errno));
-     goto lose;
+/**
+ * Let the worker pool take tasks again after worker_pool_pause().
+ */
+static void worker_pool_resume(rcynic_ctx_t *rc)
+{
+  worker_pool_t *pool = rc->pool;
 
-  case 0:
-    /*
-     * Child
-     */
-#define whine(msg) ((void) write(2, msg, sizeof(msg) - 1))
-    if (close(pipe_fds[0]) < 0)
-      whine("close(pipe_fds[0]) failed\n");
-    else if (dup2(pipe_fds[1], 1) < 0)
-      whine("dup2(pipe_fds[1], 1) failed\n");
-    else if (dup2(pipe_fds[1], 2) < 0)
-      whine("dup2(pipe_fds[1], 2) failed\n");
-    else if (close(pipe_fds[1]) < 0)
-      whine("close(pipe_fds[1]) failed\n");
-    else if (execvp(argv[0], (char * const *) argv) < 0)
-      whine("execvp(argv[0], (char * const *) argv) failed\n");
-    whine("last system error: ");
-    write(2, strerror(errno), strlen(strerror(errno)));
-    whine("\n");
-    _exit(1);
-#undef whine
-
-  default:
-    /*
-     * Parent
-     */
-    ctx->fd = pipe_fds[0];
-    if ((flags = fcntl(ctx->fd, F_GETFL, 0)) == -1 ||
-	fcntl(ctx->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-      logmsg(rc, log_sys_err, "fcntl(ctx->fd, F_[GS]ETFL, O_NONBLOCK) failed: %s",
-	     strerror(errno));
-      goto lose;
-    }
-    (void) close(pipe_fds[1]);
-    ctx->state = rsync_state_running;
-    ctx->problem = rsync_problem_none;
-    if (!ctx->started)
-      ctx->started = time(0);
-    if (rc->rsync_timeout)
-      ctx->deadline = time(0) + rc->rsync_timeout;
-    logmsg(rc, log_verbose, "Subprocess %u started, queued %d, runable %d, running %d, max %d, URI %s",
-	   (unsigned) ctx->pid, sk_rsync_ctx_t_num(rc->rsync_queue), rsync_count_runable(rc), rsync_count_running(rc), rc->max_parallel_fetches, ctx->uri.s);
-    rsync_call_handler(rc, ctx, rsync_status_pending);
+  if (pool == NULL)
     return;
 
-  }
-
- lose:
-  if (pipe_fds[0] != -1)
-    (void) close(pipe_fds[0]);
-  if (pipe_fds[1] != -1)
-    (void) close(pipe_fds[1]);
-  if (rc->rsync_queue && ctx)
-    (void) sk_rsync_ctx_t_delete_ptr(rc->rsync_queue, ctx);
-  rsync_call_handler(rc, ctx, rsync_status_failed);
-  if (ctx->pid > 0) {
-    (void) kill(ctx->pid, SIGKILL);
-    ctx->pid = 0;
-  }
+  pool->paused = 0;
+  pthread_cond_broadcast(&pool->work);
 }
 
 /**
- * Process one line of rsync's output.  This is a separate function
- * primarily to centralize scraping for magic error strings.
+ * Worker thread main loop: take tasks off the shared queue until
+ * we're told to shut down.
  */
-static void do_one_rsync_log_line(const rcynic_ctx_t *rc,
-				  rsync_ctx_t *ctx)
+static void *worker_thread(void *cookie)
 {
-  unsigned u;
-  char *s;
+  rcynic_ctx_t *rc = cookie;
+  worker_pool_t *pool = rc->pool;
 
-  /*
-   * Send line to our log unless it's empty.
-   */
-  if (ctx->buffer[strspn(ctx->buffer, " \t\n\r")] != '\0')
-    logmsg(rc, log_telemetry, "rsync[%u]: %s", ctx->pid, ctx->buffer);
+  pthread_mutex_lock(&pool->lock);
 
-  /*
-   * Check for magic error strings
-   */
-  if ((s = strstr(ctx->buffer, "@ERROR: max connections")) != NULL) {
-    ctx->problem = rsync_problem_refused;
-    if (sscanf(s, "@ERROR: max connections (%u) reached -- try again later", &u) == 1)
-      logmsg(rc, log_verbose, "Subprocess %u reported limit of %u for %s", ctx->pid, u, ctx->uri.s);
+  thread_number = ++pool->numbered;
+
+  for (;;) {
+    while (!pool->shutdown && (pool->paused || sk_task_t_num(rc->task_queue) == 0))
+      pthread_cond_wait(&pool->work, &pool->lock);
+    if (pool->shutdown)
+      break;
+    task_run_one(rc);
   }
+
+  pthread_mutex_unlock(&pool->lock);
+  ERR_remove_thread_state(NULL);
+  return NULL;
 }
 
 /**
- * Construct select() arguments.
+ * Locks for OpenSSL's own shared data structures (reference counts,
+ * cached Montgomery contexts, and so forth).  OpenSSL's callback API
+ * gives us no way to pass a context, so this has to be global.
+ */
+static pthread_mutex_t *openssl_locks;
+
+/**
+ * OpenSSL locking callback.
  */
-static int rsync_construct_select(const rcynic_ctx_t *rc,
-				  const time_t now,
-				  fd_set *rfds,
-				  struct timeval *tv)
+static void openssl_locking_callback(int mode, int n, const char *file, int line)
 {
-  rsync_ctx_t *ctx;
-  time_t when = 0;
-  int i, n = 0;
+  if (mode & CRYPTO_LOCK)
+    pthread_mutex_lock(&openssl_locks[n]);
+  else
+    pthread_mutex_unlock(&openssl_locks[n]);
+}
+
+/**
+ * OpenSSL thread ID callback.
+ */
+static void openssl_threadid_callback(CRYPTO_THREADID *id)
+{
+  CRYPTO_THREADID_set_numeric(id, (unsigned long) pthread_self());
+}
 
-  assert(rc && rc->rsync_queue && rfds && tv && rc->max_select_time >= 0);
+/**
+ * Start the worker pool.  The calling thread becomes the main thread
+ * and holds the big lock from here on, except when it's waiting for
+ * the pool to go idle or is doing crypto on the pool's behalf.
+ */
+static int worker_pool_start(rcynic_ctx_t *rc)
+{
+  worker_pool_t *pool;
+  int i, n, err;
 
-  FD_ZERO(rfds);
+  assert(rc && rc->pool == NULL && rc->worker_threads > 1);
 
-  for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i) {
+  if ((pool = malloc(sizeof(*pool))) == NULL)
+    return 0;
+  memset(pool, 0, sizeof(*pool));
 
-    switch (ctx->state) {
+  n = rc->worker_threads - 1;
 
-    case rsync_state_running:
-      assert(ctx->fd >= 0);
-      FD_SET(ctx->fd, rfds);
-      if (ctx->fd > n)
-	n = ctx->fd;
-      if (!rc->rsync_timeout)
-	continue;
-      /* Fall through */
+  if ((pool->threads = malloc(n * sizeof(*pool->threads))) == NULL ||
+      (openssl_locks = malloc(CRYPTO_num_locks() * sizeof(*openssl_locks))) == NULL) {
+    free(pool->threads);
+    free(pool);
+    return 0;
+  }
 
-    case rsync_state_retry_wait:
-      if (when == 0 || ctx->deadline < when)
-	when = ctx->deadline;
-      /* Fall through */
+  for (i = 0; i < CRYPTO_num_locks(); i++)
+    pthread_mutex_init(&openssl_locks[i], NULL);
+  CRYPTO_THREADID_set_callback(openssl_threadid_callback);
+  CRYPTO_set_locking_callback(openssl_locking_callback);
 
-    default:
-      continue;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  pthread_cond_init(&pool->frame, NULL);
+
+  pthread_mutex_lock(&pool->lock);
+  rc->pool = pool;
+
+  for (i = 0; i < n; i++) {
+    if ((err = pthread_create(&pool->threads[i], NULL, worker_thread, rc)) != 0) {
+      logmsg(rc, log_sys_err, "Couldn't start worker thread: %s", strerror(err));
+      break;
     }
+    pool->nthreads++;
   }
 
-  if (!when)
-    tv->tv_sec = rc->max_select_time;
-  else if (when < now)
-    tv->tv_sec = 0;
-  else if (when < now + rc->max_select_time)
-    tv->tv_sec = when - now;
-  else
-    tv->tv_sec = rc->max_select_time;
-  tv->tv_usec = 0;
-  return n;
+  logmsg(rc, log_telemetry, "Started %d worker threads", pool->nthreads);
+  return pool->nthreads > 0;
 }
 
 /**
- * Convert rsync_status_t to mib_counter_t.
- *
- * Maybe some day this will go away and we won't be carrying
- * essentially the same information in two different databases, but
- * for now I'll settle for cleaning up the duplicate code logic.
+ * Shut down the worker pool.  Called from the main thread, which
+ * holds the big lock.
  */
-static mib_counter_t rsync_status_to_mib_counter(rsync_status_t status)
+static void worker_pool_stop(rcynic_ctx_t *rc)
 {
-  switch (status) {
-  case rsync_status_done:	return rsync_transfer_succeeded;
-  case rsync_status_timed_out:	return rsync_transfer_timed_out;
-  case rsync_status_failed:	return rsync_transfer_failed;
-  case rsync_status_skipped:	return rsync_transfer_skipped;
-  default:
-    /*
-     * Keep GCC from whining about untested cases.
-     */
-    assert(status == rsync_status_done ||
-	   status == rsync_status_timed_out ||
-	   status == rsync_status_failed ||
-	   status == rsync_status_skipped);
-    return rsync_transfer_failed;
-  }
-}
+  worker_pool_t *pool = rc->pool;
+  int i;
 
-/**
- * Manager for queue of rsync tasks in progress.
- *
- * General plan here is to process one completed child, or output
- * accumulated from children, or block if there is absolutely nothing
- * to do, on the theory that caller had nothing to do either or would
- * not have called us.  Once we've done something allegedly useful, we
- * return, because this is not the event loop; if and when the event
- * loop has nothing more important to do, we'll be called again.
- *
- * So this is the only place where the program blocks waiting for
- * children, but we only do it when we know there's nothing else
- * useful that we could be doing while we wait.
- */
-static void rsync_mgr(rcynic_ctx_t *rc)
-{
-  rsync_status_t rsync_status;
-  int i, n, pid_status = -1;
-  rsync_ctx_t *ctx = NULL;
-  time_t now = time(0);
-  struct timeval tv;
-  fd_set rfds;
-  pid_t pid;
-  char *s;
+  if (pool == NULL)
+    return;
 
-  assert(rc && rc->rsync_queue);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
 
-  /*
-   * Check for exited subprocesses.
-   */
+  for (i = 0; i < pool->nthreads; i++)
+    (void) pthread_join(pool->threads[i], NULL);
 
-  while ((pid = waitpid(-1, &pid_status, WNOHANG)) > 0) {
+  rc->pool = NULL;
 
-    /*
-     * Child exited, handle it.
-     */
+  pthread_cond_destroy(&pool->frame);
+  pthread_cond_destroy(&pool->idle);
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
 
-    logmsg(rc, log_verbose, "Subprocess %u exited with status %d",
-	   (unsigned) pid, WEXITSTATUS(pid_status));
+  CRYPTO_set_locking_callback(NULL);
+  for (i = 0; i < CRYPTO_num_locks(); i++)
+    pthread_mutex_destroy(&openssl_locks[i]);
+  free(openssl_locks);
+  openssl_locks = NULL;
+}
 
-    for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i)
-      if (ctx->pid == pid)
-	break;
-    if (ctx == NULL) {
-      assert(i == sk_rsync_ctx_t_num(rc->rsync_queue));
-      logmsg(rc, log_sys_err, "Couldn't find rsync context for pid %d", pid);
-      continue;
-    }
+
+
+/**
+ * Allocate a new rsync URI trie.
+ */
+static rsync_trie_t *rsync_trie_new(void)
+{
+  rsync_trie_t *t = malloc(sizeof(*t));
 
-    close(ctx->fd);
-    ctx->fd = -1;
+  if (t == NULL)
+    return NULL;
 
-    if (ctx->buflen > 0) {
-      assert(ctx->buflen < sizeof(ctx->buffer));
-      ctx->buffer[ctx->buflen] = '\0';
-      do_one_rsync_log_line(rc, ctx);
-      ctx->buflen = 0;
-    }
+  memset(t, 0, sizeof(*t));
 
-    switch (WEXITSTATUS(pid_status)) {
+  if ((t->root = arena_alloc(&t->arena, sizeof(*t->root))) == NULL) {
+    free(t);
+    return NULL;
+  }
 
-    case 0:
-      rsync_status = rsync_status_done;
-      break;
+  memset(t->root, 0, sizeof(*t->root));
+  return t;
+}
 
-    case 5:			/* "Error starting client-server protocol" */
-      /*
-       * Handle remote rsyncd refusing to talk to us because we've
-       * exceeded its connection limit.  Back off for a short
-       * interval, then retry.
-       */
-      if (ctx->problem == rsync_problem_refused && ctx->tries < rc->max_retries) {
-	unsigned char r;
-	if (!RAND_bytes(&r, sizeof(r)))
-	  r = 60;
-	ctx->deadline = time(0) + rc->retry_wait_min + r;
-	ctx->state = rsync_state_retry_wait;
-	ctx->problem = rsync_problem_none;
-	ctx->pid = 0;
-	ctx->tries++;
-	logmsg(rc, log_telemetry, "Scheduling retry for %s", ctx->uri.s);
-	continue;
-      }
-      goto failure;
+/**
+ * Free an rsync URI trie and all of its nodes.
+ */
+static void rsync_trie_free(rsync_trie_t *t)
+{
+  if (t) {
+    arena_free(t->arena);
+    free(t->slots);
+    free(t);
+  }
+}
 
-    case 23:			/* "Partial transfer due to error" */
-      /*
-       * This appears to be a catch-all for "something bad happened
-       * trying to do what you asked me to do".  In the cases I've
-       * seen to date, this is things like "the directory you
-       * requested isn't there" or "NFS exploded when I tried to touch
-       * the directory".  These aren't network layer failures, so we
-       * (probably) shouldn't give up on the repository host.
-       */
-      rsync_status = rsync_status_done;
-      log_validation_status(rc, &ctx->uri, rsync_partial_transfer, object_generation_null);
-      break;
+/**
+ * Find the slot in an rsync URI trie's hash table where a child node
+ * lives or would live.
+ */
+static rsync_trie_node_t **rsync_trie_slot(const rsync_trie_t *t,
+					   const rsync_trie_node_t *parent,
+					   const char *name,
+					   const size_t len,
+					   const unsigned hash)
+{
+  size_t mask = t->nslots - 1, i;
+  rsync_trie_node_t *n;
 
-    default:
-    failure:
-      rsync_status = rsync_status_failed;
-      logmsg(rc, log_data_err, "rsync %u exited with status %d fetching %s",
-	     (unsigned) pid, WEXITSTATUS(pid_status), ctx->uri.s);
+  for (i = hash & mask; (n = t->slots[i]) != NULL; i = (i + 1) & mask)
+    if (n->hash == hash && n->parent == parent && n->len == len && !memcmp(n->name, name, len))
       break;
-    }
 
-    if (rc->rsync_timeout && now >= ctx->deadline)
-      rsync_status = rsync_status_timed_out;
-    log_validation_status(rc, &ctx->uri,
-			  rsync_status_to_mib_counter(rsync_status),
-			  object_generation_null);
-    rsync_history_add(rc, ctx, rsync_status);
-    rsync_call_handler(rc, ctx, rsync_status);
-    (void) sk_rsync_ctx_t_delete_ptr(rc->rsync_queue, ctx);
-    free(ctx);
-    ctx = NULL;
-  }
+  return &t->slots[i];
+}
 
-  if (pid == -1 && errno != EINTR && errno != ECHILD)
-    logmsg(rc, log_sys_err, "waitpid() returned error: %s", strerror(errno));
+/**
+ * Double the size of an rsync URI trie's hash table.
+ */
+static int rsync_trie_grow(rsync_trie_t *t)
+{
+  size_t nslots = t->nslots ? t->nslots * 2 : RSYNC_TRIE_MIN_SLOTS;
+  rsync_trie_node_t **slots, *n;
+  size_t i, j;
 
-  assert(rsync_count_running(rc) <= rc->max_parallel_fetches);
+  if ((slots = calloc(nslots, sizeof(*slots))) == NULL)
+    return 0;
 
-  /*
-   * Look for rsync contexts that have become runable.  Odd loop
-   * structure is because rsync_run() might decide to remove the
-   * specified rsync task from the queue instead of running it.
-   */
-  for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; i++) {
-    n = sk_rsync_ctx_t_num(rc->rsync_queue);
-    if (ctx->state != rsync_state_running &&
-	rsync_runable(rc, ctx) &&
-	rsync_count_running(rc) < rc->max_parallel_fetches)
-      rsync_run(rc, ctx);
-    if (n > sk_rsync_ctx_t_num(rc->rsync_queue))
-      i--;
+  for (i = 0; i < t->nslots; i++) {
+    if ((n = t->slots[i]) == NULL)
+      continue;
+    for (j = n->hash & (nslots - 1); slots[j] != NULL; j = (j + 1) & (nslots - 1))
+      ;
+    slots[j] = n;
   }
 
-  assert(rsync_count_running(rc) <= rc->max_parallel_fetches);
+  free(t->slots);
+  t->slots = slots;
+  t->nslots = nslots;
+  return 1;
+}
 
-  /*
-   * Check for log text from subprocesses.
-   */
+/**
+ * Find a child of an rsync URI trie node, creating it if it doesn't
+ * exist and we've been asked to.
+ */
+static rsync_trie_node_t *rsync_trie_child(rsync_trie_t *t,
+					   rsync_trie_node_t *parent,
+					   const char *name,
+					   const size_t len,
+					   const int create)
+{
+  unsigned hash = uri_hash(URI_HASH_INIT ^ (unsigned) ((size_t) parent >> 4), name, len);
+  rsync_trie_node_t *n;
 
-  n = rsync_construct_select(rc, now, &rfds, &tv);
+  if (t->nslots > 0 && (n = *rsync_trie_slot(t, parent, name, len, hash)) != NULL)
+    return n;
 
-  if (n > 0 && tv.tv_sec)
-    logmsg(rc, log_verbose, "Waiting up to %u seconds for rsync, queued %d, runable %d, running %d, max %d",
-	   (unsigned) tv.tv_sec, sk_rsync_ctx_t_num(rc->rsync_queue), rsync_count_runable(rc),
-	   rsync_count_running(rc), rc->max_parallel_fetches);
+  if (!create)
+    return NULL;
 
-  if (n > 0) {
-#if 0
-    logmsg(rc, log_debug, "++ select(%d, %u)", n, tv.tv_sec);
-#endif
-    n = select(n + 1, &rfds, NULL, NULL, &tv);
-  }
+  if (((t->count + 1) * 4 > t->nslots * 3 && !rsync_trie_grow(t)) ||
+      (n = arena_alloc(&t->arena, sizeof(*n) + len + 1)) == NULL)
+    return NULL;
 
-  if (n > 0) {
+  memset(n, 0, sizeof(*n));
+  n->parent = parent;
+  n->hash = hash;
+  n->len = len;
+  memcpy(n->name, name, len);
+  n->name[len] = '\0';
 
-    for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i) {
-      if (ctx->fd <= 0 || !FD_ISSET(ctx->fd, &rfds))
-	continue;
+  *rsync_trie_slot(t, parent, name, len, hash) = n;
+  t->count++;
+  return n;
+}
 
-      assert(ctx->buflen < sizeof(ctx->buffer) - 1);
-
-      while ((n = read(ctx->fd, ctx->buffer + ctx->buflen, sizeof(ctx->buffer) - 1 - ctx->buflen)) > 0) {
-	ctx->buflen += n;
-	assert(ctx->buflen < sizeof(ctx->buffer));
-	ctx->buffer[ctx->buflen] = '\0';
-
-	while ((s = strchr(ctx->buffer, '\n')) != NULL) {
-	  *s++ = '\0';
-	  do_one_rsync_log_line(rc, ctx);
-	  assert(s > ctx->buffer && s < ctx->buffer + sizeof(ctx->buffer));
-	  ctx->buflen -= s - ctx->buffer;
-	  assert(ctx->buflen < sizeof(ctx->buffer));
-	  if (ctx->buflen > 0)
-	    memmove(ctx->buffer, s, ctx->buflen);
-	  ctx->buffer[ctx->buflen] = '\0';
-	}
+/**
+ * Find the next path component of an rsync URI, skipping empty ones
+ * (doubled or trailing slashes).  Returns a pointer to the start of
+ * the component and sets *len to its length, zero at end of string.
+ */
+static const char *rsync_trie_component(const char *s, size_t *len)
+{
+  while (*s == '/')
+    s++;
+  *len = strcspn(s, "/");
+  return s;
+}
 
-	if (ctx->buflen == sizeof(ctx->buffer) - 1) {
-	  ctx->buffer[sizeof(ctx->buffer) - 1] = '\0';
-	  do_one_rsync_log_line(rc, ctx);
-	  ctx->buflen = 0;
-	}
-      }
+/**
+ * Find the rsync URI trie node for a URI, creating it (and any
+ * missing ancestors) if we've been asked to.
+ *
+ * RRDP fetches go in the trie under the rsync URI of the SIA they're
+ * fetching, not under the notification URI, since the SIA is where
+ * they write; that way they conflict with rsync fetches of the same
+ * tree, and a successful one covers it just as an rsync fetch would.
+ */
+static rsync_trie_node_t *rsync_trie_find(const rcynic_ctx_t *rc,
+					  const uri_t *uri,
+					  const int create)
+{
+  rsync_trie_node_t *node;
+  const char *s;
+  size_t len;
 
-      if (n == 0) {
-	(void) close(ctx->fd);
-	ctx->fd = -1;
-	ctx->state = rsync_state_closed;
-      }
-    }
-  }
+  assert(rc && rc->rsync_trie && uri && is_rsync(uri->s));
 
-  assert(rsync_count_running(rc) <= rc->max_parallel_fetches);
+  node = rc->rsync_trie->root;
 
-  /*
-   * Deal with children that have been running too long.
-   */
-  if (rc->rsync_timeout) {
-    for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i) {
-      int sig;
-      if (ctx->pid <= 0 || now < ctx->deadline)
-	continue;
-      sig = ctx->tries++ < KILL_MAX ? SIGTERM : SIGKILL;
-      if (ctx->state != rsync_state_terminating) {
-	ctx->problem = rsync_problem_timed_out;
-	ctx->state = rsync_state_terminating;
-	ctx->tries = 0;
-	logmsg(rc, log_telemetry, "Subprocess %u is taking too long fetching %s, whacking it", (unsigned) ctx->pid, ctx->uri.s);
-	rsync_history_add(rc, ctx, rsync_status_timed_out);
-      } else if (sig == SIGTERM) {
-	logmsg(rc, log_verbose, "Whacking subprocess %u again", (unsigned) ctx->pid);
-      } else {
-	logmsg(rc, log_verbose, "Whacking subprocess %u with big hammer", (unsigned) ctx->pid);
-      }
-      (void) kill(ctx->pid, sig);
-      ctx->deadline = now + 1;
-    }
-  }
+  for (s = rsync_trie_component(uri->s + SIZEOF_RSYNC, &len);
+       len > 0 && node != NULL;
+       s = rsync_trie_component(s + len, &len))
+    node = rsync_trie_child(rc->rsync_trie, node, s, len, create);
+
+  return node;
 }
 
 /**
- * Set up rsync context and attempt to start it.
+ * Check cache of whether we've already fetched a particular URI, or
+ * something that covers it.  If there's more than one, we want the
+ * most specific, which is the last one we pass on the way down.
  */
-static void rsync_init(rcynic_ctx_t *rc,
-		       const uri_t *uri,
-		       void *cookie,
-		       void (*handler)(rcynic_ctx_t *, const rsync_ctx_t *, const rsync_status_t, const uri_t *, void *))
+static rsync_history_t *rsync_history_uri(const rcynic_ctx_t *rc,
+					  const uri_t *uri)
 {
-  rsync_ctx_t *ctx = NULL;
+  rsync_history_t *h = NULL;
+  rsync_trie_node_t *node;
+  const char *s;
+  size_t len;
 
-  assert(rc && uri && strlen(uri->s) > SIZEOF_RSYNC);
+  assert(rc && uri && rc->rsync_trie);
 
-  if (!rc->run_rsync) {
-    logmsg(rc, log_verbose, "rsync disabled, skipping %s", uri->s);
-    if (handler)
-      handler(rc, NULL, rsync_status_skipped, uri, cookie);
-    return;
-  }
-
-  if (rsync_history_uri(rc, uri)) {
-    logmsg(rc, log_verbose, "rsync cache hit for %s", uri->s);
-    if (handler)
-      handler(rc, NULL, rsync_status_done, uri, cookie);
-    return;
-  }
-
-  if ((ctx = malloc(sizeof(*ctx))) == NULL) {
-    logmsg(rc, log_sys_err, "malloc(rsync_ctxt_t) failed");
-    if (handler)
-      handler(rc, NULL, rsync_status_failed, uri, cookie);
-    return;
-  }
+  if (!is_rsync(uri->s))
+    return NULL;
 
-  memset(ctx, 0, sizeof(*ctx));
-  ctx->uri = *uri;
-  ctx->handler = handler;
-  ctx->cookie = cookie;
-  ctx->fd = -1;
+  node = rc->rsync_trie->root;
 
-  if (!sk_rsync_ctx_t_push(rc->rsync_queue, ctx)) {
-    logmsg(rc, log_sys_err, "Couldn't push rsync state object onto queue, punting %s", ctx->uri.s);
-    rsync_call_handler(rc, ctx, rsync_status_failed);
-    free(ctx);
-    return;
+  for (s = rsync_trie_component(uri->s + SIZEOF_RSYNC, &len);
+       len > 0;
+       s = rsync_trie_component(s + len, &len)) {
+    if ((node = rsync_trie_child(rc->rsync_trie, node, s, len, 0)) == NULL)
+      break;
+    if (node->history != NULL)
+      h = node->history;
   }
 
-  if (rsync_conflicts(rc, ctx)) {
-    logmsg(rc, log_debug, "New rsync context %s is feeling conflicted", ctx->uri.s);
-    ctx->state = rsync_state_conflict_wait;
-  }
+  return h;
 }
 
 /**
- * rsync a trust anchor.
+ * Is this context fetching via RRDP rather than rsync?  We don't need
+ * a separate flag for this, only RRDP contexts have a notification
+ * URI.
  */
-static void rsync_ta(rcynic_ctx_t *rc,
-		     const uri_t *uri,
-		     tal_ctx_t *tctx,
-		     void (*handler)(rcynic_ctx_t *, const rsync_ctx_t *,
-				     const rsync_status_t, const uri_t *, void *))
+static int rsync_ctx_is_rrdp(const rsync_ctx_t *ctx)
 {
-  assert(endswith(uri->s, ".cer"));
-  rsync_init(rc, uri, tctx, handler);
+  return ctx != NULL && ctx->notify.s != NULL;
 }
 
 /**
- * rsync an entire subtree, generally rooted at a SIA collection.
+ * The URI to report a fetch's outcome against: the notification URI
+ * for RRDP, since that's what failed or succeeded, the rsync URI
+ * otherwise.
  */
-static void rsync_tree(rcynic_ctx_t *rc,
-		       const uri_t *uri,
-		       STACK_OF(walk_ctx_t) *wsk,
-		       void (*handler)(rcynic_ctx_t *, const rsync_ctx_t *,
-				       const rsync_status_t, const uri_t *, void *))
+static const uri_t *rsync_ctx_source(const rsync_ctx_t *ctx)
 {
-  assert(endswith(uri->s, "/"));
-  rsync_init(rc, uri, wsk, handler);
+  assert(ctx);
+  return rsync_ctx_is_rrdp(ctx) ? &ctx->notify : &ctx->uri;
 }
 
-
-
 /**
- * Clean up old stuff from previous rsync runs.  --delete doesn't help
- * if the URI changes and we never visit the old URI again.
+ * Record that we've already attempted to synchronize a particular
+ * rsync URI.  Failed rsync fetches are recorded against the whole
+ * host, since there's no point in trying it again this run.  RRDP
+ * fetches are recorded under the notification URI, since that's what
+ * the summary should show.  A successful one covers its SIA in the
+ * trie, just as rsync would; a failed one goes on a list of its own
+ * instead, because the rsync fallback for the same SIA still has to
+ * run, and all we want to remember is not to try that notification
+ * URI again.
  */
-static int prune_unauthenticated(const rcynic_ctx_t *rc,
-				 const path_t *name,
-				 const size_t baselen)
+static void rsync_history_add(const rcynic_ctx_t *rc,
+			      const rsync_ctx_t *ctx,
+			      const rsync_status_t status)
 {
-  path_t path;
-  struct dirent *d;
-  DIR *dir;
-  const char *slash;
+  const int rrdp = rsync_ctx_is_rrdp(ctx);
+  int final_slash = 0;
+  rsync_trie_node_t *node;
+  rsync_history_t *h;
+  char buf[URI_MAX];
+  uri_t uri, notify;
+  size_t n;
+  char *s;
 
-  assert(rc && name && baselen > 0 && strlen(name->s) >= baselen);
+  assert(rc && ctx && rc->rsync_history && rc->rrdp_failures);
 
-  if (!is_directory(name)) {
-    logmsg(rc, log_usage_err, "prune: %s is not a directory", name->s);
-    return 0;
-  }
+  assert(strlen(ctx->uri.s) < sizeof(buf));
+  strcpy(buf, ctx->uri.s);
 
-  if ((dir = opendir(name->s)) == NULL) {
-    logmsg(rc, log_sys_err, "prune: opendir() failed on %s: %s", name->s, strerror(errno));
-    return 0;
+  while ((s = strrchr(buf, '/')) != NULL && s[1] == '\0') {
+    final_slash = 1;
+    *s = '\0';
   }
 
-  slash = endswith(name->s, "/") ? "" : "/";
+  if (status != rsync_status_done && !rrdp) {
 
-  while ((d = readdir(dir)) != NULL) {
-    if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
-      continue;
+    n = SIZEOF_RSYNC + strcspn(buf + SIZEOF_RSYNC, "/");
+    assert(n < sizeof(buf));
+    buf[n] = '\0';
+    final_slash = 1;
 
-    if (snprintf(path.s, sizeof(path.s), "%s%s%s", name->s, slash, d->d_name) >= sizeof(path.s)) {
-      logmsg(rc, log_debug, "prune: %s%s%s too long", name->s, slash, d->d_name);
-      goto done;
+    uri.s = buf;
+    if ((h = rsync_history_uri(rc, &uri)) != NULL) {
+      assert(h->status != rsync_status_done);
+      return;
     }
+  }
 
-    if (validation_status_find_filename(rc, path.s + baselen)) {
-      logmsg(rc, log_debug, "prune: cache hit %s", path.s);
-      continue;
-    }
+  if (!uri_intern(rc, &uri, buf) ||
+      (rrdp && !uri_intern(rc, &notify, ctx->notify.s)))
+    return;
 
-    if (unlink(path.s) == 0) {
-      logmsg(rc, log_debug, "prune: removed %s", path.s);
-      continue;
-    }
+  if ((h = rsync_history_t_new()) != NULL) {
+    h->uri = rrdp ? notify : uri;
+    h->status = status;
+    h->started = ctx->started;
+    h->finished = time(0);
+    h->final_slash = final_slash && !rrdp;
+  }
 
-    if (prune_unauthenticated(rc, &path, baselen))
-      continue;
+  if (h == NULL || !sk_rsync_history_t_push(rc->rsync_history, h)) {
+    rsync_history_t_free(h);
+    logmsg(rc, log_sys_err,
+	   "Couldn't add %s to rsync_history, blundering onwards", uri.s);
+    return;
+  }
 
-    logmsg(rc, log_sys_err, "prune: removing %s failed: %s", path.s, strerror(errno));
-    goto done;
+  if (rrdp && status != rsync_status_done) {
+    if (!sk_rsync_history_t_push(rc->rrdp_failures, h))
+      logmsg(rc, log_sys_err,
+	     "Couldn't add %s to rrdp_failures, blundering onwards", notify.s);
+    return;
   }
 
-  if (rmdir(name->s) == 0)
-    logmsg(rc, log_debug, "prune: removed %s", name->s);
-  else if (errno != ENOTEMPTY)
-    logmsg(rc, log_sys_err, "prune: couldn't remove %s: %s", name->s, strerror(errno));
+  if ((node = rsync_trie_find(rc, &uri, 1)) == NULL) {
+    logmsg(rc, log_sys_err,
+	   "Couldn't add %s to rsync URI trie, blundering onwards", uri.s);
+    return;
+  }
 
- done:
-  closedir(dir);
-  return !d;
+  if (node->history == NULL)
+    node->history = h;
 }
 
-
-
 /**
- * Read a DER object using a BIO pipeline that hashes the file content
- * as we read it.  Returns the internal form of the parsed DER object,
- * sets the hash buffer (if specified) as a side effect.  The default
- * hash algorithm is SHA-256.
+ * Check whether the history gives us a reason not to fetch, and if
+ * so, what to tell the caller.  For rsync, any hit will do: somebody
+ * already fetched (or gave up on) something covering this URI, so
+ * what's on disk is all we're going to get and the caller should
+ * carry on as if the fetch worked.  For RRDP, only a successful fetch
+ * covering the SIA counts that way, since an rsync failure recorded
+ * against the whole host says nothing about its RRDP server; and if
+ * the notification URI already failed, the caller needs to hear that,
+ * so that it can fall back to rsync.
  */
-static void *read_file_with_hash(const path_t *filename,
-				 const ASN1_ITEM *it,
-				 const EVP_MD *md,
-				 hashbuf_t *hash)
+static int rsync_history_check(const rcynic_ctx_t *rc,
+			       const uri_t *uri,
+			       const uri_t *notify,
+			       rsync_status_t *status)
 {
-  void *result = NULL;
-  BIO *b;
+  const rsync_history_t *h;
+  rsync_history_t key;
+  int i;
 
-  if ((b = BIO_new_file(filename->s, "rb")) == NULL)
-    goto error;
+  assert(rc && uri && status);
 
-  if (hash != NULL) {
-    BIO *b2 = BIO_new(BIO_f_md());
-    if (b2 == NULL)
-      goto error;
-    if (md == NULL)
-      md = EVP_sha256();
-    if (!BIO_set_md(b2, md)) {
-      BIO_free(b2);
-      goto error;
-    }
-    BIO_push(b2, b);
-    b = b2;
+  if ((h = rsync_history_uri(rc, uri)) != NULL &&
+      (notify == NULL || h->status == rsync_status_done)) {
+    *status = rsync_status_done;
+    return 1;
   }
 
-  if ((result = ASN1_item_d2i_bio(it, b, NULL)) == NULL)
-    goto error;
+  if (notify == NULL)
+    return 0;
 
-  if (hash != NULL) {
-    memset(hash, 0, sizeof(*hash));
-    BIO_gets(b, (char *) hash, sizeof(hash->h));
-  }
+  key.uri = *notify;
+  if ((i = sk_rsync_history_t_find(rc->rrdp_failures, &key)) < 0)
+    return 0;
 
- error:
-  BIO_free_all(b);
-  return result;
+  *status = sk_rsync_history_t_value(rc->rrdp_failures, i)->status;
+  return 1;
 }
 
 /**
- * Read and hash a certificate.
+ * Check whether rsync says nothing in a directory changed this run:
+ * an rsync fetch covering the directory finished cleanly, and nothing
+ * in its itemized output (or a partial transfer anywhere above) marked
+ * the directory as changed.  RRDP fetches don't tell us what they
+ * changed, so a directory whose covering fetch was RRDP never
+ * qualifies.
  */
-static X509 *read_cert(const path_t *filename, hashbuf_t *hash)
+static int rsync_unchanged(const rcynic_ctx_t *rc,
+			   const uri_t *uri)
 {
-  return read_file_with_hash(filename, ASN1_ITEM_rptr(X509), NULL, hash);
+  const rsync_history_t *h = NULL;
+  rsync_trie_node_t *node;
+  int changed = 0;
+  const char *s;
+  size_t len;
+
+  assert(rc && uri && rc->rsync_trie);
+
+  if (!is_rsync(uri->s))
+    return 0;
+
+  node = rc->rsync_trie->root;
+
+  for (s = rsync_trie_component(uri->s + SIZEOF_RSYNC, &len);
+       len > 0;
+       s = rsync_trie_component(s + len, &len)) {
+    if ((node = rsync_trie_child(rc->rsync_trie, node, s, len, 0)) == NULL)
+      break;
+    if (node->history != NULL)
+      h = node->history;
+    changed |= node->changed & RSYNC_CHANGED_TREE;
+  }
+
+  if (node != NULL)
+    changed |= node->changed;
+
+  return h != NULL && h->status == rsync_status_done && is_rsync(h->uri.s) && !changed;
 }
 
+
+
 /**
- * Read and hash a CRL.
+ * Compare two rsync_host_t objects.
  */
-static X509_CRL *read_crl(const path_t *filename, hashbuf_t *hash)
+static int rsync_host_cmp(const rsync_host_t * const *a, const rsync_host_t * const *b)
 {
-  return read_file_with_hash(filename, ASN1_ITEM_rptr(X509_CRL), NULL, hash);
+  return strcmp((*a)->name, (*b)->name);
 }
 
 /**
- * Read and hash a CMS message.
+ * Free an rsync_host_t object.
  */
-static CMS_ContentInfo *read_cms(const path_t *filename, hashbuf_t *hash)
+static void rsync_host_t_free(rsync_host_t *h)
 {
-  return read_file_with_hash(filename, ASN1_ITEM_rptr(CMS_ContentInfo), NULL, hash);
+  free(h);
 }
 
-
-
 /**
- * Extract CRLDP data from a certificate.  Stops looking after finding
- * the first rsync URI.
+ * Find the scheduling state for the host a URI points at, creating it
+ * if this is the first we've heard of the host.
  */
-static int extract_crldp_uri(rcynic_ctx_t *rc,
-			     const uri_t *uri,
-			     const object_generation_t generation,
-			     const STACK_OF(DIST_POINT) *crldp,
-			     uri_t *result)
+static rsync_host_t *rsync_host_find(rcynic_ctx_t *rc,
+				     const uri_t *uri)
 {
-  DIST_POINT *d;
+  rsync_host_t key, *h;
+  const char *s;
+  size_t len;
   int i;
 
-  assert(rc && uri && crldp && result);
+  assert(rc && rc->rsync_hosts && uri && strstr(uri->s, "://") != NULL);
 
-  if (sk_DIST_POINT_num(crldp) != 1)
-    goto bad;
+  s = strstr(uri->s, "://") + 3;
+  len = (s - uri->s) + strcspn(s, "/");
+  if (len >= sizeof(key.name))
+    len = sizeof(key.name) - 1;
+  memcpy(key.name, uri->s, len);
+  key.name[len] = '\0';
 
-  d = sk_DIST_POINT_value(crldp, 0);
+  if ((i = sk_rsync_host_t_find(rc->rsync_hosts, &key)) >= 0)
+    return sk_rsync_host_t_value(rc->rsync_hosts, i);
 
-  if (d->reasons || d->CRLissuer || !d->distpoint || d->distpoint->type != 0)
-    goto bad;
+  if ((h = malloc(sizeof(*h))) == NULL)
+    return NULL;
 
-  for (i = 0; i < sk_GENERAL_NAME_num(d->distpoint->name.fullname); i++) {
-    GENERAL_NAME *n = sk_GENERAL_NAME_value(d->distpoint->name.fullname, i);
-    if (n == NULL || n->type != GEN_URI)
-      goto bad;
-    if (!is_rsync((char *) n->d.uniformResourceIdentifier->data))
-      log_validation_status(rc, uri, non_rsync_uri_in_extension, generation);
-    else if (sizeof(result->s) <= n->d.uniformResourceIdentifier->length)
-      log_validation_status(rc, uri, uri_too_long, generation);
-    else if (result->s[0])
-      log_validation_status(rc, uri, multiple_rsync_uris_in_extension, generation);
-    else
-      strcpy(result->s, (char *) n->d.uniformResourceIdentifier->data);
-  }
+  memset(h, 0, sizeof(*h));
+  strcpy(h->name, key.name);
+  h->limit = rc->max_fetches_per_host > 0 ? rc->max_fetches_per_host : 1;
+  h->waiting_tail = &h->waiting;
 
-  return result->s[0];
+  if (!sk_rsync_host_t_push(rc->rsync_hosts, h)) {
+    rsync_host_t_free(h);
+    return NULL;
+  }
 
- bad:
-  log_validation_status(rc, uri, malformed_crldp_extension, generation);
-  return 0;
+  return h;
 }
 
 /**
- * Extract SIA or AIA data from a certificate.
+ * How much fetch time a host has had from us, counting each fetch
+ * still in progress as an average one.  The host with the least gets
+ * the next free slot, so a slow host can't crowd out fast ones just
+ * by having a lot of work queued.
  */
-static int extract_access_uri(rcynic_ctx_t *rc,
-			      const uri_t *uri,
-			      const object_generation_t generation,
-			      const AUTHORITY_INFO_ACCESS *xia,
-			      const int nid,
-			      uri_t *result,
-			      int *count,
-			      int (*relevant)(const char *))
+static time_t rsync_host_cost(const rsync_host_t *h)
 {
-  int i;
-
-  assert(rc && uri && xia && result && count);
-
-  for (i = 0; i < sk_ACCESS_DESCRIPTION_num(xia); i++) {
-    ACCESS_DESCRIPTION *a = sk_ACCESS_DESCRIPTION_value(xia, i);
-    if (a == NULL || a->location->type != GEN_URI)
-      return 0;
-    if (OBJ_obj2nid(a->method) != nid)
-      continue;
-    ++*count;
-    if (relevant && !relevant((char *) a->location->d.uniformResourceIdentifier->data))
-      continue;
-    if (sizeof(result->s) <= a->location->d.uniformResourceIdentifier->length)
-      log_validation_status(rc, uri, uri_too_long, generation);
-    else if (result->s[0])
-      log_validation_status(rc, uri, multiple_rsync_uris_in_extension, generation);
-    else
-      strcpy(result->s, (char *) a->location->d.uniformResourceIdentifier->data);
-  }
-  return 1;
+  assert(h);
+  return h->busy + h->running * (h->fetches ? h->busy / h->fetches : 0);
 }
 
-
-
 /**
- * Check to see whether an AKI extension is present, is of the right
- * form, and matches the issuer.
+ * Test whether a failed fetch says something about the host, rather
+ * than about the one thing we asked it for: the daemon refused us for
+ * being over its connection limit, the fetch timed out, or rsync
+ * reported a socket, protocol stream, or daemon connection error
+ * (exit statuses 10, 12, 30 and 35).  Anything else, such as a
+ * missing directory, is no reason to slow down everything else we
+ * want from that host.
  */
-static int check_aki(rcynic_ctx_t *rc,
-		     const uri_t *uri,
-		     const X509 *issuer,
-		     const AUTHORITY_KEYID *aki,
-		     const object_generation_t generation)
+static int rsync_host_problem(const rsync_ctx_t *ctx,
+			      const rsync_status_t status,
+			      const int exit_status)
 {
-  assert(rc && uri && issuer && issuer->skid);
+  assert(ctx);
 
-  if (aki == NULL) {
-    log_validation_status(rc, uri, aki_extension_missing, generation);
-    return 0;
-  }
+  if (status == rsync_status_timed_out ||
+      ctx->problem == rsync_problem_refused ||
+      ctx->problem == rsync_problem_timed_out)
+    return 1;
 
-  if (!aki->keyid || aki->serial || aki->issuer) {
-    log_validation_status(rc, uri, aki_extension_wrong_format, generation);
+  if (rsync_ctx_is_rrdp(ctx))
     return 0;
-  }
 
-  if (ASN1_OCTET_STRING_cmp(aki->keyid, issuer->skid)) {
-    log_validation_status(rc, uri, aki_extension_issuer_mismatch, generation);
+  switch (exit_status) {
+  case 10:			/* "Error in socket I/O" */
+  case 12:			/* "Error in rsync protocol data stream" */
+  case 30:			/* "Timeout in data send/receive" */
+  case 35:			/* "Timeout waiting for daemon connection" */
+    return 1;
+  default:
     return 0;
   }
-
-  return 1;
 }
 
-
-
 /**
- * Check whether a Distinguished Name conforms to the rescert profile.
- * The profile is very restrictive: it only allows one mandatory
- * CommonName field and one optional SerialNumber field, both of which
- * must be of type PrintableString.
+ * Learn from how a fetch went.  Success clears the host's backoff and
+ * raises its limit by one, up to max-fetches-per-host.  A refusal
+ * cuts the limit to below the number of fetches the host just
+ * refused to put up with; a timeout or connection failure halves it.
+ * Either way, the host backs off exponentially.  Other failures only
+ * count towards the host's fetch time.
  */
-static int check_allowed_dn(X509_NAME *dn)
+static void rsync_host_update(const rcynic_ctx_t *rc,
+			      const rsync_ctx_t *ctx,
+			      const rsync_status_t status,
+			      const int exit_status,
+			      const time_t now)
 {
-  X509_NAME_ENTRY *ne;
-  ASN1_STRING *s;
-  int loc;
+  rsync_host_t *h;
+  time_t backoff;
+  unsigned i;
 
-  if (dn == NULL)
-    return 0;
+  assert(rc && ctx && ctx->host);
 
-  switch (X509_NAME_entry_count(dn)) {
+  h = ctx->host;
 
-  case 2:
-    if ((loc = X509_NAME_get_index_by_NID(dn, NID_serialNumber, -1)) < 0 ||
-	(ne = X509_NAME_get_entry(dn, loc)) == NULL ||
-	(s = X509_NAME_ENTRY_get_data(ne)) == NULL ||
-	ASN1_STRING_type(s) != V_ASN1_PRINTABLESTRING)
-      return 0;
+  if (ctx->launched > 0 && now >= ctx->launched) {
+    h->busy += now - ctx->launched;
+    h->fetches++;
+  }
 
-    /* Fall through */
+  if (status == rsync_status_done) {
+    h->failures = 0;
+    if (h->limit < rc->max_fetches_per_host)
+      h->limit++;
+    return;
+  }
 
-  case 1:
-    if ((loc = X509_NAME_get_index_by_NID(dn, NID_commonName, -1)) < 0 ||
-	(ne = X509_NAME_get_entry(dn, loc)) == NULL ||
-	(s = X509_NAME_ENTRY_get_data(ne)) == NULL ||
-	ASN1_STRING_type(s) != V_ASN1_PRINTABLESTRING)
-      return 0;
+  if (!rsync_host_problem(ctx, status, exit_status))
+    return;
 
-    return 1;
+  if (ctx->problem == rsync_problem_refused && h->running - 1 < h->limit)
+    h->limit = h->running - 1;
+  else if (ctx->problem != rsync_problem_refused)
+    h->limit /= 2;
+  if (h->limit < 1)
+    h->limit = 1;
+
+  backoff = rc->retry_wait_min;
+  for (i = 0; i < h->failures && backoff < rc->retry_wait_min * RSYNC_HOST_BACKOFF_MAX; i++)
+    backoff *= 2;
+  h->failures++;
+  h->backoff_until = now + backoff;
+
+  logmsg(rc, log_verbose, "Host %s now limited to %d parallel fetches, backing off for %lu seconds",
+	 h->name, h->limit, (unsigned long) backoff);
+}
 
+/**
+ * Test whether an rsync state counts against max-parallel-fetches,
+ * that is, whether there's a subprocess attached to it.
+ */
+static int rsync_state_is_running(const rsync_state_t state)
+{
+  switch (state) {
+  case rsync_state_running:
+  case rsync_state_closed:
+  case rsync_state_terminating:
+    return 1;
   default:
     return 0;
   }
 }
 
 /**
- * Check whether an ASN.1 TIME value conforms to RFC 5280 4.1.2.5.
+ * Test whether an rsync state is one that other fetches of
+ * overlapping URIs have to wait for.
  */
-static int check_allowed_time_encoding(ASN1_TIME *t)
+static int rsync_state_is_active(const rsync_state_t state)
 {
-  switch (t->type) {
-
-  case V_ASN1_UTCTIME:
-    return t->length == sizeof("yymmddHHMMSSZ") - 1;
-
-  case  V_ASN1_GENERALIZEDTIME:
-    return (t->length == sizeof("yyyymmddHHMMSSZ") - 1 &&
-	    strcmp("205", (char *) t->data) <= 0);
-
-  }
-  return 0;
+  return state == rsync_state_initial || state == rsync_state_running;
 }
 
 /**
- * Compare ASN1_TIME values.
+ * Add (delta = 1) or remove (delta = -1) an rsync context's
+ * contribution to the count of running contexts and to the activity
+ * counts in the URI trie, according to its current state.
  */
-static int asn1_time_cmp(ASN1_TIME *t1, ASN1_TIME *t2)
+static void rsync_ctx_account(rcynic_ctx_t *rc,
+			      const rsync_ctx_t *ctx,
+			      const int delta)
 {
-  ASN1_GENERALIZEDTIME *g1 = ASN1_TIME_to_generalizedtime(t1, NULL);
-  ASN1_GENERALIZEDTIME *g2 = ASN1_TIME_to_generalizedtime(t2, NULL);
+  rsync_trie_node_t *n;
 
-  int cmp = ASN1_STRING_cmp(g1, g2);
+  assert(rc && ctx && ctx->node && ctx->host);
 
-  ASN1_GENERALIZEDTIME_free(g1);
-  ASN1_GENERALIZEDTIME_free(g2);
+  rc->rsync_running += delta * rsync_state_is_running(ctx->state);
+  assert(rc->rsync_running >= 0);
 
-  return cmp;
-}
+  ctx->host->running += delta * rsync_state_is_running(ctx->state);
+  assert(ctx->host->running >= 0);
 
-
+  if (!rsync_state_is_active(ctx->state))
+    return;
+
+  ctx->node->active += delta;
+  for (n = ctx->node; n != NULL; n = n->parent)
+    n->active_below += delta;
+}
 
 /**
- * Attempt to read and check one CRL from disk.
+ * Test whether an rsync state is one in which the context is waiting
+ * for a fetch slot, and so belongs on its host's queue.
  */
-
-static X509_CRL *check_crl_1(rcynic_ctx_t *rc,
-			     const uri_t *uri,
-			     path_t *path,
-			     const path_t *prefix,
-			     X509 *issuer,
-			     const object_generation_t generation)
+static int rsync_state_is_waiting(const rsync_state_t state)
 {
-  STACK_OF(X509_REVOKED) *revoked;
-  X509_CRL *crl = NULL;
-  EVP_PKEY *pkey;
-  int i, ret;
+  return (state == rsync_state_initial ||
+	  state == rsync_state_conflict_wait ||
+	  state == rsync_state_retry_wait);
+}
 
-  assert(uri && path && issuer);
+/**
+ * Add an rsync context to the end of its host's queue.
+ */
+static void rsync_host_enqueue(rsync_ctx_t *ctx)
+{
+  assert(ctx && ctx->host && ctx->host_prev == NULL);
+  ctx->host_next = NULL;
+  ctx->host_prev = ctx->host->waiting_tail;
+  *ctx->host->waiting_tail = ctx;
+  ctx->host->waiting_tail = &ctx->host_next;
+}
 
-  if (!uri_to_filename(rc, uri, path, prefix) ||
-      (crl = read_crl(path, NULL)) == NULL)
-    goto punt;
+/**
+ * Remove an rsync context from its host's queue, if it's there.
+ */
+static void rsync_host_dequeue(rsync_ctx_t *ctx)
+{
+  assert(ctx && ctx->host);
 
-  if (X509_CRL_get_version(crl) != 1) {
-    log_validation_status(rc, uri, wrong_object_version, generation);
-    goto punt;
-  }
+  if (ctx->host_prev == NULL)
+    return;
 
-  if (!crl->crl || !crl->crl->sig_alg || !crl->crl->sig_alg->algorithm ||
-      OBJ_obj2nid(crl->crl->sig_alg->algorithm) != NID_sha256WithRSAEncryption) {
-    log_validation_status(rc, uri, nonconformant_signature_algorithm, generation);
-    goto punt;
-  }
+  if (ctx->host_next != NULL)
+    ctx->host_next->host_prev = ctx->host_prev;
+  else
+    ctx->host->waiting_tail = ctx->host_prev;
+  *ctx->host_prev = ctx->host_next;
+  ctx->host_next = NULL;
+  ctx->host_prev = NULL;
+}
 
-  if (!check_allowed_time_encoding(X509_CRL_get_lastUpdate(crl)) ||
-      !check_allowed_time_encoding(X509_CRL_get_nextUpdate(crl))) {
-    log_validation_status(rc, uri, nonconformant_asn1_time_value, generation);
-    goto punt;
-  }
+/**
+ * Change the state of an rsync context.  All state changes go through
+ * here so that we can keep count of running and active contexts, and
+ * keep the per-host queues up to date, instead of scanning the queue
+ * every time we need to know.
+ */
+static void rsync_ctx_set_state(rcynic_ctx_t *rc,
+				rsync_ctx_t *ctx,
+				const rsync_state_t state)
+{
+  assert(rc && ctx);
+  rsync_ctx_account(rc, ctx, -1);
+  if (!rsync_state_is_waiting(state))
+    rsync_host_dequeue(ctx);
+  else if (!rsync_state_is_waiting(ctx->state))
+    rsync_host_enqueue(ctx);
+  ctx->state = state;
+  rsync_ctx_account(rc, ctx, 1);
+}
 
-  if (X509_cmp_current_time(X509_CRL_get_lastUpdate(crl)) > 0) {
-    log_validation_status(rc, uri, crl_not_yet_valid, generation);
-    goto punt;
-  }
+/**
+ * Return count of how many rsync contexts are in running.
+ */
+static int rsync_count_running(const rcynic_ctx_t *rc)
+{
+  assert(rc);
+  return rc->rsync_running;
+}
 
-  if (X509_cmp_current_time(X509_CRL_get_nextUpdate(crl)) < 0) {
-    log_validation_status(rc, uri, stale_crl_or_manifest, generation);
-    if (!rc->allow_stale_crl)
-      goto punt;
-  }
+/**
+ * Remove an rsync context from the timer wheel, if it's there.
+ */
+static void rsync_timer_cancel(rcynic_ctx_t *rc,
+			       rsync_ctx_t *ctx)
+{
+  assert(rc && ctx);
 
-  if (!check_aki(rc, uri, issuer, crl->akid, generation))
-    goto punt;
+  if (ctx->timer_prev == NULL)
+    return;
 
-  if (crl->crl_number == NULL) {
-    log_validation_status(rc, uri, crl_number_extension_missing, generation);
-    goto punt;
-  }
+  if (ctx->timer_next != NULL)
+    ctx->timer_next->timer_prev = ctx->timer_prev;
+  *ctx->timer_prev = ctx->timer_next;
+  ctx->timer_next = NULL;
+  ctx->timer_prev = NULL;
+  rc->rsync_timer_count--;
+}
 
-  if (ASN1_INTEGER_cmp(crl->crl_number, asn1_zero) < 0) {
-    log_validation_status(rc, uri, crl_number_is_negative, generation);
-    goto punt;
-  }
+/**
+ * Set an rsync context's deadline and put it on the timer wheel.
+ */
+static void rsync_timer_set(rcynic_ctx_t *rc,
+			    rsync_ctx_t *ctx,
+			    const time_t when)
+{
+  rsync_ctx_t **slot = &rc->rsync_timers[when & (RSYNC_TIMER_SLOTS - 1)];
 
-  if (ASN1_INTEGER_cmp(crl->crl_number, asn1_twenty_octets) > 0) {
-    log_validation_status(rc, uri, crl_number_out_of_range, generation);
-    goto punt;
-  }
+  rsync_timer_cancel(rc, ctx);
 
-  if (X509_CRL_get_ext_count(crl) != 2) {
-    log_validation_status(rc, uri, disallowed_x509v3_extension, generation);
-    goto punt;
-  }
+  ctx->deadline = when;
+  ctx->timer_prev = slot;
+  if ((ctx->timer_next = *slot) != NULL)
+    ctx->timer_next->timer_prev = &ctx->timer_next;
+  *slot = ctx;
+  rc->rsync_timer_count++;
+}
 
-  if (X509_NAME_cmp(X509_CRL_get_issuer(crl), X509_get_subject_name(issuer))) {
-    log_validation_status(rc, uri, crl_issuer_name_mismatch, generation);
-    goto punt;
-  }
+/**
+ * Find the next deadline on the timer wheel, looking no further than
+ * limit seconds past now.  Returns zero if there's nothing due that
+ * soon.  This assumes the wheel has been run up to now, so we only
+ * look at one trip around it; if the limit is further away than that,
+ * we return the end of the trip, and the caller will look again then.
+ */
+static time_t rsync_timer_next(const rcynic_ctx_t *rc,
+			       const time_t now,
+			       const time_t limit)
+{
+  time_t t, first = rc->rsync_timer_clock + 1, last = now + limit;
+  const rsync_ctx_t *ctx;
 
-  if (!check_allowed_dn(X509_CRL_get_issuer(crl))) {
-    log_validation_status(rc, uri, nonconformant_issuer_name, generation);
-    if (!rc->allow_nonconformant_name)
-      goto punt;
-  }
+  if (rc->rsync_timer_count == 0)
+    return 0;
 
-  if ((revoked = X509_CRL_get_REVOKED(crl)) != NULL) {
-    for (i = sk_X509_REVOKED_num(revoked) - 1; i >= 0; --i) {
-      if (X509_REVOKED_get_ext_count(sk_X509_REVOKED_value(revoked, i)) > 0) {
-	log_validation_status(rc, uri, disallowed_x509v3_extension, generation);
-	goto punt;
-      }
-    }
-  }
+  if (last >= first + RSYNC_TIMER_SLOTS)
+    last = first + RSYNC_TIMER_SLOTS - 1;
 
-  if ((pkey = X509_get_pubkey(issuer)) == NULL)
-    goto punt;
-  ret = X509_CRL_verify(crl, pkey);
-  EVP_PKEY_free(pkey);
+  for (t = first; t <= last; t++)
+    for (ctx = rc->rsync_timers[t & (RSYNC_TIMER_SLOTS - 1)]; ctx != NULL; ctx = ctx->timer_next)
+      if (ctx->deadline <= t)
+	return t;
 
-  if (ret > 0)
-    return crl;
+  return last < now + limit ? last : 0;
+}
 
- punt:
-  X509_CRL_free(crl);
-  return NULL;
+/**
+ * Remove an rsync context from the queue, the timer wheel, and the
+ * running and active counts, and free it.
+ */
+static void rsync_ctx_discard(rcynic_ctx_t *rc,
+			      rsync_ctx_t *ctx)
+{
+  assert(rc && ctx);
+  (void) sk_rsync_ctx_t_delete_ptr(rc->rsync_queue, ctx);
+  rsync_timer_cancel(rc, ctx);
+  rsync_host_dequeue(ctx);
+  rsync_ctx_account(rc, ctx, -1);
+  free(ctx);
 }
 
 /**
- * Check whether we already have a particular CRL, attempt to fetch it
- * and check issuer's signature if we don't.
- *
- * General plan here is to do basic checks on both current and backup
- * generation CRLs, then, if both generations pass all of our other
- * tests, pick the generation with the highest CRL number, to protect
- * against replay attacks.
+ * Test whether an rsync context conflicts with anything that's
+ * currently runable, that is, whether attempting to rsync both of
+ * them at the same time in parallel might cause unpredictable
+ * behavior.  Two URIs conflict if one is a path prefix of the other,
+ * so we look for active contexts at or below this one's trie node,
+ * and at the nodes above it.  The context itself must not be counted
+ * as active when we ask.
  */
-static X509_CRL *check_crl(rcynic_ctx_t *rc,
-			   const uri_t *uri,
-			   X509 *issuer)
+static int rsync_conflicts(const rcynic_ctx_t *rc,
+			   const rsync_ctx_t *ctx)
 {
-  X509_CRL *old_crl, *new_crl, *result = NULL;
-  path_t old_path, new_path;
+  const rsync_trie_node_t *n;
 
-  if (uri_to_filename(rc, uri, &new_path, &rc->new_authenticated) &&
-      (new_crl = read_crl(&new_path, NULL)) != NULL)
-    return new_crl;
+  assert(rc && ctx && ctx->node);
 
-  logmsg(rc, log_telemetry, "Checking CRL %s", uri->s);
+  if (ctx->node->active_below > 0)
+    return 1;
 
-  new_crl = check_crl_1(rc, uri, &new_path, &rc->unauthenticated,
-			issuer, object_generation_current);
+  for (n = ctx->node->parent; n != NULL; n = n->parent)
+    if (n->active > 0)
+      return 1;
 
-  old_crl = check_crl_1(rc, uri, &old_path, &rc->old_authenticated,
-			issuer, object_generation_backup);
+  return 0;
+}
 
-  if (!new_crl)
-    result = old_crl;
+/**
+ * Test whether a rsync context is runable at this time.
+ */
+static int rsync_runable(const rcynic_ctx_t *rc,
+			 const rsync_ctx_t *ctx)
+{
+  assert(rc && ctx);
 
-  else if (!old_crl)
-    result = new_crl;
+  switch (ctx->state) {
 
-  else {
-    ASN1_GENERALIZEDTIME *g_old = ASN1_TIME_to_generalizedtime(X509_CRL_get_lastUpdate(old_crl), NULL);
-    ASN1_GENERALIZEDTIME *g_new = ASN1_TIME_to_generalizedtime(X509_CRL_get_lastUpdate(new_crl), NULL);
-    int num_cmp = ASN1_INTEGER_cmp(old_crl->crl_number, new_crl->crl_number);
-    int date_cmp = (!g_old || !g_new) ? 0 : ASN1_STRING_cmp(g_old, g_new);
+  case rsync_state_initial:
+  case rsync_state_running:
+    return 1;
 
-    if (!g_old)
-      log_validation_status(rc, uri, bad_thisupdate, object_generation_backup);
-    if (!g_new)
-      log_validation_status(rc, uri, bad_thisupdate, object_generation_current);
-    if (num_cmp > 0)
-      log_validation_status(rc, uri, backup_number_higher_than_current, object_generation_current);
-    if (g_old && g_new && date_cmp > 0)
-      log_validation_status(rc, uri, backup_thisupdate_newer_than_current, object_generation_current);
+  case rsync_state_retry_wait:
+    return ctx->deadline <= time(0);
 
-    if (num_cmp > 0 && (!g_old || !g_new || date_cmp > 0))
-      result = old_crl;
-    else
-      result = new_crl;
+  case rsync_state_closed:
+  case rsync_state_terminating:
+    return 0;
 
-    ASN1_GENERALIZEDTIME_free(g_old);
-    ASN1_GENERALIZEDTIME_free(g_new);
+  case rsync_state_conflict_wait:
+    return !rsync_conflicts(rc, ctx);
+
+  default:
+    break;
   }
 
-  if (result && result == new_crl)
-    install_object(rc, uri, &new_path, object_generation_current);
-  else if (!access(new_path.s, F_OK))
-    log_validation_status(rc, uri, object_rejected, object_generation_current);
+  return 0;
+}
 
-  if (result && result == old_crl)
-    install_object(rc, uri, &old_path, object_generation_backup);
-  else if (!result && !access(old_path.s, F_OK))
-    log_validation_status(rc, uri, object_rejected, object_generation_backup);
+/**
+ * Return count of runable rsync contexts.
+ */
+static int rsync_count_runable(const rcynic_ctx_t *rc)
+{
+  const rsync_ctx_t *ctx;
+  int i, n = 0;
 
-  if (result != new_crl)
-    X509_CRL_free(new_crl);
+  assert(rc && rc->rsync_queue);
 
-  if (result != old_crl)
-    X509_CRL_free(old_crl);
+  for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i)
+    if (rsync_runable(rc, ctx))
+      n++;
 
-  return result;
+  return n;
 }
 
-
 /**
- * Check digest of a CRL we've already accepted.
+ * Pick the next rsync context to start: of the hosts that have work
+ * waiting and are neither at their limit nor backing off, the one
+ * that's had the least fetch time so far, and of that host's waiting
+ * contexts, the oldest runable one.  A host held up only by its
+ * backoff gets its oldest context put on the timer wheel, so that we
+ * wake up when the backoff is over.  This looks at every host, but
+ * only at the queues of hosts we might actually pick.
  */
-static int check_crl_digest(const rcynic_ctx_t *rc,
-			    const uri_t *uri,
-			    const unsigned char *hash,
-			    const size_t hashlen)
+static rsync_ctx_t *rsync_next(rcynic_ctx_t *rc,
+			       const time_t now)
 {
-  X509_CRL *crl = NULL;
-  hashbuf_t hashbuf;
-  path_t path;
-  int result;
+  rsync_ctx_t *ctx, *best = NULL;
+  time_t cost, best_cost = 0;
+  rsync_host_t *h;
+  int i;
 
-  assert(rc && uri && hash);
+  assert(rc && rc->rsync_hosts);
 
-  if (!uri_to_filename(rc, uri, &path, &rc->new_authenticated) ||
-      (crl = read_crl(&path, &hashbuf)) == NULL)
-    return 0;
+  for (i = 0; (h = sk_rsync_host_t_value(rc->rsync_hosts, i)) != NULL; ++i) {
 
-  result = hashlen <= sizeof(hashbuf.h) && !memcmp(hashbuf.h, hash, hashlen);
+    if (h->waiting == NULL)
+      continue;
 
-  X509_CRL_free(crl);
+    if (h->backoff_until > now) {
+      if (h->waiting->timer_prev == NULL)
+	rsync_timer_set(rc, h->waiting, h->backoff_until);
+      continue;
+    }
 
-  return result;
-}
+    if (h->running >= h->limit)
+      continue;
 
-
+    cost = rsync_host_cost(h);
+
+    if (best != NULL && (cost > best_cost ||
+			 (cost == best_cost && h->running >= best->host->running)))
+      continue;
+
+    for (ctx = h->waiting; ctx != NULL; ctx = ctx->host_next)
+      if (rsync_runable(rc, ctx))
+	break;
+
+    if (ctx != NULL) {
+      best = ctx;
+      best_cost = cost;
+    }
+  }
+
+  return best;
+}
 
 /**
- * Validation callback function for use with x509_verify_cert().
+ * Convert rsync_status_t to mib_counter_t.
+ *
+ * Maybe some day this will go away and we won't be carrying
+ * essentially the same information in two different databases, but
+ * for now I'll settle for cleaning up the duplicate code logic.
  */
-static int check_x509_cb(int ok, X509_STORE_CTX *ctx)
+static mib_counter_t rsync_status_to_mib_counter(const rsync_ctx_t *ctx,
+						 rsync_status_t status)
 {
-  rcynic_x509_store_ctx_t *rctx = (rcynic_x509_store_ctx_t *) ctx;
-  mib_counter_t code;
-
-  assert(rctx != NULL);
+  const int rrdp = rsync_ctx_is_rrdp(ctx);
 
-  switch (ctx->error) {
-  case X509_V_OK:
-    return ok;
-
-  case X509_V_ERR_SUBJECT_ISSUER_MISMATCH:
+  switch (status) {
+  case rsync_status_done:	return rrdp ? rrdp_transfer_succeeded : rsync_transfer_succeeded;
+  case rsync_status_timed_out:	return rrdp ? rrdp_transfer_timed_out : rsync_transfer_timed_out;
+  case rsync_status_failed:	return rrdp ? rrdp_transfer_failed    : rsync_transfer_failed;
+  case rsync_status_skipped:	return rsync_transfer_skipped;
+  default:
     /*
-     * Informational events, not really errors.  ctx->check_issued()
-     * is called in many places where failure to find an issuer is not
-     * a failure for the calling function.  Just leave these alone.
+     * Keep GCC from whining about untested cases.
      */
-    return ok;
+    assert(status == rsync_status_done ||
+	   status == rsync_status_timed_out ||
+	   status == rsync_status_failed ||
+	   status == rsync_status_skipped);
+    return rsync_transfer_failed;
+  }
+}
 
-  case X509_V_ERR_CRL_HAS_EXPIRED:
-    /*
-     * This isn't really an error, exactly.  CRLs don't really
-     * "expire".  What OpenSSL really means by this error is just
-     * "it's now later than the issuer said it intended to publish a
-     * new CRL".  Whether we treat this as an error or not is
-     * configurable, see the allow_stale_crl parameter.
-     *
-     * Deciding whether to allow stale CRLs is check_crl_1()'s job,
-     * not ours.  By the time this callback occurs, we've already
-     * accepted the CRL; this callback is just notifying us that the
-     * object being checked is tainted by a stale CRL.  So we mark the
-     * object as tainted and carry on.
-     */
-    log_validation_status(rctx->rc, &rctx->subject->uri, tainted_by_stale_crl, rctx->subject->generation);
-    ok = 1;
-    return ok;
+/**
+ * Call rsync context handler, if one is set.
+ */
+static void rsync_call_handler(rcynic_ctx_t *rc,
+			       rsync_ctx_t *ctx,
+			       const rsync_status_t status)
+{
+  if (!ctx)
+    return;
 
-  case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT:
-    /*
-     * This is another error that's only an error in the strange world
-     * of OpenSSL, but a more serious one.  By default, OpenSSL
-     * expects all trust anchors to be self-signed.  This is not a
-     * PKIX requirement, it's just an OpenSSL thing, but one violates
-     * it at one's peril, because the only way to convince OpenSSL to
-     * allow a non-self-signed trust anchor is to intercept this
-     * "error" in the verify callback handler.
-     *
-     * So this program supports non-self-signed trust anchors, but be
-     * warned that enabling this feature may cause this program's
-     * output not to work with other OpenSSL-based applications.
-     */
-    if (rctx->rc->allow_non_self_signed_trust_anchor)
-      ok = 1;
-    log_validation_status(rctx->rc, &rctx->subject->uri, trust_anchor_not_self_signed, rctx->subject->generation);
-    return ok;
+  switch (status) {
 
-  /*
-   * Select correct MIB counter for every known OpenSSL verify errors
-   * except the ones we handle explicitly above, then fall through to
-   * common handling for all of these.
-   */
-#define QV(x)							\
-  case x:							\
-    code = mib_openssl_##x;					\
+  case rsync_status_pending:
+  case rsync_status_done:
     break;
-    MIB_COUNTERS_FROM_OPENSSL;
-#undef	QV
 
-  default:
-    code = unknown_openssl_verify_error;
+  case rsync_status_failed:
+  case rsync_status_timed_out:
+  case rsync_status_skipped:
+    log_validation_status(rc, rsync_ctx_source(ctx), rsync_status_to_mib_counter(ctx, status),
+			  object_generation_null);
     break;
   }
 
-  log_validation_status(rctx->rc, &rctx->subject->uri, code, rctx->subject->generation);
-  return ok;
+  if (ctx->handler)
+    ctx->handler(rc, ctx, status, &ctx->uri, ctx->cookie);
 }
 
 /**
- * Check crypto aspects of a certificate, policy OID, RFC 3779 path
- * validation, and conformance to the RPKI certificate profile.
+ * Close one of an rsync context's descriptors.  Take it out of the
+ * epoll() set first: the set tracks the open file, not the descriptor,
+ * so if anybody else still has the file open the registration outlives
+ * close() and keeps reporting events for a context we've freed.
  */
-static int check_x509(rcynic_ctx_t *rc,
-		      STACK_OF(walk_ctx_t) *wsk,
-		      const uri_t *uri,
-		      X509 *x,
-		      certinfo_t *certinfo,
-		      const object_generation_t generation)
+static void rsync_close_fd(const rcynic_ctx_t *rc, int *fd)
 {
-  walk_ctx_t *w = walk_ctx_stack_head(wsk);
-  rcynic_x509_store_ctx_t rctx;
-  EVP_PKEY *issuer_pkey = NULL, *subject_pkey = NULL;
-  unsigned long flags = (X509_V_FLAG_POLICY_CHECK | X509_V_FLAG_EXPLICIT_POLICY | X509_V_FLAG_X509_STRICT);
-  AUTHORITY_INFO_ACCESS *sia = NULL, *aia = NULL;
-  STACK_OF(POLICYINFO) *policies = NULL;
-  ASN1_BIT_STRING *ski_pubkey = NULL;
-  STACK_OF(DIST_POINT) *crldp = NULL;
-  EXTENDED_KEY_USAGE *eku = NULL;
-  BASIC_CONSTRAINTS *bc = NULL;
-  hashbuf_t ski_hashbuf;
-  unsigned ski_hashlen, afi;
-  int i, ok, crit, loc, ex_count, routercert = 0, ret = 0;
+  assert(rc && fd);
 
-  assert(rc && wsk && w && uri && x && w->cert);
+  if (*fd < 0)
+    return;
 
-  /*
-   * Cleanup logic will explode if rctx.ctx hasn't been initialized,
-   * so we need to do this before running any test that can fail.
-   */
-  if (!X509_STORE_CTX_init(&rctx.ctx, rc->x509_store, x, NULL))
-    return 0;
+#ifdef USE_EPOLL
+  if (rc->rsync_epoll >= 0)
+    (void) epoll_ctl(rc->rsync_epoll, EPOLL_CTL_DEL, *fd, NULL);
+#endif
 
-  /*
-   * certinfo == NULL means x is a self-signed trust anchor.
-   */
-  if (certinfo == NULL)
-    certinfo = &w->certinfo;
+  (void) close(*fd);
+  *fd = -1;
+}
 
-  memset(certinfo, 0, sizeof(*certinfo));
+#ifdef USE_EPOLL
 
-  certinfo->uri = *uri;
-  certinfo->generation = generation;
+/**
+ * Set up the epoll() instance for rsync_mgr(), if this kernel can
+ * give us pidfds.  Returns -1 if it can't, in which case we fall back
+ * to select() and waitpid().
+ */
+static int rsync_epoll_open(const rcynic_ctx_t *rc)
+{
+  int fd;
 
-  if (ASN1_INTEGER_cmp(X509_get_serialNumber(x), asn1_zero) <= 0 ||
-      ASN1_INTEGER_cmp(X509_get_serialNumber(x), asn1_twenty_octets) > 0) {
-    log_validation_status(rc, uri, bad_certificate_serial_number, generation);
-    goto done;
+  if ((fd = syscall(SYS_pidfd_open, getpid(), 0)) < 0) {
+    logmsg(rc, log_verbose, "pidfd_open() failed (%s), using select() for rsync", strerror(errno));
+    return -1;
   }
+  (void) close(fd);
 
-  if (!check_allowed_time_encoding(X509_get_notBefore(x)) ||
-      !check_allowed_time_encoding(X509_get_notAfter(x))) {
-    log_validation_status(rc, uri, nonconformant_asn1_time_value, generation);
-    goto done;
+  if ((fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    logmsg(rc, log_sys_err, "epoll_create1() failed (%s), using select() for rsync", strerror(errno));
+
+  return fd;
+}
+
+/**
+ * Register a newly started rsync subprocess with epoll().  We watch
+ * both its output pipe and a pidfd, and tag both with the context.
+ */
+static int rsync_epoll_add(const rcynic_ctx_t *rc,
+			   rsync_ctx_t *ctx)
+{
+  struct epoll_event ev;
+
+  assert(rc && ctx && rc->rsync_epoll >= 0 && ctx->fd >= 0 && ctx->pid > 0);
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = ctx;
+
+  if ((ctx->pidfd = syscall(SYS_pidfd_open, ctx->pid, 0)) < 0) {
+    logmsg(rc, log_sys_err, "pidfd_open(%u) failed: %s", (unsigned) ctx->pid, strerror(errno));
+    return 0;
   }
 
-  /*
-   * Apparently nothing ever looks at these fields, so there are no
-   * API functions for them.  We wouldn't bother either if they
-   * weren't forbidden by the RPKI certificate profile.
-   */
-  if (!x->cert_info || x->cert_info->issuerUID || x->cert_info->subjectUID) {
-    log_validation_status(rc, uri, nonconformant_certificate_uid, generation);
-    goto done;
+  if (epoll_ctl(rc->rsync_epoll, EPOLL_CTL_ADD, ctx->fd, &ev) < 0 ||
+      epoll_ctl(rc->rsync_epoll, EPOLL_CTL_ADD, ctx->pidfd, &ev) < 0) {
+    logmsg(rc, log_sys_err, "epoll_ctl() failed: %s", strerror(errno));
+    return 0;
   }
 
-  /*
-   * Keep track of allowed extensions we've seen.  Once we've
-   * processed all the ones we expect, anything left is an error.
-   */
-  ex_count = X509_get_ext_count(x);
+  return 1;
+}
 
-  /*
-   * We don't use X509_check_ca() to set certinfo->ca anymore, because
-   * it's not paranoid enough to enforce the RPKI certificate profile,
-   * but we still call it because we need it (or something) to invoke
-   * x509v3_cache_extensions() for us.
-   */
-  (void) X509_check_ca(x);
+#endif /* USE_EPOLL */
 
-  if ((bc = X509_get_ext_d2i(x, NID_basic_constraints, &crit, NULL)) != NULL) {
-    ex_count--;
-    if (!crit || bc->ca <= 0 || bc->pathlen != NULL) {
-      log_validation_status(rc, uri, malformed_basic_constraints, generation);
-      goto done;
-    }
-  }
+static void rrdp_child(const rcynic_ctx_t *, const rsync_ctx_t *, int *);
 
-  certinfo->ca = bc != NULL;
+/**
+ * Build the argument vector for an rsync subprocess.  path is where
+ * the target filename goes, since argv points into it.
+ */
+static int rsync_argv(const rcynic_ctx_t *rc,
+		      const rsync_ctx_t *ctx,
+		      const char **argv,
+		      const int argvmax,
+		      path_t *path)
+{
+  static const char * const rsync_cmd[] = {
+    "rsync", "--update", "--times", "--copy-links", "--itemize-changes"
+  };
+  static const char * const rsync_tree_args[] = {
+    "--recursive", "--delete"
+  };
 
-  if (certinfo == &w->certinfo) {
-    certinfo->ta = 1;
-    if (!certinfo->ca) {
-      log_validation_status(rc, uri, malformed_trust_anchor, generation);
-      goto done;
-    }
-  }
+  int i, argc = 0;
 
-  if ((aia = X509_get_ext_d2i(x, NID_info_access, NULL, NULL)) != NULL) {
-    int n_caIssuers = 0;
-    ex_count--;
-    if (!extract_access_uri(rc, uri, generation, aia, NID_ad_ca_issuers,
-			    &certinfo->aia, &n_caIssuers, NULL) ||
-	!certinfo->aia.s[0] ||
-	sk_ACCESS_DESCRIPTION_num(aia) != n_caIssuers) {
-      log_validation_status(rc, uri, malformed_aia_extension, generation);
-      goto done;
-    }
-  }
+  assert(rc && ctx && argv && path);
 
-  if (certinfo->ta && aia) {
-    log_validation_status(rc, uri, aia_extension_forbidden, generation);
-    goto done;
-  }
+  memset(argv, 0, argvmax * sizeof(*argv));
 
-  if (!certinfo->ta && !aia) {
-    log_validation_status(rc, uri, aia_extension_missing, generation);
-    goto done;
+  for (i = 0; i < sizeof(rsync_cmd)/sizeof(*rsync_cmd); i++) {
+    assert(argc < argvmax);
+    argv[argc++] = rsync_cmd[i];
   }
-
-  if ((eku = X509_get_ext_d2i(x, NID_ext_key_usage, &crit, NULL)) != NULL) {
-    ex_count--;
-    if (crit || certinfo->ca || !endswith(uri->s, ".cer") || sk_ASN1_OBJECT_num(eku) == 0) {
-      log_validation_status(rc, uri, inappropriate_eku_extension, generation);
-      goto done;
+  if (endswith(ctx->uri.s, "/")) {
+    for (i = 0; i < sizeof(rsync_tree_args)/sizeof(*rsync_tree_args); i++) {
+      assert(argc < argvmax);
+      argv[argc++] = rsync_tree_args[i];
     }
-    for (i = 0; i < sk_ASN1_OBJECT_num(eku); i++)
-      routercert |= OBJ_obj2nid(sk_ASN1_OBJECT_value(eku, i)) == NID_id_kp_bgpsec_router;
   }
 
-  if ((sia = X509_get_ext_d2i(x, NID_sinfo_access, NULL, NULL)) != NULL) {
-    int got_caDirectory,     got_rpkiManifest,     got_signedObject;
-    int   n_caDirectory = 0,   n_rpkiManifest = 0,   n_signedObject = 0, n_rpkiNotify = 0;
-    ex_count--;
-    ok = (extract_access_uri(rc, uri, generation, sia, NID_caRepository,
-			     &certinfo->sia, &n_caDirectory, is_rsync) &&
-	  extract_access_uri(rc, uri, generation, sia, NID_ad_rpkiManifest,
-			     &certinfo->manifest, &n_rpkiManifest, is_rsync) &&
-	  extract_access_uri(rc, uri, generation, sia, NID_ad_signedObject,
-			     &certinfo->signedobject, &n_signedObject, is_rsync) &&
-	  extract_access_uri(rc, uri, generation, sia, NID_ad_rpkiNotify,
-			     &certinfo->rrdpnotify, &n_rpkiNotify, is_http));
-    got_caDirectory  = certinfo->sia.s[0]          != '\0';
-    got_rpkiManifest = certinfo->manifest.s[0]     != '\0';
-    got_signedObject = certinfo->signedobject.s[0] != '\0';
-    ok &= (sk_ACCESS_DESCRIPTION_num(sia) ==
-	   n_caDirectory + n_rpkiManifest + n_signedObject + n_rpkiNotify);
-    if (certinfo->ca)
-      ok &=  got_caDirectory &&  got_rpkiManifest && !got_signedObject;
-    else if (rc->allow_ee_without_signedObject)
-      ok &= !got_caDirectory && !got_rpkiManifest;
-    else
-      ok &= !got_caDirectory && !got_rpkiManifest &&  got_signedObject;
-    if (!ok) {
-      log_validation_status(rc, uri, malformed_sia_extension, generation);
-      goto done;
-    }
-  } else if (certinfo->ca || !rc->allow_ee_without_signedObject) {
-    log_validation_status(rc, uri, sia_extension_missing, generation);
-    goto done;
-  } else if (!routercert) {
-    log_validation_status(rc, uri, sia_extension_missing_from_ee, generation);
+  if (rc->rsync_program)
+    argv[0] = rc->rsync_program;
+
+  if (!uri_to_filename(rc, &ctx->uri, path, &rc->unauthenticated)) {
+    logmsg(rc, log_data_err, "Couldn't extract filename from URI: %s", ctx->uri.s);
+    return 0;
   }
 
-  if (certinfo->signedobject.s[0] && strcmp(uri->s, certinfo->signedobject.s))
-    log_validation_status(rc, uri, bad_signed_object_uri, generation);
+  assert(argc < argvmax);
+  argv[argc++] = ctx->uri.s;
 
-  if ((crldp = X509_get_ext_d2i(x, NID_crl_distribution_points, NULL, NULL)) != NULL) {
-    ex_count--;
-    if (!extract_crldp_uri(rc, uri, generation, crldp, &certinfo->crldp))
-      goto done;
+  assert(argc < argvmax);
+  argv[argc++] = path->s;
+
+  if (!mkdir_maybe(rc, path)) {
+    logmsg(rc, log_sys_err, "Couldn't make target directory: %s", path->s);
+    return 0;
   }
 
-  rctx.rc = rc;
-  rctx.subject = certinfo;
+  for (i = 0; i < argc; i++)
+    logmsg(rc, log_debug, "rsync argv[%d]: %s", i, argv[i]);
 
-  if (w->certs == NULL && (w->certs = walk_ctx_stack_certs(rc, wsk)) == NULL)
-    goto done;
+  return 1;
+}
 
-  if (X509_get_version(x) != 2) {
-    log_validation_status(rc, uri, wrong_object_version, generation);
-    goto done;
-  }
+/**
+ * Run an rsync process, or fork an RRDP fetch.  Either way, what we
+ * get is a subprocess with a pipe, a timeout, and an exit status.
+ */
+static void rsync_run(rcynic_ctx_t *rc,
+		      rsync_ctx_t *ctx)
+{
+  const int rrdp = rsync_ctx_is_rrdp(ctx);
+  rsync_status_t status;
+  const char *argv[10];
+  path_t path;
+  int flags, pipe_fds[2];
 
-  if (!x->cert_info || !x->cert_info->signature || !x->cert_info->signature->algorithm ||
-      OBJ_obj2nid(x->cert_info->signature->algorithm) != NID_sha256WithRSAEncryption) {
-    log_validation_status(rc, uri, nonconformant_signature_algorithm, generation);
-    goto done;
-  }
+  pipe_fds[0] = pipe_fds[1] = -1;
 
-  if (certinfo->sia.s[0] && certinfo->sia.s[strlen(certinfo->sia.s) - 1] != '/') {
-    log_validation_status(rc, uri, malformed_cadirectory_uri, generation);
-    goto done;
+  assert(rc && ctx && ctx->pid == 0 && ctx->state != rsync_state_running && rsync_runable(rc, ctx));
+
+  if (rsync_history_check(rc, &ctx->uri, rrdp ? &ctx->notify : NULL, &status)) {
+    logmsg(rc, log_verbose, "Late rsync cache hit for %s", ctx->uri.s);
+    rsync_call_handler(rc, ctx, status);
+    rsync_ctx_discard(rc, ctx);
+    return;
   }
 
-  if (!w->certinfo.ta && strcmp(w->certinfo.uri.s, certinfo->aia.s))
-    log_validation_status(rc, uri, aia_doesnt_match_issuer, generation);
+  assert(rsync_count_running(rc) < rc->max_parallel_fetches);
 
-  if (certinfo->ca && !certinfo->sia.s[0]) {
-    log_validation_status(rc, uri, sia_cadirectory_uri_missing, generation);
-    goto done;
-  }
+  if (rrdp)
+    logmsg(rc, log_telemetry, "Fetching %s via RRDP from %s", ctx->uri.s, ctx->notify.s);
+  else
+    logmsg(rc, log_telemetry, "Fetching %s", ctx->uri.s);
 
-  if (certinfo->ca && !certinfo->manifest.s[0]) {
-    log_validation_status(rc, uri, sia_manifest_uri_missing, generation);
-    goto done;
-  }
+  if (!rrdp && !rsync_argv(rc, ctx, argv, sizeof(argv)/sizeof(*argv), &path))
+    goto lose;
 
-  if (certinfo->ca && !startswith(certinfo->manifest.s, certinfo->sia.s)) {
-    log_validation_status(rc, uri, manifest_carepository_mismatch, generation);
-    goto done;
+  /*
+   * Our end of the pipe mustn't leak into later rsync children, or
+   * we'd never see it close.  Only this thread forks, so setting
+   * close-on-exec here is soon enough; rrdp_child() closes the ones
+   * exec() won't.
+   */
+  if (pipe(pipe_fds) < 0) {
+    logmsg(rc, log_sys_err, "pipe() failed: %s", strerror(errno));
+    goto lose;
   }
 
-  if (x->skid) {
-    ex_count--;
-  } else {
-    log_validation_status(rc, uri, ski_extension_missing, generation);
-    goto done;
+  if (fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC) < 0) {
+    logmsg(rc, log_sys_err, "fcntl(F_SETFD, FD_CLOEXEC) failed: %s", strerror(errno));
+    goto lose;
   }
 
-  if (!check_allowed_dn(X509_get_subject_name(x))) {
-    log_validation_status(rc, uri, nonconformant_subject_name, generation);
-    if (!rc->allow_nonconformant_name)
-      goto done;
-  }
+  /*
+   * RRDP fetches run in our own code, so they need a real fork(), and
+   * that means parking the worker pool first; see worker_pool_pause().
+   * rsync only needs vfork() and exec().
+   */
+  if (rrdp)
+    worker_pool_pause(rc);
 
-  if (!check_allowed_dn(X509_get_issuer_name(x))) {
-    log_validation_status(rc, uri, nonconformant_issuer_name, generation);
-    if (!rc->allow_nonconformant_name)
-      goto done;
-  }
+  ctx->pid = rrdp ? fork() : vfork();
 
-  if ((policies = X509_get_ext_d2i(x, NID_certificate_policies, &crit, NULL)) != NULL) {
-    POLICYQUALINFO *qualifier = NULL;
-    POLICYINFO *policy = NULL;
-    ex_count--;
-    if (!crit || sk_POLICYINFO_num(policies) != 1 ||
-	(policy = sk_POLICYINFO_value(policies, 0)) == NULL ||
-	OBJ_obj2nid(policy->policyid) != NID_cp_ipAddr_asNumber ||
-	sk_POLICYQUALINFO_num(policy->qualifiers) > 1 ||
-	(sk_POLICYQUALINFO_num(policy->qualifiers) == 1 &&
-	 ((qualifier = sk_POLICYQUALINFO_value(policy->qualifiers, 0)) == NULL ||
-	  OBJ_obj2nid(qualifier->pqualid) != NID_id_qt_cps))) {
-      log_validation_status(rc, uri, bad_certificate_policy, generation);
-      goto done;
-    }
-    if (qualifier)
-      log_validation_status(rc, uri, policy_qualifier_cps, generation);
-  }
+  if (rrdp && ctx->pid != 0)
+    worker_pool_resume(rc);
 
-  if (!X509_EXTENSION_get_critical(X509_get_ext(x, X509_get_ext_by_NID(x, NID_key_usage, -1))) ||
-      (x->ex_flags & EXFLAG_KUSAGE) == 0 ||
-      x->ex_kusage != (certinfo->ca ? KU_KEY_CERT_SIGN | KU_CRL_SIGN : KU_DIGITAL_SIGNATURE)) {
-    log_validation_status(rc, uri, bad_key_usage, generation);
-    goto done;
-  }
-  ex_count--;
+  switch (ctx->pid) {
 
-  if (x->rfc3779_addr) {
-    ex_count--;
-    if (routercert ||
-	(loc = X509_get_ext_by_NID(x, NID_sbgp_ipAddrBlock, -1)) < 0 ||
-	!X509_EXTENSION_get_critical(X509_get_ext(x, loc)) ||
-	!v3_addr_is_canonical(x->rfc3779_addr) ||
-	sk_IPAddressFamily_num(x->rfc3779_addr) == 0) {
-      log_validation_status(rc, uri, bad_ipaddrblocks, generation);
-      goto done;
-    }
-    for (i = 0; i < sk_IPAddressFamily_num(x->rfc3779_addr); i++) {
-      IPAddressFamily *f = sk_IPAddressFamily_value(x->rfc3779_addr, i);
-      afi = v3_addr_get_afi(f);
-      if (afi != IANA_AFI_IPV4 && afi != IANA_AFI_IPV6) {
-	log_validation_status(rc, uri, unknown_afi, generation);
-	goto done;
-      }
-      if (f->addressFamily->length != 2) {
-	log_validation_status(rc, uri, safi_not_allowed, generation);
-	goto done;
-      }
-    }
-  }
+  case -1:
+     logmsg(rc, log_sys_err, "fork() failed: %s", strerror(errno));
+     goto lose;
 
-  if (x->rfc3779_asid) {
-    ex_count--;
-    if ((loc = X509_get_ext_by_NID(x, NID_sbgp_autonomousSysNum, -1)) < 0 ||
-	!X509_EXTENSION_get_critical(X509_get_ext(x, loc)) ||
-	!v3_asid_is_canonical(x->rfc3779_asid) ||
-	x->rfc3779_asid->asnum == NULL ||
-	x->rfc3779_asid->rdi != NULL ||
-	(routercert && x->rfc3779_asid->asnum->type == ASIdentifierChoice_inherit)) {
-      log_validation_status(rc, uri, bad_asidentifiers, generation);
-      goto done;
+  case 0:
+    /*
+     * Child
+     */
+    if (rrdp)
+      rrdp_child(rc, ctx, pipe_fds);
+#define whine(msg) ((void) write(2, msg, sizeof(msg) - 1))
+    if (close(pipe_fds[0]) < 0)
+      whine("close(pipe_fds[0]) failed\n");
+    else if (dup2(pipe_fds[1], 1) < 0)
+      whine("dup2(pipe_fds[1], 1) failed\n");
+    else if (dup2(pipe_fds[1], 2) < 0)
+      whine("dup2(pipe_fds[1], 2) failed\n");
+    else if (close(pipe_fds[1]) < 0)
+      whine("close(pipe_fds[1]) failed\n");
+    else if (execvp(argv[0], (char * const *) argv) < 0)
+      whine("execvp(argv[0], (char * const *) argv) failed\n");
+    whine("last system error: ");
+    write(2, strerror(errno), strlen(strerror(errno)));
+    whine("\n");
+    _exit(1);
+#undef whine
+
+  default:
+    /*
+     * Parent
+     */
+    ctx->fd = pipe_fds[0];
+    pipe_fds[0] = -1;
+    if ((flags = fcntl(ctx->fd, F_GETFL, 0)) == -1 ||
+	fcntl(ctx->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+      logmsg(rc, log_sys_err, "fcntl(ctx->fd, F_[GS]ETFL, O_NONBLOCK) failed: %s",
+	     strerror(errno));
+      goto lose;
     }
-  }
+    (void) close(pipe_fds[1]);
+    pipe_fds[1] = -1;
+#ifdef USE_EPOLL
+    if (rc->rsync_epoll >= 0 && !rsync_epoll_add(rc, ctx))
+      goto lose;
+#endif
+    rsync_ctx_set_state(rc, ctx, rsync_state_running);
+    ctx->problem = rsync_problem_none;
+    ctx->launched = time(0);
+    ctx->launched_usec = monotonic_usec();
+    if (!ctx->started)
+      ctx->started = ctx->launched;
+    if (rc->rsync_timeout)
+      rsync_timer_set(rc, ctx, time(0) + rc->rsync_timeout);
+    logmsg(rc, log_verbose, "Subprocess %u started, queued %d, runable %d, running %d, max %d, URI %s",
+	   (unsigned) ctx->pid, sk_rsync_ctx_t_num(rc->rsync_queue), rsync_count_runable(rc), rsync_count_running(rc), rc->max_parallel_fetches, ctx->uri.s);
+    rsync_call_handler(rc, ctx, rsync_status_pending);
+    return;
 
-  if (!x->rfc3779_addr && !x->rfc3779_asid) {
-    log_validation_status(rc, uri, missing_resources, generation);
-    goto done;
   }
 
-  subject_pkey = X509_get_pubkey(x);
-  ok = subject_pkey != NULL;
-  if (ok) {
-    ASN1_OBJECT *algorithm;
+ lose:
+  if (pipe_fds[0] != -1)
+    (void) close(pipe_fds[0]);
+  if (pipe_fds[1] != -1)
+    (void) close(pipe_fds[1]);
+  rsync_close_fd(rc, &ctx->fd);
+  rsync_close_fd(rc, &ctx->pidfd);
+  rsync_call_handler(rc, ctx, rsync_status_failed);
+  if (ctx->pid > 0) {
+    (void) kill(ctx->pid, SIGKILL);
+    (void) waitpid(ctx->pid, NULL, 0);
+    ctx->pid = 0;
+  }
+  rsync_ctx_discard(rc, ctx);
+}
 
-    (void) X509_PUBKEY_get0_param(&algorithm, NULL, NULL, NULL, X509_get_X509_PUBKEY(x));
+/**
+ * Mark a directory as changed in the rsync URI trie.  name is
+ * relative to the directory that the fetch in ctx wrote into, and
+ * only its first len characters are used.
+ */
+static void rsync_mark_changed(const rcynic_ctx_t *rc,
+			       const rsync_ctx_t *ctx,
+			       const char *name,
+			       const size_t len,
+			       const int how)
+{
+  rsync_trie_node_t *node;
+  char buf[URI_MAX];
+  const char *s;
+  size_t n;
+  uri_t uri;
 
-    switch (OBJ_obj2nid(algorithm)) {
+  assert(rc && ctx && name && is_rsync(ctx->uri.s));
 
-    case NID_rsaEncryption:
-      ok = (EVP_PKEY_type(subject_pkey->type) == EVP_PKEY_RSA &&
-	    BN_get_word(subject_pkey->pkey.rsa->e) == 65537);
-      if (!ok)
-	break;
-      if (!certinfo->ca && rc->allow_1024_bit_ee_key &&
-	  BN_num_bits(subject_pkey->pkey.rsa->n) == 1024)
-	log_validation_status(rc, uri, ee_certificate_with_1024_bit_key, generation);
-      else
-	ok = BN_num_bits(subject_pkey->pkey.rsa->n) == 2048;
-      break;
+  n = (s = strrchr(ctx->uri.s, '/')) == NULL ? 0 : s + 1 - ctx->uri.s;
 
-    case NID_X9_62_id_ecPublicKey:
-      ok = !certinfo->ca && routercert;
-      break;
+  if (n + len >= sizeof(buf))
+    return;
 
-    default:
-      ok = 0;
-    }
-  }
-  if (!ok) {
-    log_validation_status(rc, uri, bad_public_key, generation);
-    goto done;
-  }
+  memcpy(buf, ctx->uri.s, n);
+  memcpy(buf + n, name, len);
+  buf[n + len] = '\0';
 
-  if (x->skid == NULL ||
-      (ski_pubkey = X509_get0_pubkey_bitstr(x)) == NULL ||
-      !EVP_Digest(ski_pubkey->data, ski_pubkey->length,
-		  ski_hashbuf.h, &ski_hashlen, EVP_sha1(), NULL) ||
-      ski_hashlen != 20 ||
-      ski_hashlen != x->skid->length ||
-      memcmp(ski_hashbuf.h, x->skid->data, ski_hashlen)) {
-    log_validation_status(rc, uri, ski_public_key_mismatch, generation);
-    goto done;
-  }
+  uri.s = buf;
+  if ((node = rsync_trie_find(rc, &uri, 1)) != NULL)
+    node->changed |= how;
+  else
+    logmsg(rc, log_sys_err, "Couldn't record change to %s, blundering onwards", buf);
+}
 
-  if (x->akid) {
-    ex_count--;
+/**
+ * Scrape one line of rsync's --itemize-changes output for what it
+ * changed.  Itemized lines are an eleven character change code, a
+ * space, and the name relative to the directory we're fetching into;
+ * a name ending in a slash is a directory.  A change code starting
+ * with "." means only attributes changed, which we don't care about.
+ * Anything else that rsync says (errors, etc) won't look like this.
+ */
+static void rsync_itemize(const rcynic_ctx_t *rc,
+			  const rsync_ctx_t *ctx)
+{
+  const char *line = ctx->buffer, *name, *s;
+
+  assert(rc && ctx);
+
+  if (rsync_ctx_is_rrdp(ctx) || strlen(line) < 13 || line[11] != ' ')
+    return;
+
+  if (line[0] == '*' ? strncmp(line, "*deleting", 9) != 0
+      : (strchr("<>ch", line[0]) == NULL || strchr("fdLDS", line[1]) == NULL))
+    return;
+
+  name = line + 12;
+
+  if (!strncmp(name, "./", 2))
+    name += 2;
+
+  if (endswith(name, "/"))
+    s = name + strlen(name);
+  else if ((s = strrchr(name, '/')) != NULL)
+    s++;
+  else
+    s = name;
+
+  rsync_mark_changed(rc, ctx, name, s - name, RSYNC_CHANGED_DIR);
+}
+
+/**
+ * Process one line of rsync's output.  This is a separate function
+ * primarily to centralize scraping for magic error strings.  RRDP
+ * subprocesses have magic strings of their own.
+ */
+static void do_one_rsync_log_line(rcynic_ctx_t *rc,
+				  rsync_ctx_t *ctx)
+{
+  unsigned u;
+  uri_t uri;
+  char *s;
+
+  /*
+   * Send line to our log unless it's empty.
+   */
+  if (ctx->buffer[strspn(ctx->buffer, " \t\n\r")] != '\0')
+    logmsg(rc, log_telemetry, "rsync[%u]: %s", ctx->pid, ctx->buffer);
+
+  rsync_itemize(rc, ctx);
+
+  if (rsync_ctx_is_rrdp(ctx)) {
+    if (!strncmp(ctx->buffer, RRDP_OUTSIDE_TAG, sizeof(RRDP_OUTSIDE_TAG) - 1)) {
+      uri.s = ctx->buffer + sizeof(RRDP_OUTSIDE_TAG) - 1;
+      log_validation_status(rc, &uri, rrdp_uri_outside_repository, object_generation_null);
+    }
+    return;
+  }
+
+  /*
+   * Check for magic error strings
+   */
+  if ((s = strstr(ctx->buffer, "@ERROR: max connections")) != NULL) {
+    ctx->problem = rsync_problem_refused;
+    if (sscanf(s, "@ERROR: max connections (%u) reached -- try again later", &u) == 1)
+      logmsg(rc, log_verbose, "Subprocess %u reported limit of %u for %s", ctx->pid, u, ctx->uri.s);
+  }
+}
+
+/**
+ * Read whatever output an rsync subprocess has for us and log it a
+ * line at a time.  Notices when the subprocess closes its end of the
+ * pipe.
+ */
+static void rsync_read_output(rcynic_ctx_t *rc,
+			      rsync_ctx_t *ctx)
+{
+  ssize_t n;
+  char *s;
+
+  assert(rc && ctx && ctx->fd >= 0 && ctx->buflen < sizeof(ctx->buffer) - 1);
+
+  while ((n = read(ctx->fd, ctx->buffer + ctx->buflen, sizeof(ctx->buffer) - 1 - ctx->buflen)) > 0) {
+    ctx->buflen += n;
+    assert(ctx->buflen < sizeof(ctx->buffer));
+    ctx->buffer[ctx->buflen] = '\0';
+
+    while ((s = strchr(ctx->buffer, '\n')) != NULL) {
+      *s++ = '\0';
+      do_one_rsync_log_line(rc, ctx);
+      assert(s > ctx->buffer && s < ctx->buffer + sizeof(ctx->buffer));
+      ctx->buflen -= s - ctx->buffer;
+      assert(ctx->buflen < sizeof(ctx->buffer));
+      if (ctx->buflen > 0)
+	memmove(ctx->buffer, s, ctx->buflen);
+      ctx->buffer[ctx->buflen] = '\0';
+    }
+
+    if (ctx->buflen == sizeof(ctx->buffer) - 1) {
+      ctx->buffer[sizeof(ctx->buffer) - 1] = '\0';
+      do_one_rsync_log_line(rc, ctx);
+      ctx->buflen = 0;
+    }
+  }
+
+  if (n == 0) {
+    rsync_close_fd(rc, &ctx->fd);
+    rsync_ctx_set_state(rc, ctx, rsync_state_closed);
+  }
+}
+
+/**
+ * Handle an rsync subprocess that has exited: figure out how it went,
+ * schedule a retry if that's appropriate, otherwise record the result,
+ * tell whoever asked for this fetch, and discard the context.
+ */
+static void rsync_reap(rcynic_ctx_t *rc,
+		       rsync_ctx_t *ctx,
+		       const int pid_status,
+		       const time_t now)
+{
+  rsync_status_t rsync_status;
+
+  assert(rc && ctx && ctx->pid > 0);
+
+  logmsg(rc, log_verbose, "Subprocess %u exited with status %d",
+	 (unsigned) ctx->pid, WEXITSTATUS(pid_status));
+
+  trace_fetch(rc, ctx, WEXITSTATUS(pid_status));
+
+  rsync_close_fd(rc, &ctx->fd);
+  rsync_close_fd(rc, &ctx->pidfd);
+
+  if (ctx->buflen > 0) {
+    assert(ctx->buflen < sizeof(ctx->buffer));
+    ctx->buffer[ctx->buflen] = '\0';
+    do_one_rsync_log_line(rc, ctx);
+    ctx->buflen = 0;
+  }
+
+  switch (WEXITSTATUS(pid_status)) {
+
+  case 0:
+    rsync_status = rsync_status_done;
+    break;
+
+  case 5:			/* "Error starting client-server protocol" */
+    /*
+     * Handle remote rsyncd refusing to talk to us because we've
+     * exceeded its connection limit.  Back off for a short
+     * interval, then retry.
+     */
+    if (ctx->problem == rsync_problem_refused && ctx->tries < rc->max_retries) {
+      unsigned char r;
+      if (!RAND_bytes(&r, sizeof(r)))
+	r = 60;
+      rsync_host_update(rc, ctx, rsync_status_failed, WEXITSTATUS(pid_status), now);
+      rsync_ctx_set_state(rc, ctx, rsync_state_retry_wait);
+      rsync_timer_set(rc, ctx, ctx->host->backoff_until + r);
+      ctx->problem = rsync_problem_none;
+      ctx->pid = 0;
+      ctx->tries++;
+      logmsg(rc, log_telemetry, "Scheduling retry for %s", ctx->uri.s);
+      return;
+    }
+    goto failure;
+
+  case 23:			/* "Partial transfer due to error" */
+    /*
+     * This appears to be a catch-all for "something bad happened
+     * trying to do what you asked me to do".  In the cases I've
+     * seen to date, this is things like "the directory you
+     * requested isn't there" or "NFS exploded when I tried to touch
+     * the directory".  These aren't network layer failures, so we
+     * (probably) shouldn't give up on the repository host.  We
+     * can't tell what didn't get transferred, though, so don't
+     * believe the itemized output when it says nothing changed.
+     */
+    rsync_status = rsync_status_done;
+    if (!rsync_ctx_is_rrdp(ctx))
+      rsync_mark_changed(rc, ctx, "", 0, RSYNC_CHANGED_TREE);
+    log_validation_status(rc, &ctx->uri, rsync_partial_transfer, object_generation_null);
+    break;
+
+  default:
+  failure:
+    rsync_status = rsync_status_failed;
+    logmsg(rc, log_data_err, "rsync %u exited with status %d fetching %s",
+	   (unsigned) ctx->pid, WEXITSTATUS(pid_status), ctx->uri.s);
+    break;
+  }
+
+  if (rc->rsync_timeout && now >= ctx->deadline)
+    rsync_status = rsync_status_timed_out;
+  rsync_host_update(rc, ctx, rsync_status, WEXITSTATUS(pid_status), now);
+  log_validation_status(rc, rsync_ctx_source(ctx),
+			rsync_status_to_mib_counter(ctx, rsync_status),
+			object_generation_null);
+  rsync_history_add(rc, ctx, rsync_status);
+  rsync_call_handler(rc, ctx, rsync_status);
+  rsync_ctx_discard(rc, ctx);
+}
+
+/**
+ * Check for exited subprocesses the old-fashioned way, when we don't
+ * have pidfds to tell us which one it was.
+ */
+static void rsync_reap_any(rcynic_ctx_t *rc,
+			   const time_t now)
+{
+  int i, pid_status = -1;
+  rsync_ctx_t *ctx;
+  pid_t pid;
+
+  while ((pid = waitpid(-1, &pid_status, WNOHANG)) > 0) {
+
+    for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i)
+      if (ctx->pid == pid)
+	break;
+
+    if (ctx == NULL) {
+      assert(i == sk_rsync_ctx_t_num(rc->rsync_queue));
+      logmsg(rc, log_sys_err, "Couldn't find rsync context for pid %d", pid);
+      continue;
+    }
+
+    rsync_reap(rc, ctx, pid_status, now);
+  }
+
+  if (pid == -1 && errno != EINTR && errno != ECHILD)
+    logmsg(rc, log_sys_err, "waitpid() returned error: %s", strerror(errno));
+}
+
+/**
+ * Whack an rsync subprocess that has been running too long.  We keep
+ * whacking it once a second until it goes away, escalating to
+ * SIGKILL if it ignores us for too long.
+ */
+static void rsync_whack(rcynic_ctx_t *rc,
+			rsync_ctx_t *ctx,
+			const time_t now)
+{
+  int sig = ctx->tries++ < KILL_MAX ? SIGTERM : SIGKILL;
+
+  assert(rc && ctx && ctx->pid > 0);
+
+  if (ctx->state != rsync_state_terminating) {
+    ctx->problem = rsync_problem_timed_out;
+    rsync_ctx_set_state(rc, ctx, rsync_state_terminating);
+    ctx->tries = 0;
+    logmsg(rc, log_telemetry, "Subprocess %u is taking too long fetching %s, whacking it", (unsigned) ctx->pid, ctx->uri.s);
+    rsync_history_add(rc, ctx, rsync_status_timed_out);
+  } else if (sig == SIGTERM) {
+    logmsg(rc, log_verbose, "Whacking subprocess %u again", (unsigned) ctx->pid);
+  } else {
+    logmsg(rc, log_verbose, "Whacking subprocess %u with big hammer", (unsigned) ctx->pid);
+  }
+  (void) kill(ctx->pid, sig);
+  rsync_timer_set(rc, ctx, now + 1);
+}
+
+/**
+ * Run the timer wheel up to now.  Contexts whose deadline has passed
+ * come off the wheel; running ones get whacked, ones in retry_wait
+ * just become runable again.
+ */
+static void rsync_timer_expire(rcynic_ctx_t *rc,
+			       const time_t now)
+{
+  time_t t, first = rc->rsync_timer_clock + 1;
+  rsync_ctx_t *ctx, *next;
+
+  if (first + RSYNC_TIMER_SLOTS <= now)
+    first = now - RSYNC_TIMER_SLOTS + 1;
+
+  for (t = first; t <= now && rc->rsync_timer_count > 0; t++) {
+    for (ctx = rc->rsync_timers[t & (RSYNC_TIMER_SLOTS - 1)]; ctx != NULL; ctx = next) {
+      next = ctx->timer_next;
+      if (ctx->deadline > now)
+	continue;
+      rsync_timer_cancel(rc, ctx);
+      if (ctx->pid > 0)
+	rsync_whack(rc, ctx, now);
+    }
+  }
+
+  if (now > rc->rsync_timer_clock)
+    rc->rsync_timer_clock = now;
+}
+
+/**
+ * How long we can wait for rsync subprocesses before we have to deal
+ * with a deadline.
+ */
+static time_t rsync_wait_time(const rcynic_ctx_t *rc,
+			      const time_t now)
+{
+  time_t when = rsync_timer_next(rc, now, rc->max_select_time);
+
+  if (!when)
+    return rc->max_select_time;
+  else if (when < now)
+    return 0;
+  else
+    return when - now;
+}
+
+/**
+ * Wait for output from rsync subprocesses using select().  This is
+ * the portable version; it has to rebuild the fd_set on every pass
+ * and is limited to FD_SETSIZE descriptors.
+ */
+static void rsync_wait_select(rcynic_ctx_t *rc,
+			      const time_t now)
+{
+  rsync_ctx_t *ctx;
+  struct timeval tv;
+  fd_set rfds;
+  int i, n = 0;
+
+  FD_ZERO(&rfds);
+
+  for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i) {
+    if (ctx->state != rsync_state_running)
+      continue;
+    assert(ctx->fd >= 0 && ctx->fd < FD_SETSIZE);
+    FD_SET(ctx->fd, &rfds);
+    if (ctx->fd > n)
+      n = ctx->fd;
+  }
+
+  if (n == 0)
+    return;
+
+  tv.tv_sec = rsync_wait_time(rc, now);
+  tv.tv_usec = 0;
+
+  if (tv.tv_sec)
+    logmsg(rc, log_verbose, "Waiting up to %u seconds for rsync, queued %d, runable %d, running %d, max %d",
+	   (unsigned) tv.tv_sec, sk_rsync_ctx_t_num(rc->rsync_queue), rsync_count_runable(rc),
+	   rsync_count_running(rc), rc->max_parallel_fetches);
+
+  if (select(n + 1, &rfds, NULL, NULL, &tv) <= 0)
+    return;
+
+  for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i)
+    if (ctx->fd > 0 && FD_ISSET(ctx->fd, &rfds))
+      rsync_read_output(rc, ctx);
+}
+
+#ifdef USE_EPOLL
+
+/**
+ * Wait for rsync subprocesses using epoll().  Each event carries the
+ * context it belongs to, whether it came from the output pipe or the
+ * pidfd, so we only ever look at contexts that have something to
+ * tell us, and subprocess exits don't need a search to find their
+ * owners.
+ */
+static void rsync_wait_epoll(rcynic_ctx_t *rc,
+			     const time_t now)
+{
+  struct epoll_event events[RSYNC_MAX_EVENTS];
+  rsync_ctx_t *ready[RSYNC_MAX_EVENTS], *ctx;
+  int i, j, n, nready = 0, pid_status;
+  time_t timeout;
+
+  if (rsync_count_running(rc) == 0 && rc->rsync_timer_count == 0)
+    return;
+
+  timeout = rsync_wait_time(rc, now);
+
+  if (timeout)
+    logmsg(rc, log_verbose, "Waiting up to %u seconds for rsync, queued %d, runable %d, running %d, max %d",
+	   (unsigned) timeout, sk_rsync_ctx_t_num(rc->rsync_queue), rsync_count_runable(rc),
+	   rsync_count_running(rc), rc->max_parallel_fetches);
+
+  if ((n = epoll_wait(rc->rsync_epoll, events, RSYNC_MAX_EVENTS, timeout * 1000)) < 0) {
+    if (errno != EINTR)
+      logmsg(rc, log_sys_err, "epoll_wait() failed: %s", strerror(errno));
+    return;
+  }
+
+  /*
+   * The pipe and the pidfd for one context may both have fired, and
+   * handling an exit frees the context, so collect each context once.
+   */
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < nready && ready[j] != events[i].data.ptr; j++)
+      ;
+    if (j == nready)
+      ready[nready++] = events[i].data.ptr;
+  }
+
+  for (i = 0; i < nready; i++) {
+    ctx = ready[i];
+    if (ctx->fd >= 0)
+      rsync_read_output(rc, ctx);
+    if (ctx->pid > 0 && waitpid(ctx->pid, &pid_status, WNOHANG) == ctx->pid)
+      rsync_reap(rc, ctx, pid_status, now);
+  }
+}
+
+#endif /* USE_EPOLL */
+
+/**
+ * Manager for queue of rsync tasks in progress.
+ *
+ * General plan here is to process one completed child, or output
+ * accumulated from children, or block if there is absolutely nothing
+ * to do, on the theory that caller had nothing to do either or would
+ * not have called us.  Once we've done something allegedly useful, we
+ * return, because this is not the event loop; if and when the event
+ * loop has nothing more important to do, we'll be called again.
+ *
+ * So this is the only place where the program blocks waiting for
+ * children, but we only do it when we know there's nothing else
+ * useful that we could be doing while we wait.
+ */
+static void rsync_mgr(rcynic_ctx_t *rc)
+{
+  rsync_ctx_t *ctx = NULL;
+  time_t now = time(0);
+
+  assert(rc && rc->rsync_queue);
+
+  /*
+   * Check for exited subprocesses.  With epoll() we hear about
+   * these along with their output, below.
+   */
+  if (rc->rsync_epoll < 0)
+    rsync_reap_any(rc, now);
+
+  /*
+   * Deal with children that have been running too long, and with
+   * retries whose wait is over.
+   */
+  rsync_timer_expire(rc, now);
+
+  assert(rsync_count_running(rc) <= rc->max_parallel_fetches);
+
+  /*
+   * Fill free fetch slots, fairest host first.  rsync_run() might
+   * decide to remove the rsync task from the queue instead of running
+   * it, in which case we just pick again.
+   */
+  while (rsync_count_running(rc) < rc->max_parallel_fetches &&
+	 (ctx = rsync_next(rc, now)) != NULL)
+    rsync_run(rc, ctx);
+
+  assert(rsync_count_running(rc) <= rc->max_parallel_fetches);
+
+  /*
+   * Wait for output, exits, or deadlines.
+   */
+#ifdef USE_EPOLL
+  if (rc->rsync_epoll >= 0)
+    rsync_wait_epoll(rc, now);
+  else
+#endif
+    rsync_wait_select(rc, now);
+
+  assert(rsync_count_running(rc) <= rc->max_parallel_fetches);
+}
+
+/**
+ * Set up rsync context and attempt to start it.  notify is the RRDP
+ * notification URI to fetch uri from, or NULL to use rsync.
+ */
+static void rsync_init(rcynic_ctx_t *rc,
+		       const uri_t *uri,
+		       const uri_t *notify,
+		       void *cookie,
+		       void (*handler)(rcynic_ctx_t *, const rsync_ctx_t *, const rsync_status_t, const uri_t *, void *))
+{
+  rsync_ctx_t *ctx = NULL;
+  rsync_status_t status;
+
+  assert(rc && uri && is_rsync(uri->s) && strlen(uri->s) > SIZEOF_RSYNC);
+
+  if (!rc->run_rsync) {
+    logmsg(rc, log_verbose, "rsync disabled, skipping %s", uri->s);
+    if (handler)
+      handler(rc, NULL, rsync_status_skipped, uri, cookie);
+    return;
+  }
+
+  if (rsync_history_check(rc, uri, notify, &status)) {
+    logmsg(rc, log_verbose, "rsync cache hit for %s", uri->s);
+    if (handler)
+      handler(rc, NULL, status, uri, cookie);
+    return;
+  }
+
+  if ((ctx = malloc(sizeof(*ctx))) == NULL) {
+    logmsg(rc, log_sys_err, "malloc(rsync_ctxt_t) failed");
+    if (handler)
+      handler(rc, NULL, rsync_status_failed, uri, cookie);
+    return;
+  }
+
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->uri = *uri;
+  if (notify)
+    ctx->notify = *notify;
+  ctx->handler = handler;
+  ctx->cookie = cookie;
+  ctx->fd = ctx->pidfd = -1;
+
+  if ((ctx->node = rsync_trie_find(rc, uri, 1)) == NULL ||
+      (ctx->host = rsync_host_find(rc, notify ? notify : uri)) == NULL ||
+      !sk_rsync_ctx_t_push(rc->rsync_queue, ctx)) {
+    logmsg(rc, log_sys_err, "Couldn't push rsync state object onto queue, punting %s", ctx->uri.s);
+    rsync_call_handler(rc, ctx, rsync_status_failed);
+    free(ctx);
+    return;
+  }
+
+  /*
+   * Not yet counted as active, so we can check for conflicts and
+   * pick the initial state before we account for it.
+   */
+  if (rsync_conflicts(rc, ctx)) {
+    logmsg(rc, log_debug, "New rsync context %s is feeling conflicted", ctx->uri.s);
+    ctx->state = rsync_state_conflict_wait;
+  }
+
+  rsync_ctx_account(rc, ctx, 1);
+  rsync_host_enqueue(ctx);
+}
+
+/**
+ * rsync a trust anchor.
+ */
+static void rsync_ta(rcynic_ctx_t *rc,
+		     const uri_t *uri,
+		     tal_ctx_t *tctx,
+		     void (*handler)(rcynic_ctx_t *, const rsync_ctx_t *,
+				     const rsync_status_t, const uri_t *, void *))
+{
+  assert(endswith(uri->s, ".cer"));
+  rsync_init(rc, uri, NULL, tctx, handler);
+}
+
+/**
+ * rsync an entire subtree, generally rooted at a SIA collection.
+ */
+static void rsync_tree(rcynic_ctx_t *rc,
+		       const uri_t *uri,
+		       STACK_OF(walk_ctx_t) *wsk,
+		       void (*handler)(rcynic_ctx_t *, const rsync_ctx_t *,
+				       const rsync_status_t, const uri_t *, void *))
+{
+  assert(endswith(uri->s, "/"));
+  rsync_init(rc, uri, NULL, wsk, handler);
+}
+
+
+
+/*
+ * RRDP (RFC 8182).
+ *
+ * An RRDP fetch runs in a forked copy of rcynic, so that as far as the
+ * rsync manager is concerned it's just another subprocess with a
+ * pipe, a timeout, and an exit status, and the event loop never
+ * blocks on the network.  The child fetches the notification file,
+ * then either the deltas that take us from the serial we saw last
+ * time to the current one or, failing those, the snapshot, and writes
+ * the objects into the unauthenticated tree where rsync would have
+ * put them.  Session state lives in rrdp-directory, one small file per
+ * notification URI and SIA.
+ *
+ * A publication server can host any number of repositories under one
+ * notification URI, so the child only writes objects under the SIA of
+ * the certificate that sent us there, and tells the parent about any
+ * others, which the parent logs as rrdp_uri_outside_repository.  It
+ * also holds back everything a snapshot or delta says to do until the
+ * document's hash has checked out, so a bad document changes nothing.
+ */
+
+/**
+ * rsync (well, fetch) an entire SIA tree via RRDP, given the
+ * rpkiNotify URI from the certificate whose SIA it is.
+ */
+static void rrdp_tree(rcynic_ctx_t *rc,
+		      const uri_t *uri,
+		      const uri_t *notify,
+		      STACK_OF(walk_ctx_t) *wsk,
+		      void (*handler)(rcynic_ctx_t *, const rsync_ctx_t *,
+				      const rsync_status_t, const uri_t *, void *))
+{
+  assert(endswith(uri->s, "/") && is_http(notify->s));
+  rsync_init(rc, uri, notify, wsk, handler);
+}
+
+/**
+ * Free an rrdp_delta_t.
+ */
+static void rrdp_delta_t_free(rrdp_delta_t *d)
+{
+  free(d);
+}
+
+/**
+ * Compare two rrdp_delta_t objects by serial number.
+ */
+static int rrdp_delta_cmp(const rrdp_delta_t * const *a, const rrdp_delta_t * const *b)
+{
+  return (*a)->serial < (*b)->serial ? -1 : (*a)->serial > (*b)->serial;
+}
+
+/**
+ * Compare two rrdp_change_t objects by filename.
+ */
+static int rrdp_change_cmp(const rrdp_change_t * const *a, const rrdp_change_t * const *b)
+{
+  return strcmp((*a)->path, (*b)->path);
+}
+
+/**
+ * Name of the temporary file in which a published object waits for
+ * the document it came in to check out.
+ */
+static int rrdp_temp_filename(const char *path, path_t *temp)
+{
+  return snprintf(temp->s, sizeof(temp->s), "%s.rrdp-%u",
+		  path, (unsigned) getpid()) < sizeof(temp->s);
+}
+
+/**
+ * Hex-encode a SHA-256 digest.
+ */
+static void rrdp_hex(const unsigned char *digest, char *hex)
+{
+  int i;
+
+  for (i = 0; i < HASH_SHA256_LEN; i++)
+    sprintf(hex + 2 * i, "%02x", digest[i]);
+}
+
+/**
+ * Is this a plausible hex SHA-256 hash?
+ */
+static int rrdp_is_hash(const char *s)
+{
+  return s != NULL && strlen(s) == RRDP_HASH_HEX_LEN &&
+    strspn(s, "0123456789abcdefABCDEF") == RRDP_HASH_HEX_LEN;
+}
+
+/**
+ * Parse an RRDP serial number.
+ */
+static int rrdp_serial(const char *s, unsigned long *serial)
+{
+  char *e;
+
+  if (s == NULL || *s == '\0' || strspn(s, "0123456789") != strlen(s))
+    return 0;
+  errno = 0;
+  *serial = strtoul(s, &e, 10);
+  return *e == '\0' && errno == 0;
+}
+
+/**
+ * Allocate a parser for one RRDP document.  base is the rsync URI
+ * objects have to be under, NULL for a notification file.
+ */
+static rrdp_parser_t *rrdp_parser_new(const rcynic_ctx_t *rc,
+				      const rrdp_doc_t doc,
+				      const char *source,
+				      const char *base)
+{
+  rrdp_parser_t *p;
+
+  assert(rc && source && (doc == rrdp_doc_notification || base != NULL));
+
+  if ((p = malloc(sizeof(*p))) == NULL)
+    return NULL;
+
+  memset(p, 0, sizeof(*p));
+  p->rc = rc;
+  p->doc = doc;
+  p->source = source;
+  p->base = base;
+  p->fd = -1;
+
+  if (doc == rrdp_doc_notification
+      ? (p->deltas = sk_rrdp_delta_t_new(rrdp_delta_cmp)) == NULL
+      : (p->changes = sk_rrdp_change_t_new(rrdp_change_cmp)) == NULL) {
+    free(p);
+    return NULL;
+  }
+
+  return p;
+}
+
+/**
+ * Throw away whatever changes we've staged, along with the temporary
+ * files holding the objects they would have published.
+ */
+static void rrdp_discard(rrdp_parser_t *p)
+{
+  rrdp_change_t *c;
+  path_t temp;
+
+  while ((c = sk_rrdp_change_t_pop(p->changes)) != NULL) {
+    if (!c->withdraw && rrdp_temp_filename(c->path, &temp))
+      (void) unlink(temp.s);
+    free(c);
+  }
+}
+
+/**
+ * Free an RRDP parser, throwing away any half-written object and
+ * anything staged but not committed.
+ */
+static void rrdp_parser_free(rrdp_parser_t *p)
+{
+  if (p == NULL)
+    return;
+  if (p->fd >= 0) {
+    (void) close(p->fd);
+    (void) unlink(p->temp.s);
+  }
+  rrdp_discard(p);
+  sk_rrdp_change_t_free(p->changes);
+  sk_rrdp_delta_t_pop_free(p->deltas, rrdp_delta_t_free);
+  free(p);
+}
+
+#ifdef __GNUC__
+static void rrdp_error(rrdp_parser_t *p, const char *fmt, ...)
+     __attribute__ ((format (printf, 2, 3)));
+#endif
+
+/**
+ * Complain about an RRDP document and mark the parse as failed.  Only
+ * the first complaint gets logged, the rest are likely to be fallout.
+ */
+static void rrdp_error(rrdp_parser_t *p, const char *fmt, ...)
+{
+  char buf[URI_MAX * 2];
+  va_list ap;
+
+  assert(p && fmt);
+
+  if (p->failed)
+    return;
+  p->failed = 1;
+
+  va_start(ap, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+
+  logmsg(p->rc, log_data_err, "RRDP %s: %s", p->source, buf);
+}
+
+/**
+ * Find an attribute by name.
+ */
+static const char *rrdp_attr(const rrdp_attrs_t *attrs, const char *name)
+{
+  int i;
+
+  for (i = 0; i < attrs->n; i++)
+    if (!strcmp(attrs->name[i], name))
+      return attrs->value[i];
+  return NULL;
+}
+
+/**
+ * Strip the namespace prefix, if any, from an element name.  RRDP
+ * only has the one namespace, which we check on the root element.
+ */
+static const char *rrdp_local_name(const char *name)
+{
+  const char *s = strchr(name, ':');
+  return s ? s + 1 : name;
+}
+
+/**
+ * Expand the predefined XML entities in place.  RRDP attribute values
+ * are URIs, hashes and numbers, so we don't bother with character
+ * references.
+ */
+static int rrdp_unescape(char *s)
+{
+  static const struct { const char *name; char c; } entities[] = {
+    { "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' },
+    { "&quot;", '"' }, { "&apos;", '\'' }
+  };
+  char *out = s;
+  int i;
+
+  while (*s != '\0') {
+    if (*s != '&') {
+      *out++ = *s++;
+      continue;
+    }
+    for (i = 0; i < sizeof(entities)/sizeof(*entities); i++)
+      if (!strncmp(s, entities[i].name, strlen(entities[i].name)))
+	break;
+    if (i == sizeof(entities)/sizeof(*entities))
+      return 0;
+    *out++ = entities[i].c;
+    s += strlen(entities[i].name);
+  }
+
+  *out = '\0';
+  return 1;
+}
+
+/**
+ * Hash the file we have for an object and compare with what a delta
+ * thinks it's replacing or withdrawing.  Not having the file at all
+ * is fine: we might have pruned it, or never seen it.  Having a
+ * different one means we're out of sync with the server.
+ */
+static int rrdp_check_hash(rrdp_parser_t *p,
+			   const char *uri,
+			   const char *hash)
+{
+  unsigned char buf[8192], digest[HASH_SHA256_LEN];
+  char hex[RRDP_HASH_HEX_LEN + 1];
+  EVP_MD_CTX *ctx = NULL;
+  int fd, ok = 0;
+  ssize_t n;
+
+  if (!rrdp_is_hash(hash)) {
+    rrdp_error(p, "Malformed hash for %s", uri);
+    return 0;
+  }
+
+  if ((fd = open(p->path.s, O_RDONLY)) < 0)
+    return errno == ENOENT;
+
+  if ((ctx = EVP_MD_CTX_create()) == NULL ||
+      !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL))
+    goto done;
+
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    if (!EVP_DigestUpdate(ctx, buf, n))
+      goto done;
+
+  if (n < 0 || !EVP_DigestFinal_ex(ctx, digest, NULL))
+    goto done;
+
+  rrdp_hex(digest, hex);
+  ok = !strcasecmp(hex, hash);
+
+ done:
+  if (ctx)
+    EVP_MD_CTX_destroy(ctx);
+  (void) close(fd);
+  if (!ok)
+    rrdp_error(p, "Our copy of %s isn't the one the server expects", uri);
+  return ok;
+}
+
+/**
+ * Check an object URI from an RRDP document and map it to a filename
+ * in the unauthenticated tree.  Returns 1 if the object is ours, 0 if
+ * it's outside the repository we're fetching, and -1 if the URI is no
+ * good at all, which fails the document.  We skip objects outside our
+ * repository, since a server hosting several repositories under one
+ * notification URI is entitled to list them all, but we tell our
+ * parent about each one, and it's up to whoever owns the other
+ * repository to get us there with its own SIA.
+ */
+static int rrdp_filename(rrdp_parser_t *p, const char *uri)
+{
+  char buf[sizeof(RRDP_OUTSIDE_TAG) + URI_MAX + 1];
+  uri_t u;
+  int n;
+
+  assert(p && p->base);
+
+  u.s = uri;
+
+  if (uri == NULL || strlen(uri) >= URI_MAX || uri[strcspn(uri, "\r\n")] != '\0' ||
+      !is_rsync(uri)) {
+    rrdp_error(p, "Bad object URI %s", uri ? uri : "(missing)");
+    return -1;
+  }
+
+  if (!startswith(uri, p->base)) {
+    logmsg(p->rc, log_verbose, "RRDP %s: %s is outside %s, skipping", p->source, uri, p->base);
+    if ((n = snprintf(buf, sizeof(buf), "%s%s\n", RRDP_OUTSIDE_TAG, uri)) > 0 && n < sizeof(buf))
+      (void) write(1, buf, n);
+    p->outside++;
+    return 0;
+  }
+
+  if (!uri_to_filename(p->rc, &u, &p->path, &p->rc->unauthenticated)) {
+    rrdp_error(p, "Bad object URI %s", uri);
+    return -1;
+  }
+
+  return 1;
+}
+
+/**
+ * Record a change to make once the document checks out.
+ */
+static int rrdp_stage(rrdp_parser_t *p, const int withdraw)
+{
+  size_t len = strlen(p->path.s);
+  rrdp_change_t *c;
+
+  if ((c = malloc(sizeof(*c) + len + 1)) != NULL) {
+    c->withdraw = withdraw;
+    memcpy(c->path, p->path.s, len + 1);
+  }
+
+  if (c == NULL || !sk_rrdp_change_t_push(p->changes, c)) {
+    rrdp_error(p, "Couldn't record change to %s", p->path.s);
+    free(c);
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * The document checked out, so make the changes it asked for.  An
+ * object listed twice makes the document bogus, so check for that
+ * before touching anything.  Failing part way through leaves the tree
+ * partly updated, but then we don't save the new serial either, so
+ * the next fetch sorts it out.
+ */
+static int rrdp_commit(rrdp_parser_t *p)
+{
+  const rrdp_change_t *prev = NULL;
+  rrdp_change_t *c;
+  path_t temp;
+  int i, ok;
+
+  sk_rrdp_change_t_sort(p->changes);
+
+  for (i = 0; (c = sk_rrdp_change_t_value(p->changes, i)) != NULL; prev = c, i++) {
+    if (prev != NULL && !strcmp(prev->path, c->path)) {
+      rrdp_error(p, "Document lists %s more than once", c->path);
+      return 0;
+    }
+  }
+
+  while ((c = sk_rrdp_change_t_pop(p->changes)) != NULL) {
+
+    if (c->withdraw)
+      ok = unlink(c->path) == 0 || errno == ENOENT;
+    else
+      ok = rrdp_temp_filename(c->path, &temp) && rename(temp.s, c->path) == 0;
+
+    if (!ok) {
+      rrdp_error(p, "Couldn't %s %s: %s", c->withdraw ? "remove" : "install",
+		 c->path, strerror(errno));
+      if (!c->withdraw)
+	(void) unlink(temp.s);
+      free(c);
+      return 0;
+    }
+
+    logmsg(p->rc, log_debug, "RRDP: %s %s", c->withdraw ? "withdrew" : "wrote", c->path);
+    p->objects++;
+    free(c);
+  }
+
+  return 1;
+}
+
+/**
+ * Start of a publish element: open a temporary file next to where the
+ * object will go, and get ready to decode base64 into it.  If the
+ * object isn't ours, skip its content instead.
+ */
+static void rrdp_publish_start(rrdp_parser_t *p,
+			       const char *uri,
+			       const char *hash)
+{
+  int ours;
+
+  assert(p && p->fd < 0 && !p->skip);
+
+  if ((ours = rrdp_filename(p, uri)) == 0)
+    p->skip = 1;
+
+  if (ours <= 0 || (hash && !rrdp_check_hash(p, uri, hash)))
+    return;
+
+  if (!rrdp_temp_filename(p->path.s, &p->temp)) {
+    rrdp_error(p, "Filename for %s too long", uri);
+    return;
+  }
+
+  if (!mkdir_maybe(p->rc, &p->temp) ||
+      (p->fd = open(p->temp.s, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    rrdp_error(p, "Couldn't create %s: %s", p->temp.s, strerror(errno));
+    return;
+  }
+
+  p->b64_bits = 0;
+  p->b64_count = p->b64_pad = 0;
+  p->outlen = 0;
+}
+
+/**
+ * Write out whatever base64 decoding has accumulated.
+ */
+static int rrdp_flush(rrdp_parser_t *p)
+{
+  size_t off = 0;
+  ssize_t n;
+
+  assert(p && p->fd >= 0);
+
+  while (off < p->outlen) {
+    if ((n = write(p->fd, p->out + off, p->outlen - off)) < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      rrdp_error(p, "Couldn't write %s: %s", p->temp.s, strerror(errno));
+      return 0;
+    }
+    off += n;
+  }
+
+  p->outlen = 0;
+  return 1;
+}
+
+/**
+ * End of a publish element: make sure the base64 came out even, then
+ * stage the new object to be moved into place.
+ */
+static void rrdp_publish_end(rrdp_parser_t *p)
+{
+  int ok;
+
+  assert(p && p->fd >= 0);
+
+  if (!(ok = p->b64_count == 0))
+    rrdp_error(p, "Truncated base64 for %s", p->path.s);
+
+  ok = ok && rrdp_flush(p);
+
+  if (close(p->fd) < 0 && ok) {
+    rrdp_error(p, "Couldn't close %s: %s", p->temp.s, strerror(errno));
+    ok = 0;
+  }
+  p->fd = -1;
+
+  if (!ok || !rrdp_stage(p, 0))
+    (void) unlink(p->temp.s);
+}
+
+/**
+ * Withdraw element: stage removal of the object, if we have the
+ * version the server thinks we have.
+ */
+static void rrdp_withdraw(rrdp_parser_t *p,
+			  const char *uri,
+			  const char *hash)
+{
+  if (hash == NULL) {
+    rrdp_error(p, "Withdraw of %s has no hash", uri ? uri : "(missing)");
+    return;
+  }
+
+  if (rrdp_filename(p, uri) > 0 && rrdp_check_hash(p, uri, hash))
+    (void) rrdp_stage(p, 1);
+}
+
+/**
+ * Root element: check that this is the document we asked for, and
+ * pick up or check session and serial.
+ */
+static void rrdp_root(rrdp_parser_t *p,
+		      const char *name,
+		      const rrdp_attrs_t *attrs)
+{
+  static const char * const root[] = { "notification", "snapshot", "delta" };
+  const char *xmlns	 = rrdp_attr(attrs, "xmlns");
+  const char *version	 = rrdp_attr(attrs, "version");
+  const char *session_id = rrdp_attr(attrs, "session_id");
+  unsigned long serial;
+
+  if (strcmp(name, root[p->doc]))
+    rrdp_error(p, "Expected %s document, got %s", root[p->doc], name);
+
+  else if (xmlns == NULL || strcmp(xmlns, RRDP_XMLNS) ||
+	   version == NULL || strcmp(version, "1"))
+    rrdp_error(p, "Unsupported RRDP namespace or version");
+
+  else if (session_id == NULL || *session_id == '\0' ||
+	   strlen(session_id) >= sizeof(p->session_id) ||
+	   !rrdp_serial(rrdp_attr(attrs, "serial"), &serial))
+    rrdp_error(p, "Bad session_id or serial");
+
+  else if (p->doc == rrdp_doc_notification) {
+    strcpy(p->session_id, session_id);
+    p->serial = serial;
+  }
+
+  else if (strcmp(session_id, p->session_id) || serial != p->serial)
+    rrdp_error(p, "Session %s serial %lu doesn't match notification file (%s, %lu)",
+	       session_id, serial, p->session_id, p->serial);
+}
+
+/**
+ * Snapshot or delta listed in a notification file.
+ */
+static void rrdp_notification_entry(rrdp_parser_t *p,
+				    const char *name,
+				    const rrdp_attrs_t *attrs)
+{
+  const char *uri  = rrdp_attr(attrs, "uri");
+  const char *hash = rrdp_attr(attrs, "hash");
+  rrdp_delta_t *d = NULL;
+
+  if (uri == NULL || !is_http(uri) || strlen(uri) >= URI_MAX || !rrdp_is_hash(hash)) {
+    rrdp_error(p, "Bad %s entry", name);
+    return;
+  }
+
+  if (!strcmp(name, "snapshot")) {
+    strcpy(p->snapshot_uri, uri);
+    strcpy(p->snapshot_hash, hash);
+    return;
+  }
+
+  if ((d = malloc(sizeof(*d))) == NULL ||
+      !rrdp_serial(rrdp_attr(attrs, "serial"), &d->serial)) {
+    rrdp_error(p, "Bad delta entry");
+    free(d);
+    return;
+  }
+
+  strcpy(d->uri, uri);
+  strcpy(d->hash, hash);
+
+  if (!sk_rrdp_delta_t_push(p->deltas, d)) {
+    rrdp_error(p, "Couldn't record delta %s", uri);
+    free(d);
+  }
+}
+
+/**
+ * Start of an element.
+ */
+static void rrdp_start(rrdp_parser_t *p,
+		       const char *name,
+		       const rrdp_attrs_t *attrs)
+{
+  if (p->depth == 0)
+    rrdp_root(p, name, attrs);
+
+  else if (p->depth == 1 && p->doc == rrdp_doc_notification &&
+	   (!strcmp(name, "snapshot") || !strcmp(name, "delta")))
+    rrdp_notification_entry(p, name, attrs);
+
+  else if (p->depth == 1 && p->doc != rrdp_doc_notification && !strcmp(name, "publish"))
+    rrdp_publish_start(p, rrdp_attr(attrs, "uri"),
+		       p->doc == rrdp_doc_delta ? rrdp_attr(attrs, "hash") : NULL);
+
+  else if (p->depth == 1 && p->doc == rrdp_doc_delta && !strcmp(name, "withdraw"))
+    rrdp_withdraw(p, rrdp_attr(attrs, "uri"), rrdp_attr(attrs, "hash"));
+
+  else
+    rrdp_error(p, "Unexpected element %s", name);
+
+  p->depth++;
+}
+
+/**
+ * End of an element.
+ */
+static void rrdp_end(rrdp_parser_t *p)
+{
+  if (p->depth <= 0) {
+    rrdp_error(p, "Unbalanced end tag");
+    return;
+  }
+
+  if (--p->depth == 1 && p->fd >= 0)
+    rrdp_publish_end(p);
+
+  if (p->depth <= 1)
+    p->skip = 0;
+
+  if (p->depth == 0)
+    p->done = 1;
+}
+
+/**
+ * Process a complete tag: split out the element name and attributes,
+ * then dispatch.  XML declarations, DOCTYPEs and processing
+ * instructions are ignored.
+ */
+static void rrdp_tag(rrdp_parser_t *p)
+{
+  rrdp_attrs_t attrs;
+  const char *name;
+  char *s, *e, *value, q;
+  int empty = 0;
+
+  assert(p->taglen < sizeof(p->tag));
+  p->tag[p->taglen] = '\0';
+  s = p->tag;
+
+  if (*s == '?' || *s == '!')
+    return;
+
+  if (p->done) {
+    rrdp_error(p, "Junk after end of document");
+    return;
+  }
+
+  if (*s == '/') {
+    rrdp_end(p);
+    return;
+  }
+
+  for (e = s + p->taglen; e > s && strchr(RRDP_WHITESPACE, e[-1]); e--)
+    ;
+  if (e > s && e[-1] == '/') {
+    empty = 1;
+    e--;
+  }
+  *e = '\0';
+
+  name = s;
+  s += strcspn(s, RRDP_WHITESPACE);
+  if (*s != '\0')
+    *s++ = '\0';
+  name = rrdp_local_name(name);
+
+  for (attrs.n = 0; *(s += strspn(s, RRDP_WHITESPACE)) != '\0'; attrs.n++) {
+    if (attrs.n == RRDP_MAX_ATTRS) {
+      rrdp_error(p, "Too many attributes in %s element", name);
+      return;
+    }
+    attrs.name[attrs.n] = s;
+    e = s + strcspn(s, RRDP_WHITESPACE "=");
+    s = e + strspn(e, RRDP_WHITESPACE);
+    if (*s != '=') {
+      rrdp_error(p, "Malformed attribute in %s element", name);
+      return;
+    }
+    *e = '\0';
+    s++;
+    s += strspn(s, RRDP_WHITESPACE);
+    if (*s != '"' && *s != '\'') {
+      rrdp_error(p, "Unquoted attribute in %s element", name);
+      return;
+    }
+    q = *s++;
+    value = s;
+    if ((s = strchr(s, q)) != NULL)
+      *s++ = '\0';
+    if (s == NULL || !rrdp_unescape(value)) {
+      rrdp_error(p, "Malformed attribute value in %s element", name);
+      return;
+    }
+    attrs.value[attrs.n] = value;
+  }
+
+  rrdp_start(p, name, &attrs);
+  if (empty)
+    rrdp_end(p);
+}
+
+/**
+ * Decode one base64 character, or return -1 if it isn't one.
+ */
+static int rrdp_b64(const int c)
+{
+  if (c >= 'A' && c <= 'Z') return c - 'A';
+  if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+  if (c >= '0' && c <= '9') return c - '0' + 52;
+  if (c == '+')		    return 62;
+  if (c == '/')		    return 63;
+  return -1;
+}
+
+/**
+ * Character data.  The only text RRDP cares about is the base64
+ * content of publish elements, which we decode straight into the
+ * output file, so we never hold a whole object in memory, or ignore
+ * if we're skipping the object.  Whitespace elsewhere is just
+ * formatting.
+ */
+static void rrdp_text(rrdp_parser_t *p, const char *s, size_t n)
+{
+  int v;
+
+  if (p->skip)
+    return;
+
+  for (; n > 0 && !p->failed; s++, n--) {
+
+    if (strchr(RRDP_WHITESPACE, *s))
+      continue;
+
+    if (p->fd < 0) {
+      rrdp_error(p, "Unexpected text");
+      return;
+    }
+
+    if (*s == '=' && p->b64_count >= 2) {
+      p->b64_pad++;
+      v = 0;
+    } else if (p->b64_pad > 0 || (v = rrdp_b64((unsigned char) *s)) < 0) {
+      rrdp_error(p, "Bad base64 for %s", p->path.s);
+      return;
+    }
+
+    p->b64_bits = (p->b64_bits << 6) | v;
+
+    if (++p->b64_count < 4)
+      continue;
+
+    if (p->outlen + 3 > sizeof(p->out) && !rrdp_flush(p))
+      return;
+    p->out[p->outlen++] = (p->b64_bits >> 16) & 0xFF;
+    if (p->b64_pad < 2)
+      p->out[p->outlen++] = (p->b64_bits >> 8) & 0xFF;
+    if (p->b64_pad < 1)
+      p->out[p->outlen++] = p->b64_bits & 0xFF;
+    p->b64_bits = 0;
+    p->b64_count = 0;
+  }
+}
+
+/**
+ * Feed a chunk of an RRDP document to the parser.  This is a
+ * deliberately small XML tokenizer: enough for the flat, attribute-
+ * heavy documents RRDP uses, not a general XML parser.
+ */
+static int rrdp_parse(rrdp_parser_t *p, const char *buf, const size_t len)
+{
+  const char *lt;
+  size_t i = 0, n;
+  char c;
+
+  while (i < len && !p->failed) {
+
+    if (p->lex == rrdp_lex_text) {
+      lt = memchr(buf + i, '<', len - i);
+      n = lt ? lt - (buf + i) : len - i;
+      rrdp_text(p, buf + i, n);
+      i += n;
+      if (lt != NULL) {
+	p->lex = rrdp_lex_tag;
+	p->taglen = 0;
+	p->quote = 0;
+	i++;
+      }
+      continue;
+    }
+
+    c = buf[i++];
+
+    if (p->lex == rrdp_lex_comment) {
+      if (c == '>' && p->tag[0] == '-' && p->tag[1] == '-')
+	p->lex = rrdp_lex_text;
+      p->tag[0] = p->tag[1];
+      p->tag[1] = c;
+      continue;
+    }
+
+    if (p->quote && c == p->quote)
+      p->quote = 0;
+    else if (!p->quote && (c == '"' || c == '\''))
+      p->quote = c;
+    else if (!p->quote && c == '>') {
+      rrdp_tag(p);
+      p->lex = rrdp_lex_text;
+      continue;
+    }
+
+    if (p->taglen >= sizeof(p->tag) - 1) {
+      rrdp_error(p, "Tag too long");
+      break;
+    }
+
+    p->tag[p->taglen++] = c;
+
+    if (p->taglen == 3 && !memcmp(p->tag, "!--", 3)) {
+      p->lex = rrdp_lex_comment;
+      p->tag[0] = p->tag[1] = '\0';
+    }
+  }
+
+  return !p->failed;
+}
+
+/**
+ * Fetch a document over HTTP or HTTPS, feeding the body to the parser
+ * as it arrives and hashing it on the way through if the caller wants
+ * the hash.  We speak just enough HTTP/1.0 for this: one request per
+ * connection, no chunking, a few absolute redirects.  HTTPS checks
+ * the server against the system's trust anchors.
+ */
+static int rrdp_http_get(const rcynic_ctx_t *rc,
+			 const char *uri,
+			 rrdp_parser_t *p,
+			 unsigned char *digest)
+{
+  char target[URI_MAX], host[HOSTNAME_MAX], name[HOSTNAME_MAX], hostport[HOSTNAME_MAX + 8];
+  char line[URI_MAX + 64], location[URI_MAX], buf[16384];
+  int https, redirects, status, chunked, n, ret = 0;
+  SSL_CTX *ssl_ctx = NULL;
+  EVP_MD_CTX *md = NULL;
+  BIO *bio = NULL, *b;
+  long length, got;
+  const char *path;
+  SSL *ssl = NULL;
+  size_t len;
+  char *s;
+
+  assert(rc && uri && p);
+
+  if (strlen(uri) >= sizeof(target)) {
+    logmsg(rc, log_data_err, "RRDP: URI %s too long", uri);
+    goto done;
+  }
+  strcpy(target, uri);
+
+  for (redirects = 0; ; redirects++) {
+
+    https = !strncmp(target, SCHEME_HTTPS, SIZEOF_HTTPS);
+    if (!https && strncmp(target, SCHEME_HTTP, SIZEOF_HTTP)) {
+      logmsg(rc, log_data_err, "RRDP: can't fetch %s", target);
+      goto done;
+    }
+
+    s = target + (https ? SIZEOF_HTTPS : SIZEOF_HTTP);
+    len = strcspn(s, "/");
+    path = s[len] == '/' ? s + len : "/";
+    if (len == 0 || len >= sizeof(host)) {
+      logmsg(rc, log_data_err, "RRDP: bad host in %s", target);
+      goto done;
+    }
+    memcpy(host, s, len);
+    host[len] = '\0';
+    strcpy(name, host);
+    if ((s = strchr(name, ':')) != NULL)
+      *s = '\0';
+    snprintf(hostport, sizeof(hostport), "%s%s", host,
+	     strchr(host, ':') ? "" : https ? ":443" : ":80");
+
+    if ((bio = BIO_new_connect(hostport)) == NULL)
+      goto lose;
+
+    if (https) {
+      if (ssl_ctx == NULL) {
+	if ((ssl_ctx = SSL_CTX_new(SSLv23_client_method())) == NULL ||
+	    !SSL_CTX_set_default_verify_paths(ssl_ctx))
+	  goto lose;
+	SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+	SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER, NULL);
+      }
+      if ((b = BIO_new_ssl(ssl_ctx, 1)) == NULL)
+	goto lose;
+      bio = BIO_push(b, bio);
+      BIO_get_ssl(b, &ssl);
+      if (ssl == NULL || !SSL_set_tlsext_host_name(ssl, name))
+	goto lose;
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+      if (!X509_VERIFY_PARAM_set1_host(SSL_get0_param(ssl), name, 0))
+	goto lose;
+#else
+      /*
+       * Older OpenSSL can't check the server name for us, so all we
+       * get here is a chain check.  Not great, but the objects have
+       * to validate anyway.
+       */
+#endif
+    }
+
+    if ((b = BIO_new(BIO_f_buffer())) == NULL)
+      goto lose;
+    bio = BIO_push(b, bio);
+
+    if (BIO_do_connect(bio) <= 0) {
+      logmsg(rc, log_data_err, "RRDP: couldn't connect to %s for %s", hostport, target);
+      goto lose;
+    }
+
+    if (BIO_printf(bio,
+		   "GET %s HTTP/1.0\r\n"
+		   "Host: %s\r\n"
+		   "User-Agent: rcynic\r\n"
+		   "Connection: close\r\n"
+		   "\r\n", path, host) <= 0 ||
+	BIO_flush(bio) <= 0) {
+      logmsg(rc, log_data_err, "RRDP: couldn't send request for %s", target);
+      goto lose;
+    }
+
+    if (BIO_gets(bio, line, sizeof(line)) <= 0 ||
+	sscanf(line, "HTTP/%*d.%*d %d", &status) != 1) {
+      logmsg(rc, log_data_err, "RRDP: bad response fetching %s", target);
+      goto lose;
+    }
+
+    length = -1;
+    chunked = 0;
+    location[0] = '\0';
+
+    for (;;) {
+      if (BIO_gets(bio, line, sizeof(line)) <= 0) {
+	logmsg(rc, log_data_err, "RRDP: truncated headers fetching %s", target);
+	goto lose;
+      }
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0] == '\0')
+	break;
+      if ((s = strchr(line, ':')) == NULL)
+	continue;
+      *s++ = '\0';
+      s += strspn(s, RRDP_WHITESPACE);
+      if (!strcasecmp(line, "Location") && strlen(s) < sizeof(location))
+	strcpy(location, s);
+      else if (!strcasecmp(line, "Content-Length"))
+	length = strtol(s, NULL, 10);
+      else if (!strcasecmp(line, "Transfer-Encoding") && strcasecmp(s, "identity"))
+	chunked = 1;
+    }
+
+    if (status / 100 != 3 || location[0] == '\0')
+      break;
+
+    if (redirects >= RRDP_MAX_REDIRECTS || !is_http(location)) {
+      logmsg(rc, log_data_err, "RRDP: won't follow redirect from %s to %s", target, location);
+      goto done;
+    }
+
+    logmsg(rc, log_verbose, "RRDP: %s redirected to %s", target, location);
+    strcpy(target, location);
+    BIO_free_all(bio);
+    bio = NULL;
+  }
+
+  if (status != 200) {
+    logmsg(rc, log_data_err, "RRDP: HTTP status %d fetching %s", status, target);
+    goto done;
+  }
+
+  if (chunked) {
+    logmsg(rc, log_data_err, "RRDP: chunked reply to HTTP/1.0 request for %s", target);
+    goto done;
+  }
+
+  if (digest != NULL &&
+      ((md = EVP_MD_CTX_create()) == NULL ||
+       !EVP_DigestInit_ex(md, EVP_sha256(), NULL)))
+    goto lose;
+
+  for (got = 0; (n = BIO_read(bio, buf, sizeof(buf))) > 0; got += n)
+    if ((md != NULL && !EVP_DigestUpdate(md, buf, n)) ||
+	!rrdp_parse(p, buf, n))
+      goto done;
+
+  if ((length >= 0 && got != length) || !p->done) {
+    logmsg(rc, log_data_err, "RRDP: truncated document %s", target);
+    goto done;
+  }
+
+  if (md != NULL && !EVP_DigestFinal_ex(md, digest, NULL))
+    goto lose;
+
+  ret = 1;
+  goto done;
+
+ lose:
+  log_openssl_errors(rc);
+
+ done:
+  if (md)
+    EVP_MD_CTX_destroy(md);
+  BIO_free_all(bio);
+  if (ssl_ctx)
+    SSL_CTX_free(ssl_ctx);
+  return ret;
+}
+
+/**
+ * Fetch a snapshot or delta and check it against the hash, session
+ * and serial the notification file gave us for it.  The hash can't
+ * be checked until we've seen the whole thing, so the objects wait in
+ * temporary files until then, and only go into the unauthenticated
+ * tree if it matches.
+ */
+static int rrdp_fetch_file(const rcynic_ctx_t *rc,
+			   const rrdp_doc_t doc,
+			   const char *uri,
+			   const char *hash,
+			   const char *base,
+			   const char *session_id,
+			   const unsigned long serial)
+{
+  unsigned char digest[HASH_SHA256_LEN];
+  char hex[RRDP_HASH_HEX_LEN + 1];
+  rrdp_parser_t *p;
+  int ok = 0;
+
+  if ((p = rrdp_parser_new(rc, doc, uri, base)) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate RRDP parser");
+    return 0;
+  }
+
+  assert(strlen(session_id) < sizeof(p->session_id));
+  strcpy(p->session_id, session_id);
+  p->serial = serial;
+
+  logmsg(rc, log_verbose, "RRDP: fetching %s %s, serial %lu",
+	 doc == rrdp_doc_snapshot ? "snapshot" : "delta", uri, serial);
+
+  if (!rrdp_http_get(rc, uri, p, digest))
+    goto done;
+
+  rrdp_hex(digest, hex);
+  if (strcasecmp(hex, hash)) {
+    logmsg(rc, log_data_err, "RRDP: %s doesn't match hash in notification file", uri);
+    goto done;
+  }
+
+  if (!rrdp_commit(p))
+    goto done;
+
+  if (p->outside > 0)
+    logmsg(rc, log_data_err, "RRDP: %s: skipped %lu objects outside %s",
+	   uri, p->outside, base);
+
+  logmsg(rc, log_verbose, "RRDP: %s: %lu objects updated", uri, p->objects);
+  ok = 1;
+
+ done:
+  rrdp_parser_free(p);
+  return ok;
+}
+
+/**
+ * Figure out where we keep session state for a notification URI and
+ * SIA: the hex SHA-256 of the two URIs, in rrdp-directory.  Each SIA
+ * needs its own serial, since a fetch for one SIA only brings that
+ * one up to date.
+ */
+static int rrdp_state_filename(const rcynic_ctx_t *rc,
+			       const char *notify,
+			       const char *base,
+			       path_t *path)
+{
+  unsigned char digest[HASH_SHA256_LEN];
+  char hex[RRDP_HASH_HEX_LEN + 1];
+  EVP_MD_CTX *ctx;
+  int ok;
+
+  if ((ctx = EVP_MD_CTX_create()) == NULL)
+    return 0;
+  ok = (EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) &&
+	EVP_DigestUpdate(ctx, notify, strlen(notify) + 1) &&
+	EVP_DigestUpdate(ctx, base, strlen(base)) &&
+	EVP_DigestFinal_ex(ctx, digest, NULL));
+  EVP_MD_CTX_destroy(ctx);
+  if (!ok)
+    return 0;
+  rrdp_hex(digest, hex);
+  return snprintf(path->s, sizeof(path->s), "%s%s", rc->rrdp_directory.s, hex) < sizeof(path->s);
+}
+
+/**
+ * Read session state from the last successful fetch, if any.
+ */
+static int rrdp_state_read(const rcynic_ctx_t *rc,
+			   const char *notify,
+			   const char *base,
+			   char *session_id,
+			   unsigned long *serial)
+{
+  char fmt[sizeof("%9999s %lu")];
+  path_t path;
+  FILE *f;
+  int ok;
+
+  if (!rrdp_state_filename(rc, notify, base, &path) || (f = fopen(path.s, "r")) == NULL)
+    return 0;
+  snprintf(fmt, sizeof(fmt), "%%%ds %%lu", RRDP_SESSION_MAX - 1);
+  ok = fscanf(f, fmt, session_id, serial) == 2;
+  fclose(f);
+  return ok;
+}
+
+/**
+ * Save session state after a successful fetch.  The URIs are just
+ * there for the benefit of humans poking around in rrdp-directory.
+ */
+static int rrdp_state_write(const rcynic_ctx_t *rc,
+			    const char *notify,
+			    const char *base,
+			    const char *session_id,
+			    const unsigned long serial)
+{
+  path_t path, temp;
+  FILE *f;
+  int ok;
+
+  if (!rrdp_state_filename(rc, notify, base, &path) ||
+      snprintf(temp.s, sizeof(temp.s), "%s.tmp", path.s) >= sizeof(temp.s)) {
+    logmsg(rc, log_data_err, "RRDP: state filename for %s too long", notify);
+    return 0;
+  }
+
+  if (!mkdir_maybe(rc, &temp) || (f = fopen(temp.s, "w")) == NULL) {
+    logmsg(rc, log_sys_err, "RRDP: couldn't create %s: %s", temp.s, strerror(errno));
+    return 0;
+  }
+
+  ok = fprintf(f, "%s %lu %s %s\n", session_id, serial, notify, base) != EOF;
+  ok &= fclose(f) != EOF;
+  ok = ok && rename(temp.s, path.s) == 0;
+
+  if (!ok) {
+    logmsg(rc, log_sys_err, "RRDP: couldn't write %s: %s", path.s, strerror(errno));
+    (void) unlink(temp.s);
+  }
+
+  return ok;
+}
+
+/**
+ * Check whether the notification file lists every delta we need to
+ * get from where we were to the current serial.
+ */
+static int rrdp_deltas_usable(rrdp_parser_t *p, const unsigned long serial)
+{
+  const rrdp_delta_t *d;
+  unsigned long next = serial + 1;
+  int i;
+
+  sk_rrdp_delta_t_sort(p->deltas);
+
+  for (i = 0; (d = sk_rrdp_delta_t_value(p->deltas, i)) != NULL; i++)
+    if (d->serial == next)
+      next++;
+
+  return next == p->serial + 1;
+}
+
+/**
+ * Fetch the part of a repository under base via RRDP.  This runs in
+ * the child process.  Returns 1 if the unauthenticated tree now
+ * reflects the repository's current serial.
+ */
+static int rrdp_fetch(const rcynic_ctx_t *rc, const char *notify, const char *base)
+{
+  char session_id[RRDP_SESSION_MAX] = "";
+  unsigned long serial = 0, next;
+  rrdp_parser_t *p = NULL;
+  const rrdp_delta_t *d;
+  int i, ok = 0, have_state;
+
+  have_state = rrdp_state_read(rc, notify, base, session_id, &serial);
+
+  if ((p = rrdp_parser_new(rc, rrdp_doc_notification, notify, NULL)) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate RRDP parser");
+    goto done;
+  }
+
+  if (!rrdp_http_get(rc, notify, p, NULL))
+    goto done;
+
+  have_state = have_state && !strcmp(session_id, p->session_id);
+
+  if (have_state && serial == p->serial) {
+    logmsg(rc, log_verbose, "RRDP: %s unchanged at serial %lu", notify, serial);
+    ok = 1;
+    goto done;
+  }
+
+  if (have_state && serial < p->serial && rrdp_deltas_usable(p, serial)) {
+    for (i = 0, next = serial + 1, ok = 1; ok && (d = sk_rrdp_delta_t_value(p->deltas, i)) != NULL; i++)
+      if (d->serial == next && (ok = rrdp_fetch_file(rc, rrdp_doc_delta, d->uri, d->hash, base,
+						     p->session_id, d->serial)) != 0)
+	next++;
+    if (!ok)
+      logmsg(rc, log_telemetry, "RRDP: couldn't apply deltas from %s, trying snapshot", notify);
+  } else {
+    logmsg(rc, log_verbose, "RRDP: no usable deltas from %s, fetching snapshot", notify);
+  }
+
+  if (!ok && p->snapshot_uri[0] == '\0')
+    logmsg(rc, log_data_err, "RRDP: %s doesn't list a snapshot", notify);
+  else if (!ok)
+    ok = rrdp_fetch_file(rc, rrdp_doc_snapshot, p->snapshot_uri, p->snapshot_hash, base,
+			 p->session_id, p->serial);
+
+  ok = ok && rrdp_state_write(rc, notify, base, p->session_id, p->serial);
+
+ done:
+  rrdp_parser_free(p);
+  return ok;
+}
+
+/**
+ * Body of an RRDP subprocess, called right after fork(), with the
+ * worker pool parked, so we're the only thread there is and there are
+ * no locks held by threads that don't exist any more.  The pipe is on
+ * our stdout so that our parent sees it close when we're done, and so
+ * that we can tell it about objects outside the repository.  Log
+ * messages go straight to wherever our parent's go; making stderr line
+ * buffered means each one goes out in a single write() and doesn't get
+ * interleaved with anybody else's.  We never exec(), so close-on-exec
+ * does nothing for us; close the other fetches' pipes and pidfds by
+ * hand, lest we hold them open after those fetches are done.  Never
+ * returns.
+ */
+static void rrdp_child(const rcynic_ctx_t *rc,
+		       const rsync_ctx_t *ctx,
+		       int *pipe_fds)
+{
+  const rsync_ctx_t *c;
+  int i;
+
+  for (i = 0; (c = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; i++) {
+    if (c != ctx && c->fd >= 0)
+      (void) close(c->fd);
+    if (c != ctx && c->pidfd >= 0)
+      (void) close(c->pidfd);
+  }
+
+  if (close(pipe_fds[0]) < 0 || dup2(pipe_fds[1], 1) < 0 || close(pipe_fds[1]) < 0)
+    _exit(1);
+
+  (void) setvbuf(stderr, NULL, _IOLBF, BUFSIZ);
+
+  SSL_library_init();
+  SSL_load_error_strings();
+
+  _exit(rrdp_fetch(rc, ctx->notify.s, ctx->uri.s) ? 0 : 1);
+}
+
+
+
+/**
+ * Clean up old stuff from previous rsync runs.  --delete doesn't help
+ * if the URI changes and we never visit the old URI again.
+ */
+static int prune_unauthenticated(const rcynic_ctx_t *rc,
+				 const path_t *name,
+				 const size_t baselen)
+{
+  path_t path;
+  struct dirent *d;
+  DIR *dir;
+  const char *slash;
+
+  assert(rc && name && baselen > 0 && strlen(name->s) >= baselen);
+
+  if (!is_directory(name)) {
+    logmsg(rc, log_usage_err, "prune: %s is not a directory", name->s);
+    return 0;
+  }
+
+  if ((dir = opendir(name->s)) == NULL) {
+    logmsg(rc, log_sys_err, "prune: opendir() failed on %s: %s", name->s, strerror(errno));
+    return 0;
+  }
+
+  slash = endswith(name->s, "/") ? "" : "/";
+
+  while ((d = readdir(dir)) != NULL) {
+    if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+      continue;
+
+    if (snprintf(path.s, sizeof(path.s), "%s%s%s", name->s, slash, d->d_name) >= sizeof(path.s)) {
+      logmsg(rc, log_debug, "prune: %s%s%s too long", name->s, slash, d->d_name);
+      goto done;
+    }
+
+    if (validation_status_find_filename(rc, path.s + baselen)) {
+      logmsg(rc, log_debug, "prune: cache hit %s", path.s);
+      continue;
+    }
+
+    if (unlink(path.s) == 0) {
+      logmsg(rc, log_debug, "prune: removed %s", path.s);
+      continue;
+    }
+
+    if (prune_unauthenticated(rc, &path, baselen))
+      continue;
+
+    logmsg(rc, log_sys_err, "prune: removing %s failed: %s", path.s, strerror(errno));
+    goto done;
+  }
+
+  if (rmdir(name->s) == 0)
+    logmsg(rc, log_debug, "prune: removed %s", name->s);
+  else if (errno != ENOTEMPTY)
+    logmsg(rc, log_sys_err, "prune: couldn't remove %s: %s", name->s, strerror(errno));
+
+ done:
+  closedir(dir);
+  return !d;
+}
+
+
+
+/**
+ * Load an entire file into memory.  Small files we just read(); large
+ * ones (big CRLs and manifests, mostly) we map, which saves copying
+ * them.  Files larger than max_size are rejected.
+ */
+static unsigned char *load_file(const path_t *filename,
+				const size_t max_size,
+				size_t *len,
+				int *mapped)
+{
+  unsigned char *buf = NULL;
+  struct stat statbuf;
+  size_t got;
+  ssize_t n;
+  int fd;
+
+  assert(filename && len && mapped);
+
+  *mapped = 0;
+
+  if ((fd = open(filename->s, O_RDONLY)) < 0)
+    return NULL;
+
+  if (fstat(fd, &statbuf) < 0 || statbuf.st_size <= 0 || (size_t) statbuf.st_size > max_size)
+    goto done;
+
+  *len = statbuf.st_size;
+
+  if (*len > MMAP_THRESHOLD) {
+    if ((buf = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+      buf = NULL;
+    else
+      *mapped = 1;
+    goto done;
+  }
+
+  if ((buf = malloc(*len)) == NULL)
+    goto done;
+
+  for (got = 0; got < *len; got += n) {
+    if ((n = read(fd, buf + got, *len - got)) <= 0) {
+      free(buf);
+      buf = NULL;
+      break;
+    }
+  }
+
+ done:
+  (void) close(fd);
+  return buf;
+}
+
+/**
+ * Release a buffer returned by load_file().
+ */
+static void unload_file(unsigned char *buf, const size_t len, const int mapped)
+{
+  if (buf && mapped)
+    (void) munmap(buf, len);
+  else if (buf)
+    free(buf);
+}
+
+/**
+ * Check whether two files have the same contents.  Hard links to the
+ * same inode (use-links) obviously do.  Otherwise, since we preserve
+ * modification times when we copy, a copy which still has the
+ * original's size and mtime is probably the same, and we compare the
+ * bytes to make sure.
+ */
+static int same_file_contents(const path_t *a, const path_t *b, const size_t max_size)
+{
+  unsigned char *abuf = NULL, *bbuf = NULL;
+  struct stat ast, bst;
+  int amapped, bmapped, ok;
+  size_t alen, blen;
+
+  assert(a && b);
+
+  if (stat(a->s, &ast) < 0 || stat(b->s, &bst) < 0)
+    return 0;
+
+  if (ast.st_dev == bst.st_dev && ast.st_ino == bst.st_ino)
+    return 1;
+
+  if (ast.st_size != bst.st_size || ast.st_mtime != bst.st_mtime)
+    return 0;
+
+  ok = ((abuf = load_file(a, max_size, &alen, &amapped)) != NULL &&
+	(bbuf = load_file(b, max_size, &blen, &bmapped)) != NULL &&
+	alen == blen && !memcmp(abuf, bbuf, alen));
+
+  if (abuf)
+    unload_file(abuf, alen, amapped);
+  if (bbuf)
+    unload_file(bbuf, blen, bmapped);
+  return ok;
+}
+
+/**
+ * Copy the validation status codes logged so far for the current
+ * generation of an object, so that backup_same_as_current() can tell
+ * which ones the check of the current generation added.
+ */
+static void current_events(const rcynic_ctx_t *rc,
+			   const uri_t *uri,
+			   unsigned char events[(MIB_COUNTER_T_MAX + 7) / 8])
+{
+  const validation_status_t *v;
+
+  assert(rc && uri && events);
+
+  if ((v = validation_status_find(rc->validation_status, uri, object_generation_current)) != NULL)
+    memcpy(events, v->events, sizeof(v->events));
+  else
+    memset(events, 0, (MIB_COUNTER_T_MAX + 7) / 8);
+}
+
+/**
+ * In steady state, the backup copy of an object is usually the very
+ * same bytes as the current copy, so checking it would just repeat
+ * every test (and every signature verification) we just did on the
+ * current copy, with the same results.  If that's the case, log the
+ * codes the current check logged (those not in events, which the
+ * caller got from current_events() before the check) against the
+ * backup generation instead, and return 1 to tell the caller to treat
+ * the backup as having gotten the same verdict.
+ *
+ * Only the codes the check itself logged are copied.  Anything
+ * already on the current generation's entry before the check was
+ * logged by somebody else about the current copy (how we fetched it,
+ * what the manifest said about it, and so on), and checking the
+ * backup copy for real wouldn't have logged it against the backup
+ * generation either, so neither do we.
+ *
+ * Either way, path is set to the backup copy's filename.
+ */
+static int backup_same_as_current(rcynic_ctx_t *rc,
+				  const uri_t *uri,
+				  path_t *path,
+				  const size_t max_size,
+				  const unsigned char events[(MIB_COUNTER_T_MAX + 7) / 8])
+{
+  const validation_status_t *v;
+  mib_counter_t code;
+  path_t current;
+  int same;
+
+  assert(rc && uri && path && events);
+
+  if (!uri_to_filename(rc, uri, &current, &rc->unauthenticated) ||
+      !uri_to_filename(rc, uri, path, &rc->old_authenticated))
+    return 0;
+
+  rcynic_unlock(rc);
+  same = same_file_contents(&current, path, max_size);
+  rcynic_lock(rc);
+
+  if (!same)
+    return 0;
+
+  logmsg(rc, log_verbose, "Backup copy of %s is the same as current copy, not checking it again", uri->s);
+
+  if ((v = validation_status_find(rc->validation_status, uri, object_generation_current)) != NULL)
+    for (code = (mib_counter_t) 0; code < MIB_COUNTER_T_MAX; code++)
+      if (validation_status_get_code(v, code) && !(events[code / 8] & (1 << (code % 8))))
+	log_validation_status(rc, uri, code, object_generation_backup);
+
+  return 1;
+}
+
+/**
+ * Read a DER object and hash the file content in one pass over an
+ * in-memory copy of the file.  Returns the internal form of the
+ * parsed DER object, sets the hash buffer (if specified) as a side
+ * effect.  The default hash algorithm is SHA-256.
+ */
+static void *read_file_with_hash(const path_t *filename,
+				 const ASN1_ITEM *it,
+				 const size_t max_size,
+				 const EVP_MD *md,
+				 hashbuf_t *hash)
+{
+  const unsigned char *p;
+  unsigned char *buf;
+  void *result = NULL;
+  int mapped;
+  size_t len;
+
+  if ((buf = load_file(filename, max_size, &len, &mapped)) == NULL)
+    return NULL;
+
+  if (hash != NULL) {
+    memset(hash, 0, sizeof(*hash));
+    if (!EVP_Digest(buf, len, hash->h, NULL, (md ? md : EVP_sha256()), NULL))
+      goto error;
+  }
+
+  p = buf;
+  result = ASN1_item_d2i(NULL, &p, len, it);
+
+ error:
+  unload_file(buf, len, mapped);
+  return result;
+}
+
+/**
+ * Read and hash a certificate.
+ */
+static X509 *read_cert(const path_t *filename, hashbuf_t *hash)
+{
+  return read_file_with_hash(filename, ASN1_ITEM_rptr(X509), MAX_CERT_SIZE, NULL, hash);
+}
+
+/**
+ * Read and hash a CRL.
+ */
+static X509_CRL *read_crl(const path_t *filename, hashbuf_t *hash)
+{
+  return read_file_with_hash(filename, ASN1_ITEM_rptr(X509_CRL), MAX_CRL_SIZE, NULL, hash);
+}
+
+/**
+ * Read and hash a CMS message.
+ */
+static CMS_ContentInfo *read_cms(const path_t *filename, hashbuf_t *hash)
+{
+  return read_file_with_hash(filename, ASN1_ITEM_rptr(CMS_ContentInfo), MAX_CMS_SIZE, NULL, hash);
+}
+
+
+
+/**
+ * Extract CRLDP data from a certificate.  Stops looking after finding
+ * the first rsync URI.
+ */
+static int extract_crldp_uri(rcynic_ctx_t *rc,
+			     const uri_t *uri,
+			     const object_generation_t generation,
+			     const STACK_OF(DIST_POINT) *crldp,
+			     uri_t *result)
+{
+  DIST_POINT *d;
+  int i;
+
+  assert(rc && uri && crldp && result);
+
+  if (sk_DIST_POINT_num(crldp) != 1)
+    goto bad;
+
+  d = sk_DIST_POINT_value(crldp, 0);
+
+  if (d->reasons || d->CRLissuer || !d->distpoint || d->distpoint->type != 0)
+    goto bad;
+
+  for (i = 0; i < sk_GENERAL_NAME_num(d->distpoint->name.fullname); i++) {
+    GENERAL_NAME *n = sk_GENERAL_NAME_value(d->distpoint->name.fullname, i);
+    if (n == NULL || n->type != GEN_URI)
+      goto bad;
+    if (!is_rsync((char *) n->d.uniformResourceIdentifier->data))
+      log_validation_status(rc, uri, non_rsync_uri_in_extension, generation);
+    else if (URI_MAX <= n->d.uniformResourceIdentifier->length)
+      log_validation_status(rc, uri, uri_too_long, generation);
+    else if (result->s[0])
+      log_validation_status(rc, uri, multiple_rsync_uris_in_extension, generation);
+    else if (!uri_intern(rc, result, (char *) n->d.uniformResourceIdentifier->data))
+      return 0;
+  }
+
+  return result->s[0];
+
+ bad:
+  log_validation_status(rc, uri, malformed_crldp_extension, generation);
+  return 0;
+}
+
+/**
+ * Extract SIA or AIA data from a certificate.
+ */
+static int extract_access_uri(rcynic_ctx_t *rc,
+			      const uri_t *uri,
+			      const object_generation_t generation,
+			      const AUTHORITY_INFO_ACCESS *xia,
+			      const int nid,
+			      uri_t *result,
+			      int *count,
+			      int (*relevant)(const char *))
+{
+  int i;
+
+  assert(rc && uri && xia && result && count);
+
+  for (i = 0; i < sk_ACCESS_DESCRIPTION_num(xia); i++) {
+    ACCESS_DESCRIPTION *a = sk_ACCESS_DESCRIPTION_value(xia, i);
+    if (a == NULL || a->location->type != GEN_URI)
+      return 0;
+    if (OBJ_obj2nid(a->method) != nid)
+      continue;
+    ++*count;
+    if (relevant && !relevant((char *) a->location->d.uniformResourceIdentifier->data))
+      continue;
+    if (URI_MAX <= a->location->d.uniformResourceIdentifier->length)
+      log_validation_status(rc, uri, uri_too_long, generation);
+    else if (result->s[0])
+      log_validation_status(rc, uri, multiple_rsync_uris_in_extension, generation);
+    else if (!uri_intern(rc, result, (char *) a->location->d.uniformResourceIdentifier->data))
+      return 0;
+  }
+  return 1;
+}
+
+
+
+/**
+ * Check to see whether an AKI extension is present, is of the right
+ * form, and matches the issuer.
+ */
+static int check_aki(rcynic_ctx_t *rc,
+		     const uri_t *uri,
+		     const X509 *issuer,
+		     const AUTHORITY_KEYID *aki,
+		     const object_generation_t generation)
+{
+  assert(rc && uri && issuer && issuer->skid);
+
+  if (aki == NULL) {
+    log_validation_status(rc, uri, aki_extension_missing, generation);
+    return 0;
+  }
+
+  if (!aki->keyid || aki->serial || aki->issuer) {
+    log_validation_status(rc, uri, aki_extension_wrong_format, generation);
+    return 0;
+  }
+
+  if (ASN1_OCTET_STRING_cmp(aki->keyid, issuer->skid)) {
+    log_validation_status(rc, uri, aki_extension_issuer_mismatch, generation);
+    return 0;
+  }
+
+  return 1;
+}
+
+
+
+/**
+ * Check whether a Distinguished Name conforms to the rescert profile.
+ * The profile is very restrictive: it only allows one mandatory
+ * CommonName field and one optional SerialNumber field, both of which
+ * must be of type PrintableString.
+ */
+static int check_allowed_dn(X509_NAME *dn)
+{
+  X509_NAME_ENTRY *ne;
+  ASN1_STRING *s;
+  int loc;
+
+  if (dn == NULL)
+    return 0;
+
+  switch (X509_NAME_entry_count(dn)) {
+
+  case 2:
+    if ((loc = X509_NAME_get_index_by_NID(dn, NID_serialNumber, -1)) < 0 ||
+	(ne = X509_NAME_get_entry(dn, loc)) == NULL ||
+	(s = X509_NAME_ENTRY_get_data(ne)) == NULL ||
+	ASN1_STRING_type(s) != V_ASN1_PRINTABLESTRING)
+      return 0;
+
+    /* Fall through */
+
+  case 1:
+    if ((loc = X509_NAME_get_index_by_NID(dn, NID_commonName, -1)) < 0 ||
+	(ne = X509_NAME_get_entry(dn, loc)) == NULL ||
+	(s = X509_NAME_ENTRY_get_data(ne)) == NULL ||
+	ASN1_STRING_type(s) != V_ASN1_PRINTABLESTRING)
+      return 0;
+
+    return 1;
+
+  default:
+    return 0;
+  }
+}
+
+/**
+ * Check whether an ASN.1 TIME value conforms to RFC 5280 4.1.2.5.
+ */
+static int check_allowed_time_encoding(ASN1_TIME *t)
+{
+  switch (t->type) {
+
+  case V_ASN1_UTCTIME:
+    return t->length == sizeof("yymmddHHMMSSZ") - 1;
+
+  case  V_ASN1_GENERALIZEDTIME:
+    return (t->length == sizeof("yyyymmddHHMMSSZ") - 1 &&
+	    strcmp("205", (char *) t->data) <= 0);
+
+  }
+  return 0;
+}
+
+/**
+ * Compare ASN1_TIME values.
+ */
+static int asn1_time_cmp(ASN1_TIME *t1, ASN1_TIME *t2)
+{
+  ASN1_GENERALIZEDTIME *g1 = ASN1_TIME_to_generalizedtime(t1, NULL);
+  ASN1_GENERALIZEDTIME *g2 = ASN1_TIME_to_generalizedtime(t2, NULL);
+
+  int cmp = ASN1_STRING_cmp(g1, g2);
+
+  ASN1_GENERALIZEDTIME_free(g1);
+  ASN1_GENERALIZEDTIME_free(g2);
+
+  return cmp;
+}
+
+
+
+/**
+ * Allocate a new CRL cache.
+ */
+static crl_cache_index_t *crl_cache_index_new(void)
+{
+  crl_cache_index_t *idx = malloc(sizeof(*idx));
+  if (idx)
+    memset(idx, 0, sizeof(*idx));
+  return idx;
+}
+
+/**
+ * Free a CRL cache and all the entries in it.
+ */
+static void crl_cache_index_free(crl_cache_index_t *idx)
+{
+  size_t i;
+
+  if (idx) {
+    for (i = 0; i < idx->nslots; i++)
+      crl_cache_t_free(idx->slots[i]);
+    free(idx->slots);
+    free(idx);
+  }
+}
+
+/**
+ * Find the slot in a CRL cache where an entry lives or would live.
+ * URIs are interned, so the handle itself is the key, and the table
+ * entry behind it already carries its hash.
+ */
+static crl_cache_t **crl_cache_slot(const crl_cache_index_t *idx,
+				    const uri_t *uri)
+{
+  size_t mask = idx->nslots - 1, i;
+  crl_cache_t *c;
+
+  for (i = uri_entry(uri)->hash & mask; (c = idx->slots[i]) != NULL; i = (i + 1) & mask)
+    if (c->uri.s == uri->s)
+      break;
+
+  return &idx->slots[i];
+}
+
+/**
+ * Double the size of a CRL cache's hash table.
+ */
+static int crl_cache_index_grow(crl_cache_index_t *idx)
+{
+  size_t nslots = idx->nslots ? idx->nslots * 2 : CRL_CACHE_MIN_SLOTS;
+  crl_cache_t **slots, *c;
+  size_t i, j;
+
+  if ((slots = calloc(nslots, sizeof(*slots))) == NULL)
+    return 0;
+
+  for (i = 0; i < idx->nslots; i++) {
+    if ((c = idx->slots[i]) == NULL)
+      continue;
+    for (j = uri_entry(&c->uri)->hash & (nslots - 1); slots[j] != NULL; j = (j + 1) & (nslots - 1))
+      ;
+    slots[j] = c;
+  }
+
+  free(idx->slots);
+  idx->slots = slots;
+  idx->nslots = nslots;
+  return 1;
+}
+
+/**
+ * Look up a CRL we've already accepted.
+ */
+static crl_cache_t *crl_cache_find(const rcynic_ctx_t *rc,
+				   const uri_t *uri)
+{
+  assert(rc && uri && rc->crl_cache);
+
+  if (rc->crl_cache->nslots == 0 || !uri->s[0])
+    return NULL;
+
+  return *crl_cache_slot(rc->crl_cache, uri);
+}
+
+/**
+ * Remember a CRL we've just accepted.  The cache takes its own
+ * reference to the CRL, caller still owns the one it passed in.
+ */
+static void crl_cache_add(const rcynic_ctx_t *rc,
+			  const uri_t *uri,
+			  const object_generation_t generation,
+			  X509_CRL *crl,
+			  const hashbuf_t *hash)
+{
+  crl_cache_index_t *idx = rc->crl_cache;
+  crl_cache_t *c;
+
+  assert(rc && uri && crl && hash && idx);
+
+  if (!uri->s[0] || crl_cache_find(rc, uri) != NULL)
+    return;
+
+  if ((idx->count + 1) * 4 > idx->nslots * 3 && !crl_cache_index_grow(idx)) {
+    logmsg(rc, log_sys_err, "Couldn't add %s to CRL cache", uri->s);
+    return;
+  }
+
+  if ((c = malloc(sizeof(*c))) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate CRL cache entry for %s", uri->s);
+    return;
+  }
+
+  memset(c, 0, sizeof(*c));
+  c->uri = *uri;
+  c->generation = generation;
+  c->hash = *hash;
+  c->crl = crl;
+  CRYPTO_add(&crl->references, 1, CRYPTO_LOCK_X509_CRL);
+
+  *crl_cache_slot(idx, uri) = c;
+  idx->count++;
+}
+
+/**
+ * Attempt to read and check one CRL from disk.
+ */
+
+static X509_CRL *check_crl_1(rcynic_ctx_t *rc,
+			     STACK_OF(walk_ctx_t) *wsk,
+			     const uri_t *uri,
+			     path_t *path,
+			     const path_t *prefix,
+			     X509 *issuer,
+			     hashbuf_t *hash,
+			     const object_generation_t generation)
+{
+  STACK_OF(X509_REVOKED) *revoked;
+  X509_CRL *crl = NULL;
+  EVP_PKEY *pkey;
+  stopwatch_t sw;
+  int i, ret;
+
+  assert(uri && path && issuer);
+
+  if (!uri_to_filename(rc, uri, path, prefix))
+    goto punt;
+
+  rcynic_unlock(rc);
+  stopwatch_start(&sw, CLOCK_THREAD_CPUTIME_ID);
+  crl = read_crl(path, hash);
+  stopwatch_stop(&sw);
+  rcynic_lock(rc);
+  operation_charge(rc, wsk, operation_decode, &sw);
+
+  if (crl == NULL)
+    goto punt;
+
+  if (X509_CRL_get_version(crl) != 1) {
+    log_validation_status(rc, uri, wrong_object_version, generation);
+    goto punt;
+  }
+
+  if (!crl->crl || !crl->crl->sig_alg || !crl->crl->sig_alg->algorithm ||
+      OBJ_obj2nid(crl->crl->sig_alg->algorithm) != NID_sha256WithRSAEncryption) {
+    log_validation_status(rc, uri, nonconformant_signature_algorithm, generation);
+    goto punt;
+  }
+
+  if (!check_allowed_time_encoding(X509_CRL_get_lastUpdate(crl)) ||
+      !check_allowed_time_encoding(X509_CRL_get_nextUpdate(crl))) {
+    log_validation_status(rc, uri, nonconformant_asn1_time_value, generation);
+    goto punt;
+  }
+
+  if (validation_cmp_time(rc, X509_CRL_get_lastUpdate(crl)) > 0) {
+    log_validation_status(rc, uri, crl_not_yet_valid, generation);
+    goto punt;
+  }
+
+  if (validation_cmp_time(rc, X509_CRL_get_nextUpdate(crl)) < 0) {
+    log_validation_status(rc, uri, stale_crl_or_manifest, generation);
+    if (!rc->allow_stale_crl)
+      goto punt;
+  }
+
+  if (!check_aki(rc, uri, issuer, crl->akid, generation))
+    goto punt;
+
+  if (crl->crl_number == NULL) {
+    log_validation_status(rc, uri, crl_number_extension_missing, generation);
+    goto punt;
+  }
+
+  if (ASN1_INTEGER_cmp(crl->crl_number, asn1_zero) < 0) {
+    log_validation_status(rc, uri, crl_number_is_negative, generation);
+    goto punt;
+  }
+
+  if (ASN1_INTEGER_cmp(crl->crl_number, asn1_twenty_octets) > 0) {
+    log_validation_status(rc, uri, crl_number_out_of_range, generation);
+    goto punt;
+  }
+
+  if (X509_CRL_get_ext_count(crl) != 2) {
+    log_validation_status(rc, uri, disallowed_x509v3_extension, generation);
+    goto punt;
+  }
+
+  if (X509_NAME_cmp(X509_CRL_get_issuer(crl), X509_get_subject_name(issuer))) {
+    log_validation_status(rc, uri, crl_issuer_name_mismatch, generation);
+    goto punt;
+  }
+
+  if (!check_allowed_dn(X509_CRL_get_issuer(crl))) {
+    log_validation_status(rc, uri, nonconformant_issuer_name, generation);
+    if (!rc->allow_nonconformant_name)
+      goto punt;
+  }
+
+  if ((revoked = X509_CRL_get_REVOKED(crl)) != NULL) {
+    for (i = sk_X509_REVOKED_num(revoked) - 1; i >= 0; --i) {
+      if (X509_REVOKED_get_ext_count(sk_X509_REVOKED_value(revoked, i)) > 0) {
+	log_validation_status(rc, uri, disallowed_x509v3_extension, generation);
+	goto punt;
+      }
+    }
+  }
+
+  assert(walk_ctx_stack_head(wsk)->cert == issuer);
+
+  if ((pkey = walk_ctx_pkey(walk_ctx_stack_head(wsk))) == NULL)
+    goto punt;
+  rcynic_unlock(rc);
+  stopwatch_start(&sw, CLOCK_THREAD_CPUTIME_ID);
+  ret = X509_CRL_verify(crl, pkey);
+  stopwatch_stop(&sw);
+  rcynic_lock(rc);
+  operation_charge(rc, wsk, operation_verify, &sw);
+
+  if (ret > 0)
+    return crl;
+
+ punt:
+  X509_CRL_free(crl);
+  return NULL;
+}
+
+/**
+ * Check whether we already have a particular CRL, attempt to fetch it
+ * and check issuer's signature if we don't.
+ *
+ * General plan here is to do basic checks on both current and backup
+ * generation CRLs, then, if both generations pass all of our other
+ * tests, pick the generation with the highest CRL number, to protect
+ * against replay attacks.
+ *
+ * CRLs we've accepted are kept in rc->crl_cache for the rest of the
+ * run, so once we've checked a CRL we never have to decode it again.
+ * Caller owns a reference to the returned CRL, as before.
+ */
+static X509_CRL *check_crl(rcynic_ctx_t *rc,
+			   STACK_OF(walk_ctx_t) *wsk,
+			   const uri_t *uri,
+			   X509 *issuer)
+{
+  X509_CRL *old_crl, *new_crl, *result = NULL;
+  unsigned char events[(MIB_COUNTER_T_MAX + 7) / 8];
+  hashbuf_t old_hash, new_hash;
+  path_t old_path, new_path;
+  crl_cache_t *c;
+
+  if ((c = crl_cache_find(rc, uri)) != NULL) {
+    CRYPTO_add(&c->crl->references, 1, CRYPTO_LOCK_X509_CRL);
+    return c->crl;
+  }
+
+  if (uri_to_filename(rc, uri, &new_path, &rc->new_authenticated) &&
+      (new_crl = read_crl(&new_path, &new_hash)) != NULL) {
+    crl_cache_add(rc, uri, object_generation_null, new_crl, &new_hash);
+    return new_crl;
+  }
+
+  logmsg(rc, log_telemetry, "Checking CRL %s", uri->s);
+
+  current_events(rc, uri, events);
+
+  new_crl = check_crl_1(rc, wsk, uri, &new_path, &rc->unauthenticated,
+			issuer, &new_hash, object_generation_current);
+
+  /*
+   * An identical backup CRL would get the same verdict and could
+   * never win the comparison below, so it's as if we didn't have one.
+   */
+  if (backup_same_as_current(rc, uri, &old_path, MAX_CRL_SIZE, events))
+    old_crl = NULL;
+  else
+    old_crl = check_crl_1(rc, wsk, uri, &old_path, &rc->old_authenticated,
+			  issuer, &old_hash, object_generation_backup);
+
+  if (!new_crl)
+    result = old_crl;
+
+  else if (!old_crl)
+    result = new_crl;
+
+  else {
+    ASN1_GENERALIZEDTIME *g_old = ASN1_TIME_to_generalizedtime(X509_CRL_get_lastUpdate(old_crl), NULL);
+    ASN1_GENERALIZEDTIME *g_new = ASN1_TIME_to_generalizedtime(X509_CRL_get_lastUpdate(new_crl), NULL);
+    int num_cmp = ASN1_INTEGER_cmp(old_crl->crl_number, new_crl->crl_number);
+    int date_cmp = (!g_old || !g_new) ? 0 : ASN1_STRING_cmp(g_old, g_new);
+
+    if (!g_old)
+      log_validation_status(rc, uri, bad_thisupdate, object_generation_backup);
+    if (!g_new)
+      log_validation_status(rc, uri, bad_thisupdate, object_generation_current);
+    if (num_cmp > 0)
+      log_validation_status(rc, uri, backup_number_higher_than_current, object_generation_current);
+    if (g_old && g_new && date_cmp > 0)
+      log_validation_status(rc, uri, backup_thisupdate_newer_than_current, object_generation_current);
+
+    if (num_cmp > 0 && (!g_old || !g_new || date_cmp > 0))
+      result = old_crl;
+    else
+      result = new_crl;
+
+    ASN1_GENERALIZEDTIME_free(g_old);
+    ASN1_GENERALIZEDTIME_free(g_new);
+  }
+
+  if (result && result == new_crl) {
+    if (install_object(rc, wsk, uri, &new_path, object_generation_current))
+      crl_cache_add(rc, uri, object_generation_current, new_crl, &new_hash);
+  } else if (!access(new_path.s, F_OK))
+    log_validation_status(rc, uri, object_rejected, object_generation_current);
+
+  if (result && result == old_crl) {
+    if (install_object(rc, wsk, uri, &old_path, object_generation_backup))
+      crl_cache_add(rc, uri, object_generation_backup, old_crl, &old_hash);
+  } else if (!result && !access(old_path.s, F_OK))
+    log_validation_status(rc, uri, object_rejected, object_generation_backup);
+
+  if (result != new_crl)
+    X509_CRL_free(new_crl);
+
+  if (result != old_crl)
+    X509_CRL_free(old_crl);
+
+  return result;
+}
+
+
+/**
+ * Check digest of a CRL we've already accepted.  Normally the digest
+ * is sitting in the CRL cache; if it isn't, fall back to reading the
+ * installed copy.
+ */
+static int check_crl_digest(const rcynic_ctx_t *rc,
+			    const uri_t *uri,
+			    const unsigned char *hash,
+			    const size_t hashlen)
+{
+  X509_CRL *crl = NULL;
+  hashbuf_t hashbuf;
+  crl_cache_t *c;
+  path_t path;
+  int result;
+
+  assert(rc && uri && hash);
+
+  if ((c = crl_cache_find(rc, uri)) != NULL)
+    return hashlen <= sizeof(c->hash.h) && !memcmp(c->hash.h, hash, hashlen);
+
+  if (!uri_to_filename(rc, uri, &path, &rc->new_authenticated) ||
+      (crl = read_crl(&path, &hashbuf)) == NULL)
+    return 0;
+
+  result = hashlen <= sizeof(hashbuf.h) && !memcmp(hashbuf.h, hash, hashlen);
+
+  X509_CRL_free(crl);
+
+  return result;
+}
+
+
+
+/**
+ * Log an OpenSSL certificate verification error against the object
+ * we're checking, and decide whether we can live with it.  Returns
+ * the new value of the "ok" flag the way an X509_verify_cert()
+ * callback would.  Call with the big lock held.
+ */
+static int check_x509_error(rcynic_ctx_t *rc,
+			    const certinfo_t *subject,
+			    const int error,
+			    int ok)
+{
+  mib_counter_t code;
+
+  assert(rc && subject);
+
+  switch (error) {
+  case X509_V_OK:
+    return ok;
+
+  case X509_V_ERR_SUBJECT_ISSUER_MISMATCH:
+    /*
+     * Informational events, not really errors.  ctx->check_issued()
+     * is called in many places where failure to find an issuer is not
+     * a failure for the calling function.  Just leave these alone.
+     */
+    return ok;
+
+  case X509_V_ERR_CRL_HAS_EXPIRED:
+    /*
+     * This isn't really an error, exactly.  CRLs don't really
+     * "expire".  What OpenSSL really means by this error is just
+     * "it's now later than the issuer said it intended to publish a
+     * new CRL".  Whether we treat this as an error or not is
+     * configurable, see the allow_stale_crl parameter.
+     *
+     * Deciding whether to allow stale CRLs is check_crl_1()'s job,
+     * not ours.  By the time this callback occurs, we've already
+     * accepted the CRL; this callback is just notifying us that the
+     * object being checked is tainted by a stale CRL.  So we mark the
+     * object as tainted and carry on.
+     */
+    log_validation_status(rc, &subject->uri, tainted_by_stale_crl, subject->generation);
+    ok = 1;
+    return ok;
+
+  case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT:
+    /*
+     * This is another error that's only an error in the strange world
+     * of OpenSSL, but a more serious one.  By default, OpenSSL
+     * expects all trust anchors to be self-signed.  This is not a
+     * PKIX requirement, it's just an OpenSSL thing, but one violates
+     * it at one's peril, because the only way to convince OpenSSL to
+     * allow a non-self-signed trust anchor is to intercept this
+     * "error" in the verify callback handler.
+     *
+     * So this program supports non-self-signed trust anchors, but be
+     * warned that enabling this feature may cause this program's
+     * output not to work with other OpenSSL-based applications.
+     */
+    if (rc->allow_non_self_signed_trust_anchor)
+      ok = 1;
+    log_validation_status(rc, &subject->uri, trust_anchor_not_self_signed, subject->generation);
+    return ok;
+
+  /*
+   * Select correct MIB counter for every known OpenSSL verify errors
+   * except the ones we handle explicitly above, then fall through to
+   * common handling for all of these.
+   */
+#define QV(x)							\
+  case x:							\
+    code = mib_openssl_##x;					\
+    break;
+    MIB_COUNTERS_FROM_OPENSSL;
+#undef	QV
+
+  default:
+    code = unknown_openssl_verify_error;
+    break;
+  }
+
+  log_validation_status(rc, &subject->uri, code, subject->generation);
+  return ok;
+}
+
+/**
+ * Validation callback function for use with x509_verify_cert().
+ */
+static int check_x509_cb(int ok, X509_STORE_CTX *ctx)
+{
+  rcynic_x509_store_ctx_t *rctx = (rcynic_x509_store_ctx_t *) ctx;
+
+  assert(rctx != NULL);
+
+  /*
+   * Called once per certificate in the chain even when all is well,
+   * so don't take the lock unless there's something to look at.
+   */
+  if (ctx->error == X509_V_OK)
+    return ok;
+
+  rcynic_lock(rctx->rc);
+  ok = check_x509_error(rctx->rc, rctx->subject, ctx->error, ok);
+  rcynic_unlock(rctx->rc);
+  return ok;
+}
+
+/**
+ * Whether one canonical, non-inheriting set of AS numbers is a subset
+ * of another.  OpenSSL's v3_asid_subset() would do, except that it
+ * insists on routing domain identifiers, which the RPKI forbids.
+ */
+static int asnum_subset(ASIdentifierChoice *child, ASIdentifierChoice *parent)
+{
+  ASN1_INTEGER *c_min, *c_max, *p_min, *p_max;
+  ASIdOrRange *a;
+  int c, p = 0;
+
+  if (child == NULL || child == parent)
+    return 1;
+
+  if (parent == NULL ||
+      child->type  != ASIdentifierChoice_asIdsOrRanges ||
+      parent->type != ASIdentifierChoice_asIdsOrRanges)
+    return 0;
+
+  for (c = 0; c < sk_ASIdOrRange_num(child->u.asIdsOrRanges); c++) {
+    a = sk_ASIdOrRange_value(child->u.asIdsOrRanges, c);
+    c_min = a->type == ASIdOrRange_id ? a->u.id : a->u.range->min;
+    c_max = a->type == ASIdOrRange_id ? a->u.id : a->u.range->max;
+    for (;; p++) {
+      if (p >= sk_ASIdOrRange_num(parent->u.asIdsOrRanges))
+	return 0;
+      a = sk_ASIdOrRange_value(parent->u.asIdsOrRanges, p);
+      p_min = a->type == ASIdOrRange_id ? a->u.id : a->u.range->min;
+      p_max = a->type == ASIdOrRange_id ? a->u.id : a->u.range->max;
+      if (ASN1_INTEGER_cmp(p_max, c_max) < 0)
+	continue;
+      if (ASN1_INTEGER_cmp(p_min, c_min) > 0)
+	return 0;
+      break;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Incremental replacement for X509_verify_cert(), used when the
+ * incremental-validation option is set.  Everything above us on the
+ * walk context stack has already been validated, so all that's left
+ * is the new link: that the issuer really is our issuer, the
+ * certificate's validity interval, revocation status on the
+ * issuer's current CRL, the explicit RPKI policy, and that our RFC
+ * 3779 resources are a subset of the issuer's.  Signature, CRL
+ * signature, CRL extensions, and the rest of the certificate profile
+ * have already been checked by our callers.  Errors are reported
+ * with the same codes X509_verify_cert() would use.
+ *
+ * This costs the same no matter how deep we are in the tree, where
+ * X509_verify_cert() rebuilds the whole chain up to the trust anchor
+ * and redoes the policy tree and RFC 3779 path validation every time.
+ *
+ * Call with the big lock held.
+ */
+static int check_x509_incremental(rcynic_ctx_t *rc,
+				  STACK_OF(walk_ctx_t) *wsk,
+				  X509 *x,
+				  const certinfo_t *subject,
+				  const int have_policy)
+{
+  const int n = sk_walk_ctx_t_num(wsk) - 1;
+  walk_ctx_t *w = sk_walk_ctx_t_value(wsk, n);
+  X509_CRL *crl = sk_X509_CRL_value(w->crls, 0);
+  time_t *ptime = rc->validation_time ? &rc->validation_time : NULL;
+  IPAddrBlocks *addr = NULL;
+  ASIdentifierChoice *asnum = NULL;
+  X509_REVOKED *revoked = NULL;
+  int i, error, ok = 0;
+
+  assert(rc && wsk && w && w->cert && crl && x && subject);
+
+#define	CHECK(_cond_, _error_)					\
+  do {								\
+    if ((_cond_) && !check_x509_error(rc, subject, _error_, 0))	\
+      goto done;						\
+  } while (0)
+
+  CHECK(X509_check_issued(w->cert, x) != X509_V_OK,
+	X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT_LOCALLY);
+
+  CHECK((x->ex_flags & EXFLAG_CRITICAL) != 0,
+	X509_V_ERR_UNHANDLED_CRITICAL_EXTENSION);
+
+  i = X509_cmp_time(X509_get_notBefore(x), ptime);
+  CHECK(i == 0, X509_V_ERR_ERROR_IN_CERT_NOT_BEFORE_FIELD);
+  CHECK(i > 0,  X509_V_ERR_CERT_NOT_YET_VALID);
+
+  i = X509_cmp_time(X509_get_notAfter(x), ptime);
+  CHECK(i == 0, X509_V_ERR_ERROR_IN_CERT_NOT_AFTER_FIELD);
+  CHECK(i < 0,  X509_V_ERR_CERT_HAS_EXPIRED);
+
+  CHECK(X509_NAME_cmp(X509_CRL_get_issuer(crl), X509_get_issuer_name(x)) != 0,
+	X509_V_ERR_UNABLE_TO_GET_CRL);
+
+  i = X509_cmp_time(X509_CRL_get_lastUpdate(crl), ptime);
+  CHECK(i == 0, X509_V_ERR_ERROR_IN_CRL_LAST_UPDATE_FIELD);
+  CHECK(i > 0,  X509_V_ERR_CRL_NOT_YET_VALID);
+
+  if (X509_CRL_get_nextUpdate(crl) != NULL) {
+    i = X509_cmp_time(X509_CRL_get_nextUpdate(crl), ptime);
+    CHECK(i == 0, X509_V_ERR_ERROR_IN_CRL_NEXT_UPDATE_FIELD);
+    CHECK(i < 0,  X509_V_ERR_CRL_HAS_EXPIRED);
+  }
+
+  CHECK(X509_CRL_get0_by_cert(crl, &revoked, x) == 1,
+	X509_V_ERR_CERT_REVOKED);
+
+  CHECK(!have_policy, X509_V_ERR_NO_EXPLICIT_POLICY);
+
+  if ((error = walk_ctx_resources(wsk, n)) == X509_V_OK)
+    error = resolve_resources(x, w->addr, w->asnum, &addr, &asnum);
+  CHECK(error != X509_V_OK, error);
+
+  CHECK(!v3_addr_subset(addr, w->addr) || !asnum_subset(asnum, w->asnum),
+	X509_V_ERR_UNNESTED_RESOURCE);
+
+#undef	CHECK
+
+  ok = 1;
+
+ done:
+  sk_IPAddressFamily_free(addr);
+  return ok;
+}
+
+
+/**
+ * Forget an extension cert_extensions_parse() has already recorded,
+ * freeing its decoded form if we made one.
+ */
+static void cert_extension_discard(cert_extensions_t *ext, const cert_extension_t t)
+{
+  switch (t) {
+  case cert_extension_info_access:
+    sk_ACCESS_DESCRIPTION_pop_free(ext->aia, ACCESS_DESCRIPTION_free);
+    ext->aia = NULL;
+    break;
+  case cert_extension_sinfo_access:
+    sk_ACCESS_DESCRIPTION_pop_free(ext->sia, ACCESS_DESCRIPTION_free);
+    ext->sia = NULL;
+    break;
+  case cert_extension_ext_key_usage:
+    sk_ASN1_OBJECT_pop_free(ext->eku, ASN1_OBJECT_free);
+    ext->eku = NULL;
+    break;
+  case cert_extension_certificate_policies:
+    sk_POLICYINFO_pop_free(ext->policies, POLICYINFO_free);
+    ext->policies = NULL;
+    break;
+  default:
+    break;
+  }
+  ext->present  &= ~(1U << t);
+  ext->critical &= ~(1U << t);
+}
+
+/**
+ * Walk a certificate's extension list once, decoding each extension
+ * at most once.  Extensions that x509v3_cache_extensions() has
+ * already decoded for us (basic constraints, key usage, key
+ * identifiers, CRL distribution points, RFC 3779) we just look up in
+ * the X509, so call X509_check_ca() or similar first.  The rest we
+ * decode here, and only if they're present.  Free the result with
+ * cert_extensions_free().
+ */
+static void cert_extensions_parse(X509 *x, cert_extensions_t *ext)
+{
+  cert_extension_t t;
+  X509_EXTENSION *e;
+  int i, n, decoded;
+  unsigned seen = 0;
+
+  assert(x && ext);
+
+  memset(ext, 0, sizeof(*ext));
+
+  n = X509_get_ext_count(x);
+
+  for (i = 0; i < n; i++) {
+    e = X509_get_ext(x, i);
+
+    switch (OBJ_obj2nid(X509_EXTENSION_get_object(e))) {
+#define	QQ(x)					\
+    case NID_##x:				\
+      t = cert_extension_##x;			\
+      break;
+      CERT_EXTENSIONS;
+#undef	QQ
+    default:
+      ext->unexpected++;
+      continue;
+    }
+
+    /*
+     * X509_get_ext_d2i() returns nothing for a duplicated extension,
+     * so the old one-lookup-per-extension code treated a duplicate as
+     * missing and left every copy over as disallowed.  Do the same
+     * here, so that a duplicated AIA or SIA still reports
+     * aia_extension_missing or sia_extension_missing.
+     */
+    if (seen & (1U << t)) {
+      if (ext->present & (1U << t)) {
+	cert_extension_discard(ext, t);
+	ext->unexpected++;
+      }
+      ext->unexpected++;
+      continue;
+    }
+
+    seen |= 1U << t;
+    ext->present |= 1U << t;
+    if (X509_EXTENSION_get_critical(e))
+      ext->critical |= 1U << t;
+
+    switch (t) {
+    case cert_extension_basic_constraints:
+      decoded = (x->ex_flags & EXFLAG_BCONS) != 0;
+      break;
+    case cert_extension_key_usage:
+      decoded = (x->ex_flags & EXFLAG_KUSAGE) != 0;
+      break;
+    case cert_extension_subject_key_identifier:
+      decoded = x->skid != NULL;
+      break;
+    case cert_extension_authority_key_identifier:
+      decoded = x->akid != NULL;
+      break;
+    case cert_extension_crl_distribution_points:
+      decoded = x->crldp != NULL;
+      break;
+    case cert_extension_sbgp_ipAddrBlock:
+      decoded = x->rfc3779_addr != NULL;
+      break;
+    case cert_extension_sbgp_autonomousSysNum:
+      decoded = x->rfc3779_asid != NULL;
+      break;
+    case cert_extension_info_access:
+      decoded = (ext->aia = X509V3_EXT_d2i(e)) != NULL;
+      break;
+    case cert_extension_sinfo_access:
+      decoded = (ext->sia = X509V3_EXT_d2i(e)) != NULL;
+      break;
+    case cert_extension_ext_key_usage:
+      decoded = (ext->eku = X509V3_EXT_d2i(e)) != NULL;
+      break;
+    case cert_extension_certificate_policies:
+      decoded = (ext->policies = X509V3_EXT_d2i(e)) != NULL;
+      break;
+    default:
+      decoded = 0;
+      break;
+    }
+
+    if (!decoded) {
+      ext->present  &= ~(1U << t);
+      ext->critical &= ~(1U << t);
+      ext->unexpected++;
+    }
+  }
+}
+
+/**
+ * Free the decoded extensions in a cert_extensions_t.
+ */
+static void cert_extensions_free(cert_extensions_t *ext)
+{
+  if (ext == NULL)
+    return;
+  sk_ACCESS_DESCRIPTION_pop_free(ext->sia, ACCESS_DESCRIPTION_free);
+  sk_ACCESS_DESCRIPTION_pop_free(ext->aia, ACCESS_DESCRIPTION_free);
+  sk_ASN1_OBJECT_pop_free(ext->eku, ASN1_OBJECT_free);
+  sk_POLICYINFO_pop_free(ext->policies, POLICYINFO_free);
+  memset(ext, 0, sizeof(*ext));
+}
+
+/**
+ * Check crypto aspects of a certificate, policy OID, RFC 3779 path
+ * validation, and conformance to the RPKI certificate profile.
+ */
+static int check_x509(rcynic_ctx_t *rc,
+		      STACK_OF(walk_ctx_t) *wsk,
+		      const uri_t *uri,
+		      X509 *x,
+		      certinfo_t *certinfo,
+		      const object_generation_t generation)
+{
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  rcynic_x509_store_ctx_t rctx;
+  EVP_PKEY *issuer_pkey = NULL, *subject_pkey = NULL;
+  unsigned long flags = (X509_V_FLAG_POLICY_CHECK | X509_V_FLAG_EXPLICIT_POLICY | X509_V_FLAG_X509_STRICT);
+  ASN1_BIT_STRING *ski_pubkey = NULL;
+  cert_extensions_t ext;
+  hashbuf_t ski_hashbuf;
+  unsigned ski_hashlen, afi;
+  stopwatch_t sw;
+  int i, ok, routercert = 0, ret = 0;
+
+  assert(rc && wsk && w && uri && x && w->cert);
+
+  /*
+   * Cleanup logic will explode if rctx.ctx hasn't been initialized,
+   * so we need to do this before running any test that can fail.
+   */
+  memset(&ext, 0, sizeof(ext));
+
+  if (!X509_STORE_CTX_init(&rctx.ctx, rc->x509_store, x, NULL))
+    return 0;
+
+  /*
+   * certinfo == NULL means x is a self-signed trust anchor.
+   */
+  if (certinfo == NULL)
+    certinfo = &w->certinfo;
+
+  certinfo_clear(certinfo);
+
+  certinfo->uri = *uri;
+  certinfo->generation = generation;
+
+  if (ASN1_INTEGER_cmp(X509_get_serialNumber(x), asn1_zero) <= 0 ||
+      ASN1_INTEGER_cmp(X509_get_serialNumber(x), asn1_twenty_octets) > 0) {
+    log_validation_status(rc, uri, bad_certificate_serial_number, generation);
+    goto done;
+  }
+
+  if (!check_allowed_time_encoding(X509_get_notBefore(x)) ||
+      !check_allowed_time_encoding(X509_get_notAfter(x))) {
+    log_validation_status(rc, uri, nonconformant_asn1_time_value, generation);
+    goto done;
+  }
+
+  /*
+   * Apparently nothing ever looks at these fields, so there are no
+   * API functions for them.  We wouldn't bother either if they
+   * weren't forbidden by the RPKI certificate profile.
+   */
+  if (!x->cert_info || x->cert_info->issuerUID || x->cert_info->subjectUID) {
+    log_validation_status(rc, uri, nonconformant_certificate_uid, generation);
+    goto done;
+  }
+
+  /*
+   * We don't use X509_check_ca() to set certinfo->ca anymore, because
+   * it's not paranoid enough to enforce the RPKI certificate profile,
+   * but we still call it because we need it (or something) to invoke
+   * x509v3_cache_extensions() for us.  Anything it decoded, we use
+   * as is; cert_extensions_parse() decodes the rest.  Any extension
+   * not accounted for there is an error, once we get that far.
+   */
+  (void) X509_check_ca(x);
+
+  stopwatch_start(&sw, CLOCK_THREAD_CPUTIME_ID);
+  cert_extensions_parse(x, &ext);
+  stopwatch_stop(&sw);
+  operation_charge(rc, wsk, operation_extensions, &sw);
+
+  if ((ext.present & CERT_EXTENSION(basic_constraints)) &&
+      (!(ext.critical & CERT_EXTENSION(basic_constraints)) ||
+       !(x->ex_flags & EXFLAG_CA) || x->ex_pathlen != -1)) {
+    log_validation_status(rc, uri, malformed_basic_constraints, generation);
+    goto done;
+  }
+
+  certinfo->ca = (ext.present & CERT_EXTENSION(basic_constraints)) != 0;
+
+  if (certinfo == &w->certinfo) {
+    certinfo->ta = 1;
+    if (!certinfo->ca) {
+      log_validation_status(rc, uri, malformed_trust_anchor, generation);
+      goto done;
+    }
+  }
+
+  if (ext.aia != NULL) {
+    int n_caIssuers = 0;
+    if (!extract_access_uri(rc, uri, generation, ext.aia, NID_ad_ca_issuers,
+			    &certinfo->aia, &n_caIssuers, NULL) ||
+	!certinfo->aia.s[0] ||
+	sk_ACCESS_DESCRIPTION_num(ext.aia) != n_caIssuers) {
+      log_validation_status(rc, uri, malformed_aia_extension, generation);
+      goto done;
+    }
+  }
+
+  if (certinfo->ta && ext.aia) {
+    log_validation_status(rc, uri, aia_extension_forbidden, generation);
+    goto done;
+  }
+
+  if (!certinfo->ta && !ext.aia) {
+    log_validation_status(rc, uri, aia_extension_missing, generation);
+    goto done;
+  }
+
+  if (ext.eku != NULL) {
+    if ((ext.critical & CERT_EXTENSION(ext_key_usage)) || certinfo->ca ||
+	!endswith(uri->s, ".cer") || sk_ASN1_OBJECT_num(ext.eku) == 0) {
+      log_validation_status(rc, uri, inappropriate_eku_extension, generation);
+      goto done;
+    }
+    for (i = 0; i < sk_ASN1_OBJECT_num(ext.eku); i++)
+      routercert |= OBJ_obj2nid(sk_ASN1_OBJECT_value(ext.eku, i)) == NID_id_kp_bgpsec_router;
+  }
+
+  if (ext.sia != NULL) {
+    int got_caDirectory,     got_rpkiManifest,     got_signedObject;
+    int   n_caDirectory = 0,   n_rpkiManifest = 0,   n_signedObject = 0, n_rpkiNotify = 0;
+    ok = (extract_access_uri(rc, uri, generation, ext.sia, NID_caRepository,
+			     &certinfo->sia, &n_caDirectory, is_rsync) &&
+	  extract_access_uri(rc, uri, generation, ext.sia, NID_ad_rpkiManifest,
+			     &certinfo->manifest, &n_rpkiManifest, is_rsync) &&
+	  extract_access_uri(rc, uri, generation, ext.sia, NID_ad_signedObject,
+			     &certinfo->signedobject, &n_signedObject, is_rsync) &&
+	  extract_access_uri(rc, uri, generation, ext.sia, NID_ad_rpkiNotify,
+			     &certinfo->rrdpnotify, &n_rpkiNotify, is_http));
+    got_caDirectory  = certinfo->sia.s[0]          != '\0';
+    got_rpkiManifest = certinfo->manifest.s[0]     != '\0';
+    got_signedObject = certinfo->signedobject.s[0] != '\0';
+    ok &= (sk_ACCESS_DESCRIPTION_num(ext.sia) ==
+	   n_caDirectory + n_rpkiManifest + n_signedObject + n_rpkiNotify);
+    if (certinfo->ca)
+      ok &=  got_caDirectory &&  got_rpkiManifest && !got_signedObject;
+    else if (rc->allow_ee_without_signedObject)
+      ok &= !got_caDirectory && !got_rpkiManifest;
+    else
+      ok &= !got_caDirectory && !got_rpkiManifest &&  got_signedObject;
+    if (!ok) {
+      log_validation_status(rc, uri, malformed_sia_extension, generation);
+      goto done;
+    }
+  } else if (certinfo->ca || !rc->allow_ee_without_signedObject) {
+    log_validation_status(rc, uri, sia_extension_missing, generation);
+    goto done;
+  } else if (!routercert) {
+    log_validation_status(rc, uri, sia_extension_missing_from_ee, generation);
+  }
+
+  if (certinfo->signedobject.s[0] && strcmp(uri->s, certinfo->signedobject.s))
+    log_validation_status(rc, uri, bad_signed_object_uri, generation);
+
+  if ((ext.present & CERT_EXTENSION(crl_distribution_points)) &&
+      !extract_crldp_uri(rc, uri, generation, x->crldp, &certinfo->crldp))
+    goto done;
+
+  rctx.rc = rc;
+  rctx.subject = certinfo;
+
+  if (w->certs == NULL && (w->certs = walk_ctx_stack_certs(rc, wsk)) == NULL)
+    goto done;
+
+  if (X509_get_version(x) != 2) {
+    log_validation_status(rc, uri, wrong_object_version, generation);
+    goto done;
+  }
+
+  if (!x->cert_info || !x->cert_info->signature || !x->cert_info->signature->algorithm ||
+      OBJ_obj2nid(x->cert_info->signature->algorithm) != NID_sha256WithRSAEncryption) {
+    log_validation_status(rc, uri, nonconformant_signature_algorithm, generation);
+    goto done;
+  }
+
+  if (certinfo->sia.s[0] && certinfo->sia.s[strlen(certinfo->sia.s) - 1] != '/') {
+    log_validation_status(rc, uri, malformed_cadirectory_uri, generation);
+    goto done;
+  }
+
+  if (!w->certinfo.ta && strcmp(w->certinfo.uri.s, certinfo->aia.s))
+    log_validation_status(rc, uri, aia_doesnt_match_issuer, generation);
+
+  if (certinfo->ca && !certinfo->sia.s[0]) {
+    log_validation_status(rc, uri, sia_cadirectory_uri_missing, generation);
+    goto done;
+  }
+
+  if (certinfo->ca && !certinfo->manifest.s[0]) {
+    log_validation_status(rc, uri, sia_manifest_uri_missing, generation);
+    goto done;
+  }
+
+  if (certinfo->ca && !startswith(certinfo->manifest.s, certinfo->sia.s)) {
+    log_validation_status(rc, uri, manifest_carepository_mismatch, generation);
+    goto done;
+  }
+
+  if (!x->skid) {
+    log_validation_status(rc, uri, ski_extension_missing, generation);
+    goto done;
+  }
+
+  if (!check_allowed_dn(X509_get_subject_name(x))) {
+    log_validation_status(rc, uri, nonconformant_subject_name, generation);
+    if (!rc->allow_nonconformant_name)
+      goto done;
+  }
+
+  if (!check_allowed_dn(X509_get_issuer_name(x))) {
+    log_validation_status(rc, uri, nonconformant_issuer_name, generation);
+    if (!rc->allow_nonconformant_name)
+      goto done;
+  }
+
+  if (ext.policies != NULL) {
+    POLICYQUALINFO *qualifier = NULL;
+    POLICYINFO *policy = NULL;
+    if (!(ext.critical & CERT_EXTENSION(certificate_policies)) ||
+	sk_POLICYINFO_num(ext.policies) != 1 ||
+	(policy = sk_POLICYINFO_value(ext.policies, 0)) == NULL ||
+	OBJ_obj2nid(policy->policyid) != NID_cp_ipAddr_asNumber ||
+	sk_POLICYQUALINFO_num(policy->qualifiers) > 1 ||
+	(sk_POLICYQUALINFO_num(policy->qualifiers) == 1 &&
+	 ((qualifier = sk_POLICYQUALINFO_value(policy->qualifiers, 0)) == NULL ||
+	  OBJ_obj2nid(qualifier->pqualid) != NID_id_qt_cps))) {
+      log_validation_status(rc, uri, bad_certificate_policy, generation);
+      goto done;
+    }
+    if (qualifier)
+      log_validation_status(rc, uri, policy_qualifier_cps, generation);
+  }
+
+  if (!(ext.critical & CERT_EXTENSION(key_usage)) ||
+      (x->ex_flags & EXFLAG_KUSAGE) == 0 ||
+      x->ex_kusage != (certinfo->ca ? KU_KEY_CERT_SIGN | KU_CRL_SIGN : KU_DIGITAL_SIGNATURE)) {
+    log_validation_status(rc, uri, bad_key_usage, generation);
+    goto done;
+  }
+
+  if (x->rfc3779_addr) {
+    if (routercert ||
+	!(ext.critical & CERT_EXTENSION(sbgp_ipAddrBlock)) ||
+	!v3_addr_is_canonical(x->rfc3779_addr) ||
+	sk_IPAddressFamily_num(x->rfc3779_addr) == 0) {
+      log_validation_status(rc, uri, bad_ipaddrblocks, generation);
+      goto done;
+    }
+    for (i = 0; i < sk_IPAddressFamily_num(x->rfc3779_addr); i++) {
+      IPAddressFamily *f = sk_IPAddressFamily_value(x->rfc3779_addr, i);
+      afi = v3_addr_get_afi(f);
+      if (afi != IANA_AFI_IPV4 && afi != IANA_AFI_IPV6) {
+	log_validation_status(rc, uri, unknown_afi, generation);
+	goto done;
+      }
+      if (f->addressFamily->length != 2) {
+	log_validation_status(rc, uri, safi_not_allowed, generation);
+	goto done;
+      }
+    }
+  }
+
+  if (x->rfc3779_asid) {
+    if (!(ext.critical & CERT_EXTENSION(sbgp_autonomousSysNum)) ||
+	!v3_asid_is_canonical(x->rfc3779_asid) ||
+	x->rfc3779_asid->asnum == NULL ||
+	x->rfc3779_asid->rdi != NULL ||
+	(routercert && x->rfc3779_asid->asnum->type == ASIdentifierChoice_inherit)) {
+      log_validation_status(rc, uri, bad_asidentifiers, generation);
+      goto done;
+    }
+  }
+
+  if (!x->rfc3779_addr && !x->rfc3779_asid) {
+    log_validation_status(rc, uri, missing_resources, generation);
+    goto done;
+  }
+
+  subject_pkey = X509_get_pubkey(x);
+  ok = subject_pkey != NULL;
+  if (ok) {
+    ASN1_OBJECT *algorithm;
+
+    (void) X509_PUBKEY_get0_param(&algorithm, NULL, NULL, NULL, X509_get_X509_PUBKEY(x));
+
+    switch (OBJ_obj2nid(algorithm)) {
+
+    case NID_rsaEncryption:
+      ok = (EVP_PKEY_type(subject_pkey->type) == EVP_PKEY_RSA &&
+	    BN_get_word(subject_pkey->pkey.rsa->e) == 65537);
+      if (!ok)
+	break;
+      if (!certinfo->ca && rc->allow_1024_bit_ee_key &&
+	  BN_num_bits(subject_pkey->pkey.rsa->n) == 1024)
+	log_validation_status(rc, uri, ee_certificate_with_1024_bit_key, generation);
+      else
+	ok = BN_num_bits(subject_pkey->pkey.rsa->n) == 2048;
+      break;
+
+    case NID_X9_62_id_ecPublicKey:
+      ok = !certinfo->ca && routercert;
+      break;
+
+    default:
+      ok = 0;
+    }
+  }
+  if (!ok) {
+    log_validation_status(rc, uri, bad_public_key, generation);
+    goto done;
+  }
+
+  if (x->skid == NULL ||
+      (ski_pubkey = X509_get0_pubkey_bitstr(x)) == NULL ||
+      !EVP_Digest(ski_pubkey->data, ski_pubkey->length,
+		  ski_hashbuf.h, &ski_hashlen, EVP_sha1(), NULL) ||
+      ski_hashlen != 20 ||
+      ski_hashlen != x->skid->length ||
+      memcmp(ski_hashbuf.h, x->skid->data, ski_hashlen)) {
+    log_validation_status(rc, uri, ski_public_key_mismatch, generation);
+    goto done;
+  }
+
+  if (x->akid) {
     if (!check_aki(rc, uri, w->cert, x->akid, generation))
       goto done;
   }
 
-  if (!x->akid && !certinfo->ta) {
-    log_validation_status(rc, uri, aki_extension_missing, generation);
-    goto done;
+  if (!x->akid && !certinfo->ta) {
+    log_validation_status(rc, uri, aki_extension_missing, generation);
+    goto done;
+  }
+
+  if ((issuer_pkey = walk_ctx_pkey(w)) != NULL) {
+    rcynic_unlock(rc);
+    stopwatch_start(&sw, CLOCK_THREAD_CPUTIME_ID);
+    ok = X509_verify(x, issuer_pkey) > 0;
+    stopwatch_stop(&sw);
+    rcynic_lock(rc);
+    operation_charge(rc, wsk, operation_verify, &sw);
+  }
+  if (issuer_pkey == NULL || !ok) {
+    log_validation_status(rc, uri, certificate_bad_signature, generation);
+    goto done;
+  }
+
+  /*
+   * X509_verify_cert() skips the signature check on any certificate
+   * already marked valid, which is how it avoids rechecking the chain
+   * above us every time.  We've just checked this one's signature
+   * ourselves, so save it the trouble of doing so again.
+   *
+   * This depends on OpenSSL 1.0's internal_verify(), which only checks
+   * a certificate's signature when X509->valid is clear.  If that ever
+   * changes, the leaf signature just gets checked twice again, which is
+   * slower but still correct.
+   */
+  x->valid = 1;
+
+  if (certinfo->ta) {
+
+    if (certinfo->crldp.s[0]) {
+      log_validation_status(rc, uri, trust_anchor_with_crldp, generation);
+      goto done;
+    }
+
+  } else {
+
+    if (!certinfo->crldp.s[0]) {
+      log_validation_status(rc, uri, crldp_uri_missing, generation);
+      goto done;
+    }
+
+    if (!certinfo->ca && !startswith(certinfo->crldp.s, w->certinfo.sia.s)) {
+      log_validation_status(rc, uri, crldp_doesnt_match_issuer_sia, generation);
+      goto done;
+    }
+
+    if (w->crls == NULL && ((w->crls = sk_X509_CRL_new_null()) == NULL ||
+			    !sk_X509_CRL_push(w->crls, NULL))) {
+      logmsg(rc, log_sys_err, "Internal allocation error setting up CRL for validation");
+      goto done;
+    }
+
+    assert(sk_X509_CRL_num(w->crls) == 1);
+    assert((w->crldp.s[0] == '\0') == (sk_X509_CRL_value(w->crls, 0) == NULL));
+
+    if (strcmp(w->crldp.s, certinfo->crldp.s)) {
+      X509_CRL *old_crl = sk_X509_CRL_value(w->crls, 0);
+      const unsigned long long started = trace_check_start(rc);
+      X509_CRL *new_crl = check_crl(rc, wsk, &certinfo->crldp, w->cert);
+
+      trace_check_end(rc, "check_crl", &certinfo->crldp, started);
+
+      ta_stats_count(wsk, object_type_crl, new_crl != NULL);
+
+      if (w->crldp.s[0])
+	log_validation_status(rc, uri, issuer_uses_multiple_crldp_values, generation);
+
+      if (new_crl == NULL) {
+	log_validation_status(rc, uri, bad_crl, generation);
+	goto done;
+      }
+
+      if (old_crl && new_crl && ASN1_INTEGER_cmp(old_crl->crl_number, new_crl->crl_number) < 0) {
+	log_validation_status(rc, uri, crldp_names_newer_crl, generation);
+	X509_CRL_free(old_crl);
+	old_crl = NULL;
+      }
+
+      if (old_crl == NULL) {
+	sk_X509_CRL_set(w->crls, 0, new_crl);
+	w->crldp = certinfo->crldp;
+      } else {
+	X509_CRL_free(new_crl);
+      }
+    }
+
+    assert(sk_X509_CRL_value(w->crls, 0));
+    flags |= X509_V_FLAG_CRL_CHECK;
+    X509_STORE_CTX_set0_crls(&rctx.ctx, w->crls);
+  }
+
+  if (ext.unexpected > 0) {
+    log_validation_status(rc, uri, disallowed_x509v3_extension, generation);
+    goto done;
+  }
+
+  if (rc->incremental_validation && !certinfo->ta) {
+
+    /*
+     * Cheap enough to run without dropping the lock, and it needs the
+     * lock anyway to look at resources cached in shared frames.
+     */
+    stopwatch_start(&sw, CLOCK_THREAD_CPUTIME_ID);
+    ok = check_x509_incremental(rc, wsk, x, certinfo, ext.policies != NULL);
+    stopwatch_stop(&sw);
+
+  } else {
+
+    assert(w->certs != NULL);
+    X509_STORE_CTX_trusted_stack(&rctx.ctx, w->certs);
+    X509_STORE_CTX_set_verify_cb(&rctx.ctx, check_x509_cb);
+
+    X509_VERIFY_PARAM_set_flags(rctx.ctx.param, flags);
+
+    if (rc->validation_time)
+      X509_VERIFY_PARAM_set_time(rctx.ctx.param, rc->validation_time);
+
+    X509_VERIFY_PARAM_add0_policy(rctx.ctx.param, OBJ_nid2obj(NID_cp_ipAddr_asNumber));
+
+    /*
+     * Safe to drop the big lock here: nobody else touches w->certs or
+     * w->crls while we're working on this frame (see walk_cert()), and
+     * check_x509_cb() takes the lock back when it needs to log.
+     */
+    rcynic_unlock(rc);
+    stopwatch_start(&sw, CLOCK_THREAD_CPUTIME_ID);
+    ok = X509_verify_cert(&rctx.ctx) > 0;
+    stopwatch_stop(&sw);
+    rcynic_lock(rc);
+
+  }
+
+  operation_charge(rc, wsk, operation_verify, &sw);
+
+  if (!ok) {
+    log_validation_status(rc, uri, certificate_failed_validation, generation);
+    goto done;
+  }
+
+  ret = 1;
+
+ done:
+  X509_STORE_CTX_cleanup(&rctx.ctx);
+  EVP_PKEY_free(subject_pkey);
+  cert_extensions_free(&ext);
+
+  return ret;
+}
+
+/**
+ * Extract one datum from a CMS_SignerInfo.
+ */
+static void *extract_si_datum(CMS_SignerInfo *si,
+			      int *n,
+			      const int optional,
+			      const int nid,
+			      const int asn1_type)
+{
+  int i = CMS_signed_get_attr_by_NID(si, nid, -1);
+  void *result = NULL;
+  X509_ATTRIBUTE *a;
+
+  assert(si && n);
+
+  if (i < 0 && optional)
+    return NULL;
+
+  if (i >= 0 &&
+      CMS_signed_get_attr_by_NID(si, nid, i) < 0 &&
+      (a = CMS_signed_get_attr(si, i)) != NULL &&
+      X509_ATTRIBUTE_count(a) == 1 &&
+      (result = X509_ATTRIBUTE_get0_data(a, 0, asn1_type, NULL)) != NULL)
+    --*n;
+  else
+    *n = -1;
+
+  return result;
+}
+
+/**
+ * Compute chain hashes for any frames of a walk context stack which
+ * don't have them yet.  A frame's chain hash covers its own
+ * certificate, the CRL against which we checked that certificate,
+ * and its issuer's chain hash, so it changes whenever anything
+ * between the trust anchor and this frame changes.
+ */
+static int walk_ctx_stack_chain_hash(const rcynic_ctx_t *rc,
+				     STACK_OF(walk_ctx_t) *wsk)
+{
+  walk_ctx_t *w, *parent = NULL;
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned mdlen, chainlen;
+  EVP_MD_CTX *ctx = NULL;
+  crl_cache_t *c = NULL;
+  int i, ok = 1;
+
+  assert(rc && wsk);
+
+  for (i = 0; ok && i < sk_walk_ctx_t_num(wsk); parent = w, i++) {
+    w = sk_walk_ctx_t_value(wsk, i);
+
+    if (w->have_chain_hash)
+      continue;
+
+    ok = (X509_digest(w->cert, EVP_sha256(), md, &mdlen) &&
+	  (parent == NULL || (c = crl_cache_find(rc, &parent->crldp)) != NULL) &&
+	  (ctx = EVP_MD_CTX_create()) != NULL &&
+	  EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) &&
+	  EVP_DigestUpdate(ctx, md, mdlen) &&
+	  (parent == NULL ||
+	   (EVP_DigestUpdate(ctx, parent->chain_hash.h, SHA256_DIGEST_LENGTH) &&
+	    EVP_DigestUpdate(ctx, c->hash.h, SHA256_DIGEST_LENGTH))) &&
+	  EVP_DigestFinal_ex(ctx, w->chain_hash.h, &chainlen));
+
+    EVP_MD_CTX_destroy(ctx);
+    ctx = NULL;
+
+    w->have_chain_hash = ok;
+  }
+
+  return ok;
+}
+
+/**
+ * Hash an object file, for validation cache lookup.
+ */
+static int hash_file(const path_t *filename, const size_t max_size, hashbuf_t *hash)
+{
+  unsigned char *buf;
+  int mapped, ok;
+  size_t len;
+
+  if ((buf = load_file(filename, max_size, &len, &mapped)) == NULL)
+    return 0;
+
+  ok = EVP_Digest(buf, len, hash->h, NULL, EVP_sha256(), NULL);
+
+  unload_file(buf, len, mapped);
+  return ok;
+}
+
+/**
+ * Compute an object's validation cache key, as described under
+ * validation_cache_lookup().
+ */
+static int validation_cache_key(const walk_ctx_t *w,
+				const crl_cache_t *c,
+				const hashbuf_t *objhash,
+				const unsigned char g,
+				unsigned char *key)
+{
+  EVP_MD_CTX *ctx;
+  unsigned keylen;
+  int ok;
+
+  ok = ((ctx = EVP_MD_CTX_create()) != NULL &&
+	EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) &&
+	EVP_DigestUpdate(ctx, objhash->h, SHA256_DIGEST_LENGTH) &&
+	EVP_DigestUpdate(ctx, w->chain_hash.h, SHA256_DIGEST_LENGTH) &&
+	EVP_DigestUpdate(ctx, c->hash.h, SHA256_DIGEST_LENGTH) &&
+	EVP_DigestUpdate(ctx, &g, sizeof(g)) &&
+	EVP_DigestFinal_ex(ctx, key, &keylen));
+  EVP_MD_CTX_destroy(ctx);
+  return ok;
+}
+
+/**
+ * Is the file a validation cache entry was made from still the one
+ * we're looking at?
+ */
+static int validation_cache_same_file(const validation_cache_t *a, const validation_cache_t *b)
+{
+  return a->size == b->size && a->mtime == b->mtime && a->ino == b->ino;
+}
+
+/**
+ * Look for an object in the validation cache.
+ *
+ * The cache key covers the object's own hash, the chain hash of its
+ * issuer, the hash of the CRL in force for the issuer's products, and
+ * the generation we're checking, so a hit means that everything the
+ * full check would have looked at is byte-for-byte what it was when
+ * we last accepted this object.  The only thing that can change
+ * underneath us is the clock, hence the expiration time.
+ *
+ * Returns 1 on a usable hit, in which case we've replayed the events
+ * the full check logged last time and filled in certinfo.  Otherwise
+ * returns 0, with vc set up for validation_cache_store() to use once
+ * the full check is done.
+ *
+ * objhash is the object's SHA-256 if the caller already has it, NULL
+ * if we should hash the file ourselves.  hash is the manifest's idea
+ * of what the object's hash should be; if it doesn't match, we don't
+ * cache, so that the full check gets to complain every time.
+ *
+ * If rsync told us that nothing in the publication point changed, we
+ * take the manifest's word for the object's hash rather than reading
+ * the file, but only if the cache entry that gets us says the file
+ * has the same size, modification time and inode as the one we hashed
+ * when we wrote it.  rsync saying nothing changed isn't enough on its
+ * own: a run which fetched new bytes and then died before writing the
+ * cache leaves an older cache behind, and the next rsync has nothing
+ * to report.  If the file didn't match the manifest last time, it
+ * wasn't cached under the manifest's hash, so the lookup misses and
+ * the full check still gets to complain.
+ */
+static int validation_cache_lookup(rcynic_ctx_t *rc,
+				   STACK_OF(walk_ctx_t) *wsk,
+				   const uri_t *uri,
+				   const path_t *path,
+				   const hashbuf_t *objhash,
+				   const unsigned char *hash,
+				   const size_t hashlen,
+				   const object_generation_t generation,
+				   certinfo_t *certinfo,
+				   validation_cache_t *vc)
+{
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  ASN1_GENERALIZEDTIME *expires = NULL;
+  const validation_status_t *v;
+  validation_cache_t *hit;
+  unsigned char g = generation;
+  hashbuf_t hashbuf;
+  struct stat st;
+  crl_cache_t *c;
+  mib_counter_t code;
+  int i, ok;
+
+  assert(rc && wsk && w && uri && path && vc);
+
+  memset(vc, 0, sizeof(*vc));
+  certinfo_clear(&vc->certinfo);
+
+  if (rc->validation_cache == NULL || !w->crldp.s[0] ||
+      (c = crl_cache_find(rc, &w->crldp)) == NULL ||
+      !walk_ctx_stack_chain_hash(rc, wsk) ||
+      stat(path->s, &st) < 0)
+    return 0;
+
+  vc->size = st.st_size;
+  vc->mtime = st.st_mtime;
+  vc->ino = st.st_ino;
+
+  if (objhash == NULL && hash && hashlen == SHA256_DIGEST_LENGTH &&
+      w->unchanged && generation == object_generation_current) {
+    memcpy(hashbuf.h, hash, hashlen);
+    if (validation_cache_key(w, c, &hashbuf, g, vc->key) &&
+	(i = sk_validation_cache_t_find(rc->validation_cache, vc)) >= 0 &&
+	validation_cache_same_file(sk_validation_cache_t_value(rc->validation_cache, i), vc))
+      objhash = &hashbuf;
+  }
+
+  if (objhash == NULL) {
+    rcynic_unlock(rc);
+    ok = hash_file(path, MAX_CMS_SIZE, &hashbuf);
+    rcynic_lock(rc);
+    if (!ok)
+      return 0;
+    objhash = &hashbuf;
+  }
+
+  if (hash && (hashlen != SHA256_DIGEST_LENGTH || memcmp(objhash->h, hash, hashlen)))
+    return 0;
+
+  if (!validation_cache_key(w, c, objhash, g, vc->key))
+    return 0;
+
+  vc->usable = 1;
+
+  if ((v = validation_status_find(rc->validation_status, uri, generation)) != NULL)
+    memcpy(vc->events, v->events, sizeof(vc->events));
+
+  if ((i = sk_validation_cache_t_find(rc->validation_cache, vc)) < 0)
+    return 0;
+
+  hit = sk_validation_cache_t_value(rc->validation_cache, i);
+
+  ok = ((expires = ASN1_GENERALIZEDTIME_new()) != NULL &&
+	ASN1_GENERALIZEDTIME_set_string(expires, hit->expires) &&
+	validation_cmp_time(rc, expires) > 0);
+  ASN1_GENERALIZEDTIME_free(expires);
+  if (!ok)
+    return 0;
+
+  for (code = (mib_counter_t) 0; code < MIB_COUNTER_T_MAX; code++)
+    if (hit->events[code / 8] & (1 << (code % 8)))
+      log_validation_status(rc, uri, code, generation);
+
+  if (certinfo) {
+    *certinfo = hit->certinfo;
+    certinfo->uri = *uri;
+    certinfo->generation = generation;
+  }
+
+  /*
+   * Same bytes, maybe not the same file, so remember the file we just
+   * hashed for next time.
+   */
+  hit->size = vc->size;
+  hit->mtime = vc->mtime;
+  hit->ino = vc->ino;
+
+  if (!sk_validation_cache_t_push(rc->validation_cache_used, hit))
+    logmsg(rc, log_sys_err, "Couldn't record validation cache hit for %s", uri->s);
+  else
+    (void) sk_validation_cache_t_delete(rc->validation_cache, i);
+
+  logmsg(rc, log_debug, "Validation cache hit for %s", uri->s);
+  return 1;
+}
+
+/**
+ * Remember that we've accepted an object, so that we can skip the
+ * full check next time.  x is the certificate (EE certificate, for
+ * signed objects) whose validity interval bounds how long the verdict
+ * is good for.
+ */
+static void validation_cache_store(rcynic_ctx_t *rc,
+				   STACK_OF(walk_ctx_t) *wsk,
+				   const uri_t *uri,
+				   const object_generation_t generation,
+				   const certinfo_t *certinfo,
+				   X509 *x,
+				   const validation_cache_t *vc)
+{
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  ASN1_GENERALIZEDTIME *g = NULL;
+  const validation_status_t *v;
+  validation_cache_t *new;
+  ASN1_TIME *t;
+  crl_cache_t *c;
+  int i;
+
+  assert(rc && wsk && w && uri && certinfo && x && vc);
+
+  /*
+   * Objects which point at some CRL other than the one we looked up
+   * weren't keyed on the CRL they were checked against.
+   */
+  if (!vc->usable || strcmp(certinfo->crldp.s, w->crldp.s) ||
+      (c = crl_cache_find(rc, &w->crldp)) == NULL)
+    return;
+
+  t = X509_get_notAfter(x);
+  if (validation_cmp_time(rc, X509_CRL_get_nextUpdate(c->crl)) > 0 &&
+      asn1_time_cmp(X509_CRL_get_nextUpdate(c->crl), t) < 0)
+    t = X509_CRL_get_nextUpdate(c->crl);
+
+  if ((g = ASN1_TIME_to_generalizedtime(t, NULL)) == NULL ||
+      g->length != sizeof(new->expires) - 1 ||
+      (new = malloc(sizeof(*new))) == NULL) {
+    ASN1_GENERALIZEDTIME_free(g);
+    return;
+  }
+
+  memset(new, 0, sizeof(*new));
+  memcpy(new->key, vc->key, sizeof(new->key));
+  memcpy(new->expires, g->data, g->length);
+  new->certinfo = *certinfo;
+  new->size = vc->size;
+  new->mtime = vc->mtime;
+  new->ino = vc->ino;
+  ASN1_GENERALIZEDTIME_free(g);
+
+  if ((v = validation_status_find(rc->validation_status, uri, generation)) != NULL)
+    for (i = 0; i < sizeof(new->events); i++)
+      new->events[i] = v->events[i] & ~vc->events[i];
+
+  if (!sk_validation_cache_t_push(rc->validation_cache_used, new)) {
+    logmsg(rc, log_sys_err, "Couldn't add %s to validation cache", uri->s);
+    validation_cache_t_free(new);
+  }
+}
+
+/**
+ * Check a signed CMS object.
+ */
+static int check_cms(rcynic_ctx_t *rc,
+		     STACK_OF(walk_ctx_t) *wsk,
+		     const uri_t *uri,
+		     path_t *path,
+		     const path_t *prefix,
+		     CMS_ContentInfo **pcms,
+		     X509 **px,
+		     certinfo_t *certinfo,
+		     BIO *bio,
+		     const unsigned char *hash,
+		     const size_t hashlen,
+		     const int expected_eContentType_nid,
+		     const int require_inheritance,
+		     const object_generation_t generation)
+{
+  STACK_OF(CMS_SignerInfo) *signer_infos = NULL;
+  CMS_ContentInfo *cms = NULL;
+  CMS_SignerInfo *si = NULL;
+  ASN1_OCTET_STRING *sid = NULL;
+  X509_NAME *si_issuer = NULL;
+  ASN1_INTEGER *si_serial = NULL;
+  STACK_OF(X509_CRL) *crls = NULL;
+  STACK_OF(X509) *certs = NULL;
+  X509_ALGOR *signature_alg = NULL, *digest_alg = NULL;
+  ASN1_OBJECT *oid = NULL;
+  hashbuf_t hashbuf;
+  X509 *x = NULL;
+  certinfo_t certinfo_;
+  stopwatch_t sw;
+  int i, result = 0;
+
+  assert(rc && wsk && uri && path && prefix);
+
+  if (!certinfo)
+    certinfo = &certinfo_;
+
+  if (!uri_to_filename(rc, uri, path, prefix))
+    goto error;
+
+  rcynic_unlock(rc);
+  stopwatch_start(&sw, CLOCK_THREAD_CPUTIME_ID);
+  if (hash)
+    cms = read_cms(path, &hashbuf);
+  else
+    cms = read_cms(path, NULL);
+  stopwatch_stop(&sw);
+  rcynic_lock(rc);
+  operation_charge(rc, wsk, operation_decode, &sw);
+
+  if (!cms)
+    goto error;
+
+  if (hash && (hashlen > sizeof(hashbuf.h) ||
+	       memcmp(hashbuf.h, hash, hashlen))) {
+    log_validation_status(rc, uri, digest_mismatch, generation);
+    if (!rc->allow_digest_mismatch)
+      goto error;
+  }
+
+  if (OBJ_obj2nid(CMS_get0_eContentType(cms)) != expected_eContentType_nid) {
+    log_validation_status(rc, uri, bad_cms_econtenttype, generation);
+    goto error;
+  }
+
+  rcynic_unlock(rc);
+  stopwatch_start(&sw, CLOCK_THREAD_CPUTIME_ID);
+  i = CMS_verify(cms, NULL, NULL, NULL, bio, CMS_NO_SIGNER_CERT_VERIFY);
+  stopwatch_stop(&sw);
+  rcynic_lock(rc);
+  operation_charge(rc, wsk, operation_verify, &sw);
+
+  if (i <= 0) {
+    log_validation_status(rc, uri, cms_validation_failure, generation);
+    goto error;
+  }
+
+  if ((crls = CMS_get1_crls(cms)) != NULL) {
+    log_validation_status(rc, uri, cms_includes_crls, generation);
+    goto error;
+  }
+
+  if ((signer_infos = CMS_get0_SignerInfos(cms)) == NULL ||
+      sk_CMS_SignerInfo_num(signer_infos) != 1 ||
+      (si = sk_CMS_SignerInfo_value(signer_infos, 0)) == NULL ||
+      !CMS_SignerInfo_get0_signer_id(si, &sid, &si_issuer, &si_serial) ||
+      sid == NULL || si_issuer != NULL || si_serial != NULL ||
+      CMS_unsigned_get_attr_count(si) != -1) {
+    log_validation_status(rc, uri, bad_cms_signer_infos, generation);
+    goto error;
+  }
+
+  CMS_SignerInfo_get0_algs(si, NULL, &x, &digest_alg, &signature_alg);
+
+  if (x == NULL) {
+    log_validation_status(rc, uri, cms_signer_missing, generation);
+    goto error;
+  }
+
+  if ((certs = CMS_get1_certs(cms)) == NULL ||
+      sk_X509_num(certs) != 1 ||
+      X509_cmp(x, sk_X509_value(certs, 0))) {
+    log_validation_status(rc, uri, bad_cms_signer, generation);
+    goto error;
+  }
+
+  X509_ALGOR_get0(&oid, NULL, NULL, signature_alg);
+  i = OBJ_obj2nid(oid);
+  if (i != NID_sha256WithRSAEncryption && i != NID_rsaEncryption) {
+    log_validation_status(rc, uri, wrong_cms_si_signature_algorithm, generation);
+    goto error;
+  }
+
+  X509_ALGOR_get0(&oid, NULL, NULL, digest_alg);
+  if (OBJ_obj2nid(oid) != NID_sha256) {
+    log_validation_status(rc, uri, wrong_cms_si_digest_algorithm, generation);
+    goto error;
+  }
+
+  i = CMS_signed_get_attr_count(si);
+
+  (void) extract_si_datum(si, &i, 1, NID_pkcs9_signingTime,   V_ASN1_UTCTIME);
+  (void) extract_si_datum(si, &i, 1, NID_binary_signing_time, V_ASN1_INTEGER);
+  oid =  extract_si_datum(si, &i, 0, NID_pkcs9_contentType,   V_ASN1_OBJECT);
+  (void) extract_si_datum(si, &i, 0, NID_pkcs9_messageDigest, V_ASN1_OCTET_STRING);
+
+  if (i != 0) {
+    log_validation_status(rc, uri, bad_cms_si_signed_attributes, generation);
+    if (!rc->allow_wrong_cms_si_attributes)
+      goto error;
+  }
+
+  if (OBJ_obj2nid(oid) != expected_eContentType_nid) {
+    log_validation_status(rc, uri, bad_cms_si_contenttype, generation);
+    goto error;
+  }
+
+  if (CMS_SignerInfo_cert_cmp(si, x)) {
+    log_validation_status(rc, uri, cms_ski_mismatch, generation);
+    goto error;
+  }
+
+  if (!check_x509(rc, wsk, uri, x, certinfo, generation))
+    goto error;
+
+  if (require_inheritance && x->rfc3779_addr) {
+    for (i = 0; i < sk_IPAddressFamily_num(x->rfc3779_addr); i++) {
+      IPAddressFamily *f = sk_IPAddressFamily_value(x->rfc3779_addr, i);
+      if (f->ipAddressChoice->type != IPAddressChoice_inherit) {
+	log_validation_status(rc, uri, rfc3779_inheritance_required, generation);
+	goto error;
+      }
+    }
+  }
+
+  if (require_inheritance && x->rfc3779_asid && x->rfc3779_asid->asnum &&
+      x->rfc3779_asid->asnum->type != ASIdentifierChoice_inherit) {
+    log_validation_status(rc, uri, rfc3779_inheritance_required, generation);
+    goto error;
+  }
+
+  if (pcms) {
+    *pcms = cms;
+    cms = NULL;
+  }
+
+  if (px)
+    *px = x;
+
+  result = 1;
+
+ error:
+  CMS_ContentInfo_free(cms);
+  sk_X509_CRL_pop_free(crls, X509_CRL_free);
+  sk_X509_pop_free(certs, X509_free);
+
+  return result;
+}
+
+
+
+/**
+ * Convert an ASN.1 INTEGER holding an AS number to an unsigned long.
+ * Unlike ASN1_INTEGER_get(), this handles four-octet AS numbers on
+ * platforms where long is 32 bits.
+ */
+static int asnum_to_ulong(const ASN1_INTEGER *a, unsigned long *asn)
+{
+  int i;
+
+  assert(asn);
+
+  if (a == NULL || a->type != V_ASN1_INTEGER || a->length > 4)
+    return 0;
+
+  for (*asn = 0, i = 0; i < a->length; i++)
+    *asn = (*asn << 8) | a->data[i];
+
+  return 1;
+}
+
+/**
+ * Give up on the VRP output after running out of memory.  A partial
+ * VRP set would silently withdraw routes, so we'd rather write nothing.
+ */
+static void vrp_output_abandon(rcynic_ctx_t *rc, const uri_t *uri)
+{
+  logmsg(rc, log_sys_err, "Couldn't add %s to VRP output, abandoning VRP output", uri->s);
+  sk_vrp_t_free(rc->vrps);
+  sk_router_key_t_free(rc->router_keys);
+  rc->vrps = NULL;
+  rc->router_keys = NULL;
+}
+
+/**
+ * Get the bounds of one entry in a router certificate's AS number
+ * extension.
+ */
+static int router_cert_asn_range(const ASIdOrRange *aor,
+				 unsigned long *min,
+				 unsigned long *max)
+{
+  if (aor == NULL)
+    return 0;
+  if (aor->type == ASIdOrRange_id) {
+    if (!asnum_to_ulong(aor->u.id, min))
+      return 0;
+    *max = *min;
+    return 1;
+  }
+  return (asnum_to_ulong(aor->u.range->min, min) &&
+	  asnum_to_ulong(aor->u.range->max, max) &&
+	  *min <= *max);
+}
+
+/**
+ * Add the keys from an accepted BGPsec router certificate to the VRP
+ * output, one for each AS number the certificate covers.  Does
+ * nothing if the certificate isn't a router certificate.  A router
+ * certificate we can't turn into keys, or one covering more than
+ * ROUTER_CERT_ASNS_MAX AS numbers, is logged and left out, rather
+ * than costing us the whole VRP output.
+ */
+static void vrp_output_add_router_cert(rcynic_ctx_t *rc,
+				       const uri_t *uri,
+				       X509 *x)
+{
+  STACK_OF(ASN1_OBJECT) *eku = NULL;
+  unsigned long asn, min, max, total;
+  unsigned char *der = NULL, *p;
+  int i, len, routercert = 0;
+  ASIdOrRanges *asids;
+  router_key_t *k;
+
+  assert(rc && uri && x);
+
+  if (rc->router_keys == NULL)
+    return;
+
+  if ((eku = X509_get_ext_d2i(x, NID_ext_key_usage, NULL, NULL)) == NULL)
+    return;
+  for (i = 0; i < sk_ASN1_OBJECT_num(eku); i++)
+    routercert |= OBJ_obj2nid(sk_ASN1_OBJECT_value(eku, i)) == NID_id_kp_bgpsec_router;
+  sk_ASN1_OBJECT_pop_free(eku, ASN1_OBJECT_free);
+  if (!routercert)
+    return;
+
+  /*
+   * Certificates accepted from the validation cache haven't been
+   * through check_x509(), so make sure OpenSSL has parsed the
+   * extensions we're about to look at.
+   */
+  (void) X509_check_purpose(x, -1, -1);
+
+  if (x->skid == NULL || x->skid->length != SHA_DIGEST_LENGTH ||
+      x->rfc3779_asid == NULL || x->rfc3779_asid->asnum == NULL ||
+      x->rfc3779_asid->asnum->type != ASIdentifierChoice_asIdsOrRanges) {
+    logmsg(rc, log_data_err,
+	   "Router certificate %s has no usable SKI or AS numbers, leaving it out of VRP output",
+	   uri->s);
+    return;
+  }
+
+  asids = x->rfc3779_asid->asnum->u.asIdsOrRanges;
+
+  /*
+   * Check every entry, and add up how many keys they'd expand to,
+   * before we touch the output, so that a bad certificate leaves no
+   * partial set of keys behind.
+   */
+  for (i = 0, total = 0; i < sk_ASIdOrRange_num(asids); i++) {
+    if (!router_cert_asn_range(sk_ASIdOrRange_value(asids, i), &min, &max)) {
+      logmsg(rc, log_data_err,
+	     "Router certificate %s has a malformed AS number, leaving it out of VRP output",
+	     uri->s);
+      return;
+    }
+    total += max - min + 1;
+    if (max - min >= ROUTER_CERT_ASNS_MAX || total > ROUTER_CERT_ASNS_MAX) {
+      logmsg(rc, log_data_err,
+	     "Router certificate %s covers more than %d AS numbers, leaving it out of VRP output",
+	     uri->s, ROUTER_CERT_ASNS_MAX);
+      return;
+    }
+  }
+
+  if ((len = i2d_X509_PUBKEY(X509_get_X509_PUBKEY(x), NULL)) <= 0 ||
+      (der = malloc(len)) == NULL)
+    goto lose;
+
+  p = der;
+  if (i2d_X509_PUBKEY(X509_get_X509_PUBKEY(x), &p) != len)
+    goto lose;
+
+  for (i = 0; i < sk_ASIdOrRange_num(asids); i++) {
+    (void) router_cert_asn_range(sk_ASIdOrRange_value(asids, i), &min, &max);
+    for (asn = min; asn <= max; asn++) {
+      if ((k = arena_alloc(&rc->vrp_arena, sizeof(*k) + len)) == NULL)
+	goto lose;
+      k->asn = asn;
+      memcpy(k->ski, x->skid->data, sizeof(k->ski));
+      k->keylen = len;
+      memcpy(k->key, der, len);
+      if (!sk_router_key_t_push(rc->router_keys, k))
+	goto lose;
+      if (asn == max)
+	break;
+    }
+  }
+
+  free(der);
+  return;
+
+ lose:
+  free(der);
+  vrp_output_abandon(rc, uri);
+}
+
+/**
+ * Load certificate, check against manifest, then run it through all
+ * the check_x509() tests.
+ */
+static X509 *check_cert_1(rcynic_ctx_t *rc,
+			  STACK_OF(walk_ctx_t) *wsk,
+			  const uri_t *uri,
+			  path_t *path,
+			  const path_t *prefix,
+			  certinfo_t *certinfo,
+			  const unsigned char *hash,
+			  const size_t hashlen,
+			  object_generation_t generation)
+{
+  validation_cache_t vc;
+  hashbuf_t hashbuf;
+  stopwatch_t sw;
+  X509 *x = NULL;
+
+  assert(uri && path && wsk && certinfo);
+
+  if (!uri_to_filename(rc, uri, path, prefix))
+    return NULL;
+
+  if (access(path->s, R_OK))
+    return NULL;
+
+  rcynic_unlock(rc);
+  stopwatch_start(&sw, CLOCK_THREAD_CPUTIME_ID);
+  x = read_cert(path, &hashbuf);
+  stopwatch_stop(&sw);
+  rcynic_lock(rc);
+  operation_charge(rc, wsk, operation_decode, &sw);
+
+  if (!x) {
+    logmsg(rc, log_sys_err, "Can't read certificate %s", path->s);
+    goto punt;
+  }
+
+  if (hash && (hashlen > sizeof(hashbuf.h) ||
+	       memcmp(hashbuf.h, hash, hashlen))) {
+    log_validation_status(rc, uri, digest_mismatch, generation);
+    if (!rc->allow_digest_mismatch)
+      goto punt;
+  }
+
+  if (validation_cache_lookup(rc, wsk, uri, path, &hashbuf, hash, hashlen,
+			      generation, certinfo, &vc))
+    return x;
+
+  if (check_x509(rc, wsk, uri, x, certinfo, generation)) {
+    validation_cache_store(rc, wsk, uri, generation, certinfo, x, &vc);
+    return x;
+  }
+
+ punt:
+  X509_free(x);
+  return NULL;
+}
+
+/**
+ * Try to find a good copy of a certificate either in fresh data or in
+ * backup data from a previous run of this program.
+ */
+static X509 *check_cert(rcynic_ctx_t *rc,
+			STACK_OF(walk_ctx_t) *wsk,
+			uri_t *uri,
+			certinfo_t *certinfo,
+			const unsigned char *hash,
+			const size_t hashlen)
+{
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  object_generation_t generation;
+  const path_t *prefix = NULL;
+  path_t path;
+  X509 *x;
+
+  assert(rc && uri && wsk && w && certinfo);
+
+  switch (w->state) {
+  case walk_state_current:
+    prefix = &rc->unauthenticated;
+    generation = object_generation_current;
+    break;
+  case walk_state_backup:
+    prefix = &rc->old_authenticated;
+    generation = object_generation_backup;
+    break;
+  default:
+    return NULL;
+  }
+
+  if (skip_checking_this_object(rc, uri, generation))
+    return NULL;
+
+  if ((x = check_cert_1(rc, wsk, uri, &path, prefix, certinfo,
+			hash, hashlen, generation)) != NULL) {
+    install_object(rc, wsk, uri, &path, generation);
+    ta_stats_count(wsk, object_type_cer, 1);
+  } else if (!access(path.s, F_OK)) {
+    log_validation_status(rc, uri, object_rejected, generation);
+    ta_stats_count(wsk, object_type_cer, 0);
+  } else if (hash && generation == w->manifest_generation)
+    log_validation_status(rc, uri, manifest_lists_missing_object, generation);
+
+  if (x != NULL && !certinfo->ca)
+    vrp_output_add_router_cert(rc, uri, x);
+
+  return x;
+}
+
+
+
+/**
+ * Read and check one manifest from disk.
+ */
+static Manifest *check_manifest_1(rcynic_ctx_t *rc,
+				  STACK_OF(walk_ctx_t) *wsk,
+				  const uri_t *uri,
+				  path_t *path,
+				  const path_t *prefix,
+				  certinfo_t *certinfo,
+				  const object_generation_t generation)
+{
+  STACK_OF(FileAndHash) *sorted_fileList = NULL;
+  Manifest *manifest = NULL, *result = NULL;
+  CMS_ContentInfo *cms = NULL;
+  FileAndHash *fah = NULL, *fah2 = NULL;
+  BIO *bio = NULL;
+  X509 *x;
+  int i;
+
+  assert(rc && wsk && uri && path && prefix);
+
+  if ((bio = BIO_new(BIO_s_mem())) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate BIO for manifest %s", uri->s);
+    goto done;
+  }
+
+  if (!check_cms(rc, wsk, uri, path, prefix, &cms, &x, certinfo, bio, NULL, 0,
+		 NID_ct_rpkiManifest, 1, generation))
+    goto done;
+
+  if ((manifest = ASN1_item_d2i_bio(ASN1_ITEM_rptr(Manifest), bio, NULL)) == NULL) {
+    log_validation_status(rc, uri, cms_econtent_decode_error, generation);
+    goto done;
+  }
+
+  if (manifest->version) {
+    log_validation_status(rc, uri, wrong_object_version, generation);
+    goto done;
+  }
+
+  if (validation_cmp_time(rc, manifest->thisUpdate) > 0) {
+    log_validation_status(rc, uri, manifest_not_yet_valid, generation);
+    goto done;
+  }
+
+  if (validation_cmp_time(rc, manifest->nextUpdate) < 0) {
+    log_validation_status(rc, uri, stale_crl_or_manifest, generation);
+    if (!rc->allow_stale_manifest)
+      goto done;
+  }
+
+  if (asn1_time_cmp(manifest->thisUpdate, X509_get_notBefore(x)) < 0 ||
+      asn1_time_cmp(manifest->nextUpdate, X509_get_notAfter(x))  > 0) {
+    log_validation_status(rc, uri, manifest_interval_overruns_cert, generation);
+    goto done;
+  }
+
+  if (ASN1_INTEGER_cmp(manifest->manifestNumber, asn1_zero) < 0 ||
+      ASN1_INTEGER_cmp(manifest->manifestNumber, asn1_twenty_octets) > 0) {
+    log_validation_status(rc, uri, bad_manifest_number, generation);
+    goto done;
+  }
+
+  if (OBJ_obj2nid(manifest->fileHashAlg) != NID_sha256) {
+    log_validation_status(rc, uri, nonconformant_digest_algorithm, generation);
+    goto done;
+  }
+
+  if ((sorted_fileList = sk_FileAndHash_dup(manifest->fileList)) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate shallow copy of fileList for manifest %s", uri->s);
+    goto done;
+  }
+
+  (void) sk_FileAndHash_set_cmp_func(sorted_fileList, FileAndHash_name_cmp);
+  sk_FileAndHash_sort(sorted_fileList);
+
+  for (i = 0; (fah = sk_FileAndHash_value(sorted_fileList, i)) != NULL && (fah2 = sk_FileAndHash_value(sorted_fileList, i + 1)) != NULL; i++) {
+    if (!strcmp((char *) fah->file->data, (char *) fah2->file->data)) {
+      log_validation_status(rc, uri, duplicate_name_in_manifest, generation);
+      goto done;
+    }
+  }
+
+  for (i = 0; (fah = sk_FileAndHash_value(manifest->fileList, i)) != NULL; i++) {
+    if (fah->hash->length != HASH_SHA256_LEN ||
+	(fah->hash->flags & (ASN1_STRING_FLAG_BITS_LEFT | 7)) > ASN1_STRING_FLAG_BITS_LEFT) {
+      log_validation_status(rc, uri, bad_manifest_digest_length, generation);
+      goto done;
+    }
+  }
+
+  result = manifest;
+  manifest = NULL;
+
+ done:
+  BIO_free(bio);
+  Manifest_free(manifest);
+  CMS_ContentInfo_free(cms);
+  sk_FileAndHash_free(sorted_fileList);
+  return result;
+}
+
+/**
+ * Check whether we already have a particular manifest, attempt to fetch it
+ * and check issuer's signature if we don't.
+ *
+ * General plan here is to do basic checks on both current and backup
+ * generation manifests, then, if both generations pass all of our
+ * other tests, pick the generation with the highest manifest number,
+ * to protect against replay attacks.
+ *
+ * Once we've picked the manifest we're going to use, we need to check
+ * it against the CRL we've chosen.  Not much we can do if they don't
+ * match besides whine about it, but we do need to whine in this case.
+ */
+static int check_manifest(rcynic_ctx_t *rc,
+			  STACK_OF(walk_ctx_t) *wsk)
+{
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  Manifest *old_manifest, *new_manifest, *result = NULL;
+  unsigned char events[(MIB_COUNTER_T_MAX + 7) / 8];
+  certinfo_t old_certinfo, new_certinfo;
+  const uri_t *uri, *crldp = NULL;
+  object_generation_t generation = object_generation_null;
+  path_t old_path, new_path;
+  FileAndHash *fah = NULL;
+  const unsigned long long started = trace_check_start(rc);
+  const char *crl_tail;
+  int i, ok = 1;
+
+  assert(rc && wsk && w && !w->manifest);
+
+  uri = &w->certinfo.manifest;
+
+  logmsg(rc, log_telemetry, "Checking manifest %s", uri->s);
+
+  current_events(rc, uri, events);
+
+  new_manifest = check_manifest_1(rc, wsk, uri, &new_path,
+				  &rc->unauthenticated, &new_certinfo,
+				  object_generation_current);
+
+  /*
+   * As with CRLs, an identical backup can't change the outcome.
+   */
+  if (backup_same_as_current(rc, uri, &old_path, MAX_CMS_SIZE, events))
+    old_manifest = NULL;
+  else
+    old_manifest = check_manifest_1(rc, wsk, uri, &old_path,
+				    &rc->old_authenticated, &old_certinfo,
+				    object_generation_backup);
+
+  if (!new_manifest)
+    result = old_manifest;
+
+  else if (!old_manifest)
+    result = new_manifest;
+
+  else {
+    int num_cmp = ASN1_INTEGER_cmp(old_manifest->manifestNumber, new_manifest->manifestNumber);
+    int date_cmp = ASN1_STRING_cmp(old_manifest->thisUpdate, new_manifest->thisUpdate);
+
+    if (num_cmp > 0)
+      log_validation_status(rc, uri, backup_number_higher_than_current, object_generation_current);
+    if (date_cmp > 0)
+      log_validation_status(rc, uri, backup_thisupdate_newer_than_current, object_generation_current);
+
+    if (num_cmp > 0 && date_cmp > 0)
+      result = old_manifest;
+    else
+      result = new_manifest;
+  }
+
+  if (result && result == new_manifest) {
+    generation = object_generation_current;
+    install_object(rc, wsk, uri, &new_path, generation);
+    ta_stats_count(wsk, object_type_mft, 1);
+    crldp = &new_certinfo.crldp;
+  }
+
+  if (result && result == old_manifest) {
+    generation = object_generation_backup;
+    install_object(rc, wsk, uri, &old_path, generation);
+    ta_stats_count(wsk, object_type_mft, 1);
+    crldp = &old_certinfo.crldp;
+  }
+
+  if (result) {
+    crl_tail = strrchr(crldp->s, '/');
+    assert(crl_tail != NULL);
+    crl_tail++;
+
+    for (i = 0; (fah = sk_FileAndHash_value(result->fileList, i)) != NULL; i++)
+      if (!strcmp((char *) fah->file->data, crl_tail))
+	break;
+
+    if (!fah) {
+      log_validation_status(rc, uri, crl_not_in_manifest, generation);
+      if (rc->require_crl_in_manifest)
+	ok = 0;
+    }
+
+    else if (!check_crl_digest(rc, crldp, fah->hash->data, fah->hash->length)) {
+      log_validation_status(rc, uri, digest_mismatch, generation);
+      if (!rc->allow_crl_digest_mismatch)
+	ok = 0;
+    }
+  }
+
+  if ((!result || result != new_manifest) && !access(new_path.s, F_OK)) {
+    log_validation_status(rc, uri, object_rejected, object_generation_current);
+    ta_stats_count(wsk, object_type_mft, 0);
+  }
+
+  if (!result && !access(old_path.s, F_OK)) {
+    log_validation_status(rc, uri, object_rejected, object_generation_backup);
+    ta_stats_count(wsk, object_type_mft, 0);
+  }
+
+  if (result != new_manifest)
+    Manifest_free(new_manifest);
+
+  if (result != old_manifest)
+    Manifest_free(old_manifest);
+
+  w->manifest = result;
+  if (crldp)
+    w->crldp = *crldp;
+  w->manifest_generation = generation;
+
+  trace_check_end(rc, "check_manifest", uri, started);
+  return ok;
+}
+
+
+
+/**
+ * Mark CRL or manifest that we're rechecking so XML report makes more sense.
+ */
+static void rsync_needed_mark_recheck(rcynic_ctx_t *rc,
+				      const uri_t *uri)
+{
+  validation_status_t *v = NULL;
+
+  if (uri->s[0] != '\0')
+    v = validation_status_find(rc->validation_status,
+			       uri, object_generation_current);
+
+  if (v) {
+    validation_status_set_code(v, stale_crl_or_manifest, 0);
+    log_validation_status(rc, uri, rechecking_object,
+			  object_generation_current);
+  }
+}
+
+/**
+ * Check whether we need to rsync a particular tree.  This depends on
+ * the setting of rc->rsync_early, whether we have a valid manifest on
+ * file, and whether that manifest is stale yet.
+ */
+static int rsync_needed(rcynic_ctx_t *rc,
+			STACK_OF(walk_ctx_t) *wsk)
+{
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  int needed;
+
+  assert(rc && wsk && w);
+
+  needed = (rc->rsync_early ||
+	    !check_manifest(rc, wsk) ||
+	    w->manifest == NULL ||
+	    validation_cmp_time(rc, w->manifest->nextUpdate) < 0);
+
+  if (needed && w->manifest != NULL) {
+    rsync_needed_mark_recheck(rc, &w->certinfo.manifest);
+    rsync_needed_mark_recheck(rc, &w->certinfo.crldp);
+    Manifest_free(w->manifest);
+    w->manifest = NULL;
+  }
+
+  return needed;
+}
+
+
+
+/**
+ * Extract a ROA prefix from the ASN.1 bitstring encoding.
+ */
+static int extract_roa_prefix(const ROAIPAddress *ra,
+			      const unsigned afi,
+			      unsigned char *addr,
+			      unsigned *prefixlen,
+			      unsigned *max_prefixlen)
+{
+  unsigned length;
+  long maxlen;
+
+  assert(ra && addr && prefixlen && max_prefixlen);
+
+  maxlen = ASN1_INTEGER_get(ra->maxLength);
+
+  switch (afi) {
+  case IANA_AFI_IPV4: length =  4; break;
+  case IANA_AFI_IPV6: length = 16; break;
+  default: return 0;
+  }
+
+  if (ra->IPAddress->length < 0 || ra->IPAddress->length > length ||
+      maxlen < 0 || maxlen > (long) length * 8)
+    return 0;
+
+  if (ra->IPAddress->length > 0) {
+    memcpy(addr, ra->IPAddress->data, ra->IPAddress->length);
+    if ((ra->IPAddress->flags & 7) != 0) {
+      unsigned char mask = 0xFF >> (8 - (ra->IPAddress->flags & 7));
+      addr[ra->IPAddress->length - 1] &= ~mask;
+    }
+  }
+
+  memset(addr + ra->IPAddress->length, 0, length - ra->IPAddress->length);
+  *prefixlen = (ra->IPAddress->length * 8) - (ra->IPAddress->flags & 7);
+  *max_prefixlen = ra->maxLength ? (unsigned) maxlen : *prefixlen;
+
+  return 1;
+}
+
+/**
+ * Add the payload of an accepted ROA to the VRP output.
+ */
+static void vrp_output_add_roa(rcynic_ctx_t *rc,
+			       const uri_t *uri,
+			       const ROA *roa)
+{
+  unsigned afi, prefixlen, max_prefixlen;
+  ROAIPAddressFamily *rf;
+  ROAIPAddress *ra;
+  unsigned long asn;
+  vrp_t *v;
+  int i, j;
+
+  assert(rc && uri && roa);
+
+  if (rc->vrps == NULL)
+    return;
+
+  if (!asnum_to_ulong(roa->asID, &asn))
+    goto lose;
+
+  for (i = 0; i < sk_ROAIPAddressFamily_num(roa->ipAddrBlocks); i++) {
+    rf = sk_ROAIPAddressFamily_value(roa->ipAddrBlocks, i);
+    if (!rf || !rf->addressFamily || rf->addressFamily->length < 2)
+      goto lose;
+    afi = (rf->addressFamily->data[0] << 8) | (rf->addressFamily->data[1]);
+    for (j = 0; j < sk_ROAIPAddress_num(rf->addresses); j++) {
+      ra = sk_ROAIPAddress_value(rf->addresses, j);
+      if ((v = arena_alloc(&rc->vrp_arena, sizeof(*v))) == NULL)
+	goto lose;
+      memset(v, 0, sizeof(*v));
+      if (!ra || !extract_roa_prefix(ra, afi, v->addr, &prefixlen, &max_prefixlen))
+	goto lose;
+      v->asn = asn;
+      v->afi = afi;
+      v->prefixlen = prefixlen;
+      v->max_prefixlen = max_prefixlen;
+      if (!sk_vrp_t_push(rc->vrps, v))
+	goto lose;
+    }
+  }
+
+  return;
+
+ lose:
+  vrp_output_abandon(rc, uri);
+}
+
+/**
+ * Add the payload of a ROA which the validation cache says we've
+ * already accepted.  The ROA hasn't been decoded this run, but we
+ * know its signature is good, so all we need is the eContent.
+ */
+static void vrp_output_add_cached_roa(rcynic_ctx_t *rc,
+				      const uri_t *uri,
+				      const path_t *path)
+{
+  CMS_ContentInfo *cms = NULL;
+  ASN1_OCTET_STRING **content;
+  const unsigned char *p;
+  ROA *roa = NULL;
+
+  assert(rc && uri && path);
+
+  if (rc->vrps == NULL)
+    return;
+
+  rcynic_unlock(rc);
+  if ((cms = read_cms(path, NULL)) != NULL &&
+      (content = CMS_get0_content(cms)) != NULL && *content != NULL) {
+    p = (*content)->data;
+    roa = (ROA *) ASN1_item_d2i(NULL, &p, (*content)->length, ASN1_ITEM_rptr(ROA));
+  }
+  rcynic_lock(rc);
+
+  if (roa != NULL)
+    vrp_output_add_roa(rc, uri, roa);
+  else
+    vrp_output_abandon(rc, uri);
+
+  ROA_free(roa);
+  CMS_ContentInfo_free(cms);
+}
+
+/**
+ * Read and check one ROA from disk.
+ */
+static int check_roa_1(rcynic_ctx_t *rc,
+		       STACK_OF(walk_ctx_t) *wsk,
+		       const uri_t *uri,
+		       path_t *path,
+		       const path_t *prefix,
+		       const unsigned char *hash,
+		       const size_t hashlen,
+		       const object_generation_t generation)
+{
+  STACK_OF(IPAddressFamily) *roa_resources = NULL, *ee_resources = NULL;
+  unsigned char addrbuf[ADDR_RAW_BUF_LEN];
+  CMS_ContentInfo *cms = NULL;
+  validation_cache_t vc;
+  certinfo_t certinfo;
+  stopwatch_t sw;
+  BIO *bio = NULL;
+  ROA *roa = NULL;
+  X509 *x = NULL;
+  int i, j, subset, result = 0;
+  unsigned afi, *safi = NULL, safi_, prefixlen, max_prefixlen;
+  ROAIPAddressFamily *rf;
+  ROAIPAddress *ra;
+
+  assert(rc && wsk && uri && path && prefix);
+
+  if (!uri_to_filename(rc, uri, path, prefix))
+    goto error;
+
+  if (validation_cache_lookup(rc, wsk, uri, path, NULL, hash, hashlen,
+			      generation, NULL, &vc)) {
+    vrp_output_add_cached_roa(rc, uri, path);
+    return 1;
+  }
+
+  if ((bio = BIO_new(BIO_s_mem())) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate BIO for ROA %s", uri->s);
+    goto error;
+  }
+
+  if (!check_cms(rc, wsk, uri, path, prefix, &cms, &x, &certinfo, bio, NULL, 0,
+		 NID_ct_ROA, 0, generation))
+    goto error;
+
+  if (!(roa = ASN1_item_d2i_bio(ASN1_ITEM_rptr(ROA), bio, NULL))) {
+    log_validation_status(rc, uri, cms_econtent_decode_error, generation);
+    goto error;
+  }
+
+  if (roa->version) {
+    log_validation_status(rc, uri, wrong_object_version, generation);
+    goto error;
+  }
+
+  if (ASN1_INTEGER_cmp(roa->asID, asn1_zero) < 0 ||
+      ASN1_INTEGER_cmp(roa->asID, asn1_four_octets) > 0) {
+    log_validation_status(rc, uri, bad_roa_asID, generation);
+    goto error;
+  }
+
+  ee_resources = X509_get_ext_d2i(x, NID_sbgp_ipAddrBlock, NULL, NULL);
+
+  /*
+   * Extract prefixes from ROA and convert them into a resource set.
+   */
+
+  if (!(roa_resources = sk_IPAddressFamily_new_null()))
+    goto error;
+
+  for (i = 0; i < sk_ROAIPAddressFamily_num(roa->ipAddrBlocks); i++) {
+    rf = sk_ROAIPAddressFamily_value(roa->ipAddrBlocks, i);
+    if (!rf || !rf->addressFamily || rf->addressFamily->length < 2 || rf->addressFamily->length > 3) {
+      log_validation_status(rc, uri, malformed_roa_addressfamily, generation);
+      goto error;
+    }
+    afi = (rf->addressFamily->data[0] << 8) | (rf->addressFamily->data[1]);
+    if (rf->addressFamily->length == 3)
+      *(safi = &safi_) = rf->addressFamily->data[2];
+    for (j = 0; j < sk_ROAIPAddress_num(rf->addresses); j++) {
+      ra = sk_ROAIPAddress_value(rf->addresses, j);
+      if (!ra ||
+	  !extract_roa_prefix(ra, afi, addrbuf, &prefixlen, &max_prefixlen) ||
+	  !v3_addr_add_prefix(roa_resources, afi, safi, addrbuf, prefixlen)) {
+	log_validation_status(rc, uri, roa_resources_malformed, generation);
+	goto error;
+      }
+      if (max_prefixlen < prefixlen) {
+	log_validation_status(rc, uri, roa_max_prefixlen_too_short, generation);
+	goto error;
+      }
+    }
+  }
+
+  /*
+   * ROAs can include nested prefixes, so direct translation to
+   * resource sets could include overlapping ranges, which is illegal.
+   * So we have to remove nested stuff before whacking into canonical
+   * form.  Fortunately, this is relatively easy, since we know these
+   * are just prefixes, not ranges: in a list of prefixes sorted by
+   * the RFC 3779 rules, the first element of a set of nested prefixes
+   * will always be the least specific.
+   */
+
+  for (i = 0; i < sk_IPAddressFamily_num(roa_resources); i++) {
+    IPAddressFamily *f = sk_IPAddressFamily_value(roa_resources, i);
+
+    if ((afi = v3_addr_get_afi(f)) == 0) {
+      log_validation_status(rc, uri, roa_contains_bad_afi_value, generation);
+      goto error;
+    }
+
+    if (f->ipAddressChoice->type == IPAddressChoice_addressesOrRanges) {
+      IPAddressOrRanges *aors = f->ipAddressChoice->u.addressesOrRanges;
+
+      sk_IPAddressOrRange_sort(aors);
+
+      for (j = 0; j < sk_IPAddressOrRange_num(aors) - 1; j++) {
+	IPAddressOrRange *a = sk_IPAddressOrRange_value(aors, j);
+	IPAddressOrRange *b = sk_IPAddressOrRange_value(aors, j + 1);
+	unsigned char a_min[ADDR_RAW_BUF_LEN], a_max[ADDR_RAW_BUF_LEN];
+	unsigned char b_min[ADDR_RAW_BUF_LEN], b_max[ADDR_RAW_BUF_LEN];
+	int length;
+
+	if ((length = v3_addr_get_range(a, afi, a_min, a_max, ADDR_RAW_BUF_LEN)) == 0 ||
+	    (length = v3_addr_get_range(b, afi, b_min, b_max, ADDR_RAW_BUF_LEN)) == 0) {
+	  log_validation_status(rc, uri, roa_resources_malformed, generation);
+	  goto error;
+	}
+
+	if (memcmp(a_max, b_max, length) >= 0) {
+	  (void) sk_IPAddressOrRange_delete(aors, j + 1);
+	  IPAddressOrRange_free(b);
+	  --j;
+	}
+      }
+    }
+  }
+
+  if (!v3_addr_canonize(roa_resources)) {
+    log_validation_status(rc, uri, roa_resources_malformed, generation);
+    goto error;
+  }
+
+  stopwatch_start(&sw, CLOCK_THREAD_CPUTIME_ID);
+  subset = v3_addr_subset(roa_resources, ee_resources);
+  stopwatch_stop(&sw);
+  operation_charge(rc, wsk, operation_resources, &sw);
+
+  if (!subset) {
+    log_validation_status(rc, uri, roa_resource_not_in_ee, generation);
+    goto error;
+  }
+
+  validation_cache_store(rc, wsk, uri, generation, &certinfo, x, &vc);
+
+  vrp_output_add_roa(rc, uri, roa);
+
+  result = 1;
+
+ error:
+  BIO_free(bio);
+  ROA_free(roa);
+  CMS_ContentInfo_free(cms);
+  sk_IPAddressFamily_pop_free(roa_resources, IPAddressFamily_free);
+  sk_IPAddressFamily_pop_free(ee_resources, IPAddressFamily_free);
+
+  return result;
+}
+
+/**
+ * Check whether we already have a particular ROA, attempt to fetch it
+ * and check issuer's signature if we don't.
+ */
+static void check_roa(rcynic_ctx_t *rc,
+		      STACK_OF(walk_ctx_t) *wsk,
+		      const uri_t *uri,
+		      const unsigned char *hash,
+		      const size_t hashlen)
+{
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  unsigned char events[(MIB_COUNTER_T_MAX + 7) / 8];
+  path_t path;
+
+  assert(rc && wsk && w && uri);
+
+  if (uri_to_filename(rc, uri, &path, &rc->new_authenticated) &&
+      !access(path.s, F_OK))
+    return;
+
+  logmsg(rc, log_telemetry, "Checking ROA %s", uri->s);
+
+  current_events(rc, uri, events);
+
+  if (check_roa_1(rc, wsk, uri, &path, &rc->unauthenticated,
+		  hash, hashlen, object_generation_current)) {
+    install_object(rc, wsk, uri, &path, object_generation_current);
+    ta_stats_count(wsk, object_type_roa, 1);
+    return;
+  }
+
+  if (!access(path.s, F_OK)) {
+    log_validation_status(rc, uri, object_rejected, object_generation_current);
+    ta_stats_count(wsk, object_type_roa, 0);
+  } else if (hash)
+    log_validation_status(rc, uri, manifest_lists_missing_object, object_generation_current);
+
+  if (!backup_same_as_current(rc, uri, &path, MAX_CMS_SIZE, events) &&
+      check_roa_1(rc, wsk, uri, &path, &rc->old_authenticated,
+		  hash, hashlen, object_generation_backup)) {
+    install_object(rc, wsk, uri, &path, object_generation_backup);
+    ta_stats_count(wsk, object_type_roa, 1);
+    return;
+  }
+
+  if (!access(path.s, F_OK)) {
+    log_validation_status(rc, uri, object_rejected, object_generation_backup);
+    ta_stats_count(wsk, object_type_roa, 0);
+  } else if (hash && w->manifest_generation == object_generation_backup)
+    log_validation_status(rc, uri, manifest_lists_missing_object, object_generation_backup);
+}
+
+
+
+/**
+ * Read and check one Ghostbuster record from disk.
+ */
+static int check_ghostbuster_1(rcynic_ctx_t *rc,
+			       STACK_OF(walk_ctx_t) *wsk,
+			       const uri_t *uri,
+			       path_t *path,
+			       const path_t *prefix,
+			       const unsigned char *hash,
+			       const size_t hashlen,
+			       const object_generation_t generation)
+{
+  CMS_ContentInfo *cms = NULL;
+  validation_cache_t vc;
+  certinfo_t certinfo;
+  BIO *bio = NULL;
+  X509 *x;
+  int result = 0;
+
+  assert(rc && wsk && uri && path && prefix);
+
+  if (!uri_to_filename(rc, uri, path, prefix))
+    goto error;
+
+  if (validation_cache_lookup(rc, wsk, uri, path, NULL, hash, hashlen,
+			      generation, NULL, &vc))
+    return 1;
+
+#if 0
+  /*
+   * May want this later if we're going to inspect the VCard.  For now,
+   * just leave this NULL and the right thing should happen.
+   */
+  if ((bio = BIO_new(BIO_s_mem())) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate BIO for Ghostbuster record %s", uri->s);
+    goto error;
   }
+#endif
+
+  if (!check_cms(rc, wsk, uri, path, prefix, &cms, &x, &certinfo, bio, NULL, 0,
+		 NID_ct_rpkiGhostbusters, 1, generation))
+    goto error;
+
+#if 0
+  /*
+   * Here is where we would read the VCard from the bio returned by
+   * CMS_verify() so that we could check the VCard.
+   */
+#endif
+
+  validation_cache_store(rc, wsk, uri, generation, &certinfo, x, &vc);
+
+  result = 1;
+
+ error:
+  BIO_free(bio);
+  CMS_ContentInfo_free(cms);
+
+  return result;
+}
+
+/**
+ * Check whether we already have a particular Ghostbuster record,
+ * attempt to fetch it and check issuer's signature if we don't.
+ */
+static void check_ghostbuster(rcynic_ctx_t *rc,
+			      STACK_OF(walk_ctx_t) *wsk,
+			      const uri_t *uri,
+			      const unsigned char *hash,
+			      const size_t hashlen)
+{
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  unsigned char events[(MIB_COUNTER_T_MAX + 7) / 8];
+  path_t path;
+
+  assert(rc && wsk && w && uri);
+
+  if (uri_to_filename(rc, uri, &path, &rc->new_authenticated) &&
+      !access(path.s, F_OK))
+    return;
+
+  logmsg(rc, log_telemetry, "Checking Ghostbuster record %s", uri->s);
+
+  current_events(rc, uri, events);
 
-  if ((issuer_pkey = X509_get_pubkey(w->cert)) == NULL || X509_verify(x, issuer_pkey) <= 0) {
-    log_validation_status(rc, uri, certificate_bad_signature, generation);
-    goto done;
+  if (check_ghostbuster_1(rc, wsk, uri, &path, &rc->unauthenticated,
+			  hash, hashlen, object_generation_current)) {
+    install_object(rc, wsk, uri, &path, object_generation_current);
+    ta_stats_count(wsk, object_type_gbr, 1);
+    return;
   }
 
-  if (certinfo->ta) {
+  if (!access(path.s, F_OK)) {
+    log_validation_status(rc, uri, object_rejected, object_generation_current);
+    ta_stats_count(wsk, object_type_gbr, 0);
+  } else if (hash)
+    log_validation_status(rc, uri, manifest_lists_missing_object, object_generation_current);
 
-    if (certinfo->crldp.s[0]) {
-      log_validation_status(rc, uri, trust_anchor_with_crldp, generation);
-      goto done;
-    }
+  if (!backup_same_as_current(rc, uri, &path, MAX_CMS_SIZE, events) &&
+      check_ghostbuster_1(rc, wsk, uri, &path, &rc->old_authenticated,
+			  hash, hashlen, object_generation_backup)) {
+    install_object(rc, wsk, uri, &path, object_generation_backup);
+    ta_stats_count(wsk, object_type_gbr, 1);
+    return;
+  }
 
-  } else {
+  if (!access(path.s, F_OK)) {
+    log_validation_status(rc, uri, object_rejected, object_generation_backup);
+    ta_stats_count(wsk, object_type_gbr, 0);
+  } else if (hash && w->manifest_generation == object_generation_backup)
+    log_validation_status(rc, uri, manifest_lists_missing_object, object_generation_backup);
+}
 
-    if (!certinfo->crldp.s[0]) {
-      log_validation_status(rc, uri, crldp_uri_missing, generation);
-      goto done;
-    }
+
 
-    if (!certinfo->ca && !startswith(certinfo->crldp.s, w->certinfo.sia.s)) {
-      log_validation_status(rc, uri, crldp_doesnt_match_issuer_sia, generation);
-      goto done;
-    }
+static void walk_cert(rcynic_ctx_t *, void *);
 
-    if (w->crls == NULL && ((w->crls = sk_X509_CRL_new_null()) == NULL ||
-			    !sk_X509_CRL_push(w->crls, NULL))) {
-      logmsg(rc, log_sys_err, "Internal allocation error setting up CRL for validation");
-      goto done;
-    }
+/**
+ * Charge a finished fetch to the walk that asked for it.  All we know
+ * here is how long it took from when we first started it, retries
+ * included; the fetch program's CPU time is only accounted for the
+ * run as a whole.  A NULL ctx means there was no fetch (eg, a history
+ * hit), so there's nothing to charge.
+ */
+static void fetch_charge(rcynic_ctx_t *rc,
+			 STACK_OF(walk_ctx_t) *wsk,
+			 const rsync_ctx_t *ctx)
+{
+  stopwatch_t sw;
 
-    assert(sk_X509_CRL_num(w->crls) == 1);
-    assert((w->crldp.s[0] == '\0') == (sk_X509_CRL_value(w->crls, 0) == NULL));
+  if (ctx == NULL || !ctx->started)
+    return;
 
-    if (strcmp(w->crldp.s, certinfo->crldp.s)) {
-      X509_CRL *old_crl = sk_X509_CRL_value(w->crls, 0);
-      X509_CRL *new_crl = check_crl(rc, &certinfo->crldp, w->cert);
+  memset(&sw, 0, sizeof(sw));
+  sw.wall.tv_sec = time(0) - ctx->started;
+  operation_charge(rc, wsk, operation_fetch, &sw);
+}
 
-      if (w->crldp.s[0])
-	log_validation_status(rc, uri, issuer_uses_multiple_crldp_values, generation);
+/**
+ * rsync callback for fetching SIA tree.
+ */
+static void rsync_sia_callback(rcynic_ctx_t *rc,
+			       const rsync_ctx_t *ctx,
+			       const rsync_status_t status,
+			       const uri_t *uri,
+			       void *cookie)
+{
+  STACK_OF(walk_ctx_t) *wsk = cookie;
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
 
-      if (new_crl == NULL) {
-	log_validation_status(rc, uri, bad_crl, generation);
-	goto done;
-      }
+  assert(rc && wsk);
 
-      if (old_crl && new_crl && ASN1_INTEGER_cmp(old_crl->crl_number, new_crl->crl_number) < 0) {
-	log_validation_status(rc, uri, crldp_names_newer_crl, generation);
-	X509_CRL_free(old_crl);
-	old_crl = NULL;
-      }
+  if (status != rsync_status_pending) {
+    fetch_charge(rc, wsk, ctx);
+    trace_walk_fetched(rc, wsk);
+    w->state++;
+    task_add(rc, walk_cert, wsk);
+    return;
+  }
 
-      if (old_crl == NULL) {
-	sk_X509_CRL_set(w->crls, 0, new_crl);
-	w->crldp = certinfo->crldp;
-      } else {
-	X509_CRL_free(new_crl);
-      }
-    }
+  if (rsync_count_runable(rc) >= rc->max_parallel_fetches)
+    return;
 
-    assert(sk_X509_CRL_value(w->crls, 0));
-    flags |= X509_V_FLAG_CRL_CHECK;
-    X509_STORE_CTX_set0_crls(&rctx.ctx, w->crls);
+  if ((wsk = walk_ctx_stack_clone(wsk)) == NULL) {
+    logmsg(rc, log_sys_err,
+	   "walk_ctx_stack_clone() failed, probably memory exhaustion, blundering onwards without forking stack");
+    return;
   }
 
-  if (ex_count > 0) {
-    log_validation_status(rc, uri, disallowed_x509v3_extension, generation);
-    goto done;
-  }
+  walk_ctx_stack_pop(wsk);
+  task_add(rc, walk_cert, wsk);
+}
 
-  assert(w->certs != NULL);
-  X509_STORE_CTX_trusted_stack(&rctx.ctx, w->certs);
-  X509_STORE_CTX_set_verify_cb(&rctx.ctx, check_x509_cb);
+/**
+ * rsync callback for an rsync fetch we fell back to after RRDP
+ * didn't work.  We already forked the walk when the RRDP fetch went
+ * pending, so we mustn't do it again.
+ */
+static void rsync_sia_fallback_callback(rcynic_ctx_t *rc,
+					const rsync_ctx_t *ctx,
+					const rsync_status_t status,
+					const uri_t *uri,
+					void *cookie)
+{
+  if (status != rsync_status_pending)
+    rsync_sia_callback(rc, ctx, status, uri, cookie);
+}
 
-  X509_VERIFY_PARAM_set_flags(rctx.ctx.param, flags);
+/**
+ * Callback for fetching SIA tree via RRDP.  Success or pending works
+ * the same way as for rsync; anything else falls back to rsync of the
+ * SIA.  A NULL ctx means the RRDP fetch never got as far as a
+ * subprocess (eg, a history hit on a failed fetch), so the walk
+ * hasn't forked yet and the rsync fetch is free to do so.
+ */
+static void rrdp_sia_callback(rcynic_ctx_t *rc,
+			      const rsync_ctx_t *ctx,
+			      const rsync_status_t status,
+			      const uri_t *uri,
+			      void *cookie)
+{
+  STACK_OF(walk_ctx_t) *wsk = cookie;
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
 
-  X509_VERIFY_PARAM_add0_policy(rctx.ctx.param, OBJ_nid2obj(NID_cp_ipAddr_asNumber));
+  assert(rc && wsk && w);
 
-  if (X509_verify_cert(&rctx.ctx) <= 0) {
-    log_validation_status(rc, uri, certificate_failed_validation, generation);
-    goto done;
+  if (status == rsync_status_pending || status == rsync_status_done) {
+    rsync_sia_callback(rc, ctx, status, uri, cookie);
+    return;
   }
 
-  ret = 1;
-
- done:
-  X509_STORE_CTX_cleanup(&rctx.ctx);
-  EVP_PKEY_free(issuer_pkey);
-  EVP_PKEY_free(subject_pkey);
-  BASIC_CONSTRAINTS_free(bc);
-  sk_ACCESS_DESCRIPTION_pop_free(sia, ACCESS_DESCRIPTION_free);
-  sk_ACCESS_DESCRIPTION_pop_free(aia, ACCESS_DESCRIPTION_free);
-  sk_DIST_POINT_pop_free(crldp, DIST_POINT_free);
-  sk_POLICYINFO_pop_free(policies, POLICYINFO_free);
-  sk_ASN1_OBJECT_pop_free(eku, ASN1_OBJECT_free);
+  fetch_charge(rc, wsk, ctx);
 
-  return ret;
+  logmsg(rc, log_verbose, "RRDP fetch from %s didn't work, falling back to rsync of %s",
+	 w->certinfo.rrdpnotify.s, w->certinfo.sia.s);
+  rsync_tree(rc, &w->certinfo.sia, wsk,
+	     ctx == NULL ? rsync_sia_callback : rsync_sia_fallback_callback);
 }
 
 /**
- * Extract one datum from a CMS_SignerInfo.
+ * Check one product of the certificate at the top of a walk context
+ * stack: the object named by the current iteration of the walk
+ * context loop.
+ *
+ * Dispatch to correct checking code for the object named by URI,
+ * based on the filename extension in the uri.  CRLs are a special
+ * case because we've already checked them by the time we get here, so
+ * we just ignore them.  Other objects are either certificates or
+ * CMS-signed objects of one kind or another.
  */
-static void *extract_si_datum(CMS_SignerInfo *si,
-			      int *n,
-			      const int optional,
-			      const int nid,
-			      const int asn1_type)
+static void walk_cert_product(rcynic_ctx_t *rc,
+			      STACK_OF(walk_ctx_t) *wsk,
+			      const object_generation_t generation)
 {
-  int i = CMS_signed_get_attr_by_NID(si, nid, -1);
-  void *result = NULL;
-  X509_ATTRIBUTE *a;
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  const unsigned char *hash = NULL;
+  unsigned long long started;
+  size_t hashlen;
+  uri_t uri;
 
-  assert(si && n);
+  assert(rc && wsk && w);
 
-  if (i < 0 && optional)
-    return NULL;
+  if (!walk_ctx_loop_this(rc, wsk, &uri, &hash, &hashlen)) {
+    walk_ctx_loop_next(rc, wsk);
+    return;
+  }
 
-  if (i >= 0 &&
-      CMS_signed_get_attr_by_NID(si, nid, i) < 0 &&
-      (a = CMS_signed_get_attr(si, i)) != NULL &&
-      X509_ATTRIBUTE_count(a) == 1 &&
-      (result = X509_ATTRIBUTE_get0_data(a, 0, asn1_type, NULL)) != NULL)
-    --*n;
-  else
-    *n = -1;
+  if (endswith(uri.s, ".crl") || endswith(uri.s, ".mft") || endswith(uri.s, ".mnf")) {
+    walk_ctx_loop_next(rc, wsk);
+    return;			/* CRLs and manifests checked elsewhere */
+  }
 
-  return result;
+  if (hash == NULL && !rc->allow_object_not_in_manifest) {
+    log_validation_status(rc, &uri, skipped_because_not_in_manifest, generation);
+    walk_ctx_loop_next(rc, wsk);
+    return;
+  }
+
+  if (hash == NULL)
+    log_validation_status(rc, &uri, tainted_by_not_being_in_manifest, generation);
+  else if (w->stale_manifest)
+    log_validation_status(rc, &uri, tainted_by_stale_manifest, generation);
+
+  started = trace_check_start(rc);
+
+  if (endswith(uri.s, ".roa")) {
+    check_roa(rc, wsk, &uri, hash, hashlen);
+    trace_check_end(rc, "check_roa", &uri, started);
+    walk_ctx_loop_next(rc, wsk);
+    return;
+  }
+
+  if (endswith(uri.s, ".gbr")) {
+    check_ghostbuster(rc, wsk, &uri, hash, hashlen);
+    trace_check_end(rc, "check_ghostbuster", &uri, started);
+    walk_ctx_loop_next(rc, wsk);
+    return;
+  }
+
+  if (endswith(uri.s, ".cer")) {
+    certinfo_t certinfo;
+    X509 *x = check_cert(rc, wsk, &uri, &certinfo, hash, hashlen);
+    trace_check_end(rc, "check_cert", &uri, started);
+    if (!walk_ctx_stack_push(wsk, x, &certinfo))
+      walk_ctx_loop_next(rc, wsk);
+    return;
+  }
+
+  log_validation_status(rc, &uri, unknown_object_type_skipped, object_generation_null);
+  walk_ctx_loop_next(rc, wsk);
 }
 
 /**
- * Check a signed CMS object.
+ * Recursive walk of certificate hierarchy (core of the program).
+ *
+ * Walk all products of the current certificate, starting with the
+ * ones named in the manifest and continuing with any that we find in
+ * the publication directory but which are not named in the manifest.
+ *
+ * Cloned walk context stacks share frames, so with a worker pool two
+ * threads can find themselves iterating over the same frame.  Each
+ * product check claims the frame by marking it busy; anybody else
+ * who wants the same frame waits until the check is done, then
+ * picks up wherever the frame's iterator has gotten to by then.
  */
-static int check_cms(rcynic_ctx_t *rc,
-		     STACK_OF(walk_ctx_t) *wsk,
-		     const uri_t *uri,
-		     path_t *path,
-		     const path_t *prefix,
-		     CMS_ContentInfo **pcms,
-		     X509 **px,
-		     certinfo_t *certinfo,
-		     BIO *bio,
-		     const unsigned char *hash,
-		     const size_t hashlen,
-		     const int expected_eContentType_nid,
-		     const int require_inheritance,
-		     const object_generation_t generation)
+static void walk_cert(rcynic_ctx_t *rc, void *cookie)
 {
-  STACK_OF(CMS_SignerInfo) *signer_infos = NULL;
-  CMS_ContentInfo *cms = NULL;
-  CMS_SignerInfo *si = NULL;
-  ASN1_OCTET_STRING *sid = NULL;
-  X509_NAME *si_issuer = NULL;
-  ASN1_INTEGER *si_serial = NULL;
-  STACK_OF(X509_CRL) *crls = NULL;
-  STACK_OF(X509) *certs = NULL;
-  X509_ALGOR *signature_alg = NULL, *digest_alg = NULL;
-  ASN1_OBJECT *oid = NULL;
-  hashbuf_t hashbuf;
-  X509 *x = NULL;
-  certinfo_t certinfo_;
-  int i, result = 0;
+  STACK_OF(walk_ctx_t) *wsk = cookie;
+  object_generation_t generation;
+  walk_ctx_t *w;
 
-  assert(rc && wsk && uri && path && prefix);
+  assert(rc && wsk);
 
-  if (!certinfo)
-    certinfo = &certinfo_;
+  while ((w = walk_ctx_stack_head(wsk)) != NULL) {
 
-  if (!uri_to_filename(rc, uri, path, prefix))
-    goto error;
+    switch (w->state) {
+    case walk_state_current:
+      generation = object_generation_current;
+      break;
+    case walk_state_backup:
+      generation = object_generation_backup;
+      break;
+    default:
+      generation = object_generation_null;
+      break;
+    }
 
-  if (hash)
-    cms = read_cms(path, &hashbuf);
-  else
-    cms = read_cms(path, NULL);
+    switch (w->state) {
 
-  if (!cms)
-    goto error;
+    case walk_state_initial:
+
+      if (!w->certinfo.sia.s[0] || !w->certinfo.ca) {
+	w->state = walk_state_done;
+	continue;
+      }
+
+      if (!w->certinfo.manifest.s[0]) {
+	log_validation_status(rc, &w->certinfo.uri, sia_manifest_uri_missing, w->certinfo.generation);
+	w->state = walk_state_done;
+	continue;
+      }
+
+      trace_walk_start(rc, wsk);
+      w->state++;
+      continue;
+
+    case walk_state_rsync:
+
+      if (rsync_needed(rc, wsk)) {
+	if (rc->rrdp_directory.s[0] != '\0' && w->certinfo.rrdpnotify.s[0] != '\0')
+	  rrdp_tree(rc, &w->certinfo.sia, &w->certinfo.rrdpnotify, wsk, rrdp_sia_callback);
+	else
+	  rsync_tree(rc, &w->certinfo.sia, wsk, rsync_sia_callback);
+	return;
+      }
+      log_validation_status(rc, &w->certinfo.sia, rsync_transfer_skipped, object_generation_null);
+      trace_walk_fetched(rc, wsk);
+      w->state++;
+      continue;
 
-  if (hash && (hashlen > sizeof(hashbuf.h) ||
-	       memcmp(hashbuf.h, hash, hashlen))) {
-    log_validation_status(rc, uri, digest_mismatch, generation);
-    if (!rc->allow_digest_mismatch)
-      goto error;
-  }
+    case walk_state_ready:
 
-  if (OBJ_obj2nid(CMS_get0_eContentType(cms)) != expected_eContentType_nid) {
-    log_validation_status(rc, uri, bad_cms_econtenttype, generation);
-    goto error;
-  }
+      walk_ctx_loop_init(rc, wsk);      /* sets w->state */
+      continue;
 
-  if (CMS_verify(cms, NULL, NULL, NULL, bio, CMS_NO_SIGNER_CERT_VERIFY) <= 0) {
-    log_validation_status(rc, uri, cms_validation_failure, generation);
-    goto error;
-  }
+    case walk_state_current:
+    case walk_state_backup:
 
-  if ((crls = CMS_get1_crls(cms)) != NULL) {
-    log_validation_status(rc, uri, cms_includes_crls, generation);
-    goto error;
-  }
+      if (w->busy) {
+	assert(rc->pool != NULL);
+	pthread_cond_wait(&rc->pool->frame, &rc->pool->lock);
+	continue;
+      }
 
-  if ((signer_infos = CMS_get0_SignerInfos(cms)) == NULL ||
-      sk_CMS_SignerInfo_num(signer_infos) != 1 ||
-      (si = sk_CMS_SignerInfo_value(signer_infos, 0)) == NULL ||
-      !CMS_SignerInfo_get0_signer_id(si, &sid, &si_issuer, &si_serial) ||
-      sid == NULL || si_issuer != NULL || si_serial != NULL ||
-      CMS_unsigned_get_attr_count(si) != -1) {
-    log_validation_status(rc, uri, bad_cms_signer_infos, generation);
-    goto error;
-  }
+      w->busy = 1;
+      walk_cert_product(rc, wsk, generation);
+      w->busy = 0;
 
-  CMS_SignerInfo_get0_algs(si, NULL, &x, &digest_alg, &signature_alg);
+      if (rc->pool)
+	pthread_cond_broadcast(&rc->pool->frame);
+      continue;
 
-  if (x == NULL) {
-    log_validation_status(rc, uri, cms_signer_missing, generation);
-    goto error;
-  }
+    case walk_state_done:
 
-  if ((certs = CMS_get1_certs(cms)) == NULL ||
-      sk_X509_num(certs) != 1 ||
-      X509_cmp(x, sk_X509_value(certs, 0))) {
-    log_validation_status(rc, uri, bad_cms_signer, generation);
-    goto error;
-  }
+      walk_ctx_stack_pop(wsk);	/* Resume our issuer's state */
+      continue;
 
-  X509_ALGOR_get0(&oid, NULL, NULL, signature_alg);
-  i = OBJ_obj2nid(oid);
-  if (i != NID_sha256WithRSAEncryption && i != NID_rsaEncryption) {
-    log_validation_status(rc, uri, wrong_cms_si_signature_algorithm, generation);
-    goto error;
+    }
   }
 
-  X509_ALGOR_get0(&oid, NULL, NULL, digest_alg);
-  if (OBJ_obj2nid(oid) != NID_sha256) {
-    log_validation_status(rc, uri, wrong_cms_si_digest_algorithm, generation);
-    goto error;
-  }
+  assert(walk_ctx_stack_head(wsk) == NULL);
+  walk_ctx_stack_free(wsk);
+}
 
-  i = CMS_signed_get_attr_count(si);
+/**
+ * Check a trust anchor.  Yes, we trust it, by definition, but it
+ * still needs to conform to the certificate profile, the
+ * self-signature must be correct, etcetera.
+ *
+ * Ownership of the TA certificate object passes to this function when
+ * called (ie, freeing "x" is our responsibility).
+ */
+static int check_ta(rcynic_ctx_t *rc, X509 *x, const uri_t *uri,
+		    const path_t *path1, const path_t *path2,
+		    const object_generation_t generation)
+{
+  STACK_OF(walk_ctx_t) *wsk = NULL;
+  walk_ctx_t *w = NULL;
 
-  (void) extract_si_datum(si, &i, 1, NID_pkcs9_signingTime,   V_ASN1_UTCTIME);
-  (void) extract_si_datum(si, &i, 1, NID_binary_signing_time, V_ASN1_INTEGER);
-  oid =  extract_si_datum(si, &i, 0, NID_pkcs9_contentType,   V_ASN1_OBJECT);
-  (void) extract_si_datum(si, &i, 0, NID_pkcs9_messageDigest, V_ASN1_OCTET_STRING);
+  assert(rc && x && uri && path1 && path2);
 
-  if (i != 0) {
-    log_validation_status(rc, uri, bad_cms_si_signed_attributes, generation);
-    if (!rc->allow_wrong_cms_si_attributes)
-      goto error;
-  }
+  if (x == NULL)
+    return 1;
 
-  if (OBJ_obj2nid(oid) != expected_eContentType_nid) {
-    log_validation_status(rc, uri, bad_cms_si_contenttype, generation);
-    goto error;
+  if ((wsk = walk_ctx_stack_new()) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate walk context stack");
+    X509_free(x);
+    return 0;
   }
 
-  if (CMS_SignerInfo_cert_cmp(si, x)) {
-    log_validation_status(rc, uri, cms_ski_mismatch, generation);
-    goto error;
+  if ((w = walk_ctx_stack_push(wsk, x, NULL)) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't push walk context stack");
+    walk_ctx_stack_free(wsk);
+    X509_free(x);
+    return 0;
   }
 
-  if (!check_x509(rc, wsk, uri, x, certinfo, generation))
-    goto error;
+  w->ta_stats = ta_stats_find(rc, uri);
 
-  if (require_inheritance && x->rfc3779_addr) {
-    for (i = 0; i < sk_IPAddressFamily_num(x->rfc3779_addr); i++) {
-      IPAddressFamily *f = sk_IPAddressFamily_value(x->rfc3779_addr, i);
-      if (f->ipAddressChoice->type != IPAddressChoice_inherit) {
-	log_validation_status(rc, uri, rfc3779_inheritance_required, generation);
-	goto error;
-      }
-    }
+  if (!check_x509(rc, wsk, uri, x, NULL, generation)) {
+    log_validation_status(rc, uri, object_rejected, generation);
+    ta_stats_count(wsk, object_type_cer, 0);
+    walk_ctx_stack_free(wsk);
+    return 1;
   }
 
-  if (require_inheritance && x->rfc3779_asid && x->rfc3779_asid->asnum &&
-      x->rfc3779_asid->asnum->type != ASIdentifierChoice_inherit) {
-    log_validation_status(rc, uri, rfc3779_inheritance_required, generation);
-    goto error;
-  }
+  logmsg(rc, log_telemetry, "Copying trust anchor %s to %s", path1->s, path2->s);
 
-  if (pcms) {
-    *pcms = cms;
-    cms = NULL;
+  if (!mkdir_maybe(rc, path2) || !cp_ln(rc, path1, path2)) {
+    walk_ctx_stack_free(wsk);
+    return 0;
   }
 
-  if (px)
-    *px = x;
-
-  result = 1;
-
- error:
-  CMS_ContentInfo_free(cms);
-  sk_X509_CRL_pop_free(crls, X509_CRL_free);
-  sk_X509_pop_free(certs, X509_free);
-
-  return result;
+  log_validation_status(rc, uri, object_accepted, generation);
+  ta_stats_count(wsk, object_type_cer, 1);
+  task_add(rc, walk_cert, wsk);
+  return 1;
 }
 
 
 
 /**
- * Load certificate, check against manifest, then run it through all
- * the check_x509() tests.
+ * Check a trust anchor read from a local file.
  */
-static X509 *check_cert_1(rcynic_ctx_t *rc,
-			  STACK_OF(walk_ctx_t) *wsk,
-			  const uri_t *uri,
-			  path_t *path,
-			  const path_t *prefix,
-			  certinfo_t *certinfo,
-			  const unsigned char *hash,
-			  const size_t hashlen,
-			  object_generation_t generation)
+static int check_ta_cer(rcynic_ctx_t *rc,
+			const char *fn)
+
 {
-  hashbuf_t hashbuf;
+  path_t path1, path2;
+  unsigned long hash;
   X509 *x = NULL;
+  uri_t uri;
+  int i;
 
-  assert(uri && path && wsk && certinfo);
-
-  if (!uri_to_filename(rc, uri, path, prefix))
-    return NULL;
-
-  if (access(path->s, R_OK))
-    return NULL;
+  assert(rc && fn);
 
-  if (hash)
-    x = read_cert(path, &hashbuf);
-  else
-    x = read_cert(path, NULL);
+  logmsg(rc, log_telemetry, "Processing trust anchor from file %s", fn);
 
-  if (!x) {
-    logmsg(rc, log_sys_err, "Can't read certificate %s", path->s);
-    goto punt;
+  if (strlen(fn) >= sizeof(path1.s)) {
+    logmsg(rc, log_usage_err, "Trust anchor path name too long %s", fn);
+    return 0;
   }
+  strcpy(path1.s, fn);
+  filename_to_uri(rc, &uri, path1.s);
 
-  if (hash && (hashlen > sizeof(hashbuf.h) ||
-	       memcmp(hashbuf.h, hash, hashlen))) {
-    log_validation_status(rc, uri, digest_mismatch, generation);
-    if (!rc->allow_digest_mismatch)
-      goto punt;
+  if ((x = read_cert(&path1, NULL)) == NULL) {
+    logmsg(rc, log_usage_err, "Couldn't read trust anchor from file %s", fn);
+    log_validation_status(rc, &uri, unreadable_trust_anchor, object_generation_null);
+    goto lose;
   }
 
-  if (check_x509(rc, wsk, uri, x, certinfo, generation))
-    return x;
-
- punt:
-  X509_free(x);
-  return NULL;
-}
-
-/**
- * Try to find a good copy of a certificate either in fresh data or in
- * backup data from a previous run of this program.
- */
-static X509 *check_cert(rcynic_ctx_t *rc,
-			STACK_OF(walk_ctx_t) *wsk,
-			uri_t *uri,
-			certinfo_t *certinfo,
-			const unsigned char *hash,
-			const size_t hashlen)
-{
-  walk_ctx_t *w = walk_ctx_stack_head(wsk);
-  object_generation_t generation;
-  const path_t *prefix = NULL;
-  path_t path;
-  X509 *x;
-
-  assert(rc && uri && wsk && w && certinfo);
+  hash = X509_subject_name_hash(x);
 
-  switch (w->state) {
-  case walk_state_current:
-    prefix = &rc->unauthenticated;
-    generation = object_generation_current;
-    break;
-  case walk_state_backup:
-    prefix = &rc->old_authenticated;
-    generation = object_generation_backup;
-    break;
-  default:
-    return NULL;
+  for (i = 0; i < INT_MAX; i++) {
+    if (snprintf(path2.s, sizeof(path2.s), "%s%lx.%d.cer",
+		 rc->new_authenticated.s, hash, i) >= sizeof(path2.s)) {
+      logmsg(rc, log_sys_err,
+	     "Couldn't construct path name for trust anchor %s", path1.s);
+      goto lose;
+    }
+    if (access(path2.s, F_OK))
+      break;
+  }
+  if (i == INT_MAX) {
+    logmsg(rc, log_sys_err, "Couldn't find a free name for trust anchor %s", path1.s);
+    goto lose;
   }
 
-  if (skip_checking_this_object(rc, uri, generation))
-    return NULL;
-
-  if ((x = check_cert_1(rc, wsk, uri, &path, prefix, certinfo,
-			hash, hashlen, generation)) != NULL)
-    install_object(rc, uri, &path, generation);
-  else if (!access(path.s, F_OK))
-    log_validation_status(rc, uri, object_rejected, generation);
-  else if (hash && generation == w->manifest_generation)
-    log_validation_status(rc, uri, manifest_lists_missing_object, generation);
+  return check_ta(rc, x, &uri, &path1, &path2, object_generation_null);
 
-  return x;
+ lose:
+  log_validation_status(rc, &uri, trust_anchor_skipped, object_generation_null);
+  X509_free(x);
+  return 0;
 }
 
 
 
 /**
- * Read and check one manifest from disk.
+ * Allocate a new tal_ctx_t.
  */
-static Manifest *check_manifest_1(rcynic_ctx_t *rc,
-				  STACK_OF(walk_ctx_t) *wsk,
-				  const uri_t *uri,
-				  path_t *path,
-				  const path_t *prefix,
-				  certinfo_t *certinfo,
-				  const object_generation_t generation)
+static tal_ctx_t *tal_ctx_t_new(void)
 {
-  STACK_OF(FileAndHash) *sorted_fileList = NULL;
-  Manifest *manifest = NULL, *result = NULL;
-  CMS_ContentInfo *cms = NULL;
-  FileAndHash *fah = NULL, *fah2 = NULL;
-  BIO *bio = NULL;
-  X509 *x;
-  int i;
-
-  assert(rc && wsk && uri && path && prefix);
+  tal_ctx_t *tctx = malloc(sizeof(*tctx));
+  if (tctx) {
+    memset(tctx, 0, sizeof(*tctx));
+    tctx->uri = uri_empty;
+  }
+  return tctx;
+}
 
-  if ((bio = BIO_new(BIO_s_mem())) == NULL) {
-    logmsg(rc, log_sys_err, "Couldn't allocate BIO for manifest %s", uri->s);
-    goto done;
+/**
+ * Free a tal_ctx_t.
+ */
+static void tal_ctx_t_free(tal_ctx_t *tctx)
+{
+  if (tctx) {
+    EVP_PKEY_free(tctx->pkey);
+    free(tctx);
   }
+}
 
-  if (!check_cms(rc, wsk, uri, path, prefix, &cms, &x, certinfo, bio, NULL, 0,
-		 NID_ct_rpkiManifest, 1, generation))
-    goto done;
+/**
+ * Read a trust anchor from disk and compare with known public key.
+ *
+ * NB: EVP_PKEY_cmp() returns 1 for match, not 0 like every other
+ * xyz_cmp() function in the entire OpenSSL library.  Go figure.
+ */
+static int check_ta_tal_callback_1(rcynic_ctx_t *rc,
+				   const tal_ctx_t *tctx,
+				   object_generation_t generation)
 
-  if ((manifest = ASN1_item_d2i_bio(ASN1_ITEM_rptr(Manifest), bio, NULL)) == NULL) {
-    log_validation_status(rc, uri, cms_econtent_decode_error, generation);
-    goto done;
-  }
+{
+  const path_t *prefix = NULL;
+  EVP_PKEY *pkey = NULL;
+  X509 *x = NULL;
+  path_t path;
+  int ret = 0;
 
-  if (manifest->version) {
-    log_validation_status(rc, uri, wrong_object_version, generation);
+  switch (generation) {
+  case object_generation_current:
+    prefix = &rc->unauthenticated;
+    break;
+  case object_generation_backup:
+    prefix = &rc->old_authenticated;
+    break;
+  default:
     goto done;
   }
 
-  if (X509_cmp_current_time(manifest->thisUpdate) > 0) {
-    log_validation_status(rc, uri, manifest_not_yet_valid, generation);
+  if (!uri_to_filename(rc, &tctx->uri, &path, prefix)) {
+    log_validation_status(rc, &tctx->uri, unreadable_trust_anchor_locator, generation);
     goto done;
   }
 
-  if (X509_cmp_current_time(manifest->nextUpdate) < 0) {
-    log_validation_status(rc, uri, stale_crl_or_manifest, generation);
-    if (!rc->allow_stale_manifest)
-      goto done;
-  }
-
-  if (asn1_time_cmp(manifest->thisUpdate, X509_get_notBefore(x)) < 0 ||
-      asn1_time_cmp(manifest->nextUpdate, X509_get_notAfter(x))  > 0) {
-    log_validation_status(rc, uri, manifest_interval_overruns_cert, generation);
+  if ((x = read_cert(&path, NULL)) == NULL || (pkey = X509_get_pubkey(x)) == NULL) {
+    log_validation_status(rc, &tctx->uri, unreadable_trust_anchor, generation);
     goto done;
   }
 
-  if (ASN1_INTEGER_cmp(manifest->manifestNumber, asn1_zero) < 0 ||
-      ASN1_INTEGER_cmp(manifest->manifestNumber, asn1_twenty_octets) > 0) {
-    log_validation_status(rc, uri, bad_manifest_number, generation);
+  if (EVP_PKEY_cmp(tctx->pkey, pkey) != 1) {
+    log_validation_status(rc, &tctx->uri, trust_anchor_key_mismatch, generation);
     goto done;
   }
 
-  if (OBJ_obj2nid(manifest->fileHashAlg) != NID_sha256) {
-    log_validation_status(rc, uri, nonconformant_digest_algorithm, generation);
-    goto done;
-  }
+  ret = check_ta(rc, x, &tctx->uri, &path, &tctx->path, generation);
+  x = NULL;
 
-  if ((sorted_fileList = sk_FileAndHash_dup(manifest->fileList)) == NULL) {
-    logmsg(rc, log_sys_err, "Couldn't allocate shallow copy of fileList for manifest %s", uri->s);
-    goto done;
-  }
+ done:
+  if (!ret)
+    log_validation_status(rc, &tctx->uri, object_rejected, generation);
+  EVP_PKEY_free(pkey);
+  X509_free(x);
+  return ret;
+}
 
-  (void) sk_FileAndHash_set_cmp_func(sorted_fileList, FileAndHash_name_cmp);
-  sk_FileAndHash_sort(sorted_fileList);
+/**
+ * rsync callback for fetching a TAL.
+ */
+static void rsync_tal_callback(rcynic_ctx_t *rc,
+			       const rsync_ctx_t *ctx,
+			       const rsync_status_t status,
+			       const uri_t *uri,
+			       void *cookie)
+{
+  tal_ctx_t *tctx = cookie;
 
-  for (i = 0; (fah = sk_FileAndHash_value(sorted_fileList, i)) != NULL && (fah2 = sk_FileAndHash_value(sorted_fileList, i + 1)) != NULL; i++) {
-    if (!strcmp((char *) fah->file->data, (char *) fah2->file->data)) {
-      log_validation_status(rc, uri, duplicate_name_in_manifest, generation);
-      goto done;
-    }
-  }
+  assert(rc && tctx);
 
-  for (i = 0; (fah = sk_FileAndHash_value(manifest->fileList, i)) != NULL; i++) {
-    if (fah->hash->length != HASH_SHA256_LEN ||
-	(fah->hash->flags & (ASN1_STRING_FLAG_BITS_LEFT | 7)) > ASN1_STRING_FLAG_BITS_LEFT) {
-      log_validation_status(rc, uri, bad_manifest_digest_length, generation);
-      goto done;
-    }
-  }
+  if (status == rsync_status_pending)
+    return;
 
-  result = manifest;
-  manifest = NULL;
+  if (!check_ta_tal_callback_1(rc, tctx, object_generation_current) &&
+      !check_ta_tal_callback_1(rc, tctx, object_generation_backup))
+    log_validation_status(rc, &tctx->uri, trust_anchor_skipped, object_generation_null);
 
- done:
-  BIO_free(bio);
-  Manifest_free(manifest);
-  CMS_ContentInfo_free(cms);
-  sk_FileAndHash_free(sorted_fileList);
-  return result;
+  tal_ctx_t_free(tctx);
 }
 
 /**
- * Check whether we already have a particular manifest, attempt to fetch it
- * and check issuer's signature if we don't.
- *
- * General plan here is to do basic checks on both current and backup
- * generation manifests, then, if both generations pass all of our
- * other tests, pick the generation with the highest manifest number,
- * to protect against replay attacks.
- *
- * Once we've picked the manifest we're going to use, we need to check
- * it against the CRL we've chosen.  Not much we can do if they don't
- * match besides whine about it, but we do need to whine in this case.
+ * Check a trust anchor read from a trust anchor locator (TAL).
  */
-static int check_manifest(rcynic_ctx_t *rc,
-			  STACK_OF(walk_ctx_t) *wsk)
-{
-  walk_ctx_t *w = walk_ctx_stack_head(wsk);
-  Manifest *old_manifest, *new_manifest, *result = NULL;
-  certinfo_t old_certinfo, new_certinfo;
-  const uri_t *uri, *crldp = NULL;
-  object_generation_t generation = object_generation_null;
-  path_t old_path, new_path;
-  FileAndHash *fah = NULL;
-  const char *crl_tail;
-  int i, ok = 1;
+static int check_ta_tal(rcynic_ctx_t *rc,
+			const char *fn)
 
-  assert(rc && wsk && w && !w->manifest);
+{
+  tal_ctx_t *tctx = NULL;
+  char buf[URI_MAX];
+  BIO *bio = NULL;
+  int ret = 1;
 
-  uri = &w->certinfo.manifest;
+  assert(rc && fn);
 
-  logmsg(rc, log_telemetry, "Checking manifest %s", uri->s);
+  logmsg(rc, log_telemetry, "Processing trust anchor locator from file %s", fn);
 
-  new_manifest = check_manifest_1(rc, wsk, uri, &new_path,
-				  &rc->unauthenticated, &new_certinfo,
-				  object_generation_current);
+  if ((tctx = tal_ctx_t_new()) == NULL) {
+    logmsg(rc, log_sys_err, "malloc(tal_ctxt_t) failed");
+    goto done;
+  }
 
-  old_manifest = check_manifest_1(rc, wsk, uri, &old_path,
-				  &rc->old_authenticated, &old_certinfo,
-				  object_generation_backup);
+  bio = BIO_new_file(fn, "r");
 
-  if (!new_manifest)
-    result = old_manifest;
+  if (!bio)
+    logmsg(rc, log_usage_err, "Couldn't open trust anchor locator file %s", fn);
 
-  else if (!old_manifest)
-    result = new_manifest;
+  if (!bio || BIO_gets(bio, buf, sizeof(buf)) <= 0) {
+    uri_t furi;
+    filename_to_uri(rc, &furi, fn);
+    log_validation_status(rc, &furi, unreadable_trust_anchor_locator, object_generation_null);
+    goto done;
+  }
 
-  else {
-    int num_cmp = ASN1_INTEGER_cmp(old_manifest->manifestNumber, new_manifest->manifestNumber);
-    int date_cmp = ASN1_STRING_cmp(old_manifest->thisUpdate, new_manifest->thisUpdate);
+  buf[strcspn(buf, " \t\r\n")] = '\0';
 
-    if (num_cmp > 0)
-      log_validation_status(rc, uri, backup_number_higher_than_current, object_generation_current);
-    if (date_cmp > 0)
-      log_validation_status(rc, uri, backup_thisupdate_newer_than_current, object_generation_current);
+  if (!uri_intern(rc, &tctx->uri, buf))
+    goto done;
 
-    if (num_cmp > 0 && date_cmp > 0)
-      result = old_manifest;
-    else
-      result = new_manifest;
+  if (!uri_to_filename(rc, &tctx->uri, &tctx->path, &rc->new_authenticated)) {
+    log_validation_status(rc, &tctx->uri, unreadable_trust_anchor_locator, object_generation_null);
+    goto done;
   }
 
-  if (result && result == new_manifest) {
-    generation = object_generation_current;
-    install_object(rc, uri, &new_path, generation);
-    crldp = &new_certinfo.crldp;
+  if (!endswith(tctx->uri.s, ".cer")) {
+    log_validation_status(rc, &tctx->uri, malformed_tal_uri, object_generation_null);
+    goto done;
   }
 
-  if (result && result == old_manifest) {
-    generation = object_generation_backup;
-    install_object(rc, uri, &old_path, generation);
-    crldp = &old_certinfo.crldp;
+  bio = BIO_push(BIO_new(BIO_f_linebreak()), bio);
+  bio = BIO_push(BIO_new(BIO_f_base64()), bio);
+  if (bio)
+    tctx->pkey = d2i_PUBKEY_bio(bio, NULL);
+  if (!tctx->pkey) {
+    log_validation_status(rc, &tctx->uri, unreadable_trust_anchor_locator, object_generation_null);
+    goto done;
   }
 
-  if (result) {
-    crl_tail = strrchr(crldp->s, '/');
-    assert(crl_tail != NULL);
-    crl_tail++;
-
-    for (i = 0; (fah = sk_FileAndHash_value(result->fileList, i)) != NULL; i++)
-      if (!strcmp((char *) fah->file->data, crl_tail))
-	break;
+  logmsg(rc, log_telemetry, "Processing trust anchor from URI %s", tctx->uri.s);
 
-    if (!fah) {
-      log_validation_status(rc, uri, crl_not_in_manifest, generation);
-      if (rc->require_crl_in_manifest)
-	ok = 0;
-    }
+  rsync_ta(rc, &tctx->uri, tctx, rsync_tal_callback);
+  tctx = NULL;			/* Control has passed */
 
-    else if (!check_crl_digest(rc, crldp, fah->hash->data, fah->hash->length)) {
-      log_validation_status(rc, uri, digest_mismatch, generation);
-      if (!rc->allow_crl_digest_mismatch)
-	ok = 0;
-    }
-  }
+ done:
+  tal_ctx_t_free(tctx);
+  BIO_free_all(bio);
+  return ret;
+}
 
-  if ((!result || result != new_manifest) && !access(new_path.s, F_OK))
-    log_validation_status(rc, uri, object_rejected, object_generation_current);
+/**
+ * Check a directory of trust anchors and trust anchor locators.
+ */
+static int check_ta_dir(rcynic_ctx_t *rc,
+			const char *dn)
+{
+  DIR *dir = NULL;
+  struct dirent *d;
+  path_t path;
+  int is_cer, is_tal;
 
-  if (!result && !access(old_path.s, F_OK))
-    log_validation_status(rc, uri, object_rejected, object_generation_backup);
+  assert(rc && dn);
 
-  if (result != new_manifest)
-    Manifest_free(new_manifest);
+  if ((dir = opendir(dn)) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't open trust anchor directory %s: %s",
+	   dn, strerror(errno));
+    return 0;
+  }
 
-  if (result != old_manifest)
-    Manifest_free(old_manifest);
+  while ((d = readdir(dir)) != NULL) {
+    if (snprintf(path.s, sizeof(path.s), "%s/%s", dn, d->d_name) >= sizeof(path.s)) {
+      logmsg(rc, log_data_err, "Pathname %s/%s too long", dn, d->d_name);
+      break;
+    }
+    is_cer = endswith(path.s, ".cer");
+    is_tal = endswith(path.s, ".tal");
+    if (is_cer && !check_ta_cer(rc, path.s))
+      break;
+    if (is_tal && !check_ta_tal(rc, path.s))
+      break;
+    if (!is_cer && !is_tal)
+      logmsg(rc, log_verbose, "Skipping non-trust-anchor %s", path.s);
+  }
 
-  w->manifest = result;
-  if (crldp)
-    w->crldp = *crldp;
-  w->manifest_generation = generation;
+  if (dir != NULL)
+    closedir(dir);
 
-  return ok;
+  return !d;;
 }
 
 
 
 /**
- * Mark CRL or manifest that we're rechecking so XML report makes more sense.
+ * Configuration settings which can change the outcome of the checks
+ * we cache.  Recorded in the validation cache file, so that changing
+ * any of them throws away the cache.
  */
-static void rsync_needed_mark_recheck(rcynic_ctx_t *rc,
-				      const uri_t *uri)
+static unsigned validation_cache_policy(const rcynic_ctx_t *rc)
 {
-  validation_status_t *v = NULL;
-
-  if (uri->s[0] != '\0')
-    v = validation_status_find(rc->validation_status_root,
-			       uri, object_generation_current);
-
-  if (v) {
-    validation_status_set_code(v, stale_crl_or_manifest, 0);
-    log_validation_status(rc, uri, rechecking_object,
-			  object_generation_current);
-  }
+  return ((rc->allow_stale_crl                    ? 0x001 : 0) |
+	  (rc->allow_digest_mismatch              ? 0x002 : 0) |
+	  (rc->allow_nonconformant_name           ? 0x004 : 0) |
+	  (rc->allow_ee_without_signedObject      ? 0x008 : 0) |
+	  (rc->allow_1024_bit_ee_key              ? 0x010 : 0) |
+	  (rc->allow_wrong_cms_si_attributes      ? 0x020 : 0) |
+	  (rc->allow_non_self_signed_trust_anchor ? 0x040 : 0) |
+	  (rc->incremental_validation             ? 0x080 : 0));
 }
 
 /**
- * Check whether we need to rsync a particular tree.  This depends on
- * the setting of rc->rsync_early, whether we have a valid manifest on
- * file, and whether that manifest is stale yet.
+ * Decode a hex string of exactly len bytes.
  */
-static int rsync_needed(rcynic_ctx_t *rc,
-			STACK_OF(walk_ctx_t) *wsk)
+static int hex_decode(const char *s, unsigned char *buf, const size_t len)
 {
-  walk_ctx_t *w = walk_ctx_stack_head(wsk);
-  int needed;
+  unsigned b;
+  size_t i;
 
-  assert(rc && wsk && w);
-
-  needed = (rc->rsync_early ||
-	    !check_manifest(rc, wsk) ||
-	    w->manifest == NULL ||
-	    X509_cmp_current_time(w->manifest->nextUpdate) < 0);
+  if (s == NULL || strlen(s) != len * 2)
+    return 0;
 
-  if (needed && w->manifest != NULL) {
-    rsync_needed_mark_recheck(rc, &w->certinfo.manifest);
-    rsync_needed_mark_recheck(rc, &w->certinfo.crldp);
-    Manifest_free(w->manifest);
-    w->manifest = NULL;
+  for (i = 0; i < len; i++) {
+    if (sscanf(s + i * 2, "%2x", &b) != 1)
+      return 0;
+    buf[i] = b;
   }
 
-  return needed;
+  return 1;
 }
 
-
+/**
+ * Copy a URI field from the validation cache file, where "-" means
+ * an empty URI.
+ */
+static int validation_cache_uri(const rcynic_ctx_t *rc, const char *s, uri_t *uri)
+{
+  return s != NULL && uri_intern(rc, uri, strcmp(s, "-") ? s : "");
+}
 
 /**
- * Extract a ROA prefix from the ASN.1 bitstring encoding.
+ * Parse one line of the validation cache file.
  */
-static int extract_roa_prefix(const ROAIPAddress *ra,
-			      const unsigned afi,
-			      unsigned char *addr,
-			      unsigned *prefixlen,
-			      unsigned *max_prefixlen)
+static int parse_validation_cache_entry(const rcynic_ctx_t *rc, char *line, validation_cache_t *vc)
 {
-  unsigned length;
-  long maxlen;
+  char *s;
 
-  assert(ra && addr && prefixlen && max_prefixlen);
+  if (!hex_decode(strtok(line, " "), vc->key, sizeof(vc->key)))
+    return 0;
 
-  maxlen = ASN1_INTEGER_get(ra->maxLength);
+  if ((s = strtok(NULL, " ")) == NULL || strlen(s) != sizeof(vc->expires) - 1)
+    return 0;
+  strcpy(vc->expires, s);
 
-  switch (afi) {
-  case IANA_AFI_IPV4: length =  4; break;
-  case IANA_AFI_IPV6: length = 16; break;
-  default: return 0;
-  }
+  if (!hex_decode(strtok(NULL, " "), vc->events, sizeof(vc->events)))
+    return 0;
 
-  if (ra->IPAddress->length < 0 || ra->IPAddress->length > length ||
-      maxlen < 0 || maxlen > (long) length * 8)
+  if ((s = strtok(NULL, " ")) == NULL)
     return 0;
+  vc->certinfo.ca = atoi(s);
 
-  if (ra->IPAddress->length > 0) {
-    memcpy(addr, ra->IPAddress->data, ra->IPAddress->length);
-    if ((ra->IPAddress->flags & 7) != 0) {
-      unsigned char mask = 0xFF >> (8 - (ra->IPAddress->flags & 7));
-      addr[ra->IPAddress->length - 1] &= ~mask;
-    }
-  }
+  if ((s = strtok(NULL, " ")) == NULL)
+    return 0;
+  vc->size = (off_t) strtoll(s, NULL, 10);
 
-  memset(addr + ra->IPAddress->length, 0, length - ra->IPAddress->length);
-  *prefixlen = (ra->IPAddress->length * 8) - (ra->IPAddress->flags & 7);
-  *max_prefixlen = ra->maxLength ? (unsigned) maxlen : *prefixlen;
+  if ((s = strtok(NULL, " ")) == NULL)
+    return 0;
+  vc->mtime = (time_t) strtoll(s, NULL, 10);
 
-  return 1;
+  if ((s = strtok(NULL, " ")) == NULL)
+    return 0;
+  vc->ino = (ino_t) strtoull(s, NULL, 10);
+
+  return (validation_cache_uri(rc, strtok(NULL, " "), &vc->certinfo.sia)          &&
+	  validation_cache_uri(rc, strtok(NULL, " "), &vc->certinfo.aia)          &&
+	  validation_cache_uri(rc, strtok(NULL, " "), &vc->certinfo.crldp)        &&
+	  validation_cache_uri(rc, strtok(NULL, " "), &vc->certinfo.manifest)     &&
+	  validation_cache_uri(rc, strtok(NULL, " "), &vc->certinfo.signedobject) &&
+	  validation_cache_uri(rc, strtok(NULL, " "), &vc->certinfo.rrdpnotify));
 }
 
 /**
- * Read and check one ROA from disk.
+ * Read the persistent validation cache.  A missing or unusable cache
+ * file just means we start with an empty cache.
  */
-static int check_roa_1(rcynic_ctx_t *rc,
-		       STACK_OF(walk_ctx_t) *wsk,
-		       const uri_t *uri,
-		       path_t *path,
-		       const path_t *prefix,
-		       const unsigned char *hash,
-		       const size_t hashlen,
-		       const object_generation_t generation)
+static int read_validation_cache(rcynic_ctx_t *rc,
+				 const char *filename)
 {
-  STACK_OF(IPAddressFamily) *roa_resources = NULL, *ee_resources = NULL;
-  unsigned char addrbuf[ADDR_RAW_BUF_LEN];
-  CMS_ContentInfo *cms = NULL;
-  BIO *bio = NULL;
-  ROA *roa = NULL;
-  X509 *x = NULL;
-  int i, j, result = 0;
-  unsigned afi, *safi = NULL, safi_, prefixlen, max_prefixlen;
-  ROAIPAddressFamily *rf;
-  ROAIPAddress *ra;
+  const size_t linelen = URI_MAX * 7 + 256;
+  validation_cache_t *vc = NULL;
+  unsigned version, policy, events;
+  char *line = NULL, *s;
+  FILE *f = NULL;
+  int ok = 0;
 
-  assert(rc && wsk && uri && path && prefix);
+  assert(rc && filename);
 
-  if ((bio = BIO_new(BIO_s_mem())) == NULL) {
-    logmsg(rc, log_sys_err, "Couldn't allocate BIO for ROA %s", uri->s);
-    goto error;
+  if ((rc->validation_cache = sk_validation_cache_t_new(validation_cache_cmp)) == NULL ||
+      (rc->validation_cache_used = sk_validation_cache_t_new(validation_cache_cmp)) == NULL ||
+      (line = malloc(linelen)) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate validation cache");
+    goto done;
   }
 
-  if (!check_cms(rc, wsk, uri, path, prefix, &cms, &x, NULL, bio, NULL, 0,
-		 NID_ct_ROA, 0, generation))
-    goto error;
+  ok = 1;
 
-  if (!(roa = ASN1_item_d2i_bio(ASN1_ITEM_rptr(ROA), bio, NULL))) {
-    log_validation_status(rc, uri, cms_econtent_decode_error, generation);
-    goto error;
+  if ((f = fopen(filename, "r")) == NULL) {
+    if (errno != ENOENT)
+      logmsg(rc, log_sys_err, "Couldn't open validation cache %s: %s", filename, strerror(errno));
+    goto done;
   }
 
-  if (roa->version) {
-    log_validation_status(rc, uri, wrong_object_version, generation);
-    goto error;
+  if (fgets(line, linelen, f) == NULL ||
+      sscanf(line, "rcynic-validation-cache %u %x %u", &version, &policy, &events) != 3 ||
+      version != VALIDATION_CACHE_VERSION || events != MIB_COUNTER_T_MAX) {
+    logmsg(rc, log_telemetry, "Ignoring validation cache %s from a different version of rcynic", filename);
+    goto done;
   }
 
-  if (ASN1_INTEGER_cmp(roa->asID, asn1_zero) < 0 ||
-      ASN1_INTEGER_cmp(roa->asID, asn1_four_octets) > 0) {
-    log_validation_status(rc, uri, bad_roa_asID, generation);
-    goto error;
+  if (policy != validation_cache_policy(rc)) {
+    logmsg(rc, log_telemetry, "Configuration changed, ignoring validation cache %s", filename);
+    goto done;
   }
 
-  ee_resources = X509_get_ext_d2i(x, NID_sbgp_ipAddrBlock, NULL, NULL);
+  while (fgets(line, linelen, f) != NULL) {
 
-  /*
-   * Extract prefixes from ROA and convert them into a resource set.
-   */
+    if ((s = strchr(line, '\n')) == NULL) {
+      logmsg(rc, log_data_err, "Overlong line in validation cache %s, discarding cache", filename);
+      sk_validation_cache_t_pop_free(rc->validation_cache, validation_cache_t_free);
+      goto done;
+    }
 
-  if (!(roa_resources = sk_IPAddressFamily_new_null()))
-    goto error;
+    *s = '\0';
 
-  for (i = 0; i < sk_ROAIPAddressFamily_num(roa->ipAddrBlocks); i++) {
-    rf = sk_ROAIPAddressFamily_value(roa->ipAddrBlocks, i);
-    if (!rf || !rf->addressFamily || rf->addressFamily->length < 2 || rf->addressFamily->length > 3) {
-      log_validation_status(rc, uri, malformed_roa_addressfamily, generation);
-      goto error;
-    }
-    afi = (rf->addressFamily->data[0] << 8) | (rf->addressFamily->data[1]);
-    if (rf->addressFamily->length == 3)
-      *(safi = &safi_) = rf->addressFamily->data[2];
-    for (j = 0; j < sk_ROAIPAddress_num(rf->addresses); j++) {
-      ra = sk_ROAIPAddress_value(rf->addresses, j);
-      if (!ra ||
-	  !extract_roa_prefix(ra, afi, addrbuf, &prefixlen, &max_prefixlen) ||
-	  !v3_addr_add_prefix(roa_resources, afi, safi, addrbuf, prefixlen)) {
-	log_validation_status(rc, uri, roa_resources_malformed, generation);
-	goto error;
-      }
-      if (max_prefixlen < prefixlen) {
-	log_validation_status(rc, uri, roa_max_prefixlen_too_short, generation);
-	goto error;
-      }
+    if ((vc = malloc(sizeof(*vc))) == NULL) {
+      logmsg(rc, log_sys_err, "Couldn't allocate validation cache entry");
+      goto done;
     }
-  }
 
-  /*
-   * ROAs can include nested prefixes, so direct translation to
-   * resource sets could include overlapping ranges, which is illegal.
-   * So we have to remove nested stuff before whacking into canonical
-   * form.  Fortunately, this is relatively easy, since we know these
-   * are just prefixes, not ranges: in a list of prefixes sorted by
-   * the RFC 3779 rules, the first element of a set of nested prefixes
-   * will always be the least specific.
-   */
+    memset(vc, 0, sizeof(*vc));
+    certinfo_clear(&vc->certinfo);
 
-  for (i = 0; i < sk_IPAddressFamily_num(roa_resources); i++) {
-    IPAddressFamily *f = sk_IPAddressFamily_value(roa_resources, i);
+    if (!parse_validation_cache_entry(rc, line, vc)) {
+      logmsg(rc, log_data_err, "Malformed entry in validation cache %s, skipping", filename);
+      validation_cache_t_free(vc);
+      continue;
+    }
 
-    if ((afi = v3_addr_get_afi(f)) == 0) {
-      log_validation_status(rc, uri, roa_contains_bad_afi_value, generation);
-      goto error;
+    if (!sk_validation_cache_t_push(rc->validation_cache, vc)) {
+      logmsg(rc, log_sys_err, "Couldn't store validation cache entry");
+      validation_cache_t_free(vc);
+      goto done;
     }
+  }
 
-    if (f->ipAddressChoice->type == IPAddressChoice_addressesOrRanges) {
-      IPAddressOrRanges *aors = f->ipAddressChoice->u.addressesOrRanges;
+  sk_validation_cache_t_sort(rc->validation_cache);
 
-      sk_IPAddressOrRange_sort(aors);
+  logmsg(rc, log_telemetry, "Loaded %d entries from validation cache %s",
+	 sk_validation_cache_t_num(rc->validation_cache), filename);
 
-      for (j = 0; j < sk_IPAddressOrRange_num(aors) - 1; j++) {
-	IPAddressOrRange *a = sk_IPAddressOrRange_value(aors, j);
-	IPAddressOrRange *b = sk_IPAddressOrRange_value(aors, j + 1);
-	unsigned char a_min[ADDR_RAW_BUF_LEN], a_max[ADDR_RAW_BUF_LEN];
-	unsigned char b_min[ADDR_RAW_BUF_LEN], b_max[ADDR_RAW_BUF_LEN];
-	int length;
+ done:
+  if (f)
+    fclose(f);
+  free(line);
+  return ok;
+}
 
-	if ((length = v3_addr_get_range(a, afi, a_min, a_max, ADDR_RAW_BUF_LEN)) == 0 ||
-	    (length = v3_addr_get_range(b, afi, b_min, b_max, ADDR_RAW_BUF_LEN)) == 0) {
-	  log_validation_status(rc, uri, roa_resources_malformed, generation);
-	  goto error;
-	}
+/**
+ * Write out the persistent validation cache.  We only write entries
+ * we used or created on this run, which keeps the cache from
+ * accumulating objects that have gone away.
+ */
+static int write_validation_cache(const rcynic_ctx_t *rc,
+				  const char *filename)
+{
+  validation_cache_t *vc, *prev = NULL;
+  const certinfo_t *ci;
+  path_t temp;
+  FILE *f = NULL;
+  int i, j, ok;
 
-	if (memcmp(a_max, b_max, length) >= 0) {
-	  (void) sk_IPAddressOrRange_delete(aors, j + 1);
-	  IPAddressOrRange_free(b);
-	  --j;
-	}
-      }
-    }
-  }
+  if (filename == NULL || rc->validation_cache_used == NULL)
+    return 1;
 
-  if (!v3_addr_canonize(roa_resources)) {
-    log_validation_status(rc, uri, roa_resources_malformed, generation);
-    goto error;
+  if (snprintf(temp.s, sizeof(temp.s), "%s.%u.tmp", filename, (unsigned) getpid()) >= sizeof(temp.s)) {
+    logmsg(rc, log_usage_err, "Filename \"%s\" is too long, not writing validation cache", filename);
+    return 0;
   }
 
-  if (!v3_addr_subset(roa_resources, ee_resources)) {
-    log_validation_status(rc, uri, roa_resource_not_in_ee, generation);
-    goto error;
-  }
+  logmsg(rc, log_telemetry, "Writing validation cache to %s", filename);
 
-  result = 1;
+  sk_validation_cache_t_sort(rc->validation_cache_used);
 
- error:
-  BIO_free(bio);
-  ROA_free(roa);
-  CMS_ContentInfo_free(cms);
-  sk_IPAddressFamily_pop_free(roa_resources, IPAddressFamily_free);
-  sk_IPAddressFamily_pop_free(ee_resources, IPAddressFamily_free);
+  ok = (f = fopen(temp.s, "w")) != NULL;
 
-  return result;
-}
+  if (ok)
+    ok &= fprintf(f, "rcynic-validation-cache %u %x %u\n",
+		  VALIDATION_CACHE_VERSION, validation_cache_policy(rc),
+		  (unsigned) MIB_COUNTER_T_MAX) != EOF;
 
-/**
- * Check whether we already have a particular ROA, attempt to fetch it
- * and check issuer's signature if we don't.
- */
-static void check_roa(rcynic_ctx_t *rc,
-		      STACK_OF(walk_ctx_t) *wsk,
-		      const uri_t *uri,
-		      const unsigned char *hash,
-		      const size_t hashlen)
-{
-  walk_ctx_t *w = walk_ctx_stack_head(wsk);
-  path_t path;
+  for (i = 0; ok && i < sk_validation_cache_t_num(rc->validation_cache_used); prev = vc, i++) {
+    vc = sk_validation_cache_t_value(rc->validation_cache_used, i);
+    ci = &vc->certinfo;
 
-  assert(rc && wsk && w && uri);
+    if (prev && !memcmp(prev->key, vc->key, sizeof(vc->key)))
+      continue;
 
-  if (uri_to_filename(rc, uri, &path, &rc->new_authenticated) &&
-      !access(path.s, F_OK))
-    return;
+    for (j = 0; ok && j < sizeof(vc->key); j++)
+      ok &= fprintf(f, "%02x", vc->key[j]) != EOF;
 
-  logmsg(rc, log_telemetry, "Checking ROA %s", uri->s);
+    if (ok)
+      ok &= fprintf(f, " %s ", vc->expires) != EOF;
 
-  if (check_roa_1(rc, wsk, uri, &path, &rc->unauthenticated,
-		  hash, hashlen, object_generation_current)) {
-    install_object(rc, uri, &path, object_generation_current);
-    return;
-  }
+    for (j = 0; ok && j < sizeof(vc->events); j++)
+      ok &= fprintf(f, "%02x", vc->events[j]) != EOF;
 
-  if (!access(path.s, F_OK))
-    log_validation_status(rc, uri, object_rejected, object_generation_current);
-  else if (hash)
-    log_validation_status(rc, uri, manifest_lists_missing_object, object_generation_current);
+    if (ok)
+      ok &= fprintf(f, " %d %lld %lld %llu %s %s %s %s %s %s\n", ci->ca,
+		    (long long) vc->size, (long long) vc->mtime,
+		    (unsigned long long) vc->ino,
+		    (ci->sia.s[0]          ? ci->sia.s          : "-"),
+		    (ci->aia.s[0]          ? ci->aia.s          : "-"),
+		    (ci->crldp.s[0]        ? ci->crldp.s        : "-"),
+		    (ci->manifest.s[0]     ? ci->manifest.s     : "-"),
+		    (ci->signedobject.s[0] ? ci->signedobject.s : "-"),
+		    (ci->rrdpnotify.s[0]   ? ci->rrdpnotify.s   : "-")) != EOF;
+  }
+
+  if (f)
+    ok &= fclose(f) != EOF;
 
-  if (check_roa_1(rc, wsk, uri, &path, &rc->old_authenticated,
-		  hash, hashlen, object_generation_backup)) {
-    install_object(rc, uri, &path, object_generation_backup);
-    return;
+  if (ok)
+    ok &= rename(temp.s, filename) == 0;
+
+  if (!ok) {
+    logmsg(rc, log_sys_err, "Couldn't write validation cache %s: %s", filename, strerror(errno));
+    (void) unlink(temp.s);
   }
 
-  if (!access(path.s, F_OK))
-    log_validation_status(rc, uri, object_rejected, object_generation_backup);
-  else if (hash && w->manifest_generation == object_generation_backup)
-    log_validation_status(rc, uri, manifest_lists_missing_object, object_generation_backup);
+  return ok;
 }
 
-
+
 
 /**
- * Read and check one Ghostbuster record from disk.
+ * Store a 32-bit value in network byte order.
  */
-static int check_ghostbuster_1(rcynic_ctx_t *rc,
-			       STACK_OF(walk_ctx_t) *wsk,
-			       const uri_t *uri,
-			       path_t *path,
-			       const path_t *prefix,
-			       const unsigned char *hash,
-			       const size_t hashlen,
-			       const object_generation_t generation)
+static void put_u32(unsigned char *p, const unsigned long v)
 {
-  CMS_ContentInfo *cms = NULL;
-  BIO *bio = NULL;
-  X509 *x;
-  int result = 0;
-
-  assert(rc && wsk && uri && path && prefix);
-
-#if 0
-  /*
-   * May want this later if we're going to inspect the VCard.  For now,
-   * just leave this NULL and the right thing should happen.
-   */
-  if ((bio = BIO_new(BIO_s_mem())) == NULL) {
-    logmsg(rc, log_sys_err, "Couldn't allocate BIO for Ghostbuster record %s", uri->s);
-    goto error;
-  }
-#endif
-
-  if (!check_cms(rc, wsk, uri, path, prefix, &cms, &x, NULL, bio, NULL, 0,
-		 NID_ct_rpkiGhostbusters, 1, generation))
-    goto error;
-
-#if 0
-  /*
-   * Here is where we would read the VCard from the bio returned by
-   * CMS_verify() so that we could check the VCard.
-   */
-#endif
+  p[0] = (v >> 24) & 0xFF;
+  p[1] = (v >> 16) & 0xFF;
+  p[2] = (v >>  8) & 0xFF;
+  p[3] = (v >>  0) & 0xFF;
+}
 
-  result = 1;
+/**
+ * Fetch a 32-bit value in network byte order.
+ */
+static unsigned long get_u32(const unsigned char *p)
+{
+  return (((unsigned long) p[0] << 24) |
+	  ((unsigned long) p[1] << 16) |
+	  ((unsigned long) p[2] <<  8) |
+	  ((unsigned long) p[3] <<  0));
+}
 
- error:
-  BIO_free(bio);
-  CMS_ContentInfo_free(cms);
+/**
+ * Sort the VRPs and router keys we've collected and squeeze out
+ * duplicates, so that everything downstream can treat them as sets.
+ */
+static void vrp_output_uniq(const rcynic_ctx_t *rc)
+{
+  const router_key_t *k, *prev_k = NULL;
+  const vrp_t *v, *prev_v = NULL;
+  int i, n;
+
+  sk_vrp_t_sort(rc->vrps);
+  for (i = n = 0; i < sk_vrp_t_num(rc->vrps); i++) {
+    v = sk_vrp_t_value(rc->vrps, i);
+    if (prev_v == NULL || vrp_cmp(&prev_v, &v))
+      (void) sk_vrp_t_set(rc->vrps, n++, (vrp_t *) (prev_v = v));
+  }
+  while (sk_vrp_t_num(rc->vrps) > n)
+    (void) sk_vrp_t_pop(rc->vrps);
+
+  sk_router_key_t_sort(rc->router_keys);
+  for (i = n = 0; i < sk_router_key_t_num(rc->router_keys); i++) {
+    k = sk_router_key_t_value(rc->router_keys, i);
+    if (prev_k == NULL || router_key_cmp(&prev_k, &k))
+      (void) sk_router_key_t_set(rc->router_keys, n++, (router_key_t *) (prev_k = k));
+  }
+  while (sk_router_key_t_num(rc->router_keys) > n)
+    (void) sk_router_key_t_pop(rc->router_keys);
+}
 
-  return result;
+/**
+ * Write a chunk of a VRP output file and add it to the running
+ * digest.
+ */
+static int vrp_output_put(FILE *f, EVP_MD_CTX *ctx, const void *buf, const size_t len)
+{
+  return fwrite(buf, 1, len, f) == len && EVP_DigestUpdate(ctx, buf, len);
 }
 
 /**
- * Check whether we already have a particular Ghostbuster record,
- * attempt to fetch it and check issuer's signature if we don't.
+ * Write the header of a VRP output file.
  */
-static void check_ghostbuster(rcynic_ctx_t *rc,
-			      STACK_OF(walk_ctx_t) *wsk,
-			      const uri_t *uri,
-			      const unsigned char *hash,
-			      const size_t hashlen)
+static int vrp_output_put_header(const rcynic_ctx_t *rc,
+				 FILE *f,
+				 EVP_MD_CTX *ctx,
+				 const char *magic,
+				 const unsigned long nvrps,
+				 const unsigned long nkeys,
+				 const unsigned long serial)
 {
-  walk_ctx_t *w = walk_ctx_stack_head(wsk);
-  path_t path;
+  unsigned char buf[VRP_OUTPUT_HEADER_LEN];
+
+  memset(buf, 0, sizeof(buf));
+  strcpy((char *) buf, magic);
+  put_u32(buf +  8, VRP_OUTPUT_VERSION);
+  put_u32(buf + 12, nvrps);
+  put_u32(buf + 16, nkeys);
+  put_u32(buf + 20, VRP_OUTPUT_HEADER_LEN + nvrps * VRP_OUTPUT_VRP_LEN);
+  put_u32(buf + 24, (unsigned long) validation_now(rc));
+  put_u32(buf + 28, serial);
+  return vrp_output_put(f, ctx, buf, sizeof(buf));
+}
 
-  assert(rc && wsk && w && uri);
+/**
+ * Write one VRP record.  announce is only meaningful in deltas.
+ */
+static int vrp_output_put_vrp(FILE *f,
+			      EVP_MD_CTX *ctx,
+			      const vrp_t *v,
+			      const int announce)
+{
+  unsigned char buf[VRP_OUTPUT_VRP_LEN];
+
+  buf[0] = announce;
+  buf[1] = v->afi;
+  buf[2] = v->prefixlen;
+  buf[3] = v->max_prefixlen;
+  put_u32(buf + 4, v->asn);
+  memcpy(buf + 8, v->addr, sizeof(v->addr));
+  return vrp_output_put(f, ctx, buf, sizeof(buf));
+}
 
-  if (uri_to_filename(rc, uri, &path, &rc->new_authenticated) &&
-      !access(path.s, F_OK))
-    return;
+/**
+ * Write one router key record, with padding.  announce is only
+ * meaningful in deltas.
+ */
+static int vrp_output_put_key(FILE *f,
+			      EVP_MD_CTX *ctx,
+			      const router_key_t *k,
+			      const int announce)
+{
+  static const unsigned char zeros[4];
+  unsigned char buf[VRP_OUTPUT_KEY_LEN];
+
+  put_u32(buf, k->asn);
+  memcpy(buf + 4, k->ski, sizeof(k->ski));
+  buf[24] = (k->keylen >> 8) & 0xFF;
+  buf[25] = (k->keylen >> 0) & 0xFF;
+  buf[26] = announce;
+  buf[27] = 0;
+  return (vrp_output_put(f, ctx, buf, sizeof(buf)) &&
+	  vrp_output_put(f, ctx, k->key, k->keylen) &&
+	  vrp_output_put(f, ctx, zeros, -k->keylen & 3));
+}
 
-  logmsg(rc, log_telemetry, "Checking Ghostbuster record %s", uri->s);
+/**
+ * Open a VRP output file under a temporary name and start its digest.
+ */
+static FILE *vrp_output_open(const rcynic_ctx_t *rc,
+			     const char *filename,
+			     path_t *temp,
+			     EVP_MD_CTX **ctx)
+{
+  FILE *f;
 
-  if (check_ghostbuster_1(rc, wsk, uri, &path, &rc->unauthenticated,
-			  hash, hashlen, object_generation_current)) {
-    install_object(rc, uri, &path, object_generation_current);
-    return;
+  if (snprintf(temp->s, sizeof(temp->s), "%s.%u.tmp", filename, (unsigned) getpid()) >= sizeof(temp->s)) {
+    logmsg(rc, log_usage_err, "Filename \"%s\" is too long, not writing VRP output", filename);
+    return NULL;
   }
 
-  if (!access(path.s, F_OK))
-    log_validation_status(rc, uri, object_rejected, object_generation_current);
-  else if (hash)
-    log_validation_status(rc, uri, manifest_lists_missing_object, object_generation_current);
+  if ((f = fopen(temp->s, "w")) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't open %s: %s", temp->s, strerror(errno));
+    return NULL;
+  }
 
-  if (check_ghostbuster_1(rc, wsk, uri, &path, &rc->old_authenticated,
-			  hash, hashlen, object_generation_backup)) {
-    install_object(rc, uri, &path, object_generation_backup);
-    return;
+  if ((*ctx = EVP_MD_CTX_create()) == NULL || !EVP_DigestInit_ex(*ctx, EVP_sha256(), NULL)) {
+    logmsg(rc, log_sys_err, "Couldn't initialize digest for %s", filename);
+    EVP_MD_CTX_destroy(*ctx);
+    *ctx = NULL;
+    (void) fclose(f);
+    (void) unlink(temp->s);
+    return NULL;
   }
 
-  if (!access(path.s, F_OK))
-    log_validation_status(rc, uri, object_rejected, object_generation_backup);
-  else if (hash && w->manifest_generation == object_generation_backup)
-    log_validation_status(rc, uri, manifest_lists_missing_object, object_generation_backup);
+  return f;
 }
 
-
-
-static void walk_cert(rcynic_ctx_t *, void *);
-
 /**
- * rsync callback for fetching SIA tree.
+ * Finish a VRP output file: append the digest, close it, and rename
+ * it into place, so that readers never see a partial file.
  */
-static void rsync_sia_callback(rcynic_ctx_t *rc,
-			       const rsync_ctx_t *ctx,
-			       const rsync_status_t status,
-			       const uri_t *uri,
-			       void *cookie)
+static int vrp_output_close(const rcynic_ctx_t *rc,
+			    const char *filename,
+			    const path_t *temp,
+			    FILE *f,
+			    EVP_MD_CTX *ctx,
+			    int ok)
 {
-  STACK_OF(walk_ctx_t) *wsk = cookie;
-  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned digestlen;
 
-  assert(rc && wsk);
+  if (ok)
+    ok = (EVP_DigestFinal_ex(ctx, digest, &digestlen) &&
+	  fwrite(digest, 1, digestlen, f) == digestlen);
 
-  if (status != rsync_status_pending) {
-    w->state++;
-    task_add(rc, walk_cert, wsk);
-    return;
-  }
+  EVP_MD_CTX_destroy(ctx);
 
-  if (rsync_count_runable(rc) >= rc->max_parallel_fetches)
-    return;
+  ok &= fclose(f) != EOF;
 
-  if ((wsk = walk_ctx_stack_clone(wsk)) == NULL) {
-    logmsg(rc, log_sys_err,
-	   "walk_ctx_stack_clone() failed, probably memory exhaustion, blundering onwards without forking stack");
-    return;
+  if (ok)
+    ok &= rename(temp->s, filename) == 0;
+
+  if (!ok) {
+    logmsg(rc, log_sys_err, "Couldn't write VRP output %s: %s", filename, strerror(errno));
+    (void) unlink(temp->s);
   }
 
-  walk_ctx_stack_pop(wsk);
-  task_add(rc, walk_cert, wsk);
+  return ok;
 }
 
 /**
- * Recursive walk of certificate hierarchy (core of the program).
- *
- * Walk all products of the current certificate, starting with the
- * ones named in the manifest and continuing with any that we find in
- * the publication directory but which are not named in the manifest.
- *
- * Dispatch to correct checking code for the object named by URI,
- * based on the filename extension in the uri.  CRLs are a special
- * case because we've already checked them by the time we get here, so
- * we just ignore them.  Other objects are either certificates or
- * CMS-signed objects of one kind or another.
+ * Read the VRP snapshot from the previous run into a pair of stacks,
+ * so that we can work out what changed.  Returns 0 if there's no
+ * usable previous snapshot, which isn't an error, it just means we
+ * have nothing to compare against this time.
  */
-static void walk_cert(rcynic_ctx_t *rc, void *cookie)
+static int read_vrp_output(const char *filename,
+			   STACK_OF(vrp_t) *vrps,
+			   STACK_OF(router_key_t) *keys,
+			   arena_block_t **arena,
+			   unsigned long *serial)
 {
-  STACK_OF(walk_ctx_t) *wsk = cookie;
-  const unsigned char *hash = NULL;
-  object_generation_t generation;
-  size_t hashlen;
-  walk_ctx_t *w;
-  uri_t uri;
-
-  assert(rc && wsk);
-
-  while ((w = walk_ctx_stack_head(wsk)) != NULL) {
+  unsigned char digest[SHA256_DIGEST_LENGTH], *buf;
+  unsigned long nvrps, nkeys, i;
+  size_t size, len, off, keylen;
+  const unsigned char *p;
+  router_key_t *k;
+  path_t path;
+  vrp_t *v;
+  int mapped, ok = 0;
 
-    switch (w->state) {
-    case walk_state_current:
-      generation = object_generation_current;
-      break;
-    case walk_state_backup:
-      generation = object_generation_backup;
-      break;
-    default:
-      generation = object_generation_null;
-      break;
-    }
+  assert(filename && vrps && keys && arena && serial);
 
-    switch (w->state) {
+  if (strlen(filename) >= sizeof(path.s))
+    return 0;
+  strcpy(path.s, filename);
 
-    case walk_state_initial:
+  if ((buf = load_file(&path, ~(size_t) 0, &size, &mapped)) == NULL)
+    return 0;
 
-      if (!w->certinfo.sia.s[0] || !w->certinfo.ca) {
-	w->state = walk_state_done;
-	continue;
-      }
+  if (size < VRP_OUTPUT_HEADER_LEN + sizeof(digest) ||
+      !EVP_Digest(buf, size - sizeof(digest), digest, NULL, EVP_sha256(), NULL) ||
+      memcmp(digest, buf + size - sizeof(digest), sizeof(digest)) ||
+      memcmp(buf, VRP_OUTPUT_MAGIC, sizeof(VRP_OUTPUT_MAGIC)) ||
+      get_u32(buf + 8) != VRP_OUTPUT_VERSION)
+    goto done;
 
-      if (!w->certinfo.manifest.s[0]) {
-	log_validation_status(rc, &w->certinfo.uri, sia_manifest_uri_missing, w->certinfo.generation);
-	w->state = walk_state_done;
-	continue;
-      }
+  len = size - sizeof(digest);
+  nvrps = get_u32(buf + 12);
+  nkeys = get_u32(buf + 16);
+  off = get_u32(buf + 20);
+  *serial = get_u32(buf + 28);
 
-      w->state++;
-      continue;
+  if (nvrps > (len - VRP_OUTPUT_HEADER_LEN) / VRP_OUTPUT_VRP_LEN ||
+      off != VRP_OUTPUT_HEADER_LEN + nvrps * VRP_OUTPUT_VRP_LEN)
+    goto done;
 
-    case walk_state_rsync:
+  for (i = 0; i < nvrps; i++) {
+    p = buf + VRP_OUTPUT_HEADER_LEN + i * VRP_OUTPUT_VRP_LEN;
+    if ((v = arena_alloc(arena, sizeof(*v))) == NULL)
+      goto done;
+    v->afi = p[1];
+    v->prefixlen = p[2];
+    v->max_prefixlen = p[3];
+    v->asn = get_u32(p + 4);
+    memcpy(v->addr, p + 8, sizeof(v->addr));
+    if (!sk_vrp_t_push(vrps, v))
+      goto done;
+  }
 
-      if (rsync_needed(rc, wsk)) {
-	rsync_tree(rc, &w->certinfo.sia, wsk, rsync_sia_callback);
-	return;
-      }
-      log_validation_status(rc, &w->certinfo.sia, rsync_transfer_skipped, object_generation_null);
-      w->state++;
-      continue;
+  for (i = 0; i < nkeys; i++) {
+    p = buf + off;
+    if (len - off < VRP_OUTPUT_KEY_LEN)
+      goto done;
+    keylen = (p[24] << 8) | p[25];
+    if (len - off - VRP_OUTPUT_KEY_LEN < ((keylen + 3) & ~3) ||
+	(k = arena_alloc(arena, sizeof(*k) + keylen)) == NULL)
+      goto done;
+    k->asn = get_u32(p);
+    memcpy(k->ski, p + 4, sizeof(k->ski));
+    k->keylen = keylen;
+    memcpy(k->key, p + VRP_OUTPUT_KEY_LEN, keylen);
+    if (!sk_router_key_t_push(keys, k))
+      goto done;
+    off += VRP_OUTPUT_KEY_LEN + ((keylen + 3) & ~3);
+  }
 
-    case walk_state_ready:
+  ok = off == len;
 
-      walk_ctx_loop_init(rc, wsk);      /* sets w->state */
-      continue;
+ done:
+  unload_file(buf, size, mapped);
+  return ok;
+}
 
-    case walk_state_current:
-    case walk_state_backup:
+/**
+ * Walk the previous and current VRPs in parallel, writing a withdraw
+ * record for everything that's gone and an announce record for
+ * everything that's new.  Both stacks must be sorted and free of
+ * duplicates.  With f == NULL, just counts the changes.
+ */
+static unsigned long vrp_delta_vrps(STACK_OF(vrp_t) *old,
+				    STACK_OF(vrp_t) *new,
+				    FILE *f,
+				    EVP_MD_CTX *ctx,
+				    int *ok)
+{
+  const vrp_t *a, *b;
+  unsigned long n = 0;
+  int i = 0, j = 0, cmp;
 
-      if (!walk_ctx_loop_this(rc, wsk, &uri, &hash, &hashlen)) {
-	walk_ctx_loop_next(rc, wsk);
-	continue;
-      }
+  while (*ok && (i < sk_vrp_t_num(old) || j < sk_vrp_t_num(new))) {
+    a = sk_vrp_t_value(old, i);
+    b = sk_vrp_t_value(new, j);
+    cmp = a == NULL ? 1 : b == NULL ? -1 : vrp_cmp(&a, &b);
+    if (cmp != 0 && f != NULL)
+      *ok = vrp_output_put_vrp(f, ctx, (cmp < 0 ? a : b), cmp > 0);
+    n += cmp != 0;
+    i += cmp <= 0;
+    j += cmp >= 0;
+  }
 
-      if (endswith(uri.s, ".crl") || endswith(uri.s, ".mft") || endswith(uri.s, ".mnf")) {
-	walk_ctx_loop_next(rc, wsk);
-	continue;			/* CRLs and manifests checked elsewhere */
-      }
+  return n;
+}
 
-      if (hash == NULL && !rc->allow_object_not_in_manifest) {
-	log_validation_status(rc, &uri, skipped_because_not_in_manifest, generation);
-	walk_ctx_loop_next(rc, wsk);
-	continue;
-      }
+/**
+ * Router key version of vrp_delta_vrps().
+ */
+static unsigned long vrp_delta_keys(STACK_OF(router_key_t) *old,
+				    STACK_OF(router_key_t) *new,
+				    FILE *f,
+				    EVP_MD_CTX *ctx,
+				    int *ok)
+{
+  const router_key_t *a, *b;
+  unsigned long n = 0;
+  int i = 0, j = 0, cmp;
 
-      if (hash == NULL)
-	log_validation_status(rc, &uri, tainted_by_not_being_in_manifest, generation);
-      else if (w->stale_manifest)
-	log_validation_status(rc, &uri, tainted_by_stale_manifest, generation);
+  while (*ok && (i < sk_router_key_t_num(old) || j < sk_router_key_t_num(new))) {
+    a = sk_router_key_t_value(old, i);
+    b = sk_router_key_t_value(new, j);
+    cmp = a == NULL ? 1 : b == NULL ? -1 : router_key_cmp(&a, &b);
+    if (cmp != 0 && f != NULL)
+      *ok = vrp_output_put_key(f, ctx, (cmp < 0 ? a : b), cmp > 0);
+    n += cmp != 0;
+    i += cmp <= 0;
+    j += cmp >= 0;
+  }
 
-      if (endswith(uri.s, ".roa")) {
-	check_roa(rc, wsk, &uri, hash, hashlen);
-	walk_ctx_loop_next(rc, wsk);
-	continue;
-      }
+  return n;
+}
 
-      if (endswith(uri.s, ".gbr")) {
-	check_ghostbuster(rc, wsk, &uri, hash, hashlen);
-	walk_ctx_loop_next(rc, wsk);
-	continue;
-      }
+/**
+ * Remove delta files we no longer want: all of them if we've lost
+ * track of the serial they lead up to, otherwise all but the most
+ * recent max_vrp_deltas.
+ */
+static void prune_vrp_deltas(const rcynic_ctx_t *rc,
+			     const char *filename,
+			     const int have_serial,
+			     const unsigned long serial)
+{
+  unsigned long s;
+  path_t pattern;
+  char *end;
+  glob_t g;
+  int i;
 
-      if (endswith(uri.s, ".cer")) {
-	certinfo_t certinfo;
-	X509 *x = check_cert(rc, wsk, &uri, &certinfo, hash, hashlen);
-	if (!walk_ctx_stack_push(wsk, x, &certinfo))
-	  walk_ctx_loop_next(rc, wsk);
-	continue;
-      }
+  if (snprintf(pattern.s, sizeof(pattern.s), "%s.delta.*", filename) >= sizeof(pattern.s))
+    return;
 
-      log_validation_status(rc, &uri, unknown_object_type_skipped, object_generation_null);
-      walk_ctx_loop_next(rc, wsk);
-      continue;
+  memset(&g, 0, sizeof(g));
 
-    case walk_state_done:
+  if (glob(pattern.s, 0, 0, &g) != 0)
+    return;
 
-      walk_ctx_stack_pop(wsk);	/* Resume our issuer's state */
+  for (i = 0; i < g.gl_pathc; i++) {
+    s = strtoul(g.gl_pathv[i] + strlen(pattern.s) - 1, &end, 10);
+    if (*end != '\0')
       continue;
-
+    if (!have_serial || ((serial - s) & 0xFFFFFFFFUL) >= (unsigned long) rc->max_vrp_deltas) {
+      logmsg(rc, log_verbose, "Removing old VRP delta %s", g.gl_pathv[i]);
+      (void) unlink(g.gl_pathv[i]);
     }
   }
 
-  assert(walk_ctx_stack_head(wsk) == NULL);
-  walk_ctx_stack_free(wsk);
+  globfree(&g);
 }
 
 /**
- * Check a trust anchor.  Yes, we trust it, by definition, but it
- * still needs to conform to the certificate profile, the
- * self-signature must be correct, etcetera.
+ * Write the VRP output files: a snapshot of everything we accepted
+ * this run and, if the previous snapshot is still there and anything
+ * changed, a delta listing what changed.
  *
- * Ownership of the TA certificate object passes to this function when
- * called (ie, freeing "x" is our responsibility).
- */
-static int check_ta(rcynic_ctx_t *rc, X509 *x, const uri_t *uri,
-		    const path_t *path1, const path_t *path2,
-		    const object_generation_t generation)
+ * All integers are in network byte order and everything is aligned
+ * on four-byte boundaries, so that an RTR server can mmap() the files
+ * and use them in place.  Both files have the same layout:
+ *
+ *   Header, 32 bytes: magic ("RCYNVRP\0" for the snapshot,
+ *   "RCYNVRD\0" for a delta), then version, VRP count, router key
+ *   count, offset of the first router key, generation time in
+ *   seconds since the epoch, and serial number (32 bits each).
+ *
+ *   VRPs, 24 bytes each: announce flag (8 bits, deltas only), AFI (8
+ *   bits, 1 or 2), prefix length (8 bits), maximum length (8 bits),
+ *   origin AS (32 bits), address (16 bytes, zero-filled).
+ *
+ *   Router keys, variable length: AS (32 bits), SKI (20 bytes), key
+ *   length (16 bits), announce flag (8 bits, deltas only), 1 byte of
+ *   zero, DER SubjectPublicKeyInfo, zero-filled to a four-byte
+ *   boundary.
+ *
+ *   Trailer: SHA-256 digest of everything above.
+ *
+ * The snapshot's serial number goes up by one each time its content
+ * changes, and the delta leading to serial n is written to
+ * "filename.delta.n", so an RTR server at serial n can catch up by
+ * applying n+1, n+2, and so on.  If there's no previous snapshot we
+ * start over with the current time as the serial.
+ */
+static int write_vrp_output(const rcynic_ctx_t *rc,
+			    const char *filename)
 {
-  STACK_OF(walk_ctx_t) *wsk = NULL;
-  walk_ctx_t *w = NULL;
-
-  assert(rc && x && uri && path1 && path2);
-
-  if (x == NULL)
+  STACK_OF(router_key_t) *old_keys = NULL;
+  STACK_OF(vrp_t) *old_vrps = NULL;
+  unsigned long serial, nvrps, nkeys;
+  arena_block_t *arena = NULL;
+  EVP_MD_CTX *ctx = NULL;
+  path_t delta, temp;
+  int i, have_old, ok = 0;
+  FILE *f;
+
+  if (filename == NULL)
     return 1;
 
-  if ((wsk = walk_ctx_stack_new()) == NULL) {
-    logmsg(rc, log_sys_err, "Couldn't allocate walk context stack");
-    X509_free(x);
+  if (rc->vrps == NULL || rc->router_keys == NULL) {
+    logmsg(rc, log_sys_err, "VRP output is incomplete, not writing %s", filename);
     return 0;
   }
 
-  if ((w = walk_ctx_stack_push(wsk, x, NULL)) == NULL) {
-    logmsg(rc, log_sys_err, "Couldn't push walk context stack");
-    walk_ctx_stack_free(wsk);
-    X509_free(x);
-    return 0;
-  }
+  vrp_output_uniq(rc);
 
-  if (!check_x509(rc, wsk, uri, x, NULL, generation)) {
-    log_validation_status(rc, uri, object_rejected, generation);
-    walk_ctx_stack_free(wsk);
-    return 1;
+  if ((old_vrps = sk_vrp_t_new(vrp_cmp)) == NULL ||
+      (old_keys = sk_router_key_t_new(router_key_cmp)) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate stacks for previous VRP output");
+    goto done;
   }
 
-  logmsg(rc, log_telemetry, "Copying trust anchor %s to %s", path1->s, path2->s);
+  have_old = read_vrp_output(filename, old_vrps, old_keys, &arena, &serial);
 
-  if (!mkdir_maybe(rc, path2) || !cp_ln(rc, path1, path2)) {
-    walk_ctx_stack_free(wsk);
-    return 0;
+  if (!have_old) {
+    logmsg(rc, log_verbose, "No usable previous VRP output in %s, not writing delta", filename);
+    serial = (unsigned long) validation_now(rc) & 0xFFFFFFFFUL;
   }
 
-  log_validation_status(rc, uri, object_accepted, generation);
-  task_add(rc, walk_cert, wsk);
-  return 1;
-}
+  else {
+    ok = 1;
+    nvrps = vrp_delta_vrps(old_vrps, rc->vrps, NULL, NULL, &ok);
+    nkeys = vrp_delta_keys(old_keys, rc->router_keys, NULL, NULL, &ok);
 
-
+    if (nvrps > 0 || nkeys > 0)
+      serial = (serial + 1) & 0xFFFFFFFFUL;
 
-/**
- * Check a trust anchor read from a local file.
- */
-static int check_ta_cer(rcynic_ctx_t *rc,
-			const char *fn)
+    if ((nvrps > 0 || nkeys > 0) && rc->max_vrp_deltas > 0) {
+      if (snprintf(delta.s, sizeof(delta.s), "%s.delta.%lu", filename, serial) >= sizeof(delta.s)) {
+	logmsg(rc, log_usage_err, "Filename \"%s\" is too long, not writing VRP delta", filename);
+	ok = 0;
+	goto done;
+      }
 
-{
-  path_t path1, path2;
-  unsigned long hash;
-  X509 *x = NULL;
-  uri_t uri;
-  int i;
+      logmsg(rc, log_telemetry, "Writing %lu VRP and %lu router key changes to %s", nvrps, nkeys, delta.s);
 
-  assert(rc && fn);
+      if ((f = vrp_output_open(rc, delta.s, &temp, &ctx)) == NULL) {
+	ok = 0;
+	goto done;
+      }
 
-  logmsg(rc, log_telemetry, "Processing trust anchor from file %s", fn);
+      ok = vrp_output_put_header(rc, f, ctx, VRP_DELTA_MAGIC, nvrps, nkeys, serial);
+      (void) vrp_delta_vrps(old_vrps, rc->vrps, f, ctx, &ok);
+      (void) vrp_delta_keys(old_keys, rc->router_keys, f, ctx, &ok);
 
-  if (strlen(fn) >= sizeof(path1.s)) {
-    logmsg(rc, log_usage_err, "Trust anchor path name too long %s", fn);
-    return 0;
+      if (!vrp_output_close(rc, delta.s, &temp, f, ctx, ok))
+	goto done;
+    }
   }
-  strcpy(path1.s, fn);
-  filename_to_uri(&uri, path1.s);
 
-  if ((x = read_cert(&path1, NULL)) == NULL) {
-    logmsg(rc, log_usage_err, "Couldn't read trust anchor from file %s", fn);
-    log_validation_status(rc, &uri, unreadable_trust_anchor, object_generation_null);
-    goto lose;
-  }
+  prune_vrp_deltas(rc, filename, have_old, serial);
 
-  hash = X509_subject_name_hash(x);
+  nvrps = sk_vrp_t_num(rc->vrps);
+  nkeys = sk_router_key_t_num(rc->router_keys);
 
-  for (i = 0; i < INT_MAX; i++) {
-    if (snprintf(path2.s, sizeof(path2.s), "%s%lx.%d.cer",
-		 rc->new_authenticated.s, hash, i) >= sizeof(path2.s)) {
-      logmsg(rc, log_sys_err,
-	     "Couldn't construct path name for trust anchor %s", path1.s);
-      goto lose;
-    }
-    if (access(path2.s, F_OK))
-      break;
-  }
-  if (i == INT_MAX) {
-    logmsg(rc, log_sys_err, "Couldn't find a free name for trust anchor %s", path1.s);
-    goto lose;
+  logmsg(rc, log_telemetry, "Writing %lu VRPs and %lu router keys to %s, serial %lu",
+	 nvrps, nkeys, filename, serial);
+
+  if ((f = vrp_output_open(rc, filename, &temp, &ctx)) == NULL) {
+    ok = 0;
+    goto done;
   }
 
-  return check_ta(rc, x, &uri, &path1, &path2, object_generation_null);
+  ok = vrp_output_put_header(rc, f, ctx, VRP_OUTPUT_MAGIC, nvrps, nkeys, serial);
+  for (i = 0; ok && i < sk_vrp_t_num(rc->vrps); i++)
+    ok = vrp_output_put_vrp(f, ctx, sk_vrp_t_value(rc->vrps, i), 0);
+  for (i = 0; ok && i < sk_router_key_t_num(rc->router_keys); i++)
+    ok = vrp_output_put_key(f, ctx, sk_router_key_t_value(rc->router_keys, i), 0);
 
- lose:
-  log_validation_status(rc, &uri, trust_anchor_skipped, object_generation_null);
-  X509_free(x);
-  return 0;
+  ok = vrp_output_close(rc, filename, &temp, f, ctx, ok);
+
+ done:
+  sk_vrp_t_free(old_vrps);
+  sk_router_key_t_free(old_keys);
+  arena_free(arena);
+  return ok;
 }
 
-
+
+
 
 /**
- * Allocate a new tal_ctx_t.
+ * Write one record of the binary summary: a type byte, a 24-bit
+ * body length, then the body, which is the concatenation of head and
+ * tail (either of which may be empty).
  */
-static tal_ctx_t *tal_ctx_t_new(void)
+static int binary_summary_put(FILE *f,
+			      const binary_summary_record_t type,
+			      const void *head,
+			      const size_t headlen,
+			      const void *tail,
+			      const size_t taillen)
 {
-  tal_ctx_t *tctx = malloc(sizeof(*tctx));
-  if (tctx)
-    memset(tctx, 0, sizeof(*tctx));
-  return tctx;
+  unsigned char hdr[4];
+  size_t len = headlen + taillen;
+
+  if (len > 0xFFFFFF)
+    return 0;
+
+  hdr[0] = type;
+  hdr[1] = (len >> 16) & 0xFF;
+  hdr[2] = (len >>  8) & 0xFF;
+  hdr[3] = (len >>  0) & 0xFF;
+
+  return (fwrite(hdr, 1, sizeof(hdr), f) == sizeof(hdr) &&
+	  (headlen == 0 || fwrite(head, 1, headlen, f) == headlen) &&
+	  (taillen == 0 || fwrite(tail, 1, taillen, f) == taillen));
 }
 
 /**
- * Free a tal_ctx_t.
+ * Write a record whose body is a list of NUL-separated strings.
  */
-static void tal_ctx_t_free(tal_ctx_t *tctx)
+static int binary_summary_put_strings(FILE *f,
+				      const binary_summary_record_t type,
+				      const unsigned long n,
+				      const char *s1,
+				      const char *s2,
+				      const char *s3)
 {
-  if (tctx) {
-    EVP_PKEY_free(tctx->pkey);
-    free(tctx);
+  unsigned char buf[1024];
+  size_t len;
+  int i;
+
+  put_u32(buf, n);
+  len = 4;
+
+  for (i = 0; i < 3; i++) {
+    const char *s = (i == 0 ? s1 : i == 1 ? s2 : s3);
+    if (s == NULL)
+      break;
+    if (i > 0)
+      buf[len++] = '\0';
+    if (strlen(s) >= sizeof(buf) - len)
+      return 0;
+    memcpy(buf + len, s, strlen(s));
+    len += strlen(s);
   }
+
+  return binary_summary_put(f, type, buf, len, NULL, 0);
 }
 
 /**
- * Read a trust anchor from disk and compare with known public key.
- *
- * NB: EVP_PKEY_cmp() returns 1 for match, not 0 like every other
- * xyz_cmp() function in the entire OpenSSL library.  Go figure.
+ * Look up a URI in the binary summary's string table, writing a
+ * string record for it first if this is the first time we've seen it.
  */
-static int check_ta_tal_callback_1(rcynic_ctx_t *rc,
-				   const tal_ctx_t *tctx,
-				   object_generation_t generation)
-
+static int binary_summary_string(FILE *f,
+				 binary_summary_strtab_t *tab,
+				 const char *s,
+				 unsigned long *index)
 {
-  const path_t *prefix = NULL;
-  EVP_PKEY *pkey = NULL;
-  X509 *x = NULL;
-  path_t path;
-  int ret = 0;
-
-  switch (generation) {
-  case object_generation_current:
-    prefix = &rc->unauthenticated;
-    break;
-  case object_generation_backup:
-    prefix = &rc->old_authenticated;
-    break;
-  default:
-    goto done;
-  }
-
-  if (!uri_to_filename(rc, &tctx->uri, &path, prefix)) {
-    log_validation_status(rc, &tctx->uri, unreadable_trust_anchor_locator, generation);
-    goto done;
-  }
+  size_t len = strlen(s), i;
 
-  if ((x = read_cert(&path, NULL)) == NULL || (pkey = X509_get_pubkey(x)) == NULL) {
-    log_validation_status(rc, &tctx->uri, unreadable_trust_anchor, generation);
-    goto done;
-  }
+  assert(tab && tab->nslots > tab->count);
 
-  if (EVP_PKEY_cmp(tctx->pkey, pkey) != 1) {
-    log_validation_status(rc, &tctx->uri, trust_anchor_key_mismatch, generation);
-    goto done;
+  for (i = uri_hash(URI_HASH_INIT, s, len) & (tab->nslots - 1);
+       tab->strings[i] != NULL;
+       i = (i + 1) & (tab->nslots - 1)) {
+    if (!strcmp(tab->strings[i], s)) {
+      *index = tab->index[i];
+      return 1;
+    }
   }
 
-  ret = check_ta(rc, x, &tctx->uri, &path, &tctx->path, generation);
-  x = NULL;
-
- done:
-  if (!ret)
-    log_validation_status(rc, &tctx->uri, object_rejected, generation);
-  EVP_PKEY_free(pkey);
-  X509_free(x);
-  return ret;
+  tab->strings[i] = s;
+  *index = tab->index[i] = tab->count++;
+  return binary_summary_put(f, binary_summary_string_record, NULL, 0, s, len);
 }
 
 /**
- * rsync callback for fetching a TAL.
+ * Write a timing record, if there's anything in it.  uri is NULL for
+ * the run as a whole.
  */
-static void rsync_tal_callback(rcynic_ctx_t *rc,
-			       const rsync_ctx_t *ctx,
-			       const rsync_status_t status,
-			       const uri_t *uri,
-			       void *cookie)
+static int binary_summary_put_timing(FILE *f,
+				     binary_summary_strtab_t *tab,
+				     const timing_scope_t scope,
+				     const operation_t op,
+				     const timing_t *t,
+				     const char *uri)
 {
-  tal_ctx_t *tctx = cookie;
+  unsigned char buf[26];
+  unsigned long index = 0;
 
-  assert(rc && tctx);
+  if (t->count == 0 && t->wall == 0 && t->cpu == 0)
+    return 1;
 
-  if (status == rsync_status_pending)
-    return;
+  if (uri != NULL && !binary_summary_string(f, tab, uri, &index))
+    return 0;
 
-  if (!check_ta_tal_callback_1(rc, tctx, object_generation_current) &&
-      !check_ta_tal_callback_1(rc, tctx, object_generation_backup))
-    log_validation_status(rc, &tctx->uri, trust_anchor_skipped, object_generation_null);
+  buf[0] = scope;
+  buf[1] = op;
+  put_u32(buf +  2, index);
+  put_u32(buf +  6, t->count);
+  put_u32(buf + 10, (unsigned long) (t->wall >> 32));
+  put_u32(buf + 14, (unsigned long) (t->wall & 0xFFFFFFFFUL));
+  put_u32(buf + 18, (unsigned long) (t->cpu  >> 32));
+  put_u32(buf + 22, (unsigned long) (t->cpu  & 0xFFFFFFFFUL));
 
-  tal_ctx_t_free(tctx);
+  return binary_summary_put(f, binary_summary_timing_record, buf, sizeof(buf), NULL, 0);
 }
 
 /**
- * Check a trust anchor read from a trust anchor locator (TAL).
+ * Write the same information as the XML summary in a compact binary
+ * form, which is much faster both to write and to read back.
+ * rcynic-summary-xml converts it back to XML for the benefit of
+ * tools which expect that.
+ *
+ * After a twelve-byte file header (magic "RCYNSUM\0", then version,
+ * 32 bits), the file is a stream of records, each a type byte and a
+ * 24-bit body length followed by the body.  Integers are in network
+ * byte order, times are seconds since the epoch.  Record types:
+ *
+ *   'H': generation time, XML summary version, then the rcynic
+ *   version and the reporting hostname separated by a NUL.
+ *
+ *   'L': counter code, then label, kind, and description separated
+ *   by NULs, one per mib_counter_t.
+ *
+ *   'G': generation code, then label, one per object_generation_t.
+ *
+ *   'S': a URI, with no terminator.  URIs are numbered from zero in
+ *   the order they appear; each is written once, before the first
+ *   record that refers to it.
+ *
+ *   'V': URI number, timestamp, generation (8 bits), then the event
+ *   bitmap, bit n % 8 of byte n / 8 set for each counter code n
+ *   logged against this URI and generation.
+ *
+ *   'R': URI number, start time, finish time (0 if not applicable),
+ *   status (8 bits, as in rsync_history error attribute), and 1 if
+ *   the URI had a final slash (8 bits).
+ *
+ *   'I': count, then copy method label.
+ *
+ *   'O': operation code, then label, one per operation_t.
+ *
+ *   'T': scope (8 bits, timing_scope_t), operation code (8 bits),
+ *   URI number (0 and meaningless for the run scope), count, then
+ *   wall clock and CPU time in microseconds, 64 bits each.
+ *
+ *   'E': end of file, no body.  A file without this is incomplete.
  */
-static int check_ta_tal(rcynic_ctx_t *rc,
-			const char *fn)
-
+static int write_binary_summary(const rcynic_ctx_t *rc,
+				const char *filename,
+				const time_t now)
 {
-  tal_ctx_t *tctx = NULL;
-  BIO *bio = NULL;
-  int ret = 1;
+  unsigned char buf[16 + sizeof(((validation_status_t *) 0)->events)];
+  char hostname[HOSTNAME_MAX], text[HOSTNAME_MAX + sizeof(svn_id) + 1];
+  binary_summary_strtab_t tab;
+  validation_status_t *v;
+  unsigned long index;
+  path_t temp;
+  FILE *f = NULL;
+  size_t n;
+  int i, j, ok;
 
-  assert(rc && fn);
+  if (filename == NULL)
+    return 1;
 
-  logmsg(rc, log_telemetry, "Processing trust anchor locator from file %s", fn);
+  if (snprintf(temp.s, sizeof(temp.s), "%s.%u.tmp", filename, (unsigned) getpid()) >= sizeof(temp.s)) {
+    logmsg(rc, log_usage_err, "Filename \"%s\" is too long, not writing binary summary", filename);
+    return 0;
+  }
 
-  if ((tctx = tal_ctx_t_new()) == NULL) {
-    logmsg(rc, log_sys_err, "malloc(tal_ctxt_t) failed");
-    goto done;
+  logmsg(rc, log_telemetry, "Writing binary summary to %s", filename);
+
+  memset(&tab, 0, sizeof(tab));
+  n = (rc->validation_status->count + sk_rsync_history_t_num(rc->rsync_history) +
+       sk_ta_stats_t_num(rc->ta_stats) + sk_pp_stats_t_num(rc->pp_stats) + 1);
+  for (tab.nslots = 16; tab.nslots < 2 * n; tab.nslots <<= 1)
+    ;
+
+  ok = ((tab.strings = calloc(tab.nslots, sizeof(*tab.strings))) != NULL &&
+	(tab.index = calloc(tab.nslots, sizeof(*tab.index))) != NULL &&
+	(f = fopen(temp.s, "w")) != NULL);
+
+  if (ok)
+    (void) setvbuf(f, NULL, _IOFBF, BINARY_SUMMARY_BUFSIZE);
+
+  ok &= gethostname(hostname, sizeof(hostname)) == 0;
+
+  if (ok) {
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, BINARY_SUMMARY_MAGIC, sizeof(BINARY_SUMMARY_MAGIC));
+    put_u32(buf + 8, BINARY_SUMMARY_VERSION);
+    ok = fwrite(buf, 1, 12, f) == 12;
+  }
+
+  if (ok) {
+    put_u32(buf, (unsigned long) now);
+    put_u32(buf + 4, XML_SUMMARY_VERSION);
+    n = snprintf(text, sizeof(text), "%s%c%s", svn_id, '\0', hostname);
+    ok = (n < sizeof(text) &&
+	  binary_summary_put(f, binary_summary_header_record, buf, 8, text, n));
+  }
+
+  for (i = 0; ok && i < MIB_COUNTER_T_MAX; i++)
+    ok = binary_summary_put_strings(f, binary_summary_label_record, i,
+				    mib_counter_label[i], mib_counter_kind[i],
+				    (mib_counter_desc[i]
+				     ? mib_counter_desc[i]
+				     : X509_verify_cert_error_string(mib_counter_openssl[i])));
+
+  for (i = 0; ok && i < OBJECT_GENERATION_MAX; i++)
+    ok = binary_summary_put_strings(f, binary_summary_generation_record, i,
+				    object_generation_label[i], NULL, NULL);
+
+  for (i = 0; ok && i < OPERATION_T_MAX; i++)
+    ok = binary_summary_put_strings(f, binary_summary_operation_record, i,
+				    operation_label[i], NULL, NULL);
+
+  for (v = rc->validation_status->head; ok && v != NULL; v = v->next) {
+    for (n = 0; n < sizeof(v->events) && !v->events[n]; n++)
+      ;
+    if (n == sizeof(v->events))
+      continue;
+    if (!binary_summary_string(f, &tab, v->uri, &index)) {
+      ok = 0;
+      break;
+    }
+    put_u32(buf, index);
+    put_u32(buf + 4, (unsigned long) v->timestamp);
+    buf[8] = v->generation;
+    memcpy(buf + 9, v->events, sizeof(v->events));
+    ok = binary_summary_put(f, binary_summary_validation_status_record,
+			    buf, 9 + sizeof(v->events), NULL, 0);
+  }
+
+  sk_rsync_history_t_sort(rc->rsync_history);
+
+  for (i = 0; ok && i < sk_rsync_history_t_num(rc->rsync_history); i++) {
+    rsync_history_t *h = sk_rsync_history_t_value(rc->rsync_history, i);
+    assert(h);
+    if (!binary_summary_string(f, &tab, h->uri.s, &index)) {
+      ok = 0;
+      break;
+    }
+    put_u32(buf, index);
+    put_u32(buf + 4, (unsigned long) h->started);
+    put_u32(buf + 8, (unsigned long) h->finished);
+    buf[12] = h->status;
+    buf[13] = h->final_slash != 0;
+    ok = binary_summary_put(f, binary_summary_rsync_history_record, buf, 14, NULL, 0);
   }
 
-  bio = BIO_new_file(fn, "r");
+  for (i = 0; ok && i < COPY_METHOD_T_MAX; i++)
+    if (rc->copy_method_count[i] > 0)
+      ok = binary_summary_put_strings(f, binary_summary_object_install_record,
+				      rc->copy_method_count[i], copy_method_label[i], NULL, NULL);
 
-  if (!bio)
-    logmsg(rc, log_usage_err, "Couldn't open trust anchor locator file %s", fn);
+  /*
+   * As in write_xml_file(), no timings when replaying.
+   */
 
-  if (!bio || BIO_gets(bio, tctx->uri.s, sizeof(tctx->uri.s)) <= 0) {
-    uri_t furi;
-    filename_to_uri(&furi, fn);
-    log_validation_status(rc, &furi, unreadable_trust_anchor_locator, object_generation_null);
-    goto done;
-  }
+  if (!rc->validation_time) {
+    for (i = 0; ok && i < OPERATION_T_MAX; i++)
+      ok = binary_summary_put_timing(f, &tab, timing_scope_run, i,
+				     &rc->operation_timing[i], NULL);
 
-  tctx->uri.s[strcspn(tctx->uri.s, " \t\r\n")] = '\0';
+    sk_ta_stats_t_sort(rc->ta_stats);
 
-  if (!uri_to_filename(rc, &tctx->uri, &tctx->path, &rc->new_authenticated)) {
-    log_validation_status(rc, &tctx->uri, unreadable_trust_anchor_locator, object_generation_null);
-    goto done;
-  }
+    for (i = 0; ok && i < sk_ta_stats_t_num(rc->ta_stats); i++) {
+      const ta_stats_t *t = sk_ta_stats_t_value(rc->ta_stats, i);
+      for (j = 0; ok && j < OPERATION_T_MAX; j++)
+	ok = binary_summary_put_timing(f, &tab, timing_scope_trust_anchor, j,
+				       &t->timing[j], t->uri.s);
+    }
 
-  if (!endswith(tctx->uri.s, ".cer")) {
-    log_validation_status(rc, &tctx->uri, malformed_tal_uri, object_generation_null);
-    goto done;
+    for (i = 0; ok && i < sk_pp_stats_t_num(rc->pp_stats); i++) {
+      const pp_stats_t *p = sk_pp_stats_t_value(rc->pp_stats, i);
+      for (j = 0; ok && j < OPERATION_T_MAX; j++)
+	ok = binary_summary_put_timing(f, &tab, timing_scope_publication_point, j,
+				       &p->timing[j], p->uri.s);
+    }
   }
 
-  bio = BIO_push(BIO_new(BIO_f_linebreak()), bio);
-  bio = BIO_push(BIO_new(BIO_f_base64()), bio);
-  if (bio)
-    tctx->pkey = d2i_PUBKEY_bio(bio, NULL);
-  if (!tctx->pkey) {
-    log_validation_status(rc, &tctx->uri, unreadable_trust_anchor_locator, object_generation_null);
-    goto done;
-  }
+  if (ok)
+    ok = binary_summary_put(f, binary_summary_end_record, NULL, 0, NULL, 0);
 
-  logmsg(rc, log_telemetry, "Processing trust anchor from URI %s", tctx->uri.s);
+  if (f)
+    ok &= fclose(f) != EOF;
 
-  rsync_ta(rc, &tctx->uri, tctx, rsync_tal_callback);
-  tctx = NULL;			/* Control has passed */
+  if (ok)
+    ok &= rename(temp.s, filename) == 0;
 
- done:
-  tal_ctx_t_free(tctx);
-  BIO_free_all(bio);
-  return ret;
+  if (!ok) {
+    logmsg(rc, log_sys_err, "Couldn't write binary summary to %s: %s", filename, strerror(errno));
+    (void) unlink(temp.s);
+  }
+
+  free(tab.strings);
+  free(tab.index);
+  return ok;
 }
 
+
+
 /**
- * Check a directory of trust anchors and trust anchor locators.
+ * Write one timing element of the XML summary, if there's anything
+ * in it.  uri is NULL for the run as a whole.
  */
-static int check_ta_dir(rcynic_ctx_t *rc,
-			const char *dn)
+static int write_xml_timing(FILE *f,
+			    const timing_scope_t scope,
+			    const operation_t op,
+			    const timing_t *t,
+			    const char *uri)
 {
-  DIR *dir = NULL;
-  struct dirent *d;
-  path_t path;
-  int is_cer, is_tal;
-
-  assert(rc && dn);
-
-  if ((dir = opendir(dn)) == NULL) {
-    logmsg(rc, log_sys_err, "Couldn't open trust anchor directory %s: %s",
-	   dn, strerror(errno));
-    return 0;
-  }
-
-  while ((d = readdir(dir)) != NULL) {
-    if (snprintf(path.s, sizeof(path.s), "%s/%s", dn, d->d_name) >= sizeof(path.s)) {
-      logmsg(rc, log_data_err, "Pathname %s/%s too long", dn, d->d_name);
-      break;
-    }
-    is_cer = endswith(path.s, ".cer");
-    is_tal = endswith(path.s, ".tal");
-    if (is_cer && !check_ta_cer(rc, path.s))
-      break;
-    if (is_tal && !check_ta_tal(rc, path.s))
-      break;
-    if (!is_cer && !is_tal)
-      logmsg(rc, log_verbose, "Skipping non-trust-anchor %s", path.s);
-  }
-
-  if (dir != NULL)
-    closedir(dir);
+  if (t->count == 0 && t->wall == 0 && t->cpu == 0)
+    return 1;
 
-  return !d;;
+  return fprintf(f, "  <timing scope=\"%s\" operation=\"%s\" count=\"%lu\""
+		 " wall=\"%llu.%06llu\" cpu=\"%llu.%06llu\">%s</timing>\n",
+		 timing_scope_label[scope], operation_label[op], t->count,
+		 t->wall / 1000000, t->wall % 1000000,
+		 t->cpu  / 1000000, t->cpu  % 1000000,
+		 (uri ? uri : "")) != EOF;
 }
 
-
-
 /**
- * Write detailed log of what we've done as an XML file.
+ * Write detailed log of what we've done as an XML file.  now is the
+ * date to put in the header; the binary summary gets the same one,
+ * so that the two describe the same run identically.
  */
 static int write_xml_file(const rcynic_ctx_t *rc,
-			  const char *xmlfile)
+			  const char *xmlfile,
+			  const time_t now)
 {
   int i, j, use_stdout, ok;
   char hostname[HOSTNAME_MAX];
+  validation_status_t *v;
   mib_counter_t code;
   timestamp_t ts;
   FILE *f = NULL;
@@ -5477,7 +12215,7 @@ static int write_xml_file(const rcynic_ctx_t *rc,
 		  "<rcynic-summary date=\"%s\" rcynic-version=\"%s\""
 		  " summary-version=\"%d\" reporting-hostname=\"%s\">\n"
 		  "  <labels>\n",
-		  time_to_string(&ts, NULL),
+		  time_to_string(&ts, &now),
 		  svn_id, XML_SUMMARY_VERSION, hostname) != EOF;
 
   for (j = 0; ok && j < MIB_COUNTER_T_MAX; ++j)
@@ -5491,9 +12229,7 @@ static int write_xml_file(const rcynic_ctx_t *rc,
   if (ok)
     ok &= fprintf(f, "  </labels>\n") != EOF;
 
-  for (i = 0; ok && i < sk_validation_status_t_num(rc->validation_status); i++) {
-    validation_status_t *v = sk_validation_status_t_value(rc->validation_status, i);
-    assert(v);
+  for (v = rc->validation_status->head; ok && v != NULL; v = v->next) {
 
     (void) time_to_string(&ts, &v->timestamp);
 
@@ -5507,11 +12243,13 @@ static int write_xml_file(const rcynic_ctx_t *rc,
 	  ok &= fprintf(f, " generation=\"%s\"",
 			object_generation_label[v->generation]) != EOF;
 	if (ok)
-	  ok &= fprintf(f, ">%s</validation_status>\n", v->uri.s) != EOF;
+	  ok &= fprintf(f, ">%s</validation_status>\n", v->uri) != EOF;
       }
     }
   }
 
+  sk_rsync_history_t_sort(rc->rsync_history);
+
   for (i = 0; ok && i < sk_rsync_history_t_num(rc->rsync_history); i++) {
     rsync_history_t *h = sk_rsync_history_t_value(rc->rsync_history, i);
     assert(h);
@@ -5531,6 +12269,36 @@ static int write_xml_file(const rcynic_ctx_t *rc,
 		    h->uri.s, (h->final_slash ? "/" : "")) != EOF;
   }
 
+  for (i = 0; ok && i < COPY_METHOD_T_MAX; i++)
+    if (rc->copy_method_count[i] > 0)
+      ok &= fprintf(f, "  <object_install method=\"%s\">%lu</object_install>\n",
+		    copy_method_label[i], rc->copy_method_count[i]) != EOF;
+
+  /*
+   * Timings differ from one run to the next, so leave them out when
+   * we're replaying at a fixed validation time and want output we
+   * can compare byte for byte.
+   */
+
+  if (!rc->validation_time) {
+    for (i = 0; ok && i < OPERATION_T_MAX; i++)
+      ok &= write_xml_timing(f, timing_scope_run, i, &rc->operation_timing[i], NULL);
+
+    sk_ta_stats_t_sort(rc->ta_stats);
+
+    for (i = 0; ok && i < sk_ta_stats_t_num(rc->ta_stats); i++) {
+      const ta_stats_t *t = sk_ta_stats_t_value(rc->ta_stats, i);
+      for (j = 0; ok && j < OPERATION_T_MAX; j++)
+	ok &= write_xml_timing(f, timing_scope_trust_anchor, j, &t->timing[j], t->uri.s);
+    }
+
+    for (i = 0; ok && i < sk_pp_stats_t_num(rc->pp_stats); i++) {
+      const pp_stats_t *p = sk_pp_stats_t_value(rc->pp_stats, i);
+      for (j = 0; ok && j < OPERATION_T_MAX; j++)
+	ok &= write_xml_timing(f, timing_scope_publication_point, j, &p->timing[j], p->uri.s);
+    }
+  }
+
   if (ok)
     ok &= fprintf(f, "</rcynic-summary>\n") != EOF;
 
@@ -5550,6 +12318,241 @@ static int write_xml_file(const rcynic_ctx_t *rc,
   return ok;
 }
 
+
+
+
+/**
+ * Switch the run to a new phase, charging the time since the last
+ * switch to the phase we were in.  RUN_PHASE_T_MAX means "no phase",
+ * and is how we stop the clock.  CPU time here is for the whole
+ * process, so it includes any worker threads.
+ */
+static void run_phase_enter(rcynic_ctx_t *rc, const run_phase_t phase)
+{
+  assert(rc);
+
+  if (rc->phase < RUN_PHASE_T_MAX) {
+    stopwatch_stop(&rc->phase_stopwatch);
+    timing_add(&rc->phase_timing[rc->phase], &rc->phase_stopwatch);
+  }
+
+  rc->phase = phase;
+
+  if (rc->phase < RUN_PHASE_T_MAX)
+    stopwatch_start(&rc->phase_stopwatch, CLOCK_PROCESS_CPUTIME_ID);
+}
+
+/**
+ * Write a label value for the metrics file, with the escaping the
+ * text exposition format requires.
+ */
+static int metrics_put_label(FILE *f, const char *s)
+{
+  int ok = 1;
+
+  for (; ok && *s; s++) {
+    switch (*s) {
+    case '\\':
+    case '"':
+      ok = putc('\\', f) != EOF && putc(*s, f) != EOF;
+      break;
+    case '\n':
+      ok = fputs("\\n", f) != EOF;
+      break;
+    default:
+      ok = putc(*s, f) != EOF;
+    }
+  }
+
+  return ok;
+}
+
+/**
+ * Write a metrics file in the OpenMetrics text format, for
+ * node_exporter's textfile collector or anything else that reads
+ * that format.  Everything here is a gauge describing this run, so
+ * that alerts can compare one run against the last without parsing
+ * the XML summary.
+ *
+ * Like the other output files, this is written under a temporary
+ * name and renamed into place, so the collector never sees a partial
+ * file.
+ */
+static int write_metrics(const rcynic_ctx_t *rc,
+			 const char *filename)
+{
+  static const char * const fetch_status_label[rsync_status_skipped + 1] = {
+    "done", "failed", "timed_out", "pending", "skipped"
+  };
+  unsigned long status_count[MIB_COUNTER_T_MAX];
+  unsigned long fetch_count[2][rsync_status_skipped + 1];
+  time_t fetch_seconds[2];
+  const validation_status_t *v;
+  unsigned long long elapsed = 0;
+  FILE *f = NULL;
+  path_t temp;
+  int i, j, ok;
+
+  if (filename == NULL)
+    return 1;
+
+  logmsg(rc, log_telemetry, "Writing metrics to %s", filename);
+
+  if (snprintf(temp.s, sizeof(temp.s), "%s.%u.tmp", filename, (unsigned) getpid()) >= sizeof(temp.s)) {
+    logmsg(rc, log_usage_err, "Filename \"%s\" is too long, not writing metrics", filename);
+    return 0;
+  }
+
+  memset(status_count, 0, sizeof(status_count));
+  memset(fetch_count, 0, sizeof(fetch_count));
+  memset(fetch_seconds, 0, sizeof(fetch_seconds));
+
+  for (v = rc->validation_status->head; v != NULL; v = v->next)
+    for (i = 0; i < MIB_COUNTER_T_MAX; i++)
+      if (validation_status_get_code(v, (mib_counter_t) i))
+	status_count[i]++;
+
+  for (i = 0; i < sk_rsync_history_t_num(rc->rsync_history); i++) {
+    const rsync_history_t *h = sk_rsync_history_t_value(rc->rsync_history, i);
+    const int rrdp = !is_rsync(h->uri.s);
+    fetch_count[rrdp][h->status]++;
+    if (h->started && h->finished > h->started)
+      fetch_seconds[rrdp] += h->finished - h->started;
+  }
+
+  sk_ta_stats_t_sort(rc->ta_stats);
+
+  ok = (f = fopen(temp.s, "w")) != NULL;
+
+  if (ok)
+    ok = fprintf(f,
+		 "# HELP rcynic_last_run_timestamp_seconds When this run finished.\n"
+		 "# TYPE rcynic_last_run_timestamp_seconds gauge\n"
+		 "rcynic_last_run_timestamp_seconds %lu\n"
+		 "# HELP rcynic_validation_status Number of objects with each validation status code.\n"
+		 "# TYPE rcynic_validation_status gauge\n",
+		 (unsigned long) time(0)) >= 0;
+
+  for (i = 0; ok && i < MIB_COUNTER_T_MAX; i++)
+    ok = fprintf(f, "rcynic_validation_status{status=\"%s\",kind=\"%s\"} %lu\n",
+		 mib_counter_label[i], mib_counter_kind[i], status_count[i]) >= 0;
+
+  if (ok)
+    ok = fprintf(f,
+		 "# HELP rcynic_trust_anchor_objects Number of objects accepted or rejected under each trust anchor.\n"
+		 "# TYPE rcynic_trust_anchor_objects gauge\n") >= 0;
+
+  for (i = 0; ok && i < sk_ta_stats_t_num(rc->ta_stats); i++) {
+    const ta_stats_t *t = sk_ta_stats_t_value(rc->ta_stats, i);
+    for (j = 0; ok && j < OBJECT_TYPE_T_MAX; j++) {
+      ok = (fputs("rcynic_trust_anchor_objects{trust_anchor=\"", f) != EOF &&
+	    metrics_put_label(f, t->uri.s) &&
+	    fprintf(f, "\",type=\"%s\",result=\"accepted\"} %lu\n",
+		    object_type_label[j], t->accepted[j]) >= 0 &&
+	    fputs("rcynic_trust_anchor_objects{trust_anchor=\"", f) != EOF &&
+	    metrics_put_label(f, t->uri.s) &&
+	    fprintf(f, "\",type=\"%s\",result=\"rejected\"} %lu\n",
+		    object_type_label[j], t->rejected[j]) >= 0);
+    }
+  }
+
+  if (ok)
+    ok = fprintf(f,
+		 "# HELP rcynic_fetches Number of repository fetches by protocol and outcome.\n"
+		 "# TYPE rcynic_fetches gauge\n") >= 0;
+
+  for (i = 0; ok && i < 2; i++)
+    for (j = 0; ok && j <= rsync_status_skipped; j++)
+      if (j != rsync_status_pending)
+	ok = fprintf(f, "rcynic_fetches{protocol=\"%s\",status=\"%s\"} %lu\n",
+		     (i ? "rrdp" : "rsync"), fetch_status_label[j], fetch_count[i][j]) >= 0;
+
+  if (ok)
+    ok = fprintf(f,
+		 "# HELP rcynic_fetch_seconds Total time spent in repository fetches, by protocol.\n"
+		 "# TYPE rcynic_fetch_seconds gauge\n"
+		 "rcynic_fetch_seconds{protocol=\"rsync\"} %lu\n"
+		 "rcynic_fetch_seconds{protocol=\"rrdp\"} %lu\n"
+		 "# HELP rcynic_object_installs Number of objects installed by each copy method.\n"
+		 "# TYPE rcynic_object_installs gauge\n",
+		 (unsigned long) fetch_seconds[0],
+		 (unsigned long) fetch_seconds[1]) >= 0;
+
+  for (i = 0; ok && i < COPY_METHOD_T_MAX; i++)
+    ok = fprintf(f, "rcynic_object_installs{method=\"%s\"} %lu\n",
+		 copy_method_label[i], rc->copy_method_count[i]) >= 0;
+
+  if (ok)
+    ok = fprintf(f,
+		 "# HELP rcynic_unchanged_publication_points Number of publication points rsync reported no changes for.\n"
+		 "# TYPE rcynic_unchanged_publication_points gauge\n"
+		 "rcynic_unchanged_publication_points %lu\n",
+		 rc->unchanged_pps) >= 0;
+
+  if (ok)
+    ok = fprintf(f,
+		 "# HELP rcynic_phase_seconds Wall clock time spent in each phase of the run.\n"
+		 "# TYPE rcynic_phase_seconds gauge\n") >= 0;
+
+  for (i = 0; ok && i < RUN_PHASE_T_MAX; i++) {
+    elapsed += rc->phase_timing[i].wall;
+    ok = fprintf(f, "rcynic_phase_seconds{phase=\"%s\"} %llu.%06llu\n", run_phase_label[i],
+		 rc->phase_timing[i].wall / 1000000, rc->phase_timing[i].wall % 1000000) >= 0;
+  }
+
+  if (ok)
+    ok = fprintf(f,
+		 "# HELP rcynic_phase_cpu_seconds CPU time spent in each phase of the run.\n"
+		 "# TYPE rcynic_phase_cpu_seconds gauge\n") >= 0;
+
+  for (i = 0; ok && i < RUN_PHASE_T_MAX; i++)
+    ok = fprintf(f, "rcynic_phase_cpu_seconds{phase=\"%s\"} %llu.%06llu\n", run_phase_label[i],
+		 rc->phase_timing[i].cpu / 1000000, rc->phase_timing[i].cpu % 1000000) >= 0;
+
+  if (ok)
+    ok = fprintf(f,
+		 "# HELP rcynic_operations Number of times we performed each operation.\n"
+		 "# TYPE rcynic_operations gauge\n") >= 0;
+
+  for (i = 0; ok && i < OPERATION_T_MAX; i++)
+    ok = fprintf(f, "rcynic_operations{operation=\"%s\"} %lu\n",
+		 operation_label[i], rc->operation_timing[i].count) >= 0;
+
+  if (ok)
+    ok = fprintf(f,
+		 "# HELP rcynic_operation_seconds Time spent in each operation, by clock.\n"
+		 "# TYPE rcynic_operation_seconds gauge\n") >= 0;
+
+  for (i = 0; ok && i < OPERATION_T_MAX; i++) {
+    const timing_t *t = &rc->operation_timing[i];
+    ok = fprintf(f,
+		 "rcynic_operation_seconds{operation=\"%s\",clock=\"wall\"} %llu.%06llu\n"
+		 "rcynic_operation_seconds{operation=\"%s\",clock=\"cpu\"} %llu.%06llu\n",
+		 operation_label[i], t->wall / 1000000, t->wall % 1000000,
+		 operation_label[i], t->cpu  / 1000000, t->cpu  % 1000000) >= 0;
+  }
+
+  if (ok)
+    ok = fprintf(f,
+		 "# HELP rcynic_run_seconds Wall clock time for the whole run.\n"
+		 "# TYPE rcynic_run_seconds gauge\n"
+		 "rcynic_run_seconds %llu.%06llu\n"
+		 "# EOF\n",
+		 elapsed / 1000000, elapsed % 1000000) >= 0;
+
+  if (f)
+    ok &= fclose(f) != EOF;
+
+  if (ok)
+    ok &= rename(temp.s, filename) == 0;
+
+  if (!ok) {
+    logmsg(rc, log_sys_err, "Couldn't write metrics to %s: %s", filename, strerror(errno));
+    (void) unlink(temp.s);
+  }
+
+  return ok;
+}
 
 
 /**
@@ -5621,16 +12624,20 @@ int main(int argc, char *argv[])
   int opt_jitter = 0, use_syslog = 0, use_stderr = 0, syslog_facility = 0;
   int opt_syslog = 0, opt_stderr = 0, opt_level = 0, prune = 1;
   int opt_auth = 0, opt_unauth = 0, keep_lockfile = 0;
-  char *lockfile = NULL, *xmlfile = NULL;
+  char *lockfile = NULL, *xmlfile = NULL, *validation_cache = NULL, *vrp_output = NULL;
+  char *binary_summary = NULL, *metrics_output = NULL, *trace_output = NULL;
+  unsigned trace_threshold = 10;
   char *cfg_file = "rcynic.conf";
-  int c, i, ret = 1, jitter = 600, lockfd = -1;
+  int c, i, ok, ret = 1, jitter = 600, lockfd = -1;
   STACK_OF(CONF_VALUE) *cfg_section = NULL;
   CONF *cfg_handle = NULL;
-  time_t start = 0, finish;
+  time_t start = 0, finish, summary_time;
   rcynic_ctx_t rc;
   unsigned delay;
   long eline = 0;
-  path_t ta_dir;
+  struct rusage ru;
+  stopwatch_t sw;
+  path_t ta_dir, old_auth;
 
 #define QF(_s_, _l_, _d_) _s_,
 #define QA(_s_, _l_, _d_) _s_, ':',
@@ -5665,11 +12672,17 @@ int main(int argc, char *argv[])
   rc.allow_1024_bit_ee_key = 1;
   rc.allow_wrong_cms_si_attributes = 1;
   rc.max_parallel_fetches = 1;
+  rc.max_fetches_per_host = 4;
+  rc.max_vrp_deltas = 24;
+  rc.worker_threads = 1;
   rc.max_retries = 3;
   rc.retry_wait_min = 30;
   rc.run_rsync = 1;
   rc.rsync_timeout = 300;
   rc.max_select_time = 30;
+  rc.rsync_epoll = -1;
+  rc.phase = RUN_PHASE_T_MAX;
+  rc.rsync_timer_clock = time(0);
   rc.rsync_early = 1;
 
 #define QQ(x,y)   rc.priority[x] = y;
@@ -5689,6 +12702,7 @@ int main(int argc, char *argv[])
   }
 
   memset(&ta_dir, 0, sizeof(ta_dir));
+  memset(&old_auth, 0, sizeof(old_auth));
 
   opterr = 0;
 
@@ -5788,6 +12802,14 @@ int main(int argc, char *argv[])
 	     !set_directory(&rc, &rc.unauthenticated, val->value, 1))
       goto done;
 
+    else if (!name_cmp(val->name, "old-authenticated") &&
+	     !set_directory(&rc, &old_auth, val->value, 1))
+      goto done;
+
+    else if (!name_cmp(val->name, "validation-time") &&
+	     !configure_time(&rc, &rc.validation_time, val->value))
+      goto done;
+
     else if (!name_cmp(val->name, "trust-anchor-directory") &&
 	     !set_directory(&rc, &ta_dir, val->value, 0))
       goto done;
@@ -5800,6 +12822,14 @@ int main(int argc, char *argv[])
 	     !configure_integer(&rc, &rc.max_parallel_fetches, val->value))
       goto done;
 
+    else if (!name_cmp(val->name, "max-fetches-per-host") &&
+	     !configure_integer(&rc, &rc.max_fetches_per_host, val->value))
+      goto done;
+
+    else if (!name_cmp(val->name, "worker-threads") &&
+	     !configure_integer(&rc, &rc.worker_threads, val->value))
+      goto done;
+
     else if (!name_cmp(val->name, "max-select-time") &&
 	     !configure_unsigned_integer(&rc, &rc.max_select_time, val->value))
       goto done;
@@ -5807,9 +12837,23 @@ int main(int argc, char *argv[])
     else if (!name_cmp(val->name, "rsync-program"))
       rc.rsync_program = strdup(val->value);
 
+    else if (!name_cmp(val->name, "rrdp-directory") &&
+	     !set_directory(&rc, &rc.rrdp_directory, val->value, 1))
+      goto done;
+
     else if (!name_cmp(val->name, "lockfile"))
       lockfile = strdup(val->value);
 
+    else if (!name_cmp(val->name, "validation-cache"))
+      validation_cache = strdup(val->value);
+
+    else if (!name_cmp(val->name, "vrp-output"))
+      vrp_output = strdup(val->value);
+
+    else if (!name_cmp(val->name, "max-vrp-deltas") &&
+	     !configure_integer(&rc, &rc.max_vrp_deltas, val->value))
+      goto done;
+
     else if (!name_cmp(val->name, "keep-lockfile") &&
 	     !configure_boolean(&rc, &keep_lockfile, val->value))
       goto done;
@@ -5844,6 +12888,19 @@ int main(int argc, char *argv[])
 	      !name_cmp(val->name, "xml-summary")))
       xmlfile = strdup(val->value);
 
+    else if (!name_cmp(val->name, "binary-summary"))
+      binary_summary = strdup(val->value);
+
+    else if (!name_cmp(val->name, "metrics-output"))
+      metrics_output = strdup(val->value);
+
+    else if (!name_cmp(val->name, "trace-output"))
+      trace_output = strdup(val->value);
+
+    else if (!name_cmp(val->name, "trace-threshold") &&
+	     !configure_unsigned_integer(&rc, &trace_threshold, val->value))
+      goto done;
+
     else if (!name_cmp(val->name, "allow-stale-crl") &&
 	     !configure_boolean(&rc, &rc.allow_stale_crl, val->value))
       goto done;
@@ -5856,6 +12913,10 @@ int main(int argc, char *argv[])
 	     !configure_boolean(&rc, &rc.allow_non_self_signed_trust_anchor, val->value))
       goto done;
 
+    else if (!name_cmp(val->name, "incremental-validation") &&
+	     !configure_boolean(&rc, &rc.incremental_validation, val->value))
+      goto done;
+
     else if (!name_cmp(val->name, "require-crl-in-manifest") &&
 	     !configure_boolean(&rc, &rc.require_crl_in_manifest, val->value))
       goto done;
@@ -5925,11 +12986,31 @@ int main(int argc, char *argv[])
     goto done;
   }
 
-  if ((rc.validation_status = sk_validation_status_t_new_null()) == NULL) {
+  if ((rc.rrdp_failures = sk_rsync_history_t_new(rsync_history_cmp)) == NULL) {
+    logmsg(&rc, log_sys_err, "Couldn't allocate rrdp_failures stack");
+    goto done;
+  }
+
+  if ((rc.rsync_trie = rsync_trie_new()) == NULL) {
+    logmsg(&rc, log_sys_err, "Couldn't allocate rsync URI trie");
+    goto done;
+  }
+
+  if ((rc.crl_cache = crl_cache_index_new()) == NULL) {
+    logmsg(&rc, log_sys_err, "Couldn't allocate CRL cache");
+    goto done;
+  }
+
+  if ((rc.validation_status = validation_status_index_new()) == NULL) {
     logmsg(&rc, log_sys_err, "Couldn't allocate validation_status stack");
     goto done;
   }
 
+  if ((rc.uri_table = uri_table_new()) == NULL) {
+    logmsg(&rc, log_sys_err, "Couldn't allocate URI table");
+    goto done;
+  }
+
   if ((rc.x509_store = X509_STORE_new()) == NULL) {
     logmsg(&rc, log_sys_err, "Couldn't allocate X509_STORE");
     goto done;
@@ -5940,6 +13021,28 @@ int main(int argc, char *argv[])
     goto done;
   }
 
+  if ((rc.rsync_hosts = sk_rsync_host_t_new(rsync_host_cmp)) == NULL) {
+    logmsg(&rc, log_sys_err, "Couldn't allocate rsync_hosts");
+    goto done;
+  }
+
+  if ((rc.ta_stats = sk_ta_stats_t_new(ta_stats_cmp)) == NULL) {
+    logmsg(&rc, log_sys_err, "Couldn't allocate ta_stats");
+    goto done;
+  }
+
+  if ((rc.pp_stats = sk_pp_stats_t_new(pp_stats_cmp)) == NULL) {
+    logmsg(&rc, log_sys_err, "Couldn't allocate pp_stats");
+    goto done;
+  }
+
+  if (!trace_open(&rc, trace_output, trace_threshold))
+    goto done;
+
+#ifdef USE_EPOLL
+  rc.rsync_epoll = rsync_epoll_open(&rc);
+#endif
+
   if ((rc.task_queue = sk_task_t_new_null()) == NULL) {
     logmsg(&rc, log_sys_err, "Couldn't allocate task_queue");
     goto done;
@@ -5975,11 +13078,23 @@ int main(int argc, char *argv[])
   }
 
   start = time(0);
+  run_phase_enter(&rc, run_phase_startup);
   logmsg(&rc, log_telemetry, "Starting");
 
   if (!construct_directory_names(&rc))
     goto done;
 
+  if (*old_auth.s != '\0') {
+    rc.old_authenticated = old_auth;
+    rc.old_authenticated_fixed = 1;
+  }
+
+  if (rc.validation_time) {
+    timestamp_t ts;
+    logmsg(&rc, log_telemetry, "Validating as of %s",
+	   time_to_string(&ts, &rc.validation_time));
+  }
+
   if (!access(rc.new_authenticated.s, F_OK)) {
     logmsg(&rc, log_sys_err,
 	   "Timestamped output directory %s already exists!  Clock went backwards?",
@@ -5993,6 +13108,18 @@ int main(int argc, char *argv[])
     goto done;
   }
 
+  if (validation_cache && !read_validation_cache(&rc, validation_cache))
+    goto done;
+
+  if (vrp_output &&
+      ((rc.vrps = sk_vrp_t_new(vrp_cmp)) == NULL ||
+       (rc.router_keys = sk_router_key_t_new(router_key_cmp)) == NULL)) {
+    logmsg(&rc, log_sys_err, "Couldn't allocate VRP output stacks");
+    goto done;
+  }
+
+  run_phase_enter(&rc, run_phase_trust_anchors);
+
   for (i = 0; i < sk_CONF_VALUE_num(cfg_section); i++) {
     CONF_VALUE *val = sk_CONF_VALUE_value(cfg_section, i);
 
@@ -6014,38 +13141,107 @@ int main(int argc, char *argv[])
   if (*ta_dir.s != '\0' && !check_ta_dir(&rc, ta_dir.s))
     goto done;
 
+  run_phase_enter(&rc, run_phase_validation);
+
+  if (rc.worker_threads > 1 && !worker_pool_start(&rc)) {
+    logmsg(&rc, log_sys_err, "Couldn't start worker pool, continuing single-threaded");
+    worker_pool_stop(&rc);
+  }
+
   while (sk_task_t_num(rc.task_queue) > 0 || sk_rsync_ctx_t_num(rc.rsync_queue) > 0) {
     task_run_q(&rc);
     rsync_mgr(&rc);
   }
 
+  worker_pool_stop(&rc);
+
   logmsg(&rc, log_telemetry, "Event loop done, beginning final output and cleanup");
 
-  if (!finalize_directories(&rc))
+  if (!trace_close(&rc, trace_output))
     goto done;
 
-  if (prune && rc.run_rsync &&
-      !prune_unauthenticated(&rc, &rc.unauthenticated,
-			     strlen(rc.unauthenticated.s))) {
-    logmsg(&rc, log_sys_err, "Trouble pruning old unauthenticated data");
+  run_phase_enter(&rc, run_phase_finalize);
+
+  /*
+   * All of our children were fetch programs, so their CPU time is
+   * the CPU cost of fetching.
+   */
+  if (getrusage(RUSAGE_CHILDREN, &ru) == 0)
+    rc.operation_timing[operation_fetch].cpu =
+      ((unsigned long long) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+       ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+
+  pp_stats_coalesce(&rc);
+
+  stopwatch_start(&sw, CLOCK_PROCESS_CPUTIME_ID);
+  ok = finalize_directories(&rc);
+  stopwatch_stop(&sw);
+  operation_charge(&rc, NULL, operation_finalize, &sw);
+
+  if (!ok)
     goto done;
+
+  if (prune && rc.run_rsync) {
+    stopwatch_start(&sw, CLOCK_PROCESS_CPUTIME_ID);
+    ok = prune_unauthenticated(&rc, &rc.unauthenticated, strlen(rc.unauthenticated.s));
+    stopwatch_stop(&sw);
+    operation_charge(&rc, NULL, operation_prune, &sw);
+    if (!ok) {
+      logmsg(&rc, log_sys_err, "Trouble pruning old unauthenticated data");
+      goto done;
+    }
   }
 
-  if (!write_xml_file(&rc, xmlfile))
+  run_phase_enter(&rc, run_phase_output);
+
+  summary_time = validation_now(&rc);
+
+  validation_status_index_sort(rc.validation_status);
+
+  if (!write_xml_file(&rc, xmlfile, summary_time))
+    goto done;
+
+  if (!write_binary_summary(&rc, binary_summary, summary_time))
+    goto done;
+
+  if (!write_validation_cache(&rc, validation_cache))
+    goto done;
+
+  if (!write_vrp_output(&rc, vrp_output))
+    goto done;
+
+  run_phase_enter(&rc, RUN_PHASE_T_MAX);
+
+  if (!write_metrics(&rc, metrics_output))
     goto done;
 
   ret = 0;
 
  done:
+  worker_pool_stop(&rc);
   log_openssl_errors(&rc);
 
   /*
    * Do NOT free cfg_section, NCONF_free() takes care of that
    */
-  sk_validation_status_t_pop_free(rc.validation_status, validation_status_t_free);
+  validation_status_index_free(rc.validation_status);
+  sk_rsync_history_t_free(rc.rrdp_failures);
   sk_rsync_history_t_pop_free(rc.rsync_history, rsync_history_t_free);
-  validation_status_t_free(rc.validation_status_in_waiting);
+  rsync_trie_free(rc.rsync_trie);
+  sk_rsync_host_t_pop_free(rc.rsync_hosts, rsync_host_t_free);
+  sk_ta_stats_t_pop_free(rc.ta_stats, ta_stats_t_free);
+  sk_pp_stats_t_pop_free(rc.pp_stats, pp_stats_t_free);
+  trace_free(rc.trace);
+  crl_cache_index_free(rc.crl_cache);
+  sk_validation_cache_t_pop_free(rc.validation_cache, validation_cache_t_free);
+  sk_validation_cache_t_pop_free(rc.validation_cache_used, validation_cache_t_free);
+  sk_vrp_t_free(rc.vrps);
+  sk_router_key_t_free(rc.router_keys);
+  arena_free(rc.vrp_arena);
   X509_STORE_free(rc.x509_store);
+  uri_table_free(rc.uri_table);
+  if (rc.rsync_epoll >= 0)
+    (void) close(rc.rsync_epoll);
   NCONF_free(cfg_handle);
   CONF_modules_free();
   EVP_cleanup();
@@ -6058,6 +13254,16 @@ int main(int argc, char *argv[])
     free(lockfile);
   if (xmlfile)
     free(xmlfile);
+  if (binary_summary)
+    free(binary_summary);
+  if (metrics_output)
+    free(metrics_output);
+  if (trace_output)
+    free(trace_output);
+  if (validation_cache)
+    free(validation_cache);
+  if (vrp_output)
+    free(vrp_output);
 
   if (start) {
     finish = time(0);
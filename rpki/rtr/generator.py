@@ -25,8 +25,10 @@ import os
 import sys
 import glob
 import socket
+import struct
 import base64
 import random
+import hashlib
 import logging
 import subprocess
 import rpki.POW
@@ -293,6 +295,47 @@ class AXFRSet(PDUSet):
                 del self[i + 1]
         return self
 
+    @classmethod
+    def parse_vrp_file(cls, filename, version):
+        """
+        Create a new AXFRSet from the VRP file written by rcynic's
+        vrp-output option.  This saves walking and re-parsing the whole
+        validated tree; see the rcynic documentation for the format.
+        """
+
+        self = cls(version = version)
+        self.serial = rpki.rtr.channels.Timestamp.now()
+
+        include_routercerts = RouterKeyPDU.pdu_type in rpki.rtr.pdus.PDU.version_map[version]
+
+        with open(filename, "rb") as f:
+            data = f.read()
+
+        if len(data) < 64 or hashlib.sha256(data[:-32]).digest() != data[-32:]:
+            raise ValueError("VRP file %s is truncated or corrupt" % filename)
+
+        magic, file_version, vrp_count, key_count, key_offset = struct.unpack_from("!8sLLLL", data)
+
+        if magic != "RCYNVRP\0" or file_version != 1:
+            raise ValueError("VRP file %s has unknown format" % filename)
+
+        for i in xrange(vrp_count):
+            afi, prefixlen, max_prefixlen, asn, addr = struct.unpack_from("!xBBBL16s", data, 32 + 24 * i)
+            address = rpki.POW.IPAddress.fromBytes(addr[:4] if afi == 1 else addr)
+            self.append(PrefixPDU.from_roa(version = version, asn = asn,
+                                           prefix_tuple = (address, prefixlen, max_prefixlen)))
+
+        offset = key_offset
+        for i in xrange(key_count if include_routercerts else 0):
+            asn, ski, keylen = struct.unpack_from("!L20sH", data, offset)
+            offset += 28
+            self.append(RouterKeyPDU.from_certificate(version = version, asn = asn, ski = ski,
+                                                      key = data[offset : offset + keylen]))
+            offset += (keylen + 3) & ~3
+
+        self.sort()
+        return self
+
     @classmethod
     def load(cls, filename):
         """
@@ -525,7 +568,10 @@ def cronjob_main(args):
                 logging.debug("# Deleting old file %s, timestamp %s", f, t)
                 os.unlink(f)
 
-        pdus = rpki.rtr.generator.AXFRSet.parse_rcynic(args.rcynic_dir, version, args.scan_roas, args.scan_routercerts)
+        if args.vrp_file:
+            pdus = rpki.rtr.generator.AXFRSet.parse_vrp_file(args.vrp_file, version)
+        else:
+            pdus = rpki.rtr.generator.AXFRSet.parse_rcynic(args.rcynic_dir, version, args.scan_roas, args.scan_routercerts)
         if pdus == rpki.rtr.generator.AXFRSet.load_current(version):
             logging.debug("# No change, new serial not needed")
             continue
@@ -579,6 +625,7 @@ def argparse_setup(subparsers):
     subparser.set_defaults(func = cronjob_main, default_log_destination = "syslog")
     subparser.add_argument("--scan-roas", help = "specify an external scan_roas program")
     subparser.add_argument("--scan-routercerts", help = "specify an external scan_routercerts program")
+    subparser.add_argument("--vrp-file", help = "read VRPs and router keys from rcynic's vrp-output file")
     subparser.add_argument("--force_zero_nonce", action = "store_true", help = "force nonce value of zero")
     subparser.add_argument("rcynic_dir", nargs = "?", help = "directory containing validated rcynic output tree")
     subparser.add_argument("rpki_rtr_dir", nargs = "?", help = "directory containing RPKI-RTR database")
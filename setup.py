@@ -79,6 +79,7 @@ if autoconf.RP_TARGET == "rp":
     scripts += [(autoconf.bindir,
                  ["rp/rcynic/rcynic-cron",
                   "rp/rcynic/rcynic-html",
+                  "rp/rcynic/rcynic-summary-xml",
                   "rp/rcynic/rcynic-svn",
                   "rp/rcynic/rcynic-text",
                   "rp/rcynic/validation_status",